@@ -0,0 +1,362 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+// Encodes a corpus of tiles with every ASTC preset and block footprint,
+// and optionally with the BCn encoder used when ASTC is not available,
+// reporting encode time, size and quality as CSV, one row per corpus and configuration.
+// The cache is bypassed, so that runs are comparable.
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QTextStream>
+
+#include "astcencoder.h"
+#include "bcnencoder.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace {
+struct Corpus {
+    QString name;
+    QStringList files;
+    std::vector<QImage> tiles;
+};
+
+struct Result {
+    quint64 tiles{0};
+    quint64 levels{0};
+    double mipMs{0};
+    double encodeMs{0};
+    double bytes{0}; // whole chains
+    double baseBytes{0}; // level 0
+    double pixels{0}; // level 0
+    double psnr{0};
+    double ssim{0};
+};
+
+const std::vector<const char *> presetNames{"fastest", "fast", "medium", "thorough", "verythorough", "exhaustive"};
+const std::vector<std::pair<const char *, BCnEncoder::Format>> bcnFormats{
+    {"bc1", BCnEncoder::BC1}, {"bc3", BCnEncoder::BC3}, {"bc7", BCnEncoder::BC7}};
+
+// PSNR of identical images is capped, to keep the averages finite
+constexpr double maxPSNR = 99.0;
+// Level 0 of BCn tiles decoding below this is reported, to catch encoder regressions
+constexpr double minBCnPSNR = 30.0;
+
+double luma(const uchar *px) {
+    return 0.299 * px[0] + 0.587 * px[1] + 0.114 * px[2];
+}
+
+// Mean SSIM of the luma, over 8x8 windows every 4 pixels
+double ssim(const QImage &a, const QImage &b)
+{
+    static constexpr double c1 = (0.01 * 255) * (0.01 * 255);
+    static constexpr double c2 = (0.03 * 255) * (0.03 * 255);
+    const QImage ra = a.convertToFormat(QImage::Format_RGBA8888);
+    const QImage rb = b.convertToFormat(QImage::Format_RGBA8888);
+    if (ra.size() != rb.size() || ra.width() < 8 || ra.height() < 8)
+        return 0.0;
+
+    double sum = 0.0;
+    int windows = 0;
+    for (int y = 0; y + 8 <= ra.height(); y += 4) {
+        for (int x = 0; x + 8 <= ra.width(); x += 4) {
+            double ma = 0, mb = 0, va = 0, vb = 0, cov = 0;
+            for (int wy = 0; wy < 8; ++wy) {
+                const uchar *la = ra.constScanLine(y + wy) + x * 4;
+                const uchar *lb = rb.constScanLine(y + wy) + x * 4;
+                for (int wx = 0; wx < 8; ++wx) {
+                    const double pa = luma(la + wx * 4);
+                    const double pb = luma(lb + wx * 4);
+                    ma += pa;
+                    mb += pb;
+                    va += pa * pa;
+                    vb += pb * pb;
+                    cov += pa * pb;
+                }
+            }
+            ma /= 64;
+            mb /= 64;
+            va = va / 64 - ma * ma;
+            vb = vb / 64 - mb * mb;
+            cov = cov / 64 - ma * mb;
+            sum += ((2 * ma * mb + c1) * (2 * cov + c2))
+                 / ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            ++windows;
+        }
+    }
+    return sum / windows;
+}
+
+Corpus loadCorpus(const QString &spec, int maxTiles)
+{
+    Corpus res;
+    const int sep = spec.indexOf(QLatin1Char('='));
+    const QString path = (sep < 0) ? spec : spec.mid(sep + 1);
+    res.name = (sep < 0) ? QFileInfo(path).fileName() : spec.left(sep);
+
+    QStringList files;
+    QDirIterator it(path,
+                    {"*.png", "*.jpg", "*.jpeg", "*.webp", "*.tif", "*.tiff"},
+                    QDir::Files,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext())
+        files.append(it.next());
+    files.sort(); // same tiles across runs
+
+    for (const QString &f: qAsConst(files)) {
+        if (int(res.tiles.size()) >= maxTiles)
+            break;
+        QImage tile(f);
+        if (tile.isNull()) {
+            qWarning() << "Failed loading "<<f;
+            continue;
+        }
+        res.files.append(f);
+        res.tiles.push_back(tile.convertToFormat(QImage::Format_RGBA8888));
+    }
+    return res;
+}
+
+using Encode = std::function<QTextureFileData (const QImage &)>;
+using Decode = std::function<QImage (const QTextureFileData &)>;
+
+// Tiles whose level 0 decodes below minPSNR are reported, if minPSNR is set
+Result run(const Corpus &corpus,
+           int minBlockSize,
+           int mipFilter,
+           const Encode &encode,
+           const Decode &decode,
+           double minPSNR = 0.0)
+{
+    Result res;
+    QElapsedTimer timer;
+    for (size_t t = 0; t < corpus.tiles.size(); ++t) {
+        const QImage &tile = corpus.tiles[t];
+        std::vector<QImage> chain;
+        timer.start();
+        ASTCEncoder::generateMips(tile, chain, minBlockSize, mipFilter);
+        res.mipMs += timer.nsecsElapsed() / 1e6;
+
+        QTextureFileData first;
+        timer.start();
+        for (const QImage &level: chain) {
+            const QTextureFileData compressed = encode(level);
+            res.bytes += compressed.dataLength();
+            if (!first.isValid()) {
+                first = compressed;
+                res.baseBytes += compressed.dataLength();
+            }
+        }
+        res.encodeMs += timer.nsecsElapsed() / 1e6;
+        res.levels += chain.size();
+        res.pixels += double(tile.width()) * tile.height();
+
+        const QImage decoded = decode(first);
+        const double psnr = BCnEncoder::psnr(tile, decoded);
+        if (psnr < minPSNR)
+            qWarning() << "PSNR "<<psnr<<" dB for "<<corpus.files.at(int(t));
+        res.psnr += std::min(maxPSNR, psnr);
+        res.ssim += ssim(tile, decoded);
+        ++res.tiles;
+    }
+    return res;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("ASTC Benchmark");
+    QCoreApplication::setApplicationVersion("1.0");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Encodes tile corpora with every ASTC preset and block size, "
+                                     "and optionally BCn, reporting timings, size and quality as CSV");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption corpusOption("corpus",
+                                    "Directory of tiles, optionally named, e.g. satellite=/data/sat. Repeatable",
+                                    "[name=]dir");
+    parser.addOption(corpusOption);
+    QCommandLineOption maxTilesOption("max-tiles", "Tiles used from each corpus. Default 100", "count", "100");
+    parser.addOption(maxTilesOption);
+    QCommandLineOption presetsOption("presets",
+                                     "Comma separated presets among fastest, fast, medium, thorough, "
+                                     "verythorough, exhaustive. Default all",
+                                     "list");
+    parser.addOption(presetsOption);
+    QCommandLineOption blocksOption("blocks", "Comma separated footprints, e.g. 4x4,8x8. Default all", "list");
+    parser.addOption(blocksOption);
+    QCommandLineOption bcnOption("bcn",
+                                 "Comma separated BCn formats among bc1, bc3, bc7, also benchmarked. "
+                                 "Tiles decoding below " + QString::number(minBCnPSNR) + " dB PSNR are reported",
+                                 "list");
+    parser.addOption(bcnOption);
+    QCommandLineOption filterOption("mip-filter", "ASTCEncoder::MipFilter flags. Default 0 (box)", "flags", "0");
+    parser.addOption(filterOption);
+    QCommandLineOption outputOption("output", "CSV file, appended to if existing. Default stdout", "file");
+    parser.addOption(outputOption);
+
+    parser.process(app);
+
+    const int maxTiles = parser.value(maxTilesOption).toInt();
+    std::vector<Corpus> corpora;
+    for (const QString &spec: parser.values(corpusOption)) {
+        Corpus c = loadCorpus(spec, std::max(1, maxTiles));
+        if (c.tiles.empty()) {
+            qWarning() << "No tiles in "<<spec;
+            continue;
+        }
+        qInfo() << "Corpus "<<c.name<<": "<<c.tiles.size()<<" tiles";
+        corpora.push_back(std::move(c));
+    }
+    if (corpora.empty()) {
+        qWarning() << "No corpus. Use --corpus [name=]dir";
+        return 1;
+    }
+
+    std::vector<int> presets;
+    const QString presetList = parser.value(presetsOption);
+    for (size_t p = 0; p < presetNames.size(); ++p) {
+        if (presetList.isEmpty()
+                || presetList.split(QLatin1Char(',')).contains(QLatin1String(presetNames[p]), Qt::CaseInsensitive))
+            presets.push_back(int(p));
+    }
+
+    // All the 2D footprints, in the order of the GL formats
+    std::vector<QSize> blocks;
+    for (quint32 format = 0x93B0; !ASTCEncoder::blockSize(format).isEmpty(); ++format)
+        blocks.push_back(ASTCEncoder::blockSize(format));
+    if (parser.isSet(blocksOption)) {
+        std::vector<QSize> selected;
+        for (const QString &b: parser.value(blocksOption).split(QLatin1Char(','))) {
+            const QStringList wh = b.split(QLatin1Char('x'));
+            const QSize size = (wh.size() == 2) ? QSize(wh[0].toInt(), wh[1].toInt()) : QSize();
+            if (std::find(blocks.begin(), blocks.end(), size) == blocks.end()) {
+                qWarning() << "Invalid footprint "<<b;
+                return 1;
+            }
+            selected.push_back(size);
+        }
+        blocks = selected;
+    }
+    std::vector<std::pair<const char *, BCnEncoder::Format>> bcn;
+    if (parser.isSet(bcnOption)) {
+        for (const QString &f: parser.value(bcnOption).split(QLatin1Char(','))) {
+            const auto it = std::find_if(bcnFormats.begin(), bcnFormats.end(),
+                                         [&f](const std::pair<const char *, BCnEncoder::Format> &e) {
+                return f.compare(QLatin1String(e.first), Qt::CaseInsensitive) == 0;
+            });
+            if (it == bcnFormats.end()) {
+                qWarning() << "Invalid BCn format "<<f;
+                return 1;
+            }
+            bcn.push_back(*it);
+        }
+    }
+    if ((presets.empty() || blocks.empty()) && bcn.empty()) {
+        qWarning() << "Nothing to run";
+        return 1;
+    }
+
+    QFile outputFile;
+    QTextStream out(stdout);
+    bool header = true;
+    if (parser.isSet(outputOption)) {
+        outputFile.setFileName(parser.value(outputOption));
+        header = !outputFile.exists() || !outputFile.size();
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text)) {
+            qWarning() << "Failed opening "<<outputFile.fileName();
+            return 1;
+        }
+        out.setDevice(&outputFile);
+    }
+
+    const QString timestamp = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    if (header) {
+        out << "timestamp,corpus,tiles,block,preset,quality,mip_filter,levels_per_tile,"
+               "mip_ms_per_tile,encode_ms_per_tile,bytes_per_tile,level0_bytes_per_tile,bits_per_pixel,psnr,ssim\n";
+    }
+    const int mipFilter = parser.value(filterOption).toInt();
+    auto write = [&](const Corpus &corpus, const QSize &block, const char *preset,
+                     float quality, const Result &r) {
+        const double n = double(r.tiles);
+        out << timestamp << ','
+            << corpus.name << ','
+            << r.tiles << ','
+            << block.width() << 'x' << block.height() << ','
+            << preset << ','
+            << quality << ','
+            << mipFilter << ','
+            << r.levels / n << ','
+            << r.mipMs / n << ','
+            << r.encodeMs / n << ','
+            << r.bytes / n << ','
+            << r.baseBytes / n << ','
+            << r.baseBytes * 8 / r.pixels << ','
+            << r.psnr / n << ','
+            << r.ssim / n << '\n';
+        out.flush();
+        qInfo() << corpus.name << block << preset << r.encodeMs / n << "ms/tile";
+    };
+
+    ASTCEncoder &encoder = ASTCEncoder::instance();
+    for (const Corpus &corpus: corpora) {
+        for (const QSize &block: blocks) {
+            for (const int preset: presets) {
+                ASTCEncoder::Configuration config;
+                config.blockX = block.width();
+                config.blockY = block.height();
+                config.quality = ASTCEncoder::presetQuality(ASTCEncoder::Preset(preset));
+                config.mipFilter = mipFilter;
+                // context allocation is not part of the encode time
+                encoder.compress(corpus.tiles.front(), config);
+
+                const Result r = run(corpus, config.blockX, mipFilter,
+                                     [&](const QImage &ima) { return encoder.compress(ima, config); },
+                                     [&](const QTextureFileData &d) { return encoder.decompress(d); });
+                write(corpus, block, presetNames[size_t(preset)], config.quality, r);
+            }
+        }
+        // Same chains as BCnEncoder::generateMips, down to one block
+        for (const auto &format: bcn) {
+            const Result r = run(corpus, 4, mipFilter,
+                                 [&](const QImage &ima) { return BCnEncoder::compress(ima, format.second); },
+                                 &BCnEncoder::decompress,
+                                 minBCnPSNR);
+            write(corpus, QSize(4, 4), format.first, 0.f, r);
+        }
+    }
+    return 0;
+}
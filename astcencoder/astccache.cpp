@@ -26,6 +26,10 @@
 #include <QRandomGenerator>
 #include <QCryptographicHash>
 #include <QStandardPaths>
+#include <QtEndian>
+#include <algorithm>
+#include <QHash>
+#include <QStringList>
 
 namespace {
 class ScopeExit {
@@ -99,6 +103,30 @@ ASTCCache::ASTCCache(const QString &sqlitePath) : m_sqlitePath(sqlitePath) {
     CREATE INDEX IF NOT EXISTS idxLastAccess ON Tile(ts);
     )";
 
+    // offsets: levels + 1 little endian uint32 offsets into mips
+    static constexpr char schemaMips[] = R"(
+    CREATE TABLE IF NOT EXISTS TileMips (
+          tileHash TEXT
+        , blockX INTEGER
+        , blockY INTEGER
+        , quality REAL
+        , width INTEGER
+        , height INTEGER
+        , levels INTEGER
+        , offsets BLOB
+        , mips BLOB
+        , ts DATETIME DEFAULT NULL
+        , x INTEGER DEFAULT NULL
+        , y INTEGER DEFAULT NULL
+        , z INTEGER DEFAULT NULL
+        , PRIMARY KEY (tileHash, blockX, blockY, quality, width, height)
+    )
+    )";
+
+    static constexpr char tsindexMips[] = R"(
+    CREATE INDEX IF NOT EXISTS idxMipsLastAccess ON TileMips(ts);
+    )";
+
 
     m_queryCreation = QSqlQuery(m_diskCache);
     m_queryCreation.setForwardOnly(true);
@@ -116,6 +144,15 @@ ASTCCache::ASTCCache(const QString &sqlitePath) : m_sqlitePath(sqlitePath) {
     m_queryIdx.finish();
     m_diskCache.commit();
 
+    m_queryCreationMips = QSqlQuery(m_diskCache);
+    m_queryCreationMips.setForwardOnly(true);
+    res = m_queryCreationMips.exec(QLatin1String(schemaMips))
+            && m_queryCreationMips.exec(QLatin1String(tsindexMips));
+    if (!res)
+        qWarning() << "Failed to create TileMips table"  << m_queryCreationMips.lastError() <<  __FILE__ << __LINE__;
+    m_queryCreationMips.finish();
+    m_diskCache.commit();
+
     m_queryFetchData = QSqlQuery(m_diskCache);
     m_queryFetchData.setForwardOnly(true);
     res = m_queryFetchData.prepare(QStringLiteral(
@@ -139,10 +176,151 @@ ASTCCache::ASTCCache(const QString &sqlitePath) : m_sqlitePath(sqlitePath) {
     if (!res)
         qWarning() << "Failed to prepare  m_queryInsertData"  << m_queryHasData.lastError() <<  __FILE__ << __LINE__;
 
+    m_queryFetchMips = QSqlQuery(m_diskCache);
+    m_queryFetchMips.setForwardOnly(true);
+    res = m_queryFetchMips.prepare(QStringLiteral(
+        "SELECT offsets, mips FROM TileMips WHERE tileHash = :hash AND blockX = :blockX AND blockY = :blockY AND quality = :quality AND width = :width AND height = :height"));
+    if (!res)
+        qWarning() << "Failed to prepare  m_queryFetchMips"  << m_queryFetchMips.lastError() <<  __FILE__ << __LINE__;
+
+    m_queryInsertMips = QSqlQuery(m_diskCache);
+    m_queryInsertMips.setForwardOnly(true);
+    res = m_queryInsertMips.prepare(QStringLiteral(
+        "INSERT OR REPLACE INTO TileMips(tileHash, blockX, blockY, quality, width, height, levels, offsets, mips, ts, x, y, z) "
+        "VALUES (:hash, :blockX, :blockY, :quality, :width, :height, :levels, :offsets, :mips, :ts, :x, :y, :z)"));
+    if (!res)
+        qWarning() << "Failed to prepare  m_queryInsertMips"  << m_queryInsertMips.lastError() <<  __FILE__ << __LINE__;
+
+    m_queryHasMips = QSqlQuery(m_diskCache);
+    m_queryHasMips.setForwardOnly(true);
+    res = m_queryHasMips.prepare(QStringLiteral(
+        "SELECT count(*) FROM TileMips WHERE tileHash = :hash AND blockX = :blockX AND blockY = :blockY AND quality = :quality"));
+    if (!res)
+        qWarning() << "Failed to prepare  m_queryHasMips"  << m_queryHasMips.lastError() <<  __FILE__ << __LINE__;
+
+    m_queryDeleteLegacy = QSqlQuery(m_diskCache);
+    m_queryDeleteLegacy.setForwardOnly(true);
+    res = m_queryDeleteLegacy.prepare(QStringLiteral(
+        "DELETE FROM Tile WHERE tileHash = :hash AND blockX = :blockX AND blockY = :blockY AND quality = :quality"));
+    if (!res)
+        qWarning() << "Failed to prepare  m_queryDeleteLegacy"  << m_queryDeleteLegacy.lastError() <<  __FILE__ << __LINE__;
+
 
     m_initialized = true;
 }
 
+bool ASTCCache::insertMips(const QByteArray &tileHash,
+                           int blockX,
+                           int blockY,
+                           float quality,
+                           int width,
+                           int height,
+                           quint64 x,
+                           quint64 y,
+                           quint64 z,
+                           const std::vector<QByteArray> &mips)
+{
+    if (!m_initialized) {
+        qWarning() << "ASTCCache::insertMips: database not initialized";
+        return false;
+    }
+    QByteArray offsets;
+    QByteArray data;
+    int total = 0;
+    for (const auto &m: mips)
+        total += m.size();
+    offsets.reserve(int(mips.size() + 1) * 4);
+    data.reserve(total);
+    for (const auto &m: mips) {
+        const quint32 offset = qToLittleEndian<quint32>(quint32(data.size()));
+        offsets.append(reinterpret_cast<const char *>(&offset), 4);
+        data.append(m);
+    }
+    const quint32 end = qToLittleEndian<quint32>(quint32(data.size()));
+    offsets.append(reinterpret_cast<const char *>(&end), 4);
+
+    bool committed = false;
+    m_diskCache.transaction();
+    ScopeExit releaser([this, &committed]() {
+        m_queryInsertMips.finish();
+        m_queryDeleteLegacy.finish();
+        if (committed)
+            m_diskCache.commit();
+        else
+            m_diskCache.rollback();
+    });
+    m_queryInsertMips.bindValue(0, tileHash.toBase64());
+    m_queryInsertMips.bindValue(1, blockX);
+    m_queryInsertMips.bindValue(2, blockY);
+    m_queryInsertMips.bindValue(3, quality);
+    m_queryInsertMips.bindValue(4, width);
+    m_queryInsertMips.bindValue(5, height);
+    m_queryInsertMips.bindValue(6, int(mips.size()));
+    m_queryInsertMips.bindValue(7, offsets);
+    m_queryInsertMips.bindValue(8, data);
+    m_queryInsertMips.bindValue(9, QDateTime::currentDateTimeUtc());
+    m_queryInsertMips.bindValue(10, x);
+    m_queryInsertMips.bindValue(11, y);
+    m_queryInsertMips.bindValue(12, z);
+
+    if (!m_queryInsertMips.exec()) {
+        qDebug() << m_queryInsertMips.lastError() <<  __FILE__ << __LINE__ << "for "<< width << ","<<height;
+        return false;
+    }
+
+    m_queryDeleteLegacy.bindValue(0, tileHash.toBase64());
+    m_queryDeleteLegacy.bindValue(1, blockX);
+    m_queryDeleteLegacy.bindValue(2, blockY);
+    m_queryDeleteLegacy.bindValue(3, quality);
+    if (!m_queryDeleteLegacy.exec()) {
+        qDebug() << m_queryDeleteLegacy.lastError() <<  __FILE__ << __LINE__ << "for "<< width << ","<<height;
+        return false;
+    }
+    committed = true;
+    return true;
+}
+
+ASTCCache::MipChain ASTCCache::mips(const QByteArray &tileHash,
+                                    int blockX,
+                                    int blockY,
+                                    float quality,
+                                    int width,
+                                    int height)
+{
+    if (!m_initialized) {
+        qWarning() << "ASTCCache::mips: database not initialized";
+        return {};
+    }
+    ScopeExit releaser([this]() {m_queryFetchMips.finish();});
+    m_queryFetchMips.bindValue(0, tileHash.toBase64());
+    m_queryFetchMips.bindValue(1, blockX);
+    m_queryFetchMips.bindValue(2, blockY);
+    m_queryFetchMips.bindValue(3, quality);
+    m_queryFetchMips.bindValue(4, width);
+    m_queryFetchMips.bindValue(5, height);
+
+    if (!m_queryFetchMips.exec()) {
+        qDebug() << m_queryFetchMips.lastError() <<  __FILE__ << __LINE__;
+        return {};
+    }
+    if (!m_queryFetchMips.first())
+        return {};
+
+    MipChain res;
+    const QByteArray offsets = m_queryFetchMips.value(0).toByteArray();
+    res.data = m_queryFetchMips.value(1).toByteArray();
+    res.offsets.reserve(size_t(offsets.size() / 4));
+    for (int i = 0; i + 4 <= offsets.size(); i += 4)
+        res.offsets.push_back(qFromLittleEndian<quint32>(offsets.constData() + i));
+    for (size_t i = 1; i < res.offsets.size(); ++i) {
+        if (res.offsets[i] < res.offsets[i - 1] || res.offsets[i] > quint32(res.data.size())) {
+            qWarning() << "ASTCCache::mips: corrupt offsets for "<<tileHash.toBase64();
+            return {};
+        }
+    }
+    return res;
+}
+
 bool ASTCCache::insert(const QByteArray &tileHash,
                        int blockX,
                        int blockY,
@@ -219,6 +397,15 @@ bool ASTCCache::contains(const QByteArray &tileHash,
         qWarning() << "ASTCCache::contains: database not initialized";
         return false;
     }
+    {
+        ScopeExit releaser([this]() {m_queryHasMips.finish();});
+        m_queryHasMips.bindValue(0, tileHash.toBase64());
+        m_queryHasMips.bindValue(1, blockX);
+        m_queryHasMips.bindValue(2, blockY);
+        m_queryHasMips.bindValue(3, quality);
+        if (m_queryHasMips.exec() && m_queryHasMips.first() && m_queryHasMips.value(0).toInt())
+            return true;
+    }
     ScopeExit releaser([this]() {m_queryHasData.finish();});
     m_queryHasData.bindValue(0, tileHash.toBase64());
     m_queryHasData.bindValue(1, blockX);
@@ -228,7 +415,63 @@ bool ASTCCache::contains(const QByteArray &tileHash,
         qDebug() << m_queryHasData.lastError() <<  __FILE__ << __LINE__;
         return {};
     }
-    return bool(m_queryHasData.value(0).toInt());
+    return m_queryHasData.first() && m_queryHasData.value(0).toInt();
+}
+
+std::vector<bool> ASTCCache::contains(const std::vector<QByteArray> &tileHashes,
+                                      int blockX,
+                                      int blockY,
+                                      float quality)
+{
+    std::vector<bool> res(tileHashes.size(), false);
+    if (!m_initialized) {
+        qWarning() << "ASTCCache::contains: database not initialized";
+        return res;
+    }
+    // below SQLITE_MAX_VARIABLE_NUMBER (999) in older sqlite builds
+    static constexpr size_t batchSize = 500;
+
+    // bound as blobs, like in the single tile queries
+    QHash<QByteArray, std::vector<size_t>> pending; // base64 hash -> indices in tileHashes
+    for (size_t i = 0; i < tileHashes.size(); ++i)
+        pending[tileHashes[i].toBase64()].push_back(i);
+
+    for (const QString table: {QStringLiteral("TileMips"), QStringLiteral("Tile")}) {
+        const QList<QByteArray> hashes = pending.keys();
+        for (int first = 0; first < hashes.size(); first += int(batchSize)) {
+            const int count = std::min(int(batchSize), hashes.size() - first);
+            QStringList placeholders;
+            placeholders.reserve(count);
+            for (int i = 0; i < count; ++i)
+                placeholders.append(QStringLiteral("?"));
+
+            QSqlQuery query(m_diskCache);
+            query.setForwardOnly(true);
+            if (!query.prepare(QStringLiteral("SELECT DISTINCT tileHash FROM %1 WHERE blockX = ? AND blockY = ? AND quality = ? AND tileHash IN (%2)")
+                               .arg(table, placeholders.join(QLatin1Char(','))))) {
+                qWarning() << "ASTCCache::contains: "<< query.lastError() <<  __FILE__ << __LINE__;
+                return res;
+            }
+            query.addBindValue(blockX);
+            query.addBindValue(blockY);
+            query.addBindValue(quality);
+            for (int i = first; i < first + count; ++i)
+                query.addBindValue(hashes.at(i));
+            if (!query.exec()) {
+                qDebug() << query.lastError() <<  __FILE__ << __LINE__;
+                return res;
+            }
+            while (query.next()) {
+                const auto it = pending.find(query.value(0).toByteArray());
+                if (it == pending.end())
+                    continue;
+                for (const size_t i: it.value())
+                    res[i] = true;
+                pending.erase(it);
+            }
+        }
+    }
+    return res;
 }
 
 quint64 ASTCCache::size() const
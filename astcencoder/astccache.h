@@ -34,12 +34,43 @@
 #include <QDebug>
 #include <QDataStream>
 #include <QImage>
+#include <vector>
 
 class ASTCCache {
 public:
+    // A mip chain stored as one row: level i spans [offsets[i], offsets[i + 1]) of data
+    struct MipChain {
+        QByteArray data;
+        std::vector<quint32> offsets;
+
+        int levels() const { return (offsets.size()) ? int(offsets.size()) - 1 : 0; }
+    };
+
     ASTCCache(const QString &sqlitePath);
     virtual ~ASTCCache() {}
 
+    // Whole chains, written with a single statement and fetched with a single query.
+    // width and height are those of the first level. Per level Tile rows of the same
+    // tile are deleted in the same transaction, as the chain supersedes them
+    bool insertMips(const QByteArray &tileHash,
+                    int blockX,
+                    int blockY,
+                    float quality,
+                    int width,
+                    int height,
+                    quint64 x,
+                    quint64 y,
+                    quint64 z,
+                    const std::vector<QByteArray> &mips);
+
+    MipChain mips(const QByteArray &tileHash,
+                  int blockX,
+                  int blockY,
+                  float quality,
+                  int width,
+                  int height);
+
+    // Per level rows, as written before chains were stored in TileMips
     bool insert(const QByteArray &tileHash,
                 int blockX,
                 int blockY,
@@ -59,6 +90,11 @@ public:
                     int height);
 
     bool contains(const QByteArray &tileHash, int blockX, int blockY, float quality);
+    // Same for many tiles, answered with one IN query per table and batch of hashes
+    std::vector<bool> contains(const std::vector<QByteArray> &tileHashes,
+                               int blockX,
+                               int blockY,
+                               float quality);
 
     quint64 size() const;
 
@@ -75,6 +111,11 @@ protected:
     QSqlQuery m_queryInsertData;
     QSqlQuery m_queryInsertMetadata;
     QSqlQuery m_queryHasData;
+    QSqlQuery m_queryCreationMips;
+    QSqlQuery m_queryFetchMips;
+    QSqlQuery m_queryInsertMips;
+    QSqlQuery m_queryHasMips;
+    QSqlQuery m_queryDeleteLegacy;
     bool m_initialized{false};
 };
 
@@ -20,14 +20,28 @@
 
 #include "astcencoder.h"
 #include "astccache.h"
+#include "tilebufferpool.h"
 
 #include <iostream>
 #include <string>
 #include <cstdlib>
 #include <vector>
 #include <map>
+#include <array>
+#include <memory>
+#include <tuple>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <QThreadPool>
 #include <QThread>
+#include <QRunnable>
+#include <QMutex>
+#include <QMutexLocker>
+#include <atomic>
 
 #include <QStandardPaths>
 #include <QDirIterator>
@@ -35,9 +49,9 @@
 #include <QFileInfo>
 #include <QCryptographicHash>
 #include <QScopedPointer>
-#include <QBuffer>
+#include <QtEndian>
 
-#include <private/qtexturefilereader_p.h>
+#include <private/qtexturefiledata_p.h>
 
 
 #include "astcenc.h"
@@ -47,32 +61,48 @@ struct ASTCEncoderPrivate {
     : m_cacheDirPath(QStringLiteral("%1/astcCache.sqlite").arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)))
     , m_tileCache(m_cacheDirPath)
     {
-        swizzle = { // QImage::Format_RGB32 == 0xffRRGGBB
-                    ASTCENC_SWZ_B,
-                    ASTCENC_SWZ_G,
+        swizzle = { // QImage::Format_RGBA8888 / RGBX8888
                     ASTCENC_SWZ_R,
+                    ASTCENC_SWZ_G,
+                    ASTCENC_SWZ_B,
                     ASTCENC_SWZ_A
                   };
+    }
 
-        astcenc_error status;
+    ~ASTCEncoderPrivate() {
+        for (auto &c: m_contexts)
+            astcenc_context_free(c.second);
+        for (auto &c: m_decompressionContexts)
+            astcenc_context_free(c.second);
+    }
 
-        config.block_x = block_x;
-        config.block_y = block_y;
-        config.profile = profile;
+    static astcenc_context *allocContext(const ASTCEncoder::Configuration &c,
+                                         unsigned int threads,
+                                         unsigned int flags = 0) {
+        astcenc_error status;
+        astcenc_config config;
 
-        status = astcenc_config_init(profile, block_x, block_y, block_z, quality, 0, &config);
+        status = astcenc_config_init(profile, c.blockX, c.blockY, block_z, c.quality, flags, &config);
         if (status != ASTCENC_SUCCESS) {
             qWarning() << "ERROR: Codec config init failed: " << astcenc_get_error_string(status);
             qFatal("Terminating");
         }
 
-        astcenc_context *c;
-        status = astcenc_context_alloc(&config, thread_count, &c);
-        m_ctx.reset(c);
+        astcenc_context *ctx;
+        status = astcenc_context_alloc(&config, threads, &ctx);
         if (status != ASTCENC_SUCCESS) {
             qWarning() << "ERROR: Codec context alloc failed: "<< astcenc_get_error_string(status);
             qFatal("Terminating");
         }
+        return ctx;
+    }
+
+    // Allocated on first use, one per configuration used by this thread
+    astcenc_context *context(const ASTCEncoder::Configuration &c) {
+        astcenc_context *&ctx = m_contexts[c];
+        if (!ctx)
+            ctx = allocContext(c, thread_count);
+        return ctx;
     }
 
     struct astcenc_context_deleter {
@@ -84,30 +114,29 @@ struct ASTCEncoderPrivate {
         }
     };
 
-    QScopedPointer<astcenc_context, astcenc_context_deleter> m_ctx;
+    // Decompress only, smaller, one per footprint used by this thread
+    astcenc_context *decompressionContext(int blockX, int blockY) {
+        astcenc_context *&ctx = m_decompressionContexts[{blockX, blockY}];
+        if (!ctx) {
+            ASTCEncoder::Configuration c;
+            c.blockX = blockX;
+            c.blockY = blockY;
+            ctx = allocContext(c, thread_count, ASTCENC_FLG_DECOMPRESS_ONLY);
+        }
+        return ctx;
+    }
+
+    std::map<ASTCEncoder::Configuration, astcenc_context *> m_contexts;
+    std::map<std::pair<int, int>, astcenc_context *> m_decompressionContexts;
     astcenc_swizzle swizzle;
-    astcenc_config config;
     QString m_cacheDirPath;
     ASTCCache m_tileCache;
 
     static const astcenc_profile profile = ASTCENC_PRF_LDR;
 
-//    static const float ASTCENC_PRE_FASTEST = 0.0f;
-//    static const float ASTCENC_PRE_FAST = 10.0f;
-//    static const float ASTCENC_PRE_MEDIUM = 60.0f;
-//    static const float ASTCENC_PRE_THOROUGH = 98.0f;
-//    static const float ASTCENC_PRE_VERYTHOROUGH = 99.0f;
-//    static const float ASTCENC_PRE_EXHAUSTIVE = 100.0f;
-
-    constexpr static const float quality = 85.0f;
-
     static const unsigned int thread_count = 1;
-    static const unsigned int block_x = 8;
-    static const unsigned int block_y = 8;
-//    static const unsigned int block_x = 4;
-//    static const unsigned int block_y = 4;
-//    static const unsigned int block_x = 6;
-//    static const unsigned int block_y = 6;
+    // Images with at least this many blocks may be compressed by the shared context
+    static const unsigned int shared_context_min_blocks = 4096;
     static const unsigned int block_z = 1;
     static const uint32_t ASTC_MAGIC_ID = 0x5CA1AB13;
 };
@@ -116,8 +145,107 @@ namespace {
 bool isEven(const QSize &s) {
     return (s.width() % 2) == 0 && (s.height() % 2) == 0;
 }
+
+// Filtered chains differ from box filtered ones, so they are cached apart
+QByteArray cacheKey(QByteArray md5, const ASTCEncoder::Configuration &config) {
+    if (config.mipFilter != ASTCEncoder::BoxFilter)
+        md5.append(char(config.mipFilter));
+    return md5;
+}
+
+// Number of threads currently inside ASTCEncoder::compress, on either context
+std::atomic<int> activeEncoders{0};
+
+struct ActiveEncoderGuard {
+    ActiveEncoderGuard() { ++activeEncoders; }
+    ~ActiveEncoderGuard() { --activeEncoders; }
+};
+
+class CompressionRunnable : public QRunnable {
+public:
+    CompressionRunnable(astcenc_context *ctx,
+                        astcenc_image &image,
+                        const astcenc_swizzle &swizzle,
+                        uint8_t *out,
+                        size_t outLen,
+                        unsigned int threadIndex,
+                        std::atomic<int> &status)
+    : m_ctx(ctx), m_image(image), m_swizzle(swizzle), m_out(out), m_outLen(outLen)
+    , m_threadIndex(threadIndex), m_status(status) {}
+
+    void run() override {
+        const astcenc_error status = astcenc_compress_image(m_ctx, &m_image, &m_swizzle,
+                                                            m_out, m_outLen, m_threadIndex);
+        if (status != ASTCENC_SUCCESS)
+            m_status = status;
+    }
+
+private:
+    astcenc_context *m_ctx;
+    astcenc_image &m_image;
+    const astcenc_swizzle &m_swizzle;
+    uint8_t *m_out;
+    size_t m_outLen;
+    unsigned int m_threadIndex;
+    std::atomic<int> &m_status;
+};
+
+// A context with one thread slot per core, where the calling thread and
+// threadCount - 1 pool threads cooperate on one image at a time.
+// The per thread contexts are best for tiles, this one for few large coverages.
+struct SharedASTCContext {
+    SharedASTCContext(const ASTCEncoder::Configuration &config)
+    : threadCount(unsigned(qMax(1, QThread::idealThreadCount()))) {
+        m_ctx.reset(ASTCEncoderPrivate::allocContext(config, threadCount));
+        m_pool.setMaxThreadCount(int(qMax(1u, threadCount - 1)));
+    }
+
+    static SharedASTCContext &instance(const ASTCEncoder::Configuration &config) {
+        static QMutex mutex;
+        static std::map<ASTCEncoder::Configuration, std::unique_ptr<SharedASTCContext>> contexts;
+        QMutexLocker locker(&mutex);
+        auto &ctx = contexts[config];
+        if (!ctx)
+            ctx.reset(new SharedASTCContext(config));
+        return *ctx;
+    }
+
+    // Returns false, without compressing, when another image is being compressed
+    bool tryCompress(astcenc_image &image,
+                     const astcenc_swizzle &swizzle,
+                     uint8_t *out,
+                     size_t outLen,
+                     astcenc_error &res) {
+        if (!m_mutex.tryLock())
+            return false;
+        std::atomic<int> status{ASTCENC_SUCCESS};
+        for (unsigned int i = 1; i < threadCount; ++i)
+            m_pool.start(new CompressionRunnable(m_ctx.get(), image, swizzle, out, outLen, i, status));
+        CompressionRunnable(m_ctx.get(), image, swizzle, out, outLen, 0, status).run();
+        m_pool.waitForDone();
+        astcenc_compress_reset(m_ctx.get());
+        m_mutex.unlock();
+        res = astcenc_error(status.load());
+        return true;
+    }
+
+    const unsigned int threadCount;
+    QScopedPointer<astcenc_context, ASTCEncoderPrivate::astcenc_context_deleter> m_ctx;
+    QThreadPool m_pool;
+    QMutex m_mutex;
+};
+
+// Intra image parallelism only pays off for large images, and only when the
+// per thread contexts leave most cores idle
+bool useSharedContext(unsigned int blockCount) {
+    if (blockCount < ASTCEncoderPrivate::shared_context_min_blocks)
+        return false;
+    const int cores = QThread::idealThreadCount();
+    return cores > 1 && activeEncoders.load() <= cores / 2;
+}
 } // namespace
 
+// Header of .astc files. Only found in rows cached before the cache stored headerless blocks
 struct astc_header
 {
     uint8_t magic[4];
@@ -135,14 +263,14 @@ ASTCEncoder &ASTCEncoder::instance()
     return instance;
 }
 
-QTextureFileData ASTCEncoder::compress(QImage ima) { // Check whether astcenc_compress_image modifies astcenc_image::data. If not, consider using const & and const_cast.
-    if (ima.hasAlphaChannel())
-       ima = ima.convertToFormat(QImage::Format_ARGB32);
-    else
-        ima = ima.convertToFormat(QImage::Format_RGB32);
+QTextureFileData ASTCEncoder::compress(QImage ima, const Configuration &config) {
+    if (ima.format() != QImage::Format_RGBA8888 && ima.format() != QImage::Format_RGBX8888) {
+        ima = ima.convertToFormat((ima.hasAlphaChannel()) ? QImage::Format_RGBA8888
+                                                          : QImage::Format_RGBX8888);
+    }
     // Compute the number of ASTC blocks in each dimension
-    unsigned int block_count_x = (ima.width() + d->block_x - 1) / d->block_x;
-    unsigned int block_count_y = (ima.height() + d->block_y - 1) / d->block_y;
+    unsigned int block_count_x = (ima.width() + config.blockX - 1) / config.blockX;
+    unsigned int block_count_y = (ima.height() + config.blockY - 1) / config.blockY;
 
     // Compress the image
     astcenc_image image;
@@ -150,7 +278,8 @@ QTextureFileData ASTCEncoder::compress(QImage ima) { // Check whether astcenc_co
     image.dim_y = ima.height();
     image.dim_z = 1;
     image.data_type = ASTCENC_TYPE_U8;
-    uint8_t* slices = ima.bits();
+    // astcenc only reads the input, and bits() would detach the shared mip chain
+    uint8_t* slices = const_cast<uint8_t *>(ima.constBits());
     image.data = reinterpret_cast<void**>(&slices);
 
     // Space needed for 16 bytes of output per compressed block
@@ -159,13 +288,21 @@ QTextureFileData ASTCEncoder::compress(QImage ima) { // Check whether astcenc_co
     QByteArray data;
     data.resize(comp_len);
 
-
-    astcenc_error status = astcenc_compress_image(d->m_ctx.get(),
-                                                  &image,
-                                                  &d->swizzle,
-                                                  reinterpret_cast<uint8_t *>(data.data()),
-                                                  comp_len,
-                                                  0);
+    ActiveEncoderGuard activeGuard;
+    astcenc_error status = ASTCENC_SUCCESS;
+    if (!useSharedContext(block_count_x * block_count_y)
+            || !SharedASTCContext::instance(config).tryCompress(image,
+                                                                d->swizzle,
+                                                                reinterpret_cast<uint8_t *>(data.data()),
+                                                                comp_len,
+                                                                status)) {
+        status = astcenc_compress_image(d->context(config),
+                                        &image,
+                                        &d->swizzle,
+                                        reinterpret_cast<uint8_t *>(data.data()),
+                                        comp_len,
+                                        0);
+    }
     if (status != ASTCENC_SUCCESS || !data.size()) {
         qWarning() << "ERROR: Codec compress failed: "
                         << astcenc_get_error_string(status)
@@ -173,111 +310,395 @@ QTextureFileData ASTCEncoder::compress(QImage ima) { // Check whether astcenc_co
         qFatal("Terminating");
     }
 
-    astc_header hdr;
-    hdr.magic[0] =  d->ASTC_MAGIC_ID        & 0xFF;
-    hdr.magic[1] = (d->ASTC_MAGIC_ID >>  8) & 0xFF;
-    hdr.magic[2] = (d->ASTC_MAGIC_ID >> 16) & 0xFF;
-    hdr.magic[3] = (d->ASTC_MAGIC_ID >> 24) & 0xFF;
-
-    hdr.block_x = static_cast<uint8_t>(d->block_x);
-    hdr.block_y = static_cast<uint8_t>(d->block_y);
-    hdr.block_z = static_cast<uint8_t>(1);
-
-    hdr.dim_x[0] =  image.dim_x        & 0xFF;
-    hdr.dim_x[1] = (image.dim_x >>  8) & 0xFF;
-    hdr.dim_x[2] = (image.dim_x >> 16) & 0xFF;
-
-    hdr.dim_y[0] =  image.dim_y       & 0xFF;
-    hdr.dim_y[1] = (image.dim_y >>  8) & 0xFF;
-    hdr.dim_y[2] = (image.dim_y >> 16) & 0xFF;
-
-    hdr.dim_z[0] =  image.dim_z        & 0xFF;
-    hdr.dim_z[1] = (image.dim_z >>  8) & 0xFF;
-    hdr.dim_z[2] = (image.dim_z >> 16) & 0xFF;
-
-    QByteArray header(reinterpret_cast<char*>(&hdr)
-                      ,sizeof(astc_header));
-    data.insert(0, header);
-    QBuffer buf(&data);
-    buf.open(QIODevice::ReadOnly);
-    if (!buf.isReadable())
-        qFatal("QBuffer not readable");
-    QTextureFileReader reader(&buf);
-    if (!reader.canRead())
-        qFatal("QTextureFileReader failed reading");
-    QTextureFileData res = reader.read();
+    return fromBlocks(std::move(data), ima.size(), config.blockX, config.blockY);
+}
+
+QImage ASTCEncoder::decompress(const QTextureFileData &data)
+{
+    const QSize block = blockSize(quint32(data.glInternalFormat()));
+    if (block.isEmpty() || !data.isValid())
+        return QImage();
+
+    QImage res(data.size(), QImage::Format_RGBA8888);
+    astcenc_image image;
+    image.dim_x = res.width();
+    image.dim_y = res.height();
+    image.dim_z = 1;
+    image.data_type = ASTCENC_TYPE_U8;
+    uint8_t* slices = res.bits();
+    image.data = reinterpret_cast<void**>(&slices);
+
+    astcenc_context *ctx = d->decompressionContext(block.width(), block.height());
+    const astcenc_error status =
+            astcenc_decompress_image(ctx,
+                                     reinterpret_cast<const uint8_t *>(data.data().constData() + data.dataOffset()),
+                                     size_t(data.dataLength()),
+                                     &image,
+                                     &d->swizzle,
+                                     0);
+    astcenc_decompress_reset(ctx);
+    if (status != ASTCENC_SUCCESS) {
+        qWarning() << "ASTCEncoder::decompress: "<< astcenc_get_error_string(status) << " " << data.size();
+        return QImage();
+    }
     return res;
 }
 
-QImage ASTCEncoder::halve(const QImage &src) { // TODO: change into move once m_image is gone from CompressedTextureData?
+QTextureFileData ASTCEncoder::constantColor(const QSize &size,
+                                            QRgb color,
+                                            int blockX,
+                                            int blockY)
+{
+    // LDR void-extent block: block mode 0x1FC, reserved bits set, no extent
+    // coordinates, then the color as UNORM16 RGBA
+    char block[16] = {char(0xFC), char(0xFD), char(0xFF), char(0xFF),
+                      char(0xFF), char(0xFF), char(0xFF), char(0xFF)};
+    const int channels[4] = {qRed(color), qGreen(color), qBlue(color), qAlpha(color)};
+    for (int c = 0; c < 4; ++c) {
+        const quint16 v = quint16(channels[c] * 257);
+        block[8 + 2 * c] = char(v & 0xFF);
+        block[9 + 2 * c] = char(v >> 8);
+    }
+    const int blockCount = ((size.width() + blockX - 1) / blockX)
+                         * ((size.height() + blockY - 1) / blockY);
+    QByteArray data;
+    data.reserve(blockCount * 16);
+    for (int i = 0; i < blockCount; ++i)
+        data.append(block, 16);
+    return fromBlocks(std::move(data), size, blockX, blockY);
+}
+
+namespace {
+// 2x2 box filter of two RGBA8888 rows into one, rounding to nearest
+void reduceBox(const uchar *row0, const uchar *row1, uchar *dst, int dstWidth)
+{
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    // 8 source pixels per row into 4
+    for (; x + 4 <= dstWidth; x += 4) {
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8));
+        const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8 + 16));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8 + 16));
+        // vertical sums, two 16 bit pixels per register
+        const __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(b0, zero));
+        const __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(b0, zero));
+        const __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(a1, zero), _mm_unpacklo_epi8(b1, zero));
+        const __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(a1, zero), _mm_unpackhi_epi8(b1, zero));
+        // horizontal sums in the low halves
+        const __m128i h0 = _mm_add_epi16(s0, _mm_srli_si128(s0, 8));
+        const __m128i h1 = _mm_add_epi16(s1, _mm_srli_si128(s1, 8));
+        const __m128i h2 = _mm_add_epi16(s2, _mm_srli_si128(s2, 8));
+        const __m128i h3 = _mm_add_epi16(s3, _mm_srli_si128(s3, 8));
+        const __m128i d01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(h0, h1), two), 2);
+        const __m128i d23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(h2, h3), two), 2);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 4), _mm_packus_epi16(d01, d23));
+    }
+#endif
+    for (; x < dstWidth; ++x) {
+        for (int c = 0; c < 4; ++c) {
+            dst[x * 4 + c] = uchar((row0[x * 8 + c] + row0[x * 8 + 4 + c]
+                                  + row1[x * 8 + c] + row1[x * 8 + 4 + c] + 2) >> 2);
+        }
+    }
+}
+
+const float *srgbToLinear()
+{
+    static const std::array<float, 256> table = [](){
+        std::array<float, 256> res;
+        for (int i = 0; i < 256; ++i) {
+            const float v = i / 255.f;
+            res[i] = (v <= 0.04045f) ? v / 12.92f : std::pow((v + 0.055f) / 1.055f, 2.4f);
+        }
+        return res;
+    }();
+    return table.data();
+}
+
+constexpr int linearToSrgbSize = 8192;
+const uchar *linearToSrgb()
+{
+    static const std::array<uchar, linearToSrgbSize> table = [](){
+        std::array<uchar, linearToSrgbSize> res;
+        for (int i = 0; i < linearToSrgbSize; ++i) {
+            const float v = i / float(linearToSrgbSize - 1);
+            const float s = (v <= 0.0031308f) ? v * 12.92f : 1.055f * std::pow(v, 1.f / 2.4f) - 0.055f;
+            res[i] = uchar(qBound(0, int(s * 255.f + .5f), 255));
+        }
+        return res;
+    }();
+    return table.data();
+}
+
+// 2x2 reduction averaging in linear light and/or weighting colors by alpha
+void reduceFiltered(const uchar *row0, const uchar *row1, uchar *dst, int dstWidth, int filter)
+{
+    const float *toLinear = (filter & ASTCEncoder::SRGBFilter) ? srgbToLinear() : nullptr;
+    const uchar *toSrgb = (toLinear) ? linearToSrgb() : nullptr;
+    const bool premultiply = filter & ASTCEncoder::PremultipliedAlpha;
+    for (int x = 0; x < dstWidth; ++x) {
+        const uchar *p[4] = {row0 + x * 8, row0 + x * 8 + 4, row1 + x * 8, row1 + x * 8 + 4};
+        const int alphaSum = p[0][3] + p[1][3] + p[2][3] + p[3][3];
+        // fully transparent blocks keep their unweighted color
+        const bool weighted = premultiply && alphaSum;
+        for (int c = 0; c < 3; ++c) {
+            float sum = 0.f;
+            for (int i = 0; i < 4; ++i) {
+                const float v = (toLinear) ? toLinear[p[i][c]] : p[i][c] * (1.f / 255.f);
+                sum += (weighted) ? v * p[i][3] : v;
+            }
+            const float v = (weighted) ? sum / alphaSum : sum * .25f;
+            dst[x * 4 + c] = (toSrgb)
+                    ? toSrgb[qBound(0, int(v * (linearToSrgbSize - 1) + .5f), linearToSrgbSize - 1)]
+                    : uchar(qBound(0, int(v * 255.f + .5f), 255));
+        }
+        dst[x * 4 + 3] = uchar((alphaSum + 2) >> 2);
+    }
+}
+
+void reduce(const uchar *src, int srcStride, uchar *dst, int dstStride, const QSize &dstSize, int filter)
+{
+    for (int y = 0; y < dstSize.height(); ++y) {
+        const uchar *row0 = src + 2 * y * srcStride;
+        if (filter == ASTCEncoder::BoxFilter)
+            reduceBox(row0, row0 + srcStride, dst + y * dstStride, dstSize.width());
+        else
+            reduceFiltered(row0, row0 + srcStride, dst + y * dstStride, dstSize.width(), filter);
+    }
+}
+
+void releaseMipBuffer(void *buffer)
+{
+    delete static_cast<std::shared_ptr<uchar> *>(buffer);
+}
+} // namespace
+
+QImage ASTCEncoder::halve(const QImage &src, int filter) {
     if ((src.width() % 2) != 0  || (src.height() % 2) != 0) {
         qWarning() << "Requested halving of size "<< QSize(src.width(), src.height()) <<" not supported";
         return src; // only do square power of 2 textures
     }
 
+    const QImage rgba = src.convertToFormat(QImage::Format_RGBA8888);
     const QSize size = QSize(src.width() / 2, src.height() / 2);
-    const float hMultiplier = src.width() / float(size.width());
-    const float vMultiplier = src.height() / float(size.height());
-    QImage res(size, QImage::Format_RGB32);
-
-    float pixelsPerPatch = int(hMultiplier) * int(vMultiplier);
-    for (int y = 0; y < size.height(); ++y) {
-        for (int x = 0; x < size.width(); ++x) {
-            float sumR = 0;
-            float sumG = 0;
-            float sumB = 0;
-            float sumA = 0;
-
-            for (int iy = 0; iy < int(vMultiplier); ++iy) {
-                for (int ix = 0; ix < int(hMultiplier); ++ix) {
-                    auto p = src.pixel(x * int(hMultiplier) + ix,
-                                       y * int(vMultiplier) + iy);
-                    sumR += qRed(p);
-                    sumG += qGreen(p);
-                    sumB += qBlue(p);
-                    sumA += qAlpha(p);
-                }
-            }
-            QRgb avg = qRgba(sumR / pixelsPerPatch
-                             ,sumG / pixelsPerPatch
-                             ,sumB / pixelsPerPatch
-                             ,sumA / pixelsPerPatch);
-            res.setPixel(x,y,avg);
-        }
-    }
+    QImage res = TileBufferPool::instance().image(size, QImage::Format_RGBA8888);
+    reduce(rgba.constBits(), rgba.bytesPerLine(), res.bits(), res.bytesPerLine(), size, filter);
     return res;
 }
 
 int ASTCEncoder::blockSize() {
-    return ASTCEncoderPrivate::block_x;
+    return Configuration().blockX;
+}
+
+float ASTCEncoder::presetQuality(Preset preset) {
+    switch (preset) {
+    case Fastest:
+        return ASTCENC_PRE_FASTEST;
+    case Fast:
+        return ASTCENC_PRE_FAST;
+    case Medium:
+        return ASTCENC_PRE_MEDIUM;
+    case Thorough:
+        return ASTCENC_PRE_THOROUGH;
+    case VeryThorough:
+        return ASTCENC_PRE_VERYTHOROUGH;
+    case Exhaustive:
+        return ASTCENC_PRE_EXHAUSTIVE;
+    }
+    return Configuration().quality;
 }
 
-QTextureFileData ASTCEncoder::fromCached(QByteArray &cached) {
-    QBuffer buf(&cached);
-    buf.open(QIODevice::ReadOnly);
-    if (!buf.isReadable())
-        qFatal("QBuffer not readable");
-    QTextureFileReader reader(&buf);
-    if (!reader.canRead())
-        qFatal("QTextureFileReader failed reading");
-    QTextureFileData res = reader.read();
+namespace {
+// The 2D footprints, in the order of the GL_COMPRESSED_*_ASTC_* enums
+const std::array<QSize, 14> footprints {
+    QSize(4, 4), QSize(5, 4), QSize(5, 5), QSize(6, 5), QSize(6, 6),
+    QSize(8, 5), QSize(8, 6), QSize(8, 8), QSize(10, 5), QSize(10, 6),
+    QSize(10, 8), QSize(10, 10), QSize(12, 10), QSize(12, 12)
+};
+constexpr quint32 rgbaASTC4x4 = 0x93B0; // GL_COMPRESSED_RGBA_ASTC_4x4_KHR
+constexpr quint32 srgbASTC4x4 = 0x93D0; // GL_COMPRESSED_SRGB8_ALPHA8_ASTC_4x4_KHR
+constexpr quint32 glRGBA = 0x1908;
+} // namespace
+
+QSize ASTCEncoder::blockSize(quint32 glInternalFormat) {
+    if (glInternalFormat >= rgbaASTC4x4 && glInternalFormat < rgbaASTC4x4 + footprints.size())
+        return footprints[glInternalFormat - rgbaASTC4x4];
+    if (glInternalFormat >= srgbASTC4x4 && glInternalFormat < srgbASTC4x4 + footprints.size())
+        return footprints[glInternalFormat - srgbASTC4x4];
+    return QSize();
+}
+
+bool ASTCEncoder::Configuration::isValid() const {
+    return std::find(footprints.begin(), footprints.end(), QSize(blockX, blockY)) != footprints.end()
+            && quality >= 0.f && quality <= 100.f;
+}
+
+bool ASTCEncoder::Configuration::operator<(const Configuration &o) const {
+    return std::tie(blockX, blockY, quality, mipFilter)
+            < std::tie(o.blockX, o.blockY, o.quality, o.mipFilter);
+}
+
+namespace {
+int blocksLength(const QSize &size, int blockX, int blockY) {
+    return ((size.width() + blockX - 1) / blockX)
+         * ((size.height() + blockY - 1) / blockY) * 16;
+}
+}
+
+QTextureFileData ASTCEncoder::fromBlocks(QByteArray blocks,
+                                         const QSize &size,
+                                         int blockX,
+                                         int blockY)
+{
+    if (blocks.isEmpty() || blockX <= 0 || blockY <= 0)
+        return fromBlocks(std::move(blocks), size, blockX, blockY, 0);
+    // Rows cached before the blocks were stored headerless start with an .astc header
+    const int length = blocksLength(size, blockX, blockY);
+    const int offset = (blocks.size() == length + int(sizeof(astc_header))
+                        && qFromLittleEndian<quint32>(blocks.constData()) == ASTCEncoderPrivate::ASTC_MAGIC_ID)
+            ? int(sizeof(astc_header))
+            : 0;
+    if (blocks.size() != offset + length) {
+        qWarning() << "ASTCEncoder::fromBlocks: "<<blocks.size()<<" bytes for "<<size
+                   <<" in "<<blockX<<"x"<<blockY<<" blocks";
+        return QTextureFileData();
+    }
+    return fromBlocks(std::move(blocks), size, blockX, blockY, offset);
+}
+
+QTextureFileData ASTCEncoder::fromBlocks(QByteArray blocks,
+                                         const QSize &size,
+                                         int blockX,
+                                         int blockY,
+                                         int offset)
+{
+    if (blocks.isEmpty())
+        return QTextureFileData();
+    const auto footprint = std::find(footprints.begin(), footprints.end(), QSize(blockX, blockY));
+    if (footprint == footprints.end()) {
+        qWarning() << "ASTCEncoder::fromBlocks: invalid footprint "<<blockX<<"x"<<blockY;
+        return QTextureFileData();
+    }
+    const int length = blocksLength(size, blockX, blockY);
+    if (offset < 0 || blocks.size() < offset + length) {
+        qWarning() << "ASTCEncoder::fromBlocks: "<<blocks.size()<<" bytes for "<<size
+                   <<" in "<<blockX<<"x"<<blockY<<" blocks at "<<offset;
+        return QTextureFileData();
+    }
+
+    QTextureFileData res;
+    res.setData(blocks);
+    res.setDataOffset(offset);
+    res.setDataLength(length);
+    res.setNumLevels(1);
+    res.setSize(size);
+    res.setGLFormat(0); // compressed
+    res.setGLInternalFormat(rgbaASTC4x4 + quint32(footprint - footprints.begin()));
+    res.setGLBaseInternalFormat(glRGBA);
     return res;
 }
 
-void ASTCEncoder::generateMips(QImage ima, std::vector<QImage> &out)
+bool ASTCEncoder::isUniform(const QImage &ima, QRgb &color, int tolerance)
+{
+    if (ima.isNull())
+        return false;
+    switch (ima.format()) {
+    case QImage::Format_RGB32:
+    case QImage::Format_ARGB32:
+    case QImage::Format_ARGB32_Premultiplied:
+    case QImage::Format_RGBX8888:
+    case QImage::Format_RGBA8888:
+    case QImage::Format_RGBA8888_Premultiplied:
+        break;
+    default:
+        return isUniform(ima.convertToFormat(QImage::Format_RGBA8888), color, tolerance);
+    }
+
+    // Byte-wise extremes are enough, whatever the channel order
+    const int rowBytes = ima.width() * 4;
+    uchar lo[16], hi[16];
+    const uchar *first = ima.constScanLine(0);
+    for (int i = 0; i < 16; ++i)
+        lo[i] = hi[i] = first[i % 4];
+    int x = 0;
+#if defined(__SSE2__)
+    __m128i vmin = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo));
+    __m128i vmax = vmin;
+    const __m128i tol = _mm_set1_epi8(char(std::min(tolerance, 255)));
+    for (int y = 0; y < ima.height(); ++y) {
+        const uchar *line = ima.constScanLine(y);
+        for (x = 0; x + 16 <= rowBytes; x += 16) {
+            const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(line + x));
+            vmin = _mm_min_epu8(vmin, v);
+            vmax = _mm_max_epu8(vmax, v);
+        }
+        // bail out at the first row exceeding the tolerance, as most tiles do right away
+        const __m128i excess = _mm_subs_epu8(_mm_subs_epu8(vmax, vmin), tol);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(excess, _mm_setzero_si128())) != 0xFFFF)
+            return false;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lo), vmin);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(hi), vmax);
+#endif
+    // Rows not multiple of 16 bytes, or no SSE2
+    for (int y = 0; y < ima.height(); ++y) {
+        const uchar *line = ima.constScanLine(y);
+        for (int i = x; i < rowBytes; ++i) {
+            lo[i % 4] = std::min(lo[i % 4], line[i]);
+            hi[i % 4] = std::max(hi[i % 4], line[i]);
+        }
+    }
+
+    uchar mid[4];
+    for (int c = 0; c < 4; ++c) {
+        for (int i = c + 4; i < 16; i += 4) {
+            lo[c] = std::min(lo[c], lo[i]);
+            hi[c] = std::max(hi[c], hi[i]);
+        }
+        if (hi[c] - lo[c] > tolerance)
+            return false;
+        mid[c] = uchar((lo[c] + hi[c] + 1) / 2);
+    }
+    color = QImage(mid, 1, 1, 4, ima.format()).convertToFormat(QImage::Format_ARGB32).pixel(0, 0);
+    return true;
+}
+
+void ASTCEncoder::generateMips(QImage ima, std::vector<QImage> &out, int minSize, int filter)
 {
-    QSize size = ima.size();
-    QImage halved = (ima.hasAlphaChannel())
-                        ? ima.convertToFormat(QImage::Format_ARGB32)
-                        : ima.convertToFormat(QImage::Format_RGB32);
-    out.emplace_back(halved.convertToFormat(QImage::Format_RGBA8888));
-
-    while (isEven(size)) {
-        size = QSize(size.width() / 2, size.height() / 2);
-        if (size.width() < ASTCEncoder::blockSize())
+    ima = ima.convertToFormat(QImage::Format_RGBA8888);
+    std::vector<QSize> sizes{ima.size()};
+    size_t total = size_t(ima.width()) * ima.height() * 4;
+    while (isEven(sizes.back())) {
+        const QSize size(sizes.back().width() / 2, sizes.back().height() / 2);
+        if (size.width() < minSize)
             break;
-        halved = ASTCEncoder::halve(halved);
-        out.emplace_back(halved.convertToFormat(QImage::Format_RGBA8888));
+        sizes.push_back(size);
+        total += size_t(size.width()) * size.height() * 4;
+    }
+
+    // All the levels share one pooled buffer, released with the last of them
+    std::shared_ptr<uchar> buffer(static_cast<uchar *>(TileBufferPool::instance().acquire(total)),
+                                  TileBufferPool::release);
+    uchar *dst = buffer.get();
+    const uchar *src = ima.constBits();
+    int srcStride = ima.bytesPerLine();
+    out.reserve(out.size() + sizes.size());
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        const QSize &size = sizes[i];
+        const int stride = size.width() * 4;
+        if (i)
+            reduce(src, srcStride, dst, stride, size, filter);
+        else
+            for (int y = 0; y < size.height(); ++y)
+                memcpy(dst + y * stride, src + y * srcStride, size_t(stride));
+        out.emplace_back(dst, size.width(), size.height(), stride, QImage::Format_RGBA8888,
+                         releaseMipBuffer, new std::shared_ptr<uchar>(buffer));
+        src = dst;
+        srcStride = stride;
+        dst += size_t(stride) * size.height();
     }
 }
 
@@ -286,93 +707,104 @@ void ASTCEncoder::generateMips(const QImage &ima,
                                quint64 y,
                                quint64 z,
                                std::vector<QTextureFileData> &out,
-                               QByteArray md5) {
+                               QByteArray md5,
+                               const Configuration &config) {
+    std::vector<QSize> sizes{ima.size()};
+    while (isEven(sizes.back())) {
+        const QSize size(sizes.back().width() / 2, sizes.back().height() / 2);
+        if (size.width() < config.blockX)
+            break;
+        sizes.push_back(size);
+    }
+
+    // Constant tiles are void-extent blocks at every level, neither encoded nor cached
+    QRgb color;
+    if (isUniform(ima, color)) {
+        for (const QSize &size: sizes)
+            out.push_back(constantColor(size, color, config.blockX, config.blockY));
+        return;
+    }
+
     if (!md5.size()) {
         QCryptographicHash ch(QCryptographicHash::Md5);
         ch.addData(reinterpret_cast<const char *>(ima.constBits()), ima.sizeInBytes());
         md5 = ch.result();
     }
-    QSize size = ima.size();
-    QImage halved;
-
-    QByteArray cached = d->m_tileCache.tile(md5,
-                                         d->block_x,
-                                         d->block_y,
-                                         d->quality,
-                                         size.width(),
-                                         size.height());
-
-    if (cached.size()) {
-        out.push_back(fromCached(cached));
-
-        while (isEven(size)) {
-            size = QSize(size.width() / 2, size.height() / 2);
-            if (size.width() < ASTCEncoder::blockSize())
+    md5 = cacheKey(std::move(md5), config);
+
+    // The whole chain in one row, every level sharing the fetched blob
+    const auto stored = d->m_tileCache.mips(md5,
+                                            config.blockX,
+                                            config.blockY,
+                                            config.quality,
+                                            ima.width(),
+                                            ima.height());
+    if (stored.levels() == int(sizes.size())) {
+        const size_t first = out.size();
+        for (size_t level = 0; level < sizes.size(); ++level) {
+            auto cached = fromBlocks(stored.data,
+                                     sizes[level],
+                                     config.blockX,
+                                     config.blockY,
+                                     int(stored.offsets[level]));
+            if (!cached.isValid())
                 break;
-            cached = d->m_tileCache.tile(md5,
-                                      d->block_x,
-                                      d->block_y,
-                                      d->quality,
-                                      size.width(),
-                                      size.height());
-            if (!cached.size()) { // generateMips was probably aborted during operation. Recover the missing mips
-                halved = ima;
-                QByteArray next;
-                while (isEven(halved.size()) && halved.size().width() > size.width()) {
-                    halved = ASTCEncoder::halve(halved);
-                }
-                while (isEven(halved.size())) {
-                    if (halved.size().width() < ASTCEncoder::blockSize())
-                        break;
-                    QByteArray compressed = ASTCEncoder::instance().compress(halved).data();
-                    if (!next.size())
-                        next = compressed;
-                    d->m_tileCache.insert(md5,
-                                       d->block_x,
-                                       d->block_y,
-                                       d->quality,
-                                       halved.size().width(),
-                                       halved.size().height(),
-                                       x,y,z,
-                                       compressed);
-                    halved = ASTCEncoder::halve(halved);
-                }
-                out.push_back(fromCached(next));
-            } else {
-                out.push_back(fromCached(cached));
-            }
+            out.push_back(std::move(cached));
         }
-    } else {
-        out.emplace_back(ASTCEncoder::instance().compress(ima));
-        d->m_tileCache.insert(md5,
-                           d->block_x,
-                           d->block_y,
-                           d->quality,
-                           size.width(),
-                           size.height(),
-                           x,y,z,
-                           out.back().data());
-        halved = ima;
-        while (isEven(size)) {
-            size = QSize(size.width() / 2, size.height() / 2);
-            if (size.width() < ASTCEncoder::blockSize())
-                break;
-            halved = ASTCEncoder::halve(halved);
-            out.emplace_back(ASTCEncoder::instance().compress(halved));
-            d->m_tileCache.insert(md5,
-                               d->block_x,
-                               d->block_y,
-                               d->quality,
-                               size.width(),
-                               size.height(),
-                               x,y,z,
-                               out.back().data());
+        if (out.size() - first == sizes.size())
+            return;
+        out.resize(first);
+    }
+
+    // Otherwise per level rows, from caches written before TileMips, and compress the rest.
+    // The chain is then stored as one row, replacing the legacy levels
+    std::vector<QImage> chain; // only generated if some level isn't cached
+    std::vector<QByteArray> levels;
+    levels.reserve(sizes.size());
+    for (size_t level = 0; level < sizes.size(); ++level) {
+        const QSize &size = sizes[level];
+        QTextureFileData cached;
+        if (chain.empty()) {
+            cached = fromBlocks(d->m_tileCache.tile(md5,
+                                                    config.blockX,
+                                                    config.blockY,
+                                                    config.quality,
+                                                    size.width(),
+                                                    size.height()),
+                                size,
+                                config.blockX,
+                                config.blockY);
+        }
+        if (cached.isValid()) {
+            out.push_back(std::move(cached));
+        } else {
+            if (chain.empty())
+                generateMips(ima, chain, config.blockX, config.mipFilter);
+            out.emplace_back(compress(chain[level], config));
         }
+        levels.push_back(out.back().data().mid(out.back().dataOffset(), out.back().dataLength()));
     }
+    d->m_tileCache.insertMips(md5,
+                              config.blockX,
+                              config.blockY,
+                              config.quality,
+                              ima.width(),
+                              ima.height(),
+                              x,y,z,
+                              levels);
+}
+
+bool ASTCEncoder::isCached(const QByteArray &md5, const Configuration &config) {
+    return d->m_tileCache.contains(cacheKey(md5, config), config.blockX, config.blockY, config.quality);
 }
 
-bool ASTCEncoder::isCached(const QByteArray &md5) {
-    return d->m_tileCache.contains(md5, d->block_x, d->block_y, d->quality);
+std::vector<bool> ASTCEncoder::isCached(const std::vector<QByteArray> &md5s,
+                                        const Configuration &config) {
+    std::vector<QByteArray> keys;
+    keys.reserve(md5s.size());
+    for (const auto &md5: md5s)
+        keys.push_back(cacheKey(md5, config));
+    return d->m_tileCache.contains(keys, config.blockX, config.blockY, config.quality);
 }
 
 ASTCEncoder::ASTCEncoder(): d(new ASTCEncoderPrivate){}
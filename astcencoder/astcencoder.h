@@ -27,30 +27,91 @@
 
 
 
-// to use a single astc context
+// to use a single astc context per configuration
 struct ASTCEncoderPrivate;
 class ASTCEncoder
 {
 public:
-    static ASTCEncoder& instance();
-
-    static QImage halve(const QImage &src);
+    // Quality presets, as in astcenc.h
+    enum Preset {
+        Fastest,
+        Fast,
+        Medium,
+        Thorough,
+        VeryThorough,
+        Exhaustive
+    };
+
+    // Mip generation filters, combinable
+    enum MipFilter {
+        BoxFilter = 0x0,
+        SRGBFilter = 0x1,         // average in linear light
+        PremultipliedAlpha = 0x2  // weight colors by alpha, for straight alpha images
+    };
+
+    struct Configuration {
+        int blockX{8};
+        int blockY{8};
+        float quality{85.f}; // 0 (fastest) to 100 (exhaustive)
+        int mipFilter{BoxFilter};
+
+        bool isValid() const;
+        bool operator<(const Configuration &o) const;
+    };
 
-    static int blockSize();
+    static ASTCEncoder& instance();
 
-    static QTextureFileData fromCached(QByteArray &cached);
+    // 2x2 reduction of an even sized image into RGBA8888
+    static QImage halve(const QImage &src, int filter = BoxFilter);
+
+    static int blockSize(); // of the default configuration
+    static float presetQuality(Preset preset);
+    // Block footprint of an ASTC GL internal format, or an empty size
+    static QSize blockSize(quint32 glInternalFormat);
+
+    // Wraps headerless blocks, as stored in the cache, without copying them
+    static QTextureFileData fromBlocks(QByteArray blocks,
+                                       const QSize &size,
+                                       int blockX,
+                                       int blockY);
+    // Same, for the blocks starting at offset, e.g. one level of a cached chain
+    static QTextureFileData fromBlocks(QByteArray blocks,
+                                       const QSize &size,
+                                       int blockX,
+                                       int blockY,
+                                       int offset);
+    // Whether every channel of every pixel is within tolerance of color, returned unpremultiplied
+    static bool isUniform(const QImage &ima, QRgb &color, int tolerance = uniformTolerance);
+    static constexpr int uniformTolerance = 2; // below the encoding error
+    // A size image of void-extent blocks, all of the given color
+    static QTextureFileData constantColor(const QSize &size,
+                                          QRgb color,
+                                          int blockX,
+                                          int blockY);
+
+    // RGBA8888, e.g. to recover a tile whose source image was released
+    QImage decompress(const QTextureFileData &data);
 
     void generateMips(const QImage &ima,
                       quint64 x,
                       quint64 y,
                       quint64 z,
-                      std::vector<QTextureFileData> &out, QByteArray md5);
-    static void generateMips(QImage ima, std::vector<QImage> &out);
-
-    bool isCached(const QByteArray &md5);
-
-protected:
-    QTextureFileData compress(QImage ima);
+                      std::vector<QTextureFileData> &out,
+                      QByteArray md5,
+                      const Configuration &config = Configuration());
+    // RGBA8888 mips sharing one buffer, down to minSize
+    static void generateMips(QImage ima,
+                             std::vector<QImage> &out,
+                             int minSize = blockSize(),
+                             int filter = BoxFilter);
+
+    bool isCached(const QByteArray &md5, const Configuration &config = Configuration());
+    // One lookup for many tiles, e.g. all those ready to be scheduled
+    std::vector<bool> isCached(const std::vector<QByteArray> &md5s,
+                               const Configuration &config = Configuration());
+
+    // A single level, bypassing the cache
+    QTextureFileData compress(QImage ima, const Configuration &config);
 
 private:
     ASTCEncoder();
@@ -0,0 +1,729 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "bcnencoder.h"
+#include "astcencoder.h"
+#include "astccache.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <QCryptographicHash>
+#include <QStandardPaths>
+#include <QtEndian>
+#include <QDebug>
+
+struct BCnEncoderPrivate {
+    BCnEncoderPrivate()
+    : m_cacheDirPath(QStringLiteral("%1/bcnCache.sqlite").arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)))
+    , m_tileCache(m_cacheDirPath)
+    {}
+
+    QString m_cacheDirPath;
+    ASTCCache m_tileCache; // same layout as the ASTC one, with 4x4 blocks
+};
+
+namespace {
+constexpr quint32 glRGB = 0x1907;
+constexpr quint32 glRGBA = 0x1908;
+
+int blockBytes(BCnEncoder::Format format) {
+    return (format == BCnEncoder::BC1) ? 8 : 16;
+}
+
+int blocksLength(const QSize &size, BCnEncoder::Format format) {
+    return ((size.width() + 3) / 4) * ((size.height() + 3) / 4) * blockBytes(format);
+}
+
+// Mean and principal axis of the 16 texels, over the first channels
+void principalAxis(const uchar *px, int channels, float mean[4], float axis[4])
+{
+    for (int c = 0; c < 4; ++c) {
+        mean[c] = 0.f;
+        for (int i = 0; i < 16; ++i)
+            mean[c] += px[i * 4 + c];
+        mean[c] /= 16.f;
+    }
+    float cov[4][4] = {};
+    for (int i = 0; i < 16; ++i)
+        for (int r = 0; r < channels; ++r)
+            for (int c = 0; c < channels; ++c)
+                cov[r][c] += (px[i * 4 + r] - mean[r]) * (px[i * 4 + c] - mean[c]);
+
+    // Power iteration, starting from the largest extent
+    float v[4] = {1.f, 1.f, 1.f, 1.f};
+    for (int c = channels; c < 4; ++c)
+        v[c] = 0.f;
+    for (int it = 0; it < 8; ++it) {
+        float w[4] = {};
+        for (int r = 0; r < channels; ++r)
+            for (int c = 0; c < channels; ++c)
+                w[r] += cov[r][c] * v[c];
+        float norm = 0.f;
+        for (int c = 0; c < channels; ++c)
+            norm = std::max(norm, std::abs(w[c]));
+        if (norm < 1e-6f)
+            break;
+        for (int c = 0; c < channels; ++c)
+            v[c] = w[c] / norm;
+    }
+    float len = 0.f;
+    for (int c = 0; c < channels; ++c)
+        len += v[c] * v[c];
+    len = std::sqrt(len);
+    for (int c = 0; c < 4; ++c)
+        axis[c] = (len > 0.f && c < channels) ? v[c] / len : 0.f;
+}
+
+// Endpoints at the extremes of the projections on the principal axis
+void rangeFit(const uchar *px, int channels, float e0[4], float e1[4])
+{
+    float mean[4], axis[4];
+    principalAxis(px, channels, mean, axis);
+    float tMin = std::numeric_limits<float>::max();
+    float tMax = std::numeric_limits<float>::lowest();
+    for (int i = 0; i < 16; ++i) {
+        float t = 0.f;
+        for (int c = 0; c < channels; ++c)
+            t += (px[i * 4 + c] - mean[c]) * axis[c];
+        tMin = std::min(tMin, t);
+        tMax = std::max(tMax, t);
+    }
+    for (int c = 0; c < 4; ++c) {
+        e0[c] = std::min(255.f, std::max(0.f, mean[c] + axis[c] * tMax));
+        e1[c] = std::min(255.f, std::max(0.f, mean[c] + axis[c] * tMin));
+    }
+}
+
+// Least squares endpoints for the given interpolation weights of e0, or false if degenerate
+bool leastSquaresFit(const uchar *px, int channels, const float weights[16], float e0[4], float e1[4])
+{
+    float aa = 0.f, ab = 0.f, bb = 0.f;
+    float ax[4] = {}, bx[4] = {};
+    for (int i = 0; i < 16; ++i) {
+        const float a = weights[i];
+        const float b = 1.f - a;
+        aa += a * a;
+        ab += a * b;
+        bb += b * b;
+        for (int c = 0; c < channels; ++c) {
+            ax[c] += a * px[i * 4 + c];
+            bx[c] += b * px[i * 4 + c];
+        }
+    }
+    const float det = aa * bb - ab * ab;
+    if (std::abs(det) < 1e-6f)
+        return false;
+    for (int c = 0; c < channels; ++c) {
+        e0[c] = std::min(255.f, std::max(0.f, (ax[c] * bb - bx[c] * ab) / det));
+        e1[c] = std::min(255.f, std::max(0.f, (bx[c] * aa - ax[c] * ab) / det));
+    }
+    return true;
+}
+
+// BC1 color block, always in 4 color mode
+quint16 to565(const float c[4]) {
+    return quint16((std::min(31, std::max(0, int(std::lround(c[0] * 31.f / 255.f)))) << 11)
+                 | (std::min(63, std::max(0, int(std::lround(c[1] * 63.f / 255.f)))) << 5)
+                 |  std::min(31, std::max(0, int(std::lround(c[2] * 31.f / 255.f)))));
+}
+
+void from565(quint16 v, int out[3]) {
+    const int r = (v >> 11) & 31, g = (v >> 5) & 63, b = v & 31;
+    out[0] = (r << 3) | (r >> 2);
+    out[1] = (g << 2) | (g >> 4);
+    out[2] = (b << 3) | (b >> 2);
+}
+
+void colorPalette(quint16 c0, quint16 c1, int pal[4][3]) {
+    from565(c0, pal[0]);
+    from565(c1, pal[1]);
+    for (int c = 0; c < 3; ++c) {
+        pal[2][c] = (2 * pal[0][c] + pal[1][c]) / 3;
+        pal[3][c] = (pal[0][c] + 2 * pal[1][c]) / 3;
+    }
+}
+
+int colorIndices(const uchar *px, quint16 c0, quint16 c1, quint32 &indices) {
+    int pal[4][3];
+    colorPalette(c0, c1, pal);
+    int error = 0;
+    indices = 0;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0, bestError = std::numeric_limits<int>::max();
+        for (int p = 0; p < 4; ++p) {
+            int e = 0;
+            for (int c = 0; c < 3; ++c) {
+                const int d = px[i * 4 + c] - pal[p][c];
+                e += d * d;
+            }
+            if (e < bestError) {
+                bestError = e;
+                best = p;
+            }
+        }
+        indices |= quint32(best) << (2 * i);
+        error += bestError;
+    }
+    return error;
+}
+
+int encodeColorCandidate(const uchar *px, const float e0[4], const float e1[4],
+                         quint16 &c0, quint16 &c1, quint32 &indices) {
+    c0 = to565(e0);
+    c1 = to565(e1);
+    if (c0 < c1)
+        std::swap(c0, c1);
+    if (c0 == c1) { // single color, index 0 in either mode
+        indices = 0;
+        int pal[4][3];
+        colorPalette(c0, c1, pal);
+        int error = 0;
+        for (int i = 0; i < 16; ++i)
+            for (int c = 0; c < 3; ++c)
+                error += (px[i * 4 + c] - pal[0][c]) * (px[i * 4 + c] - pal[0][c]);
+        return error;
+    }
+    return colorIndices(px, c0, c1, indices);
+}
+
+void encodeColorBlock(const uchar *px, uchar *out)
+{
+    float e0[4], e1[4];
+    rangeFit(px, 3, e0, e1);
+    quint16 c0, c1;
+    quint32 indices;
+    int error = encodeColorCandidate(px, e0, e1, c0, c1, indices);
+
+    if (error && c0 != c1) {
+        static constexpr float w[4] = {1.f, 0.f, 2.f / 3.f, 1.f / 3.f};
+        float weights[16];
+        for (int i = 0; i < 16; ++i)
+            weights[i] = w[(indices >> (2 * i)) & 3];
+        quint16 r0, r1;
+        quint32 refined;
+        if (leastSquaresFit(px, 3, weights, e0, e1)) {
+            const int e = encodeColorCandidate(px, e0, e1, r0, r1, refined);
+            if (e < error) {
+                c0 = r0;
+                c1 = r1;
+                indices = refined;
+            }
+        }
+    }
+    qToLittleEndian<quint16>(c0, out);
+    qToLittleEndian<quint16>(c1, out + 2);
+    qToLittleEndian<quint32>(indices, out + 4);
+}
+
+// BC3 alpha block, in 8 value mode
+void alphaPalette(int a0, int a1, int pal[8]) {
+    pal[0] = a0;
+    pal[1] = a1;
+    if (a0 > a1) {
+        for (int i = 2; i < 8; ++i)
+            pal[i] = ((8 - i) * a0 + (i - 1) * a1) / 7;
+    } else {
+        for (int i = 2; i < 6; ++i)
+            pal[i] = ((6 - i) * a0 + (i - 1) * a1) / 5;
+        pal[6] = 0;
+        pal[7] = 255;
+    }
+}
+
+void encodeAlphaBlock(const uchar *px, uchar *out)
+{
+    int a0 = 0, a1 = 255;
+    for (int i = 0; i < 16; ++i) {
+        a0 = std::max(a0, int(px[i * 4 + 3]));
+        a1 = std::min(a1, int(px[i * 4 + 3]));
+    }
+    int pal[8];
+    alphaPalette(a0, a1, pal);
+    quint64 indices = 0;
+    if (a0 != a1) {
+        for (int i = 0; i < 16; ++i) {
+            int best = 0, bestError = 256;
+            for (int p = 0; p < 8; ++p) {
+                const int e = std::abs(px[i * 4 + 3] - pal[p]);
+                if (e < bestError) {
+                    bestError = e;
+                    best = p;
+                }
+            }
+            indices |= quint64(best) << (3 * i);
+        }
+    }
+    out[0] = uchar(a0);
+    out[1] = uchar(a1);
+    for (int b = 0; b < 6; ++b)
+        out[2 + b] = uchar(indices >> (8 * b));
+}
+
+// BC7 mode 6: 7 bit RGBA endpoints with one p-bit each, 4 bit indices
+constexpr int bc7Weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+struct BC7Endpoint {
+    int c[4]; // 7 bits
+    int p;
+    int value(int ch) const { return (c[ch] << 1) | p; }
+};
+
+BC7Endpoint quantizeBC7(const float e[4]) {
+    BC7Endpoint best{};
+    float bestError = std::numeric_limits<float>::max();
+    for (int p = 0; p < 2; ++p) {
+        BC7Endpoint q;
+        q.p = p;
+        float error = 0.f;
+        for (int ch = 0; ch < 4; ++ch) {
+            q.c[ch] = std::min(127, std::max(0, int(std::lround((e[ch] - p) / 2.f))));
+            const float d = q.value(ch) - e[ch];
+            error += d * d;
+        }
+        if (error < bestError) {
+            bestError = error;
+            best = q;
+        }
+    }
+    return best;
+}
+
+int bc7Interpolate(int e0, int e1, int index) {
+    return ((64 - bc7Weights[index]) * e0 + bc7Weights[index] * e1 + 32) >> 6;
+}
+
+int bc7Indices(const uchar *px, const BC7Endpoint &e0, const BC7Endpoint &e1, uchar indices[16]) {
+    int pal[16][4];
+    for (int i = 0; i < 16; ++i)
+        for (int ch = 0; ch < 4; ++ch)
+            pal[i][ch] = bc7Interpolate(e0.value(ch), e1.value(ch), i);
+    int error = 0;
+    for (int i = 0; i < 16; ++i) {
+        int best = 0, bestError = std::numeric_limits<int>::max();
+        for (int p = 0; p < 16; ++p) {
+            int e = 0;
+            for (int ch = 0; ch < 4; ++ch) {
+                const int d = px[i * 4 + ch] - pal[p][ch];
+                e += d * d;
+            }
+            if (e < bestError) {
+                bestError = e;
+                best = p;
+            }
+        }
+        indices[i] = uchar(best);
+        error += bestError;
+    }
+    return error;
+}
+
+struct BitWriter {
+    uchar *out;
+    int pos{0};
+    void write(quint32 value, int bits) {
+        for (int b = 0; b < bits; ++b, ++pos)
+            if ((value >> b) & 1)
+                out[pos >> 3] |= uchar(1 << (pos & 7));
+    }
+};
+
+struct BitReader {
+    const uchar *in;
+    int pos{0};
+    quint32 read(int bits) {
+        quint32 value = 0;
+        for (int b = 0; b < bits; ++b, ++pos)
+            value |= quint32((in[pos >> 3] >> (pos & 7)) & 1) << b;
+        return value;
+    }
+};
+
+void encodeBC7Block(const uchar *px, uchar *out)
+{
+    float f0[4], f1[4];
+    rangeFit(px, 4, f0, f1);
+    BC7Endpoint e0 = quantizeBC7(f0), e1 = quantizeBC7(f1);
+    uchar indices[16];
+    int error = bc7Indices(px, e0, e1, indices);
+
+    if (error) {
+        float weights[16];
+        for (int i = 0; i < 16; ++i)
+            weights[i] = (64 - bc7Weights[indices[i]]) / 64.f;
+        if (leastSquaresFit(px, 4, weights, f0, f1)) {
+            const BC7Endpoint r0 = quantizeBC7(f0), r1 = quantizeBC7(f1);
+            uchar refined[16];
+            const int e = bc7Indices(px, r0, r1, refined);
+            if (e < error) {
+                e0 = r0;
+                e1 = r1;
+                std::copy(refined, refined + 16, indices);
+            }
+        }
+    }
+
+    // The anchor index is stored without its top bit
+    if (indices[0] & 8) {
+        std::swap(e0, e1);
+        for (auto &i: indices)
+            i = uchar(15 - i);
+    }
+
+    std::memset(out, 0, 16);
+    BitWriter w{out};
+    w.write(1 << 6, 7); // mode 6
+    for (int ch = 0; ch < 4; ++ch) {
+        w.write(quint32(e0.c[ch]), 7);
+        w.write(quint32(e1.c[ch]), 7);
+    }
+    w.write(quint32(e0.p), 1);
+    w.write(quint32(e1.p), 1);
+    w.write(indices[0], 3);
+    for (int i = 1; i < 16; ++i)
+        w.write(indices[i], 4);
+}
+
+bool decodeBC7Block(const uchar *in, uchar *px)
+{
+    if ((in[0] & 0x7f) != 0x40)
+        return false; // only mode 6 is produced
+    BitReader r{in, 7};
+    int e[2][4];
+    for (int ch = 0; ch < 4; ++ch) {
+        e[0][ch] = int(r.read(7)) << 1;
+        e[1][ch] = int(r.read(7)) << 1;
+    }
+    const int p0 = int(r.read(1)), p1 = int(r.read(1));
+    for (int ch = 0; ch < 4; ++ch) {
+        e[0][ch] |= p0;
+        e[1][ch] |= p1;
+    }
+    for (int i = 0; i < 16; ++i) {
+        const int index = int(r.read((i) ? 4 : 3));
+        for (int ch = 0; ch < 4; ++ch)
+            px[i * 4 + ch] = uchar(bc7Interpolate(e[0][ch], e[1][ch], index));
+    }
+    return true;
+}
+
+void decodeColorBlock(const uchar *in, uchar *px)
+{
+    int pal[4][3];
+    colorPalette(qFromLittleEndian<quint16>(in), qFromLittleEndian<quint16>(in + 2), pal);
+    const quint32 indices = qFromLittleEndian<quint32>(in + 4);
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 3; ++c)
+            px[i * 4 + c] = uchar(pal[(indices >> (2 * i)) & 3][c]);
+}
+
+void decodeAlphaBlock(const uchar *in, uchar *px)
+{
+    int pal[8];
+    alphaPalette(in[0], in[1], pal);
+    quint64 indices = 0;
+    for (int b = 0; b < 6; ++b)
+        indices |= quint64(in[2 + b]) << (8 * b);
+    for (int i = 0; i < 16; ++i)
+        px[i * 4 + 3] = uchar(pal[(indices >> (3 * i)) & 7]);
+}
+
+void encodeBlock(const uchar *px, uchar *out, BCnEncoder::Format format)
+{
+    switch (format) {
+    case BCnEncoder::BC1:
+        encodeColorBlock(px, out);
+        break;
+    case BCnEncoder::BC3:
+        encodeAlphaBlock(px, out);
+        encodeColorBlock(px, out + 8);
+        break;
+    default:
+        encodeBC7Block(px, out);
+    }
+}
+
+bool decodeBlock(const uchar *in, uchar *px, BCnEncoder::Format format)
+{
+    switch (format) {
+    case BCnEncoder::BC1:
+        decodeColorBlock(in, px);
+        for (int i = 0; i < 16; ++i)
+            px[i * 4 + 3] = 255;
+        return true;
+    case BCnEncoder::BC3:
+        decodeAlphaBlock(in, px);
+        decodeColorBlock(in + 8, px);
+        return true;
+    default:
+        return decodeBC7Block(in, px);
+    }
+}
+
+// 2 bytes after the md5 (and mip filter), so that formats are cached apart
+QByteArray cacheKey(QByteArray md5, BCnEncoder::Format format, int mipFilter) {
+    if (mipFilter != ASTCEncoder::BoxFilter)
+        md5.append(char(mipFilter));
+    const quint16 f = qToLittleEndian<quint16>(quint16(format));
+    md5.append(reinterpret_cast<const char *>(&f), 2);
+    return md5;
+}
+} // namespace
+
+BCnEncoder &BCnEncoder::instance()
+{
+    thread_local BCnEncoder instance;
+    return instance;
+}
+
+bool BCnEncoder::isFormat(quint32 glInternalFormat)
+{
+    return glInternalFormat == BC1 || glInternalFormat == BC3 || glInternalFormat == BC7;
+}
+
+BCnEncoder::Format BCnEncoder::format(const QImage &ima, Format preferred)
+{
+    if (preferred != BC1 && preferred != BC3)
+        return preferred;
+    if (!ima.hasAlphaChannel())
+        return BC1;
+    const QImage rgba = (ima.format() == QImage::Format_RGBA8888)
+            ? ima
+            : ima.convertToFormat(QImage::Format_RGBA8888);
+    for (int y = 0; y < rgba.height(); ++y) {
+        const uchar *line = rgba.constScanLine(y);
+        for (int x = 0; x < rgba.width(); ++x)
+            if (line[x * 4 + 3] != 255)
+                return BC3;
+    }
+    return BC1;
+}
+
+QTextureFileData BCnEncoder::compress(QImage ima, Format format)
+{
+    if (!isFormat(format)) {
+        qWarning() << "BCnEncoder::compress: invalid format "<< QString::number(quint32(format), 16);
+        return QTextureFileData();
+    }
+    if (ima.format() != QImage::Format_RGBA8888)
+        ima = ima.convertToFormat(QImage::Format_RGBA8888);
+    const int bytes = blockBytes(format);
+    const int blocksX = (ima.width() + 3) / 4;
+    const int blocksY = (ima.height() + 3) / 4;
+    QByteArray data(blocksX * blocksY * bytes, Qt::Uninitialized);
+    uchar *out = reinterpret_cast<uchar *>(data.data());
+
+    std::array<uchar, 64> px;
+    for (int by = 0; by < blocksY; ++by) {
+        for (int bx = 0; bx < blocksX; ++bx, out += bytes) {
+            // partial blocks repeat the last row and column
+            for (int y = 0; y < 4; ++y) {
+                const uchar *line = ima.constScanLine(std::min(by * 4 + y, ima.height() - 1));
+                for (int x = 0; x < 4; ++x) {
+                    const int sx = std::min(bx * 4 + x, ima.width() - 1);
+                    std::memcpy(&px[size_t((y * 4 + x) * 4)], line + sx * 4, 4);
+                }
+            }
+            encodeBlock(px.data(), out, format);
+        }
+    }
+    return fromBlocks(std::move(data), ima.size(), format);
+}
+
+QTextureFileData BCnEncoder::fromBlocks(QByteArray blocks,
+                                        const QSize &size,
+                                        Format format,
+                                        int offset)
+{
+    if (blocks.isEmpty())
+        return QTextureFileData();
+    if (!isFormat(format)) {
+        qWarning() << "BCnEncoder::fromBlocks: invalid format "<< QString::number(quint32(format), 16);
+        return QTextureFileData();
+    }
+    const int length = blocksLength(size, format);
+    if (offset < 0 || blocks.size() < offset + length) {
+        qWarning() << "BCnEncoder::fromBlocks: "<<blocks.size()<<" bytes for "<<size
+                   <<" at "<<offset;
+        return QTextureFileData();
+    }
+
+    QTextureFileData res;
+    res.setData(blocks);
+    res.setDataOffset(offset);
+    res.setDataLength(length);
+    res.setNumLevels(1);
+    res.setSize(size);
+    res.setGLFormat(0); // compressed
+    res.setGLInternalFormat(format);
+    res.setGLBaseInternalFormat((format == BC1) ? glRGB : glRGBA);
+    return res;
+}
+
+QTextureFileData BCnEncoder::constantColor(const QSize &size, QRgb color, Format format)
+{
+    if (!isFormat(format))
+        return QTextureFileData();
+    std::array<uchar, 64> px;
+    for (int i = 0; i < 16; ++i) {
+        px[size_t(i * 4)] = uchar(qRed(color));
+        px[size_t(i * 4 + 1)] = uchar(qGreen(color));
+        px[size_t(i * 4 + 2)] = uchar(qBlue(color));
+        px[size_t(i * 4 + 3)] = uchar(qAlpha(color));
+    }
+    const int bytes = blockBytes(format);
+    std::array<uchar, 16> block;
+    encodeBlock(px.data(), block.data(), format);
+
+    QByteArray data(blocksLength(size, format), Qt::Uninitialized);
+    for (int i = 0; i < data.size(); i += bytes)
+        std::memcpy(data.data() + i, block.data(), size_t(bytes));
+    return fromBlocks(std::move(data), size, format);
+}
+
+QTextureFileData BCnEncoder::toBC3(const QTextureFileData &data)
+{
+    if (data.glInternalFormat() != BC1 || data.dataLength() < blocksLength(data.size(), BC1))
+        return data;
+    // BC1 blocks are always in 4 color mode here, which is how BC3 reads them
+    const int blocks = blocksLength(data.size(), BC1) / 8;
+    const char *in = data.data().constData() + data.dataOffset();
+    QByteArray res(blocks * 16, Qt::Uninitialized);
+    static const uchar opaque[8] = {255, 255, 0, 0, 0, 0, 0, 0};
+    for (int i = 0; i < blocks; ++i) {
+        std::memcpy(res.data() + i * 16, opaque, 8);
+        std::memcpy(res.data() + i * 16 + 8, in + i * 8, 8);
+    }
+    return fromBlocks(std::move(res), data.size(), BC3);
+}
+
+QImage BCnEncoder::decompress(const QTextureFileData &data)
+{
+    const Format format = Format(data.glInternalFormat());
+    if (!isFormat(format) || data.dataLength() < blocksLength(data.size(), format))
+        return QImage();
+    QImage res(data.size(), QImage::Format_RGBA8888);
+    const int bytes = blockBytes(format);
+    const uchar *in = reinterpret_cast<const uchar *>(data.data().constData()) + data.dataOffset();
+    const int blocksX = (res.width() + 3) / 4;
+    const int blocksY = (res.height() + 3) / 4;
+
+    std::array<uchar, 64> px;
+    for (int by = 0; by < blocksY; ++by) {
+        for (int bx = 0; bx < blocksX; ++bx, in += bytes) {
+            if (!decodeBlock(in, px.data(), format)) {
+                qWarning() << "BCnEncoder::decompress: unsupported BC7 mode";
+                return QImage();
+            }
+            for (int y = 0; y < 4 && by * 4 + y < res.height(); ++y) {
+                uchar *line = res.scanLine(by * 4 + y);
+                for (int x = 0; x < 4 && bx * 4 + x < res.width(); ++x)
+                    std::memcpy(line + (bx * 4 + x) * 4, &px[size_t((y * 4 + x) * 4)], 4);
+            }
+        }
+    }
+    return res;
+}
+
+double BCnEncoder::psnr(const QImage &a, const QImage &b)
+{
+    if (a.size() != b.size() || a.isNull())
+        return 0.0;
+    const QImage ra = a.convertToFormat(QImage::Format_RGBA8888);
+    const QImage rb = b.convertToFormat(QImage::Format_RGBA8888);
+    double sum = 0.0;
+    for (int y = 0; y < ra.height(); ++y) {
+        const uchar *la = ra.constScanLine(y);
+        const uchar *lb = rb.constScanLine(y);
+        for (int x = 0; x < ra.width() * 4; ++x) {
+            const double d = double(la[x]) - lb[x];
+            sum += d * d;
+        }
+    }
+    if (sum == 0.0)
+        return std::numeric_limits<double>::infinity();
+    const double mse = sum / (double(ra.width()) * ra.height() * 4);
+    return 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+void BCnEncoder::generateMips(const QImage &ima,
+                              quint64 x,
+                              quint64 y,
+                              quint64 z,
+                              std::vector<QTextureFileData> &out,
+                              QByteArray md5,
+                              Format format,
+                              int mipFilter)
+{
+    // Same levels as ASTCEncoder::generateMips, down to one block
+    std::vector<QSize> sizes{ima.size()};
+    while (sizes.back().width() % 2 == 0 && sizes.back().height() % 2 == 0
+           && sizes.back().width() / 2 >= 4) {
+        sizes.emplace_back(sizes.back().width() / 2, sizes.back().height() / 2);
+    }
+
+    QRgb color;
+    if (ASTCEncoder::isUniform(ima, color)) {
+        for (const QSize &size: sizes)
+            out.push_back(constantColor(size, color, format));
+        return;
+    }
+
+    if (!md5.size()) {
+        QCryptographicHash ch(QCryptographicHash::Md5);
+        ch.addData(reinterpret_cast<const char *>(ima.constBits()), ima.sizeInBytes());
+        md5 = ch.result();
+    }
+    md5 = cacheKey(std::move(md5), format, mipFilter);
+
+    const auto stored = d->m_tileCache.mips(md5, 4, 4, 0.f, ima.width(), ima.height());
+    if (stored.levels() == int(sizes.size())) {
+        const size_t first = out.size();
+        for (size_t level = 0; level < sizes.size(); ++level) {
+            auto cached = fromBlocks(stored.data,
+                                     sizes[level],
+                                     format,
+                                     int(stored.offsets[level]));
+            if (!cached.isValid())
+                break;
+            out.push_back(std::move(cached));
+        }
+        if (out.size() - first == sizes.size())
+            return;
+        out.resize(first);
+    }
+
+    std::vector<QImage> chain;
+    ASTCEncoder::generateMips(ima, chain, 4, mipFilter);
+    std::vector<QByteArray> levels;
+    levels.reserve(chain.size());
+    for (const auto &level: chain) {
+        out.emplace_back(compress(level, format));
+        levels.push_back(out.back().data());
+    }
+
+    d->m_tileCache.insertMips(md5, 4, 4, 0.f, ima.width(), ima.height(), x, y, z, levels);
+}
+
+BCnEncoder::BCnEncoder(): d(new BCnEncoderPrivate){}
+
+BCnEncoder::~BCnEncoder() {}
@@ -0,0 +1,86 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#ifndef BCNENCODER_H
+#define BCNENCODER_H
+
+#include <QImage>
+#include <QByteArray>
+#include <QScopedPointer>
+#include <private/qtexturefiledata_p.h>
+#include <vector>
+
+// CPU BC1/BC3/BC7 encoding, for GPUs without ASTC support.
+// BC7 blocks are all mode 6 (one subset, RGBA endpoints)
+struct BCnEncoderPrivate;
+class BCnEncoder
+{
+public:
+    // GL internal formats
+    enum Format : quint32 {
+        Invalid = 0,
+        BC1 = 0x83F0, // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+        BC3 = 0x83F3, // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+        BC7 = 0x8E8C  // GL_COMPRESSED_RGBA_BPTC_UNORM
+    };
+
+    static BCnEncoder& instance();
+
+    static bool isFormat(quint32 glInternalFormat);
+    // BC1 for opaque images when S3TC is preferred, as it takes half the space of BC3
+    static Format format(const QImage &ima, Format preferred);
+
+    static QTextureFileData compress(QImage ima, Format format);
+    // Wraps blocks starting at offset, without copying them
+    static QTextureFileData fromBlocks(QByteArray blocks,
+                                       const QSize &size,
+                                       Format format,
+                                       int offset = 0);
+    static QTextureFileData constantColor(const QSize &size, QRgb color, Format format);
+    // BC1 blocks with an opaque alpha block in front, so that BC1 and BC3 tiles
+    // can share one BC3 texture array. Other formats are returned unchanged
+    static QTextureFileData toBC3(const QTextureFileData &data);
+    // RGBA8888, for validating the encoder (see astcbenchmark --bcn)
+    static QImage decompress(const QTextureFileData &data);
+    // Over the RGBA channels, infinite for identical images
+    static double psnr(const QImage &a, const QImage &b);
+
+    void generateMips(const QImage &ima,
+                      quint64 x,
+                      quint64 y,
+                      quint64 z,
+                      std::vector<QTextureFileData> &out,
+                      QByteArray md5,
+                      Format format,
+                      int mipFilter = 0);
+
+private:
+    BCnEncoder();
+
+    ~BCnEncoder();
+
+    QScopedPointer<BCnEncoderPrivate> d;
+
+public:
+    BCnEncoder(BCnEncoder const&)             = delete;
+    void operator=(BCnEncoder const&)         = delete;
+};
+
+#endif
@@ -0,0 +1,187 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "tilebufferpool.h"
+
+#include <QMutexLocker>
+#include <algorithm>
+
+namespace {
+// Every block is preceded by a header holding its class size, so that release()
+// doesn't need to be told the size. Its size preserves the buffer alignment.
+constexpr size_t headerBytes = 64;
+constexpr size_t alignment = 64;
+
+size_t classSize(size_t bytes) {
+    return ((bytes + TileBufferPool::granularity - 1) / TileBufferPool::granularity)
+            * TileBufferPool::granularity;
+}
+
+bool isPooled(size_t classBytes) {
+    return classBytes >= TileBufferPool::minPooledBytes
+            && classBytes <= TileBufferPool::maxPooledBytes;
+}
+
+void *allocateBlock(size_t classBytes) {
+    void *block = qMallocAligned(classBytes + headerBytes, alignment);
+    if (!block)
+        qFatal("TileBufferPool: allocation of %zu bytes failed", classBytes);
+    *static_cast<size_t *>(block) = classBytes;
+    return block;
+}
+
+void *payload(void *block) {
+    return static_cast<char *>(block) + headerBytes;
+}
+
+void *blockFromPayload(void *buffer) {
+    return static_cast<char *>(buffer) - headerBytes;
+}
+
+void cleanupPooledImage(void *buffer) {
+    TileBufferPool::release(buffer);
+}
+} // namespace
+
+TileBufferPool &TileBufferPool::instance()
+{
+    // Intentionally leaked: pooled buffers may be released by static objects during shutdown
+    static TileBufferPool *instance = new TileBufferPool;
+    return *instance;
+}
+
+void *TileBufferPool::acquire(size_t bytes)
+{
+    const size_t classBytes = classSize(std::max<size_t>(bytes, 1));
+    if (!isPooled(classBytes)) {
+        {
+            QMutexLocker locker(&m_mutex);
+            ++m_stats.unpooled;
+        }
+        return payload(allocateBlock(classBytes));
+    }
+
+    {
+        QMutexLocker locker(&m_mutex);
+        auto it = m_freeLists.find(classBytes);
+        if (it != m_freeLists.end() && !it->second.empty()) {
+            void *block = it->second.back();
+            it->second.pop_back();
+            ++m_stats.hits;
+            m_stats.retainedBytes -= classBytes;
+            return payload(block);
+        }
+        ++m_stats.misses;
+    }
+    return payload(allocateBlock(classBytes));
+}
+
+void TileBufferPool::release(void *buffer)
+{
+    if (!buffer)
+        return;
+    void *block = blockFromPayload(buffer);
+    const size_t classBytes = *static_cast<size_t *>(block);
+    if (!isPooled(classBytes)) {
+        qFreeAligned(block);
+        return;
+    }
+    instance().recycle(block, classBytes);
+}
+
+void TileBufferPool::recycle(void *block, size_t classBytes)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        ++m_stats.releases;
+        if (m_stats.retainedBytes + classBytes <= m_capacity) {
+            m_freeLists[classBytes].push_back(block);
+            m_stats.retainedBytes += classBytes;
+            return;
+        }
+        ++m_stats.discarded;
+    }
+    qFreeAligned(block);
+}
+
+QImage TileBufferPool::image(const QSize &size, QImage::Format format)
+{
+    if (size.isEmpty() || format == QImage::Format_Invalid)
+        return QImage();
+    const int depth = QImage::toPixelFormat(format).bitsPerPixel();
+    const int bytesPerLine = ((size.width() * depth + 31) / 32) * 4;
+    uchar *buffer = static_cast<uchar *>(acquire(size_t(bytesPerLine) * size.height()));
+    return QImage(buffer,
+                  size.width(),
+                  size.height(),
+                  bytesPerLine,
+                  format,
+                  cleanupPooledImage,
+                  buffer);
+}
+
+TileBufferPool::Stats TileBufferPool::stats() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_stats;
+}
+
+void TileBufferPool::setCapacity(quint64 bytes)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_capacity = bytes;
+        if (m_stats.retainedBytes <= m_capacity)
+            return;
+    }
+    trim();
+}
+
+quint64 TileBufferPool::capacity() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_capacity;
+}
+
+void TileBufferPool::trim()
+{
+    std::map<size_t, std::vector<void *>> freeLists;
+    {
+        QMutexLocker locker(&m_mutex);
+        freeLists.swap(m_freeLists);
+        m_stats.retainedBytes = 0;
+    }
+    for (auto &l: freeLists) {
+        for (void *block: l.second)
+            qFreeAligned(block);
+    }
+}
+
+QDebug operator<<(QDebug d, const TileBufferPool::Stats &s)
+{
+    QDebugStateSaver saver(d);
+    d.nospace() << "TileBufferPool(hits: " << s.hits
+                << ", misses: " << s.misses
+                << ", releases: " << s.releases
+                << ", discarded: " << s.discarded
+                << ", unpooled: " << s.unpooled
+                << ", retained: " << s.retainedBytes << " bytes)";
+    return d;
+}
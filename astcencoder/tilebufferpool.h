@@ -0,0 +1,83 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#ifndef TILEBUFFERPOOL_H
+#define TILEBUFFERPOOL_H
+
+#include <QImage>
+#include <QMutex>
+#include <QDebug>
+#include <map>
+#include <vector>
+#include <cstddef>
+
+// Size-class pool for tile-sized pixel buffers.
+// Decoded tiles, their mirrored copies and ASTC mips come and go at a high rate
+// but in a handful of sizes, so recycling them keeps the heap from fragmenting
+// during long sessions. Nothing is retained until setCapacity() opts in.
+class TileBufferPool
+{
+public:
+    struct Stats {
+        quint64 hits{0};
+        quint64 misses{0};
+        quint64 releases{0};
+        quint64 discarded{0}; // released with the pool already at capacity
+        quint64 unpooled{0}; // requests outside the pooled size range
+        quint64 retainedBytes{0};
+    };
+
+    static TileBufferPool &instance();
+
+    // Returned buffers are 64 bytes aligned
+    void *acquire(size_t bytes);
+    static void release(void *buffer);
+
+    // The image borrows its pixels from the pool and returns them on destruction.
+    // Detached copies are regular QImages.
+    QImage image(const QSize &size, QImage::Format format);
+
+    Stats stats() const;
+    void setCapacity(quint64 bytes);
+    quint64 capacity() const;
+    void trim();
+
+    static constexpr size_t granularity = 4096;
+    static constexpr size_t minPooledBytes = 16 * 1024;
+    static constexpr size_t maxPooledBytes = 16 * 1024 * 1024;
+
+private:
+    TileBufferPool() = default;
+    ~TileBufferPool() = default;
+    void recycle(void *block, size_t classBytes);
+
+    mutable QMutex m_mutex;
+    std::map<size_t, std::vector<void *>> m_freeLists; // class size -> free blocks
+    quint64 m_capacity{0};
+    Stats m_stats;
+
+public:
+    TileBufferPool(TileBufferPool const&)       = delete;
+    void operator=(TileBufferPool const&)       = delete;
+};
+
+QDebug operator<<(QDebug d, const TileBufferPool::Stats &s);
+
+#endif
@@ -68,7 +68,7 @@ public:
            QString dbPath,
            quint16 port = defaultPort,
            QObject *parent = nullptr)
-        : QObject(parent), m_network(network), m_timestamp(ts)
+        : QObject(parent), m_network(network), m_timestamp(ts), m_timestampMips(ts)
     {
         const QUrl url = QUrl(QStringLiteral("tcp://")
                               + host
@@ -109,6 +109,13 @@ SELECT tileHash, blockX, blockY, quality, width, height, tile, ts, x, y, z, ROWI
 FROM Tile
 WHERE ts > :clientmaxts
 ORDER BY ts ASC
+)";
+
+        static constexpr char queryStringMips[] = R"(
+SELECT tileHash, blockX, blockY, quality, width, height, levels, offsets, mips, ts, x, y, z, ROWID
+FROM TileMips
+WHERE ts > :clientmaxts
+ORDER BY ts ASC
 )";
 
         Query querySyncOff{"PRAGMA synchronous = OFF",
@@ -125,8 +132,33 @@ ORDER BY ts ASC
         auto res = SQLiteManager::instance().sqliteSelect(querySyncOff.toMap());
         res = SQLiteManager::instance().sqliteSelect(queryJournalOff.toMap());
 
+        // local caches predating single row mip chains lack TileMips
+        static constexpr char createMips[] = R"(
+CREATE TABLE IF NOT EXISTS TileMips (
+      tileHash TEXT
+    , blockX INTEGER
+    , blockY INTEGER
+    , quality REAL
+    , width INTEGER
+    , height INTEGER
+    , levels INTEGER
+    , offsets BLOB
+    , mips BLOB
+    , ts DATETIME DEFAULT NULL
+    , x INTEGER DEFAULT NULL
+    , y INTEGER DEFAULT NULL
+    , z INTEGER DEFAULT NULL
+    , PRIMARY KEY (tileHash, blockX, blockY, quality, width, height)
+)
+)";
+        res = SQLiteManager::instance().sqliteSelect(Query{createMips, {}, "", 3}.toMap());
+        if (!res["error"].isNull())
+            qWarning() << "updateASTC: " << res["error"];
+
+        // one cursor per table, as the remote may still be writing Tile rows
+        // older than the newest local TileMips row
         static constexpr char clientQuery[] = R"(
-SELECT MAX(ts) from Tile
+SELECT MAX(ts) AS maxts, (SELECT MAX(ts) FROM TileMips) AS maxtsmips FROM Tile
 )";
         if (!m_timestamp.isValid()) {
             QVariantMap clientq{{"query" , clientQuery},
@@ -134,21 +166,32 @@ SELECT MAX(ts) from Tile
                                 {"query_id" , 123}};
 
             auto res = SQLiteManager::instance().sqliteSelect(clientq);
-            m_timestamp =
-                    res.value("query_result").toList().first().toMap().value("MAX(ts)").toDateTime();
+            const QVariantMap row = res.value("query_result").toList().first().toMap();
+            m_timestamp = row.value("maxts").toDateTime();
+            m_timestampMips = row.value("maxtsmips").toDateTime();
 
-            if (!m_timestamp.isValid())
+            if (!m_timestamp.isValid() && !m_timestampMips.isValid())
                 qFatal("Invalid m_timestamp in updateASTC");
+            // a table empty locally is fetched entirely
+            if (!m_timestamp.isValid())
+                m_timestamp = QDateTime::fromMSecsSinceEpoch(0, Qt::UTC);
+            if (!m_timestampMips.isValid())
+                m_timestampMips = QDateTime::fromMSecsSinceEpoch(0, Qt::UTC);
         }
 
         Query query{queryString,
                     QVariantMap{{":clientmaxts", m_timestamp}},
                     "",
                     42};
+        Query queryMips{queryStringMips,
+                    QVariantMap{{":clientmaxts", m_timestampMips}},
+                    "",
+                    43};
 
         client->submitSelect(querySyncOff);
         client->submitSelect(queryJournalOff);
         client->submitSelectProgressive(query);
+        client->submitSelectProgressive(queryMips);
     }
 
     void updateNetwork()
@@ -251,6 +294,8 @@ INSERT INTO Document(metadata, data, url, lastAccess) VALUES (:metadata, :data,
     }
 
     void onASTCRowReceived(const QVariantMap data) {
+        if (data["query_id"].toInt() == 43)
+            return onASTCMipsRowReceived(data);
         static quint64 receivedASTCRowsCount = 0;
         const auto row = data["row"].toMap();
         static constexpr char insertQuery[] = R"(
@@ -282,11 +327,45 @@ VALUES (:tileHash, :blockX, :blockY, :quality, :width, :height, :tile, :ts, :x,
 
     }
 
+    void onASTCMipsRowReceived(const QVariantMap data) {
+        static quint64 receivedASTCMipsRowsCount = 0;
+        const auto row = data["row"].toMap();
+        static constexpr char insertQuery[] = R"(
+INSERT OR REPLACE INTO TileMips(tileHash, blockX, blockY, quality, width, height, levels, offsets, mips, ts, x, y, z)
+VALUES (:tileHash, :blockX, :blockY, :quality, :width, :height, :levels, :offsets, :mips, :ts, :x, :y, :z)
+)";
+        Query insertq{insertQuery,
+                    QVariantMap{{":tileHash", row["tileHash"]},
+                                {":blockX", row["blockX"]},
+                                {":blockY", row["blockY"]},
+                                {":quality", row["quality"]},
+                                {":width", row["width"]},
+                                {":height", row["height"]},
+                                {":levels", row["levels"]},
+                                {":offsets", row["offsets"]},
+                                {":mips", row["mips"]},
+                                {":ts", row["ts"]},
+                                {":x", row["x"]},
+                                {":y", row["y"]},
+                                {":z", row["z"]}},
+                                "",
+                                322};
+
+        auto res = SQLiteManager::instance().sqliteSelect(insertq.toMap());
+        if (!res["error"].isNull())
+            qWarning() << "onASTCMipsRowReceived: " << res["error"];
+        if (!(++receivedASTCMipsRowsCount % 1000) || receivedASTCMipsRowsCount == 1)
+            qInfo() << "onASTCMipsRowReceived "<< receivedASTCMipsRowsCount
+                            << " ROWID: "<< row["rowid"].toLongLong()
+                            << " TS: "<<row["ts"].toDateTime().toString(Qt::ISODate);
+    }
+
 public:
     QScopedPointer<DbClient> client;
     bool m_initialized{false};
     bool m_network{true};
     QDateTime m_timestamp;
+    QDateTime m_timestampMips; // TileMips cursor, in updateASTC
 };
 
 int main(int argc, char *argv[])
@@ -63,6 +63,7 @@
 #include <QOpenGLFunctions_4_0_Core>
 #include <QOpenGLExtraFunctions>
 #include <QOpenGLTexture>
+#include <QOpenGLPixelTransferOptions>
 #include <QMatrix4x4>
 #include <QQuaternion>
 #include <QVector3D>
@@ -202,8 +203,14 @@ public:
 
     Q_INVOKABLE void updateASTCSupport() {
         QQuickWindow *w = qobject_cast<QQuickWindow *>(sender());
-        if (w->openglContext()->extensions().contains(QByteArrayLiteral("GL_KHR_texture_compression_astc_ldr"))) {
+        const auto extensions = w->openglContext()->extensions();
+        if (extensions.contains(QByteArrayLiteral("GL_KHR_texture_compression_astc_ldr"))) {
             qmlContext(w)->engine()->rootContext()->setContextProperty("astcSupported", true);
+        } else if (extensions.contains(QByteArrayLiteral("GL_ARB_texture_compression_bptc"))
+                   || extensions.contains(QByteArrayLiteral("GL_EXT_texture_compression_bptc"))) {
+            NetworkConfiguration::bcnFormat = int(QOpenGLTexture::RGB_BP_UNorm); // BC7
+        } else if (extensions.contains(QByteArrayLiteral("GL_EXT_texture_compression_s3tc"))) {
+            NetworkConfiguration::bcnFormat = int(QOpenGLTexture::RGBA_DXT5); // BC3, BC1 for opaque tiles outside of texture arrays
         }
         m_window = w;
     }
@@ -647,6 +654,8 @@ struct Tile
     QSharedPointer<QOpenGLTexture> m_texMap;
 
     QPair<float, float> m_minMaxElevation;
+    float m_demOffset{0.f}; // texel to metres
+    float m_demScale{1.f};
 
     std::shared_ptr<Tile> m_right;
     std::shared_ptr<Tile> m_bottom;
@@ -1382,15 +1391,27 @@ QSharedPointer<QOpenGLTexture> Tile::demTexture() {
             m_resolution = h.size();
         }
 
-        if (!m_texDem || QSize(m_texDem->width(), m_texDem->height()) != h.m_size) {
+        // Quantized heightmaps go up as R16, and the shader maps them back to metres
+        const bool quantized = h.isQuantized();
+        const auto format = (quantized) ? QOpenGLTexture::R16_UNorm : QOpenGLTexture::R32F;
+        const auto pixelType = (quantized) ? QOpenGLTexture::UInt16 : QOpenGLTexture::Float32;
+        if (!m_texDem
+                || QSize(m_texDem->width(), m_texDem->height()) != h.m_size
+                || m_texDem->format() != format) {
             m_texDem.reset(new QOpenGLTexture(QOpenGLTexture::Target2D));
-            m_texDem->setFormat(QOpenGLTexture::R32F);
+            m_texDem->setFormat(format);
             m_texDem->setSize(h.m_size.width(), h.m_size.height());
-            m_texDem->allocateStorage(QOpenGLTexture::Red, QOpenGLTexture::Float32);
+            m_texDem->allocateStorage(QOpenGLTexture::Red, pixelType);
         }
+        QOpenGLPixelTransferOptions uploadOptions;
+        uploadOptions.setAlignment((quantized) ? 2 : 4);
         m_texDem->setData(QOpenGLTexture::Red,
-                          QOpenGLTexture::Float32,
-                          (const void *) &(h.elevations.front()));
+                          pixelType,
+                          (quantized) ? (const void *) &(h.quantized.front())
+                                      : (const void *) &(h.elevations.front()),
+                          &uploadOptions);
+        m_demOffset = (quantized) ? h.m_quantizationOffset : 0.f;
+        m_demScale = (quantized) ? h.m_quantizationScale * 65535.f : 1.f;
 
         m_dem = Heightmap();
     }
@@ -1542,6 +1563,8 @@ void Tile::draw(const QDoubleMatrix4x4 &transformation,
     shader->setUniformValue("raster", 0);
     shader->setUniformValue("dem", 1);
     shader->setUniformValue("minElevation", m_minMaxElevation.first);
+    shader->setUniformValue("demOffset", m_demOffset);
+    shader->setUniformValue("demScale", m_demScale);
     shader->setUniformValue("elevationScale", elevationScale);
     shader->setUniformValue("matrix", m);
     shader->setUniformValue("color", QColor(255,255,255,255));
@@ -1687,6 +1710,7 @@ int main(int argc, char *argv[])
     qmlRegisterType<TerrainViewer>("DemViewer", 1, 0, "TerrainViewer");
     DEMFetcher *demFetcher = new DEMFetcher(&engine, true);
     demFetcher->setObjectName("DEM Fetcher");
+    demFetcher->setQuantizedHeightmaps(true);
     demFetcher->setURLTemplate(QLatin1String("https://s3.amazonaws.com/elevation-tiles-prod/terrarium/{z}/{x}/{y}.png"));
     demFetcher->setMaximumZoomLevel(15);
     demFetcher->setOverzoom(true);
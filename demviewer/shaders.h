@@ -72,8 +72,10 @@ static constexpr char vertexShaderTile[] = R"(
 #version 450 core
 uniform sampler2D dem;
 uniform float minElevation;
+uniform float demOffset; // 0 and 1 unless the DEM is quantized
+uniform float demScale;
 float fetchDEM(ivec2 texelCoord) {
-    return texelFetch(dem, texelCoord, 0).r;
+    return demOffset + texelFetch(dem, texelCoord, 0).r * demScale;
 }
 uniform highp mat4 matrix;
 uniform vec2 resolution;
@@ -147,8 +149,10 @@ static constexpr char vertexShaderTileJoinedDownsampled[] = R"(
 #version 450 core
 uniform sampler2D dem;
 uniform float minElevation;
+uniform float demOffset; // 0 and 1 unless the DEM is quantized
+uniform float demScale;
 float fetchDEM(ivec2 texelCoord) {
-    return texelFetch(dem, texelCoord, 0).r;
+    return demOffset + texelFetch(dem, texelCoord, 0).r * demScale;
 }
 uniform highp mat4 matrix;
 
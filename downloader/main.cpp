@@ -72,7 +72,9 @@ class Utilities : public QObject {
 public:
     struct Coverages {
         std::shared_ptr<QImage> raster;
-        std::shared_ptr<Heightmap> heightmap;
+        // the DEM is streamed to disk one chunk at a time
+        std::shared_ptr<HeightmapCoverageWriter> dem;
+        std::shared_ptr<HeightmapCoverageWriter> geoTiff;
     };
 
     struct RequestID {
@@ -97,10 +99,14 @@ public:
         if (!m_demFetcher || !m_rasterFetcher)
             qFatal("Map and Terrain fetchers are NULL!");
 
-        QObject::connect(m_demFetcher, &DEMFetcher::heightmapCoverageReady,
-                         this, &Utilities::onDTMCoverageReady);
+        QObject::connect(m_demFetcher, &DEMFetcher::heightmapChunkReady,
+                         this, &Utilities::onDTMChunkReady);
         QObject::connect(m_demFetcher, &MapFetcher::requestHandlingFinished,
                          this, &Utilities::onRequestHandlingFinished);
+        QObject::connect(m_demFetcher, &DEMFetcher::heightmapReady,
+                         this, &Utilities::onHeightmapReady);
+        QObject::connect(m_demFetcher, &DEMFetcher::heightmapMeshReady,
+                         this, &Utilities::onHeightmapMeshReady);
 
         QObject::connect(m_rasterFetcher, &MapFetcher::coverageReady,
                          this, &Utilities::onMapCoverageReady);
@@ -124,9 +130,9 @@ public:
                               const QList<QGeoCoordinate> &selectionPolygon,
                               const quint8 demZoom,
                               const quint8 mapZoom) {
-        auto demID = m_demFetcher->requestCoverage(selectionPolygon,
-                                                 demZoom,
-                                                 true);
+        auto demID = m_demFetcher->requestChunkedCoverage(selectionPolygon,
+                                                          demZoom,
+                                                          true);
 
         auto rasterID = m_rasterFetcher->requestCoverage(selectionPolygon,
                                               mapZoom,
@@ -139,16 +145,62 @@ public:
         m_numResponses[requestID] = 0;
     }
 
+    // Writes a quantized-mesh z/x/y.terrain pyramid (tms scheme) with its layer.json,
+    // from level 0 to maxZoom. maxError is in metres at maxZoom, and doubles per level up
+    Q_INVOKABLE void exportQuantizedMesh(const QString exportDirectory,
+                                         const QList<QGeoCoordinate> &selectionPolygon,
+                                         const quint8 maxZoom,
+                                         const bool normals = true,
+                                         const float maxError = 1.f) {
+        const QString dst = localPath(exportDirectory);
+        if (!QDir("/").mkpath(dst)) {
+            qWarning() << "Failed creating path to export terrain at " << dst;
+            return;
+        }
+        if (!m_demFetcher->heightmapMeshesEnabled())
+            m_demFetcher->setHeightmapMeshes(true, maxError);
+
+        const int exportID = m_nextExportID++;
+        MeshExport &e = m_exports[exportID];
+        e.destination = dst;
+        e.normals = normals;
+        e.maxZoom = maxZoom;
+        e.maxError = maxError;
+        for (int z = 0; z <= maxZoom; ++z) {
+            const quint64 id = m_demFetcher->requestSlippyTiles(selectionPolygon, z, z, false);
+            m_exportIDs[id] = exportID;
+            ++e.pendingRequests;
+        }
+    }
+
 protected slots:
-    void onDTMCoverageReady(const quint64 id) {
+    void onDTMChunkReady(const quint64 id, const TileKey k) {
         if (!m_demFetcher)
             return;
 
-        auto heightmap = m_demFetcher->heightmapCoverage(id);
+        auto chunk = m_demFetcher->heightmapChunk(id, k);
+        if (!chunk || !m_demIDs.contains(id))
+            return;
         auto requestID = m_demIDs[id];
-        m_coverage[requestID].heightmap = std::move(heightmap);
-        m_numResponses[requestID]++;
-        finalizeRequest(requestID);
+        auto &coverage = m_coverage[requestID];
+        if (!coverage.dem) {
+            const QString dst = localPath(m_destination[requestID]);
+            if (!QDir("/").mkpath(dst)) {
+                QString msg = "Failed creating path to store coverages at " + dst;
+                qFatal("%s", msg.toStdString().c_str());
+            }
+            const QSize &size = chunk->coverageSize;
+            coverage.dem = std::make_shared<RawCoverageWriter>(dst + "/dem_" +
+                                                               QString::number(size.width()) + "x" +
+                                                               QString::number(size.height()) + ".bin",
+                                                               size);
+            coverage.geoTiff = std::make_shared<GeoTiffCoverageWriter>(dst + "/dem.tif",
+                                                                       size,
+                                                                       chunk->topLeft,
+                                                                       chunk->pixelSize);
+        }
+        coverage.dem->writeChunk(*chunk);
+        coverage.geoTiff->writeChunk(*chunk);
     }
 
     void onMapCoverageReady(const quint64 id) {
@@ -164,20 +216,80 @@ protected slots:
 
     void onRequestHandlingFinished(quint64 id) {
         qInfo() << "Request "<<id<< " finished. sender: "<<sender();
+        if (sender() != m_demFetcher)
+            return;
+        if (m_demIDs.contains(id)) {
+            auto requestID = m_demIDs[id];
+            auto &coverage = m_coverage[requestID];
+            if (!coverage.dem || !coverage.dem->close() || !coverage.geoTiff->close())
+                qWarning() << "failed to save the DEM coverage for request " << id;
+            m_numResponses[requestID]++;
+            finalizeRequest(requestID);
+            return;
+        }
+        if (!m_exportIDs.contains(id))
+            return;
+        const int exportID = m_exportIDs.take(id);
+        MeshExport &e = m_exports[exportID];
+        if (--e.pendingRequests)
+            return;
+
+        QSaveFile layer(e.destination + "/layer.json");
+        if (!layer.open(QIODevice::WriteOnly)
+                || layer.write(QuantizedMesh::layerJson(e.tiles, e.normals)) < 0
+                || !layer.commit()) {
+            qWarning() << "failed to save " << e.destination + "/layer.json";
+        }
+        qInfo() << "Exported "<<e.tiles.size()<<" terrain tiles to "<<e.destination;
+        m_exports.remove(exportID);
+        if (m_exports.isEmpty())
+            m_demFetcher->setHeightmapMeshes(false);
     }
 
-protected:
-    void finalizeRequest(RequestID id) {
-        if (m_numResponses[id] < 2)
+    void onHeightmapReady(quint64 id, const TileKey k) {
+        if (m_exportIDs.contains(id))
+            m_demFetcher->heightmap(id, k); // only the mesh is exported
+    }
+
+    void onHeightmapMeshReady(quint64 id, const TileKey k) {
+        auto mesh = m_demFetcher->heightmapMesh(id, k);
+        if (!mesh || !m_exportIDs.contains(id))
             return;
-        QString msg;
-        auto dst = m_destination[id];
+        MeshExport &e = m_exports[m_exportIDs.value(id)];
+        const float levelError = e.maxError * float(1 << (e.maxZoom - k.z));
+        if (mesh->rtin && mesh->maxError != levelError)
+            mesh = mesh->rtin->mesh(levelError);
+
+        const TileKey tk = QuantizedMesh::tmsKey(k);
+        const QString dir = e.destination + "/" + QString::number(tk.z) + "/" + QString::number(tk.x);
+        const QString dst = dir + "/" + QString::number(tk.y) + ".terrain";
+        QSaveFile tile(dst);
+        if (!QDir("/").mkpath(dir)
+                || !tile.open(QIODevice::WriteOnly)
+                || tile.write(QuantizedMesh::encode(*mesh, k, e.normals)) < 0
+                || !tile.commit()) {
+            qWarning() << "failed to save " << dst;
+            return;
+        }
+        e.tiles.insert(k);
+    }
+
+protected:
+    static QString localPath(QString dst) {
         if (dst.startsWith("file://"))
 #if defined(Q_OS_WINDOWS)
             dst = dst.mid(8);
 #else
             dst = dst.mid(7);
 #endif
+        return dst;
+    }
+
+    void finalizeRequest(RequestID id) {
+        if (m_numResponses[id] < 2)
+            return;
+        QString msg;
+        auto dst = localPath(m_destination[id]);
         if (!QDir("/").mkpath(dst)) {
             msg = "Failed creating path to store coverages at " + dst;
             qFatal("%s", msg.toStdString().c_str());
@@ -190,30 +302,6 @@ protected:
             qFatal("%s", msg.toStdString().c_str());
         }
 
-        // https://stackoverflow.com/a/2774014/962856
-        auto &h = m_coverage[id].heightmap;
-        QByteArray dem(reinterpret_cast<const char*>(&h->elevations.front()),
-                       sizeof(float) * m_coverage[id].heightmap->elevations.size());
-        QString demDst = dst + "/dem_" +
-                QString::number(h->size().width()) + "x" +
-                QString::number(h->size().height()) + ".bin";
-        QSaveFile demFile(demDst);
-        res = demFile.open(QIODevice::WriteOnly);
-        if (!res) {
-            msg = "failed to save " + demDst;
-            qFatal("%s", msg.toStdString().c_str());
-        }
-        res = demFile.write(dem);
-        if (!res) {
-            msg = "failed to save " + demDst;
-            qFatal("%s", msg.toStdString().c_str());
-        }
-        res = demFile.commit();
-        if (!res) {
-            msg = "failed to save " + demDst;
-            qFatal("%s", msg.toStdString().c_str());
-        }
-
         m_coverage.remove(id);
         m_destination.remove(id);
         m_numResponses.remove(id);
@@ -230,6 +318,18 @@ protected:
     QMap<RequestID, quint64> m_numResponses;
     QMap<RequestID, QString> m_destination;
     QMap<RequestID, Coverages> m_coverage;
+
+    struct MeshExport {
+        QString destination;
+        bool normals{true};
+        quint8 maxZoom{0};
+        float maxError{1.f};
+        int pendingRequests{0};
+        std::set<TileKey> tiles;
+    };
+    QMap<quint64, int> m_exportIDs;
+    QMap<int, MeshExport> m_exports;
+    int m_nextExportID{0};
 };
 
 
@@ -150,6 +150,10 @@ Window {
                                         parent.selectionPolygon,
                                         zlslider.value,
                                         zlMapSlider.value)
+                    if (quantizedMeshCheck.checked)
+                        utilities.exportQuantizedMesh(path + "/terrain",
+                                                      parent.selectionPolygon,
+                                                      zlslider.value)
                 }
             }
 
@@ -211,6 +215,12 @@ Window {
                         }
                     }
                 }
+
+                QC2.CheckBox {
+                    id: quantizedMeshCheck
+                    text: "Export quantized-mesh terrain"
+                    checked: false
+                }
             }
 
 
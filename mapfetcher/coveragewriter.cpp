@@ -0,0 +1,266 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher.h"
+#include <QtEndian>
+#include <QDebug>
+#include <cstring>
+#include <vector>
+
+namespace  {
+// Little endian TIFF/BigTIFF directory builder. Values that don't fit inline
+// are appended after the directory.
+class TiffDirectory {
+public:
+    enum Type : quint16 {
+        Short = 3,
+        Long = 4,
+        Double = 12,
+        Long8 = 16
+    };
+
+    explicit TiffDirectory(bool bigTiff) : m_bigTiff(bigTiff) {}
+
+    void add(quint16 tag, Type type, const std::vector<double> &values) {
+        m_entries.push_back({tag, type, values});
+    }
+
+    QByteArray serialize() const {
+        const int headerSize = (m_bigTiff) ? 16 : 8;
+        const int entrySize = (m_bigTiff) ? 20 : 12;
+        const int inlineSize = (m_bigTiff) ? 8 : 4;
+        const int countSize = (m_bigTiff) ? 8 : 2;
+        const int dirSize = countSize + int(m_entries.size()) * entrySize + inlineSize;
+
+        QByteArray res;
+        res.append((m_bigTiff) ? QByteArray("II\x2b\x00\x08\x00\x00\x00", 8)
+                               : QByteArray("II\x2a\x00", 4));
+        appendOffset(res, headerSize);
+        appendCount(res, m_entries.size());
+
+        QByteArray extra;
+        qint64 extraOffset = headerSize + dirSize;
+        for (const auto &e: m_entries) {
+            const QByteArray values = encode(e);
+            appendInt(res, e.tag, 2);
+            appendInt(res, e.type, 2);
+            if (m_bigTiff)
+                appendInt(res, e.values.size(), 8);
+            else
+                appendInt(res, e.values.size(), 4);
+            if (values.size() <= inlineSize) {
+                res.append(values);
+                res.append(QByteArray(inlineSize - values.size(), '\0'));
+            } else {
+                appendOffset(res, extraOffset + extra.size());
+                extra.append(values);
+                if (extra.size() & 1)
+                    extra.append('\0');
+            }
+        }
+        appendOffset(res, 0); // no further IFD
+        res.append(extra);
+        return res;
+    }
+
+private:
+    struct Entry {
+        quint16 tag;
+        Type type;
+        std::vector<double> values;
+    };
+
+    static void appendInt(QByteArray &dst, quint64 v, int bytes) {
+        for (int i = 0; i < bytes; ++i)
+            dst.append(char((v >> (8 * i)) & 0xff));
+    }
+    void appendOffset(QByteArray &dst, quint64 v) const {
+        appendInt(dst, v, (m_bigTiff) ? 8 : 4);
+    }
+    void appendCount(QByteArray &dst, quint64 v) const {
+        appendInt(dst, v, (m_bigTiff) ? 8 : 2);
+    }
+    static QByteArray encode(const Entry &e) {
+        QByteArray res;
+        for (const double v: e.values) {
+            switch (e.type) {
+            case Short:
+                appendInt(res, quint64(v), 2);
+                break;
+            case Long:
+                appendInt(res, quint64(v), 4);
+                break;
+            case Long8:
+                appendInt(res, quint64(v), 8);
+                break;
+            case Double: {
+                quint64 bits;
+                memcpy(&bits, &v, sizeof(bits));
+                appendInt(res, bits, 8);
+                break;
+            }
+            }
+        }
+        return res;
+    }
+
+    bool m_bigTiff;
+    std::vector<Entry> m_entries;
+};
+
+QByteArray geoTiffHeader(const QSize &size, const QPointF &topLeft, double pixelSize)
+{
+    const quint64 rowSize = quint64(size.width()) * sizeof(float);
+    const quint64 dataSize = rowSize * quint64(size.height());
+    // Directory and strip tables are well below 64 bytes per row
+    const bool bigTiff = dataSize + 64 * quint64(size.height()) + 4096 > 0xffffffffull;
+    const auto offsetType = (bigTiff) ? TiffDirectory::Long8 : TiffDirectory::Long;
+
+    // Strip offsets depend on the header size, which doesn't depend on their values
+    auto build = [&](quint64 dataOffset) {
+        std::vector<double> offsets(size.height()), counts(size.height(), double(rowSize));
+        for (int y = 0; y < size.height(); ++y)
+            offsets[y] = double(dataOffset + rowSize * y);
+
+        TiffDirectory dir(bigTiff);
+        dir.add(256, TiffDirectory::Long, {double(size.width())});   // ImageWidth
+        dir.add(257, TiffDirectory::Long, {double(size.height())});  // ImageLength
+        dir.add(258, TiffDirectory::Short, {32});                    // BitsPerSample
+        dir.add(259, TiffDirectory::Short, {1});                     // Compression: none
+        dir.add(262, TiffDirectory::Short, {1});                     // Photometric: BlackIsZero
+        dir.add(273, offsetType, offsets);                           // StripOffsets
+        dir.add(277, TiffDirectory::Short, {1});                     // SamplesPerPixel
+        dir.add(278, TiffDirectory::Long, {1});                      // RowsPerStrip
+        dir.add(279, offsetType, counts);                            // StripByteCounts
+        dir.add(284, TiffDirectory::Short, {1});                     // PlanarConfiguration
+        dir.add(339, TiffDirectory::Short, {3});                     // SampleFormat: float
+        dir.add(33550, TiffDirectory::Double, {pixelSize, pixelSize, 0});           // ModelPixelScale
+        dir.add(33922, TiffDirectory::Double, {0, 0, 0, topLeft.x(), topLeft.y(), 0}); // ModelTiepoint
+        dir.add(34735, TiffDirectory::Short, {1, 1, 0, 3,
+                                              1024, 0, 1, 1,      // GTModelType: projected
+                                              1025, 0, 1, 1,      // GTRasterType: PixelIsArea
+                                              3072, 0, 1, 3857}); // ProjectedCSType
+        return dir.serialize();
+    };
+    const QByteArray provisional = build(0);
+    // Round the data start to 16 bytes
+    const quint64 dataOffset = (quint64(provisional.size()) + 15) & ~quint64(15);
+    QByteArray res = build(dataOffset);
+    res.append(QByteArray(int(dataOffset - res.size()), '\0'));
+    return res;
+}
+} // namespace
+
+HeightmapCoverageWriter::HeightmapCoverageWriter(const QString &fileName, const QSize &size)
+    : m_file(fileName), m_size(size) {}
+
+bool HeightmapCoverageWriter::open(const QByteArray &header)
+{
+    if (m_size.isEmpty()) {
+        qWarning() << "HeightmapCoverageWriter: empty coverage";
+        return false;
+    }
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        qWarning() << "HeightmapCoverageWriter: failed opening "<<m_file.fileName()<< m_file.errorString();
+        return false;
+    }
+    m_dataOffset = header.size();
+    if (m_file.write(header) != header.size()
+            || !m_file.resize(m_dataOffset + qint64(m_size.width()) * m_size.height() * qint64(sizeof(float)))) {
+        qWarning() << "HeightmapCoverageWriter: failed allocating "<<m_file.fileName()<< m_file.errorString();
+        m_file.close();
+        return false;
+    }
+    return true;
+}
+
+bool HeightmapCoverageWriter::isOpen() const
+{
+    return m_file.isOpen();
+}
+
+QSize HeightmapCoverageWriter::size() const
+{
+    return m_size;
+}
+
+bool HeightmapCoverageWriter::writeBlock(const QRect &rect, const float *elevations, int stride)
+{
+    if (!isOpen())
+        return false;
+    if (!QRect(QPoint(0, 0), m_size).contains(rect)) {
+        qWarning() << "HeightmapCoverageWriter::writeBlock: "<<rect<<" outside the coverage "<<m_size;
+        return false;
+    }
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    std::vector<float> row(rect.width());
+#endif
+    for (int y = 0; y < rect.height(); ++y) {
+        const float *src = elevations + qint64(y) * stride;
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+        qToLittleEndian<float>(src, rect.width(), row.data());
+        src = row.data();
+#endif
+        const qint64 offset = m_dataOffset
+                + (qint64(rect.y() + y) * m_size.width() + rect.x()) * qint64(sizeof(float));
+        const qint64 rowBytes = qint64(rect.width()) * qint64(sizeof(float));
+        if (!m_file.seek(offset)
+                || m_file.write(reinterpret_cast<const char *>(src), rowBytes) != rowBytes) {
+            qWarning() << "HeightmapCoverageWriter::writeBlock: write failed "<<m_file.errorString();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool HeightmapCoverageWriter::writeChunk(const HeightmapChunk &chunk)
+{
+    if (chunk.heightmap.m_size != chunk.rect.size()
+            || chunk.heightmap.elevations.size() < size_t(chunk.rect.width()) * chunk.rect.height()) {
+        qWarning() << "HeightmapCoverageWriter::writeChunk: invalid chunk";
+        return false;
+    }
+    return writeBlock(chunk.rect, chunk.heightmap.elevations.data(), chunk.rect.width());
+}
+
+bool HeightmapCoverageWriter::close()
+{
+    if (!isOpen())
+        return false;
+    const bool res = m_file.flush();
+    m_file.close();
+    return res;
+}
+
+RawCoverageWriter::RawCoverageWriter(const QString &fileName, const QSize &size)
+    : HeightmapCoverageWriter(fileName, size)
+{
+    open(QByteArray());
+}
+
+GeoTiffCoverageWriter::GeoTiffCoverageWriter(const QString &fileName,
+                                             const QSize &size,
+                                             const QPointF &topLeft,
+                                             double pixelSize)
+    : HeightmapCoverageWriter(fileName, size)
+{
+    if (!size.isEmpty())
+        open(geoTiffHeader(size, topLeft, pixelSize));
+}
@@ -0,0 +1,182 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher_p.h"
+#include "utils_p.h"
+
+#include <cmath>
+#include <limits>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+constexpr double maxLatitude = 85.05112877980659; // Web Mercator square
+constexpr double degToRad = M_PI / 180.0;
+
+#if defined(__SSE2__)
+// sin(x) for |x| <= pi/2, Taylor series to x^21 (error below 1e-16)
+inline __m128d sinPd(__m128d x) {
+    static const double c[] = {  1.0 / 51090942171709440000.0, // 1/21!
+                                -1.0 / 121645100408832000.0,
+                                 1.0 / 355687428096000.0,
+                                -1.0 / 1307674368000.0,
+                                 1.0 / 6227020800.0,
+                                -1.0 / 39916800.0,
+                                 1.0 / 362880.0,
+                                -1.0 / 5040.0,
+                                 1.0 / 120.0,
+                                -1.0 / 6.0,
+                                 1.0 };
+    const __m128d x2 = _mm_mul_pd(x, x);
+    __m128d p = _mm_set1_pd(c[0]);
+    for (int i = 1; i < 11; ++i)
+        p = _mm_add_pd(_mm_mul_pd(p, x2), _mm_set1_pd(c[i]));
+    return _mm_mul_pd(p, x);
+}
+
+// Natural log of positive normal doubles: exponent split, then the atanh series
+// of the mantissa reduced to [sqrt(2)/2, sqrt(2))
+inline __m128d logPd(__m128d v) {
+    const __m128i bits = _mm_castpd_si128(v);
+    __m128i e = _mm_sub_epi64(_mm_srli_epi64(bits, 52), _mm_set1_epi64x(1023));
+    __m128d m = _mm_castsi128_pd(_mm_or_si128(_mm_and_si128(bits, _mm_set1_epi64x(0x000fffffffffffffLL)),
+                                              _mm_set1_epi64x(0x3ff0000000000000LL)));
+    const __m128d big = _mm_cmpgt_pd(m, _mm_set1_pd(M_SQRT2));
+    m = _mm_or_pd(_mm_and_pd(big, _mm_mul_pd(m, _mm_set1_pd(.5))), _mm_andnot_pd(big, m));
+    e = _mm_sub_epi64(e, _mm_castpd_si128(big)); // big lanes are all ones, i.e. -1
+    // int64 -> double through the 1.5 * 2^52 magic number, exact for |e| < 2^51
+    const __m128d ed = _mm_sub_pd(_mm_castsi128_pd(_mm_add_epi64(e, _mm_set1_epi64x(0x4338000000000000LL))),
+                                  _mm_set1_pd(6755399441055744.0));
+
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d t = _mm_div_pd(_mm_sub_pd(m, one), _mm_add_pd(m, one));
+    const __m128d t2 = _mm_mul_pd(t, t);
+    __m128d p = _mm_set1_pd(1.0 / 21.0);
+    for (int k = 19; k >= 1; k -= 2)
+        p = _mm_add_pd(_mm_mul_pd(p, t2), _mm_set1_pd(1.0 / k));
+    const __m128d lnm = _mm_mul_pd(_mm_mul_pd(p, t), _mm_set1_pd(2.0));
+    return _mm_add_pd(lnm, _mm_mul_pd(ed, _mm_set1_pd(M_LN2)));
+}
+#endif
+
+inline void projectScalar(double lat, double lon, double &x, double &y) {
+    const double s = std::sin(qBound(-maxLatitude, lat, maxLatitude) * degToRad);
+    x = lon / 360.0 + .5;
+    y = .5 - std::log((1.0 + s) / (1.0 - s)) / (4.0 * M_PI);
+}
+} // namespace
+
+void projectToMercator(const double *latitudes,
+                       const double *longitudes,
+                       size_t count,
+                       double *x,
+                       double *y)
+{
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128d maxLat = _mm_set1_pd(maxLatitude * degToRad);
+    const __m128d minLat = _mm_set1_pd(-maxLatitude * degToRad);
+    const __m128d one = _mm_set1_pd(1.0);
+    const __m128d half = _mm_set1_pd(.5);
+    for (; i + 2 <= count; i += 2) {
+        __m128d lat = _mm_mul_pd(_mm_loadu_pd(latitudes + i), _mm_set1_pd(degToRad));
+        lat = _mm_min_pd(_mm_max_pd(lat, minLat), maxLat);
+        const __m128d s = sinPd(lat);
+        const __m128d ratio = _mm_div_pd(_mm_add_pd(one, s), _mm_sub_pd(one, s));
+        const __m128d my = _mm_sub_pd(half, _mm_mul_pd(logPd(ratio), _mm_set1_pd(1.0 / (4.0 * M_PI))));
+        const __m128d mx = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(longitudes + i), _mm_set1_pd(1.0 / 360.0)), half);
+        _mm_storeu_pd(x + i, mx);
+        _mm_storeu_pd(y + i, my);
+    }
+#endif
+    for (; i < count; ++i)
+        projectScalar(latitudes[i], longitudes[i], x[i], y[i]);
+}
+
+ElevationQuery ElevationQuery::fromPoints(const ElevationPoints &points, quint8 zoom)
+{
+    ElevationQuery res;
+    const size_t count = std::min(points.latitudes.size(), points.longitudes.size());
+    if (!count)
+        return res;
+    std::vector<double> x(count), y(count);
+    projectToMercator(points.latitudes.data(), points.longitudes.data(), count, x.data(), y.data());
+
+    const double side = double(quint64(1) << zoom);
+    const quint64 maxTile = (quint64(1) << zoom) - 1;
+    std::shared_ptr<ElevationSamples> *last = nullptr;
+    TileKey lastKey(std::numeric_limits<quint64>::max(), 0, zoom);
+    for (size_t i = 0; i < count; ++i) {
+        // NaN or off-map longitudes are left out, and stay NaN in the result
+        if (!(x[i] >= 0.0 && x[i] <= 1.0 && y[i] >= 0.0 && y[i] <= 1.0))
+            continue;
+        const double gx = x[i] * side;
+        const double gy = y[i] * side;
+        const quint64 tx = std::min(quint64(gx), maxTile);
+        const quint64 ty = std::min(quint64(gy), maxTile);
+        const TileKey k(tx, ty, zoom);
+        // Tracks and asset lists are spatially coherent: skip the lookup for runs in one tile
+        if (!last || !(k == lastKey)) {
+            last = &res.tiles[k];
+            if (!*last)
+                *last = std::make_shared<ElevationSamples>();
+            lastKey = k;
+        }
+        ElevationSamples &s = **last;
+        s.indices.push_back(quint32(i));
+        s.u.push_back(float(gx - double(tx)));
+        s.v.push_back(float(gy - double(ty)));
+    }
+    res.numPoints = count;
+    return res;
+}
+
+std::shared_ptr<ElevationBatch> sampleElevations(const QImage &dem, const ElevationSamples &samples)
+{
+    auto res = std::make_shared<ElevationBatch>();
+    if (dem.isNull())
+        return res;
+    const QImage img = (dem.format() == QImage::Format_RGB32 || dem.format() == QImage::Format_ARGB32)
+            ? dem
+            : dem.convertToFormat(QImage::Format_RGB32);
+    const int w = img.width();
+    const int h = img.height();
+    const size_t count = samples.indices.size();
+    res->indices = samples.indices;
+    res->elevations.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        // Texel centers at half integers, clamped at the tile edges
+        const float px = qBound(0.f, samples.u[i] * w - .5f, float(w - 1));
+        const float py = qBound(0.f, samples.v[i] * h - .5f, float(h - 1));
+        const int x0 = int(px);
+        const int y0 = int(py);
+        const int x1 = std::min(x0 + 1, w - 1);
+        const int y1 = std::min(y0 + 1, h - 1);
+        const float fx = px - x0;
+        const float fy = py - y0;
+        const QRgb *r0 = reinterpret_cast<const QRgb *>(img.constScanLine(y0));
+        const QRgb *r1 = reinterpret_cast<const QRgb *>(img.constScanLine(y1));
+        const float top = terrariumElevation(r0[x0]) * (1.f - fx) + terrariumElevation(r0[x1]) * fx;
+        const float bottom = terrariumElevation(r1[x0]) * (1.f - fx) + terrariumElevation(r1[x1]) * fx;
+        res->elevations[i] = top * (1.f - fy) + bottom * fy;
+    }
+    return res;
+}
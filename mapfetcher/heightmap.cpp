@@ -0,0 +1,651 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher.h"
+#include "utils_p.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+// Per destination sample: the source range it reads, and its normalized weights
+struct ResampleTable {
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights; // taps floats per destination sample
+    int taps{0};
+};
+
+// Keys cubic, a = -0.5 (Catmull-Rom)
+float cubicWeight(float x) {
+    x = std::abs(x);
+    if (x < 1.f)
+        return (1.5f * x - 2.5f) * x * x + 1.f;
+    if (x < 2.f)
+        return ((-.5f * x + 2.5f) * x - 4.f) * x + 2.f;
+    return 0.f;
+}
+
+ResampleTable resampleTable(int srcSize, int dstSize, Heightmap::Filter filter) {
+    ResampleTable t;
+    const float scale = srcSize / float(dstSize);
+    const float stretch = std::max(scale, 1.f); // widen the kernel when minifying
+    const float support = (filter == Heightmap::Filter::Bicubic) ? 2.f * stretch : .5f * stretch;
+    t.taps = int(std::ceil(2.f * support)) + 2;
+    t.first.resize(dstSize);
+    t.count.resize(dstSize);
+    t.weights.assign(size_t(dstSize) * t.taps, 0.f);
+
+    std::vector<float> w(t.taps);
+    for (int i = 0; i < dstSize; ++i) {
+        const float center = (i + .5f) * scale;
+        const int lo = int(std::floor(center - support));
+        const int hi = int(std::ceil(center + support));
+        const int first = qBound(0, lo, srcSize - 1);
+        std::fill(w.begin(), w.end(), 0.f);
+        float sum = 0.f;
+        for (int j = lo; j <= hi; ++j) {
+            const float wj = (filter == Heightmap::Filter::Bicubic)
+                    ? cubicWeight((j + .5f - center) / stretch)
+                    : std::max(0.f, std::min(j + 1.f, center + support) - std::max(float(j), center - support));
+            if (wj == 0.f)
+                continue;
+            w[qBound(0, j, srcSize - 1) - first] += wj; // clamp to edge
+            sum += wj;
+        }
+        int begin = 0;
+        int end = qBound(0, hi, srcSize - 1) - first + 1;
+        while (begin < end - 1 && w[begin] == 0.f)
+            ++begin;
+        while (end > begin + 1 && w[end - 1] == 0.f)
+            --end;
+        t.first[i] = first + begin;
+        t.count[i] = end - begin;
+        float *dst = &t.weights[size_t(i) * t.taps];
+        for (int k = begin; k < end; ++k)
+            dst[k - begin] = (sum != 0.f) ? w[k] / sum : 1.f / (end - begin);
+    }
+    return t;
+}
+
+// dst[x] += src[x] * w
+void accumulate(float *dst, const float *src, float w, int n) {
+    int x = 0;
+#if defined(__SSE2__)
+    const __m128 vw = _mm_set1_ps(w);
+    for (; x + 4 <= n; x += 4)
+        _mm_storeu_ps(dst + x, _mm_add_ps(_mm_loadu_ps(dst + x),
+                                          _mm_mul_ps(_mm_loadu_ps(src + x), vw)));
+#endif
+    for (; x < n; ++x)
+        dst[x] += src[x] * w;
+}
+
+void halveRow(const float *src, float *dst, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 half = _mm_set1_ps(.5f);
+    for (; i + 4 <= n; i += 4) {
+        const __m128 a = _mm_loadu_ps(src + 2 * i);
+        const __m128 b = _mm_loadu_ps(src + 2 * i + 4);
+        const __m128 even = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+        const __m128 odd = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_add_ps(even, odd), half));
+    }
+#endif
+    for (; i < n; ++i)
+        dst[i] = (src[2 * i] + src[2 * i + 1]) * .5f;
+}
+
+void resample1D(const float *src, int srcStep, float *dst, int dstStep, const ResampleTable &t) {
+    for (size_t i = 0; i < t.first.size(); ++i) {
+        const float *s = src + t.first[i] * srcStep;
+        const float *w = &t.weights[i * t.taps];
+        float acc = 0.f;
+        for (int k = 0; k < t.count[i]; ++k, s += srcStep)
+            acc += *s * w[k];
+        dst[i * dstStep] = acc;
+    }
+}
+
+// Vertical pass first: it vectorizes along rows, and shrinks what the horizontal pass reads
+void resample2D(const float *src, int srcStride, int srcWidth,
+                float *dst, int dstStride,
+                const ResampleTable &tx, const ResampleTable &ty, bool halveX) {
+    std::vector<float> row(srcWidth);
+    const int dstWidth = int(tx.first.size());
+    for (size_t y = 0; y < ty.first.size(); ++y) {
+        const float *w = &ty.weights[y * ty.taps];
+        const float *s = src + size_t(ty.first[y]) * srcStride;
+        std::fill(row.begin(), row.end(), 0.f);
+        for (int k = 0; k < ty.count[y]; ++k, s += srcStride)
+            accumulate(row.data(), s, w[k], srcWidth);
+        if (halveX)
+            halveRow(row.data(), dst + y * dstStride, dstWidth);
+        else
+            resample1D(row.data(), 1, dst + y * dstStride, 1, tx);
+    }
+}
+
+Heightmap resampled(const Heightmap &h, QSize size, Heightmap::Filter filter) {
+    Heightmap res;
+    const int border = (h.m_hasBorders) ? 1 : 0;
+    const QSize srcInner = h.m_size - QSize(2 * border, 2 * border);
+    const QSize dstInner = size - QSize(2 * border, 2 * border);
+    if (srcInner.isEmpty() || dstInner.isEmpty()) {
+        qWarning() << "Requested resampling size "<<size<<" not supported for "<<h.m_size;
+        return res;
+    }
+
+    const ResampleTable tx = resampleTable(srcInner.width(), dstInner.width(), filter);
+    const ResampleTable ty = resampleTable(srcInner.height(), dstInner.height(), filter);
+    res.m_hasBorders = h.m_hasBorders;
+    res.m_borderNeighbors = h.m_borderNeighbors;
+    res.setSize(size);
+
+    const int srcStride = h.m_size.width();
+    const int dstStride = size.width();
+    const float *src = h.elevations.data();
+    float *dst = res.elevations.data();
+    resample2D(src + border * srcStride + border, srcStride, srcInner.width(),
+               dst + border * dstStride + border, dstStride,
+               tx, ty,
+               filter == Heightmap::Filter::Box && srcInner.width() == 2 * dstInner.width());
+
+    if (border) {
+        // Borders hold the values shared with the neighbors: resample them along their length only
+        const int srcLast = h.m_size.height() - 1;
+        const int dstLast = size.height() - 1;
+        resample1D(src + 1, 1, dst + 1, 1, tx);
+        resample1D(src + srcLast * srcStride + 1, 1, dst + dstLast * dstStride + 1, 1, tx);
+        resample1D(src + srcStride, srcStride, dst + dstStride, dstStride, ty);
+        resample1D(src + 2 * srcStride - 1, srcStride, dst + 2 * dstStride - 1, dstStride, ty);
+        dst[0] = src[0];
+        dst[dstStride - 1] = src[srcStride - 1];
+        dst[dstLast * dstStride] = src[srcLast * srcStride];
+        dst[dstLast * dstStride + dstStride - 1] = src[srcLast * srcStride + srcStride - 1];
+    }
+    res.updateMinMax();
+    return res;
+}
+
+void mergeMinMax(QPair<float, float> &dst, const QPair<float, float> &src) {
+    dst.first = std::min(dst.first, src.first);
+    dst.second = std::max(dst.second, src.second);
+}
+
+void queryMinMax(const Heightmap &h,
+                 const Heightmap::MinMaxPyramid &p,
+                 int level, int bx, int by,
+                 const QRect &rect,
+                 QPair<float, float> &res) {
+    const int span = Heightmap::MinMaxPyramid::leafSize << level;
+    const QRect node = QRect(bx * span, by * span, span, span) & QRect(QPoint(0, 0), h.m_size);
+    if (!node.intersects(rect))
+        return;
+    if (rect.contains(node)) {
+        mergeMinMax(res, p.levels[level][by * p.sizes[level].width() + bx]);
+        return;
+    }
+    if (!level) {
+        const QRect r = node & rect;
+        for (int y = r.top(); y <= r.bottom(); ++y) {
+            for (int x = r.left(); x <= r.right(); ++x) {
+                const float e = h.elevation(x, y);
+                res.first = std::min(res.first, e);
+                res.second = std::max(res.second, e);
+            }
+        }
+        return;
+    }
+    const QSize &children = p.sizes[level - 1];
+    for (int cy = 2 * by; cy < std::min(2 * by + 2, children.height()); ++cy)
+        for (int cx = 2 * bx; cx < std::min(2 * bx + 2, children.width()); ++cx)
+            queryMinMax(h, p, level - 1, cx, cy, rect, res);
+}
+} // namespace
+
+int Heightmap::neighborIndex(Heightmap::Neighbor n) {
+    return qCountTrailingZeroBits(quint32(n));
+}
+
+namespace {
+Heightmap decodeInterior(const QImage &dem, int border) {
+    Heightmap h;
+    h.setSize(dem.size() + QSize(2 * border, 2 * border));
+    float min_ = std::numeric_limits<float>::max();
+    float max_ = std::numeric_limits<float>::lowest();
+    for (int y = 0; y < dem.height(); ++y) {
+        for (int x = 0; x < dem.width(); ++x) {
+            const float elevationMeters = terrariumElevation(dem.pixel(x, y));
+            h.setElevation(x + border, y + border, elevationMeters);
+            max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
+        }
+    }
+    h.m_minMax = QPair<float, float>(min_, max_);
+    return h;
+}
+} // namespace
+
+std::shared_ptr<const DEMTileEdges> DEMTileEdges::fromImage(const QImage &dem) {
+    auto res = std::make_shared<DEMTileEdges>();
+    if (dem.isNull())
+        return res;
+    const int w = dem.width();
+    const int h = dem.height();
+    res->top.resize(w);
+    res->bottom.resize(w);
+    res->left.resize(h);
+    res->right.resize(h);
+    for (int x = 0; x < w; ++x) {
+        res->top[x] = terrariumElevation(dem.pixel(x, 0));
+        res->bottom[x] = terrariumElevation(dem.pixel(x, h - 1));
+    }
+    for (int y = 0; y < h; ++y) {
+        res->left[y] = terrariumElevation(dem.pixel(0, y));
+        res->right[y] = terrariumElevation(dem.pixel(w - 1, y));
+    }
+    res->topLeft = res->top.front();
+    res->topRight = res->top.back();
+    res->bottomLeft = res->bottom.front();
+    res->bottomRight = res->bottom.back();
+    return res;
+}
+
+std::shared_ptr<const DEMTileEdges> DEMTileEdges::fromHeightmap(const Heightmap &h) {
+    auto res = std::make_shared<DEMTileEdges>();
+    const int border = (h.m_hasBorders) ? 1 : 0;
+    const int w = h.m_size.width() - 2 * border;
+    const int ht = h.m_size.height() - 2 * border;
+    if (w <= 0 || ht <= 0)
+        return res;
+    res->top.resize(w);
+    res->bottom.resize(w);
+    res->left.resize(ht);
+    res->right.resize(ht);
+    for (int x = 0; x < w; ++x) {
+        res->top[x] = h.elevation(x + border, border);
+        res->bottom[x] = h.elevation(x + border, ht - 1 + border);
+    }
+    for (int y = 0; y < ht; ++y) {
+        res->left[y] = h.elevation(border, y + border);
+        res->right[y] = h.elevation(w - 1 + border, y + border);
+    }
+    res->topLeft = res->top.front();
+    res->topRight = res->top.back();
+    res->bottomLeft = res->bottom.front();
+    res->bottomRight = res->bottom.back();
+    return res;
+}
+
+Heightmap Heightmap::fromImage(const QImage &dem) {
+    return decodeInterior(dem, 0);
+}
+
+Heightmap Heightmap::fromImage(const QImage &dem, const Heightmap::Borders &borders) {
+    Heightmap h = decodeInterior(dem, 1);
+    float min_ = h.m_minMax.first;
+    float max_ = h.m_minMax.second;
+    const int w = h.m_size.width();
+    const int ht = h.m_size.height();
+    auto border = [&borders](Neighbor n) {
+        return borders[neighborIndex(n)].get();
+    };
+    auto blend = [&h, &min_, &max_](int x, int y, float elevationMeters) {
+        h.setElevation(x, y, elevationMeters);
+        max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
+    };
+    // Strips shorter than this tile (e.g. a neighbor that failed to decode) are ignored
+    auto usable = [](const std::vector<float> &strip, int size) {
+        return int(strip.size()) >= size;
+    };
+
+    // Edges first: the corners blend them
+    if (const DEMTileEdges *other = border(Left)) {
+        if (usable(other->right, ht - 2)) {
+            for (int y = 1; y < ht - 1; ++y)
+                blend(0, y, (h.elevation(1, y) + other->right[y - 1]) * .5f);
+            h.m_borderNeighbors |= Left;
+        }
+    }
+    if (const DEMTileEdges *other = border(Right)) {
+        if (usable(other->left, ht - 2)) {
+            for (int y = 1; y < ht - 1; ++y)
+                blend(w - 1, y, (h.elevation(w - 2, y) + other->left[y - 1]) * .5f);
+            h.m_borderNeighbors |= Right;
+        }
+    }
+    if (const DEMTileEdges *other = border(Top)) {
+        if (usable(other->bottom, w - 2)) {
+            for (int x = 1; x < w - 1; ++x)
+                blend(x, 0, (h.elevation(x, 1) + other->bottom[x - 1]) * .5f);
+            h.m_borderNeighbors |= Top;
+        }
+    }
+    if (const DEMTileEdges *other = border(Bottom)) {
+        if (usable(other->top, w - 2)) {
+            for (int x = 1; x < w - 1; ++x)
+                blend(x, ht - 1, (h.elevation(x, ht - 2) + other->top[x - 1]) * .5f);
+            h.m_borderNeighbors |= Bottom;
+        }
+    }
+
+    // Mean of the 4 pixels around the corner point: this tile's own corner, and the
+    // facing corners of the 3 neighbors. Summed in sorted order, so that all 4 tiles
+    // sharing the point get the bit identical value (meshes rely on it)
+    auto corner = [&](Neighbor c, Neighbor vertical, Neighbor horizontal, int x, int y, int dx, int dy,
+                      float DEMTileEdges::*diagonal,
+                      float DEMTileEdges::*verticalCorner,
+                      float DEMTileEdges::*horizontalCorner) {
+        if (!h.m_borderNeighbors.testFlag(vertical) || !h.m_borderNeighbors.testFlag(horizontal)
+                || !border(c))
+            return;
+        std::array<float, 4> values{ h.elevation(x + dx, y + dy),
+                                     border(c)->*diagonal,
+                                     border(vertical)->*verticalCorner,
+                                     border(horizontal)->*horizontalCorner };
+        std::sort(values.begin(), values.end());
+        blend(x, y, ((values[0] + values[1]) + (values[2] + values[3])) * .25f);
+        h.m_borderNeighbors |= c;
+    };
+    corner(TopLeft, Top, Left, 0, 0, 1, 1,
+           &DEMTileEdges::bottomRight, &DEMTileEdges::bottomLeft, &DEMTileEdges::topRight);
+    corner(TopRight, Top, Right, w - 1, 0, -1, 1,
+           &DEMTileEdges::bottomLeft, &DEMTileEdges::bottomRight, &DEMTileEdges::topLeft);
+    corner(BottomLeft, Bottom, Left, 0, ht - 1, 1, -1,
+           &DEMTileEdges::topRight, &DEMTileEdges::topLeft, &DEMTileEdges::bottomRight);
+    corner(BottomRight, Bottom, Right, w - 1, ht - 1, -1, -1,
+           &DEMTileEdges::topLeft, &DEMTileEdges::topRight, &DEMTileEdges::bottomLeft);
+
+    h.m_minMax = QPair<float, float>(min_, max_);
+    h.m_hasBorders = true;
+    return h;
+}
+
+void Heightmap::rescale(QSize size, Filter filter) {
+    if (size == m_size)
+        return;
+    const bool wasQuantized = isQuantized();
+    const bool hadPyramid = bool(m_minMaxPyramid);
+    dequantize();
+    Heightmap res = resampled(*this, size, filter);
+    if (res.m_size == size)
+        *this = std::move(res);
+    if (wasQuantized)
+        quantize();
+    if (hadPyramid && !m_minMaxPyramid)
+        buildMinMaxPyramid();
+}
+
+void Heightmap::rescale(int size, Filter filter) {
+    int newWidth, newHeight;
+    if (m_size.width() >= m_size.height()) {
+        newWidth = size;
+        newHeight = size * m_size.height() / m_size.width();
+    } else {
+        newHeight = size;
+        newWidth = size * m_size.width() / m_size.height();
+    }
+    rescale(QSize(newWidth, newHeight), filter);
+}
+
+std::vector<Heightmap> Heightmap::mipPyramid(Filter filter) const
+{
+    std::vector<Heightmap> res;
+    const QSize border = (m_hasBorders) ? QSize(2, 2) : QSize(0, 0);
+    QSize inner = m_size - border;
+    if (inner.isEmpty())
+        return res;
+    Heightmap dequantized;
+    if (isQuantized()) {
+        dequantized = *this;
+        dequantized.dequantize();
+    }
+    // every level is filtered from the previous one, so the whole chain costs ~4/3 of a halving
+    const Heightmap *previous = (isQuantized()) ? &dequantized : this;
+    while (inner.width() > 1 || inner.height() > 1) {
+        inner = QSize(std::max(1, inner.width() / 2), std::max(1, inner.height() / 2));
+        res.push_back(resampled(*previous, inner + border, filter));
+        previous = &res.back();
+    }
+    if (isQuantized()) {
+        for (auto &level: res)
+            level.quantize();
+    }
+    return res;
+}
+
+void Heightmap::setSize(QSize size, float initialValue)
+{
+    dequantize();
+    m_minMaxPyramid.reset();
+    m_size = size;
+    elevations.resize(m_size.width() * m_size.height(), initialValue);
+}
+
+QSize Heightmap::size() const {return m_size;}
+
+void Heightmap::printMinMax() const
+{
+    float minValue = qInf();
+    float maxValue = -qInf();
+    for (int y = 0; y < m_size.height(); ++y) {
+        for (int x = 0; x < m_size.width(); ++x) {
+            minValue = qMin(elevation(x, y), minValue);
+            maxValue = qMax(elevation(x, y), maxValue);
+        }
+    }
+    qDebug() << "Heightmap min "<<minValue<<" - max "<<maxValue;
+}
+
+float Heightmap::elevation(int x, int y) const
+{
+    if (!quantized.empty())
+        return m_quantizationOffset + quantized[y*m_size.width()+x] * m_quantizationScale;
+    return elevations[y*m_size.width()+x];
+}
+
+void Heightmap::setElevation(int x, int y, float e)
+{
+    if (m_minMaxPyramid)
+        m_minMaxPyramid.reset();
+    if (!quantized.empty()) {
+        const float q = std::nearbyint((e - m_quantizationOffset) / m_quantizationScale);
+        quantized[y*m_size.width()+x] = quint16(qBound(0.f, q, 65535.f));
+        return;
+    }
+    elevations[y*m_size.width()+x] = e;
+}
+
+QPair<float, float> Heightmap::minMax() const
+{
+    return m_minMax;
+}
+
+void Heightmap::updateMinMax()
+{
+    if (!quantized.empty()) {
+        const auto mm = std::minmax_element(quantized.begin(), quantized.end());
+        m_minMax = QPair<float, float>(m_quantizationOffset + *mm.first * m_quantizationScale,
+                                       m_quantizationOffset + *mm.second * m_quantizationScale);
+        return;
+    }
+    if (elevations.empty())
+        return;
+    const float *e = elevations.data();
+    const size_t n = elevations.size();
+    size_t i = 0;
+    float minValue = e[0];
+    float maxValue = e[0];
+#if defined(__SSE2__)
+    if (n >= 4) {
+        __m128 vmin = _mm_loadu_ps(e);
+        __m128 vmax = vmin;
+        for (i = 4; i + 4 <= n; i += 4) {
+            const __m128 v = _mm_loadu_ps(e + i);
+            vmin = _mm_min_ps(vmin, v);
+            vmax = _mm_max_ps(vmax, v);
+        }
+        float lanes[4];
+        _mm_storeu_ps(lanes, vmin);
+        minValue = std::min(std::min(lanes[0], lanes[1]), std::min(lanes[2], lanes[3]));
+        _mm_storeu_ps(lanes, vmax);
+        maxValue = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+    }
+#endif
+    for (; i < n; ++i) {
+        minValue = std::min(minValue, e[i]);
+        maxValue = std::max(maxValue, e[i]);
+    }
+    m_minMax = QPair<float, float>(minValue, maxValue);
+}
+
+void Heightmap::buildMinMaxPyramid()
+{
+    m_minMaxPyramid.reset();
+    if (m_size.isEmpty())
+        return;
+    constexpr int leafSize = MinMaxPyramid::leafSize;
+    auto p = std::make_shared<MinMaxPyramid>();
+    QSize size((m_size.width() + leafSize - 1) / leafSize,
+               (m_size.height() + leafSize - 1) / leafSize);
+    const QPair<float, float> empty(std::numeric_limits<float>::max(),
+                                    std::numeric_limits<float>::lowest());
+
+    p->sizes.push_back(size);
+    p->levels.emplace_back(size_t(size.width()) * size.height(), empty);
+    auto &leaves = p->levels.back();
+    std::vector<float> row;
+    for (int y = 0; y < m_size.height(); ++y) {
+        const float *line;
+        if (isQuantized()) {
+            row.resize(m_size.width());
+            for (int x = 0; x < m_size.width(); ++x)
+                row[x] = elevation(x, y);
+            line = row.data();
+        } else {
+            line = elevations.data() + size_t(y) * m_size.width();
+        }
+        auto *blocks = &leaves[size_t(y / leafSize) * size.width()];
+        for (int bx = 0; bx < size.width(); ++bx) {
+            const int end = std::min(m_size.width(), (bx + 1) * leafSize);
+            const auto mm = std::minmax_element(line + bx * leafSize, line + end);
+            mergeMinMax(blocks[bx], {*mm.first, *mm.second});
+        }
+    }
+
+    while (size.width() > 1 || size.height() > 1) {
+        const QSize parentSize((size.width() + 1) / 2, (size.height() + 1) / 2);
+        std::vector<QPair<float, float>> parents(size_t(parentSize.width()) * parentSize.height(), empty);
+        const auto &children = p->levels.back();
+        for (int y = 0; y < size.height(); ++y)
+            for (int x = 0; x < size.width(); ++x)
+                mergeMinMax(parents[(y / 2) * parentSize.width() + x / 2], children[y * size.width() + x]);
+        size = parentSize;
+        p->sizes.push_back(size);
+        p->levels.push_back(std::move(parents));
+    }
+    m_minMaxPyramid = std::move(p);
+}
+
+QPair<float, float> Heightmap::minMax(const QRect &rect) const
+{
+    QPair<float, float> res(std::numeric_limits<float>::max(),
+                            std::numeric_limits<float>::lowest());
+    const QRect r = rect & QRect(QPoint(0, 0), m_size);
+    if (r.isEmpty())
+        return res;
+    if (!m_minMaxPyramid) {
+        for (int y = r.top(); y <= r.bottom(); ++y) {
+            for (int x = r.left(); x <= r.right(); ++x) {
+                const float e = elevation(x, y);
+                res.first = std::min(res.first, e);
+                res.second = std::max(res.second, e);
+            }
+        }
+        return res;
+    }
+    queryMinMax(*this, *m_minMaxPyramid, int(m_minMaxPyramid->levels.size()) - 1, 0, 0, r, res);
+    return res;
+}
+
+void Heightmap::quantize()
+{
+    if (!quantized.empty() || elevations.empty())
+        return;
+    updateMinMax();
+    const float range = m_minMax.second - m_minMax.first;
+    m_quantizationOffset = m_minMax.first;
+    m_quantizationScale = (range > 0.f) ? range / 65535.f : 1.f;
+    const float invScale = 1.f / m_quantizationScale;
+
+    quantized.resize(elevations.size());
+    const float *src = elevations.data();
+    quint16 *dst = quantized.data();
+    const size_t n = elevations.size();
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128 offset = _mm_set1_ps(m_quantizationOffset);
+    const __m128 inv = _mm_set1_ps(invScale);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16(short(0x8000));
+    for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(src + i), offset), inv);
+        // SSE2 only packs signed: shift to int16 range, saturate, shift back
+        __m128i q = _mm_sub_epi32(_mm_cvtps_epi32(v), bias);
+        q = _mm_xor_si128(_mm_packs_epi32(q, q), flip);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(dst + i), q);
+    }
+#endif
+    // half to even, like _mm_cvtps_epi32 in the default rounding mode
+    for (; i < n; ++i)
+        dst[i] = quint16(qBound(0.f, std::nearbyint((src[i] - m_quantizationOffset) * invScale), 65535.f));
+    decltype(elevations)().swap(elevations);
+    // bounds must enclose the dequantized samples, not the original ones
+    const auto mm = std::minmax_element(quantized.begin(), quantized.end());
+    m_minMax = qMakePair(m_quantizationOffset + *mm.first * m_quantizationScale,
+                         m_quantizationOffset + *mm.second * m_quantizationScale);
+    if (m_minMaxPyramid)
+        buildMinMaxPyramid();
+}
+
+void Heightmap::dequantize()
+{
+    if (quantized.empty())
+        return;
+    elevations.resize(quantized.size());
+    for (size_t i = 0; i < quantized.size(); ++i)
+        elevations[i] = m_quantizationOffset + quantized[i] * m_quantizationScale;
+    decltype(quantized)().swap(quantized);
+    m_quantizationOffset = 0.f;
+    m_quantizationScale = 1.f;
+}
+
+bool Heightmap::isQuantized() const
+{
+    return !quantized.empty();
+}
@@ -0,0 +1,412 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "heightmapstore_p.h"
+#include <QDebug>
+#include <QDir>
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <QSqlError>
+#include <QStandardPaths>
+#include <cstring>
+
+namespace {
+constexpr quint32 slotMagic = 0x48534d31; // "HSM1"
+constexpr qint64 growthSlots = 64; // files grow, and get remapped, this many slots at a time
+
+enum SlotFlags : quint32 {
+    Borders = 1 << 0,
+    Quantized = 1 << 1
+};
+
+struct SlotHeader {
+    quint32 magic;
+    quint32 flags;
+    quint32 width;
+    quint32 height;
+    quint32 neighbors;
+    quint32 z;
+    quint64 x;
+    quint64 y;
+    float minElevation;
+    float maxElevation;
+    float quantizationOffset;
+    float quantizationScale;
+    quint8 padding[8];
+};
+static_assert(sizeof(SlotHeader) == 64, "SlotHeader must stay 64 bytes");
+
+QString slotFileName(const QSize &size, bool quantized) {
+    return QStringLiteral("heightmaps_%1x%2_%3.bin").arg(size.width())
+                                                    .arg(size.height())
+                                                    .arg((quantized) ? QStringLiteral("u16")
+                                                                     : QStringLiteral("f32"));
+}
+
+bool parseSlotFileName(const QString &name, QSize &size, bool &quantized) {
+    static const QRegularExpression re(QStringLiteral("^heightmaps_(\\d+)x(\\d+)_(f32|u16)\\.bin$"));
+    const QRegularExpressionMatch m = re.match(name);
+    if (!m.hasMatch())
+        return false;
+    size = QSize(m.captured(1).toInt(), m.captured(2).toInt());
+    quantized = m.captured(3) == QLatin1String("u16");
+    return !size.isEmpty();
+}
+
+qint64 slotSize(const QSize &size, bool quantized) {
+    return qint64(sizeof(SlotHeader))
+            + qint64(size.width()) * size.height() * ((quantized) ? sizeof(quint16) : sizeof(float));
+}
+
+QString randomConnectionName() {
+    return QStringLiteral("HeightmapStore%1").arg(QRandomGenerator::global()->generate64());
+}
+} // namespace
+
+HeightmapStore::HeightmapStore()
+    : m_directory(storePath())
+{
+    if (m_directory.isEmpty() || !QDir::root().mkpath(m_directory)) {
+        qWarning() << "HeightmapStore: cannot create " << m_directory;
+        return;
+    }
+
+    m_index = QSqlDatabase::addDatabase("QSQLITE", randomConnectionName());
+    m_index.setDatabaseName(QDir(m_directory).filePath(QStringLiteral("index.sqlite")));
+    if (!m_index.open()) {
+        qWarning("Impossible to create the SQLITE database for the heightmap store");
+        return;
+    }
+
+    static constexpr char schema[] = R"(
+    CREATE TABLE IF NOT EXISTS HeightmapTile (
+          baseURL TEXT
+        , x INTEGER
+        , y INTEGER
+        , z INTEGER
+        , borders INTEGER
+        , quantized INTEGER
+        , neighbors INTEGER
+        , file TEXT
+        , slot INTEGER
+        , PRIMARY KEY (baseURL, x, y, z, borders, quantized)
+    )
+    )";
+    QSqlQuery creation(m_index);
+    // Indexes predating the quantized column are dropped, their slots get overwritten
+    if (creation.exec(QStringLiteral("PRAGMA table_info(HeightmapTile)"))) {
+        bool columns = false, quantizedColumn = false;
+        while (creation.next()) {
+            columns = true;
+            quantizedColumn |= creation.value(1).toString() == QLatin1String("quantized");
+        }
+        creation.finish();
+        if (columns && !quantizedColumn && !creation.exec(QStringLiteral("DROP TABLE HeightmapTile")))
+            qWarning() << "Failed to drop HeightmapTile table" << creation.lastError() << __FILE__ << __LINE__;
+    }
+    if (!creation.exec(QLatin1String(schema))) {
+        qWarning() << "Failed to create HeightmapTile table" << creation.lastError() << __FILE__ << __LINE__;
+        return;
+    }
+
+    m_queryFetch = QSqlQuery(m_index);
+    m_queryFetch.setForwardOnly(true);
+    bool res = m_queryFetch.prepare(QStringLiteral(
+        "SELECT neighbors, file, slot FROM HeightmapTile WHERE baseURL = :baseURL "
+        "AND x = :x AND y = :y AND z = :z AND borders = :borders AND quantized = :quantized"));
+    if (!res)
+        qWarning() << "Failed to prepare m_queryFetch" << m_queryFetch.lastError() << __FILE__ << __LINE__;
+
+    m_queryInsert = QSqlQuery(m_index);
+    m_queryInsert.setForwardOnly(true);
+    res = m_queryInsert.prepare(QStringLiteral(
+        "INSERT OR REPLACE INTO HeightmapTile(baseURL, x, y, z, borders, quantized, neighbors, file, slot) "
+        "VALUES (:baseURL, :x, :y, :z, :borders, :quantized, :neighbors, :file, :slot)"));
+    if (!res)
+        qWarning() << "Failed to prepare m_queryInsert" << m_queryInsert.lastError() << __FILE__ << __LINE__;
+
+    m_queryNextSlot = QSqlQuery(m_index);
+    m_queryNextSlot.setForwardOnly(true);
+    res = m_queryNextSlot.prepare(QStringLiteral(
+        "SELECT COALESCE(MAX(slot) + 1, 0) FROM HeightmapTile WHERE file = :file"));
+    if (!res)
+        qWarning() << "Failed to prepare m_queryNextSlot" << m_queryNextSlot.lastError() << __FILE__ << __LINE__;
+
+    // INSERT OR REPLACE assigns a new ROWID, so the lowest one is the least recently written
+    m_queryOldestSlot = QSqlQuery(m_index);
+    m_queryOldestSlot.setForwardOnly(true);
+    res = m_queryOldestSlot.prepare(QStringLiteral(
+        "SELECT ROWID, slot FROM HeightmapTile WHERE file = :file ORDER BY ROWID ASC LIMIT 1"));
+    if (!res)
+        qWarning() << "Failed to prepare m_queryOldestSlot" << m_queryOldestSlot.lastError() << __FILE__ << __LINE__;
+
+    m_queryDeleteSlot = QSqlQuery(m_index);
+    m_queryDeleteSlot.setForwardOnly(true);
+    res = m_queryDeleteSlot.prepare(QStringLiteral(
+        "DELETE FROM HeightmapTile WHERE ROWID = :rowid"));
+    if (!res)
+        qWarning() << "Failed to prepare m_queryDeleteSlot" << m_queryDeleteSlot.lastError() << __FILE__ << __LINE__;
+
+    m_initialized = true;
+}
+
+HeightmapStore::~HeightmapStore()
+{
+    for (auto &f: m_files) {
+        if (f.second.data)
+            f.second.file->unmap(f.second.data);
+    }
+}
+
+HeightmapStore::SlotFile *HeightmapStore::slotFile(const QString &name, qint64 slotSize, qint64 minSlots)
+{
+    SlotFile &f = m_files[name];
+    if (!f.file) {
+        f.file.reset(new QFile(QDir(m_directory).filePath(name)));
+        if (!f.file->open(QIODevice::ReadWrite)) {
+            qWarning() << "HeightmapStore: cannot open " << f.file->fileName();
+            m_files.erase(name);
+            return nullptr;
+        }
+        f.slotSize = slotSize;
+    }
+    const qint64 slots = f.file->size() / slotSize;
+    if (f.data && slots >= minSlots && f.slots == slots)
+        return &f;
+
+    if (f.data) {
+        f.file->unmap(f.data);
+        f.data = nullptr;
+    }
+    qint64 mapped = slots;
+    if (slots < minSlots) {
+        mapped = ((minSlots + growthSlots - 1) / growthSlots) * growthSlots;
+        if (!f.file->resize(mapped * slotSize)) {
+            qWarning() << "HeightmapStore: cannot grow " << f.file->fileName();
+            return nullptr;
+        }
+    }
+    if (!mapped)
+        return nullptr;
+    f.data = f.file->map(0, mapped * slotSize);
+    if (!f.data) {
+        qWarning() << "HeightmapStore: cannot map " << f.file->fileName() << f.file->errorString();
+        return nullptr;
+    }
+    f.slots = mapped;
+    return &f;
+}
+
+std::shared_ptr<Heightmap> HeightmapStore::heightmap(const QString &tileBaseURL,
+                                                     const TileKey &k,
+                                                     bool borders,
+                                                     bool quantized,
+                                                     Heightmap::Neighbors required)
+{
+    if (!m_initialized)
+        return nullptr;
+
+    m_queryFetch.bindValue(0, tileBaseURL);
+    m_queryFetch.bindValue(1, k.x);
+    m_queryFetch.bindValue(2, k.y);
+    m_queryFetch.bindValue(3, k.z);
+    m_queryFetch.bindValue(4, borders);
+    m_queryFetch.bindValue(5, quantized);
+    if (!m_queryFetch.exec()) {
+        qDebug() << m_queryFetch.lastError() << __FILE__ << __LINE__;
+        return nullptr;
+    }
+    if (!m_queryFetch.first()) {
+        m_queryFetch.finish();
+        return nullptr;
+    }
+    const Heightmap::Neighbors stored(QFlag(m_queryFetch.value(0).toInt()));
+    const QString name = m_queryFetch.value(1).toString();
+    const qint64 slot = m_queryFetch.value(2).toLongLong();
+    m_queryFetch.finish();
+    if ((stored & required) != required)
+        return nullptr; // stitched while some neighbors were missing
+
+    // Grid size and sample type are encoded in the file name
+    QSize size;
+    bool quantizedFile = false;
+    if (!parseSlotFileName(name, size, quantizedFile) || quantizedFile != quantized)
+        return nullptr;
+    SlotFile *f = slotFile(name, slotSize(size, quantized));
+    if (!f || slot >= f->slots)
+        return nullptr;
+
+    const uchar *data = f->data + slot * f->slotSize;
+    SlotHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != slotMagic || header.x != k.x || header.y != k.y || header.z != k.z
+            || header.width != quint32(size.width()) || header.height != quint32(size.height())
+            || bool(header.flags & Quantized) != quantized) {
+        qWarning() << "HeightmapStore: corrupted slot "<<slot<<" in "<<name;
+        return nullptr;
+    }
+
+    auto h = std::make_shared<Heightmap>();
+    h->m_size = size;
+    h->m_hasBorders = header.flags & Borders;
+    h->m_borderNeighbors = Heightmap::Neighbors(QFlag(int(header.neighbors)));
+    h->m_minMax = qMakePair(header.minElevation, header.maxElevation);
+    const size_t samples = size_t(size.width()) * size.height();
+    if (quantized) {
+        h->quantized.resize(samples);
+        memcpy(h->quantized.data(), data + sizeof(SlotHeader), samples * sizeof(quint16));
+        h->m_quantizationOffset = header.quantizationOffset;
+        h->m_quantizationScale = header.quantizationScale;
+    } else {
+        h->elevations.resize(samples);
+        memcpy(h->elevations.data(), data + sizeof(SlotHeader), samples * sizeof(float));
+    }
+    return h;
+}
+
+bool HeightmapStore::insert(const QString &tileBaseURL, const TileKey &k, const Heightmap &h)
+{
+    if (!m_initialized || h.m_size.isEmpty())
+        return false;
+    const bool quantized = h.isQuantized();
+    const QString name = slotFileName(h.m_size, quantized);
+    const qint64 size = slotSize(h.m_size, quantized);
+
+    // Another process sharing the store could pick the same slot, so the slot is
+    // chosen and the row written while holding the write lock
+    QSqlQuery transaction(m_index);
+    if (!transaction.exec(QStringLiteral("BEGIN IMMEDIATE"))) {
+        qWarning() << transaction.lastError() << __FILE__ << __LINE__;
+        return false;
+    }
+    bool committed = false;
+    auto end = [&]() {
+        if (!transaction.exec((committed) ? QStringLiteral("COMMIT") : QStringLiteral("ROLLBACK")))
+            qWarning() << transaction.lastError() << __FILE__ << __LINE__;
+        return committed;
+    };
+
+    // A replaced tile reuses its slot
+    qint64 slot = -1;
+    m_queryFetch.bindValue(0, tileBaseURL);
+    m_queryFetch.bindValue(1, k.x);
+    m_queryFetch.bindValue(2, k.y);
+    m_queryFetch.bindValue(3, k.z);
+    m_queryFetch.bindValue(4, h.m_hasBorders);
+    m_queryFetch.bindValue(5, quantized);
+    if (m_queryFetch.exec() && m_queryFetch.first() && m_queryFetch.value(1).toString() == name)
+        slot = m_queryFetch.value(2).toLongLong();
+    m_queryFetch.finish();
+
+    if (slot < 0) {
+        m_queryNextSlot.bindValue(0, name);
+        if (!m_queryNextSlot.exec() || !m_queryNextSlot.first()) {
+            qDebug() << m_queryNextSlot.lastError() << __FILE__ << __LINE__;
+            m_queryNextSlot.finish();
+            return end();
+        }
+        slot = m_queryNextSlot.value(0).toLongLong();
+        m_queryNextSlot.finish();
+
+        // Growing the file past the limit recycles its oldest slot instead
+        const quint64 maxSize = quint64(int(NetworkConfiguration::heightmapStoreMaxMB)) * 1024 * 1024;
+        const qint64 fileSize = QFileInfo(QDir(m_directory).filePath(name)).size();
+        if (maxSize && (slot + 1) * size > fileSize
+                && storeSize() + quint64(growthSlots * size) > maxSize) {
+            m_queryOldestSlot.bindValue(0, name);
+            if (m_queryOldestSlot.exec() && m_queryOldestSlot.first()) {
+                const qint64 rowid = m_queryOldestSlot.value(0).toLongLong();
+                slot = m_queryOldestSlot.value(1).toLongLong();
+                m_queryOldestSlot.finish();
+                m_queryDeleteSlot.bindValue(0, rowid);
+                if (!m_queryDeleteSlot.exec()) {
+                    qWarning() << m_queryDeleteSlot.lastError() << __FILE__ << __LINE__;
+                    m_queryDeleteSlot.finish();
+                    return end();
+                }
+                m_queryDeleteSlot.finish();
+            }
+            m_queryOldestSlot.finish();
+        }
+    }
+
+    m_queryInsert.bindValue(0, tileBaseURL);
+    m_queryInsert.bindValue(1, k.x);
+    m_queryInsert.bindValue(2, k.y);
+    m_queryInsert.bindValue(3, k.z);
+    m_queryInsert.bindValue(4, h.m_hasBorders);
+    m_queryInsert.bindValue(5, quantized);
+    m_queryInsert.bindValue(6, quint32(h.m_borderNeighbors));
+    m_queryInsert.bindValue(7, name);
+    m_queryInsert.bindValue(8, slot);
+    const bool res = m_queryInsert.exec();
+    if (!res)
+        qWarning() << m_queryInsert.lastError() << __FILE__ << __LINE__;
+    m_queryInsert.finish();
+    if (!res)
+        return end();
+
+    SlotFile *f = slotFile(name, size, slot + 1);
+    if (!f)
+        return end();
+
+    SlotHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = slotMagic;
+    header.flags = ((h.m_hasBorders) ? Borders : 0) | ((quantized) ? Quantized : 0);
+    header.width = quint32(h.m_size.width());
+    header.height = quint32(h.m_size.height());
+    header.neighbors = quint32(h.m_borderNeighbors);
+    header.x = k.x;
+    header.y = k.y;
+    header.z = k.z;
+    header.minElevation = h.m_minMax.first;
+    header.maxElevation = h.m_minMax.second;
+    header.quantizationOffset = h.m_quantizationOffset;
+    header.quantizationScale = h.m_quantizationScale;
+
+    uchar *data = f->data + slot * f->slotSize;
+    memcpy(data, &header, sizeof(header));
+    if (quantized)
+        memcpy(data + sizeof(SlotHeader), h.quantized.data(), h.quantized.size() * sizeof(quint16));
+    else
+        memcpy(data + sizeof(SlotHeader), h.elevations.data(), h.elevations.size() * sizeof(float));
+
+    committed = true;
+    return end();
+}
+
+QString HeightmapStore::storePath()
+{
+    return QStringLiteral("%1/heightmaps").arg(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
+}
+
+quint64 HeightmapStore::storeSize()
+{
+    quint64 res = 0;
+    QDirIterator it(storePath(), QDir::Files);
+    while (it.hasNext()) {
+        it.next();
+        res += it.fileInfo().size();
+    }
+    return res;
+}
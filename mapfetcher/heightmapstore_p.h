@@ -0,0 +1,86 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#ifndef HEIGHTMAPSTORE_P_H
+#define HEIGHTMAPSTORE_P_H
+
+#include "mapfetcher.h"
+
+#include <QFile>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <map>
+#include <memory>
+
+// Processed heightmap tiles (decoded, borders stitched, possibly quantized) kept
+// across runs, so that warm starts skip decoding altogether.
+// Grids live in fixed size slots of memory mapped files, one file per grid size
+// and sample type, indexed by TileKey in a small sqlite table.
+// Like CompoundTileCache, one instance per thread, to be used from the network thread only.
+// Other processes (e.g. viewer and downloader) may share the store: slots are allocated
+// within an immediate transaction, and recycled oldest first past heightmapStoreMaxMB.
+class HeightmapStore {
+public:
+    static HeightmapStore& instance()
+    {
+        static thread_local HeightmapStore instance;
+        return instance;
+    }
+
+    HeightmapStore(HeightmapStore const&) = delete;
+    void operator=(HeightmapStore const&) = delete;
+
+    // Null unless stored with borders stitched to at least the neighbors in required.
+    // Quantized and unquantized tiles are stored separately, never converted
+    std::shared_ptr<Heightmap> heightmap(const QString &tileBaseURL,
+                                         const TileKey &k,
+                                         bool borders,
+                                         bool quantized,
+                                         Heightmap::Neighbors required);
+    bool insert(const QString &tileBaseURL, const TileKey &k, const Heightmap &h);
+
+    bool initialized() const { return m_initialized; }
+    static QString storePath();
+    static quint64 storeSize();
+
+protected:
+    HeightmapStore();
+    ~HeightmapStore();
+
+    struct SlotFile {
+        std::unique_ptr<QFile> file;
+        uchar *data{nullptr};
+        qint64 slotSize{0};
+        qint64 slots{0}; // mapped
+    };
+    SlotFile *slotFile(const QString &name, qint64 slotSize, qint64 minSlots = 0);
+
+    QString m_directory;
+    QSqlDatabase m_index;
+    QSqlQuery m_queryFetch;
+    QSqlQuery m_queryInsert;
+    QSqlQuery m_queryNextSlot;
+    QSqlQuery m_queryOldestSlot;
+    QSqlQuery m_queryDeleteSlot;
+    std::map<QString, SlotFile> m_files;
+    bool m_initialized{false};
+};
+
+#endif
@@ -23,6 +23,7 @@
 #include "networksqlitecache_p.h"
 #include "tilecache_p.h"
 #include "utils_p.h"
+#include "astcencoder.h"
 
 #include <QtPositioning/private/qwebmercator_p.h>
 #include <QtLocation/private/qgeocameratiles_p_p.h>
@@ -57,10 +58,14 @@
 #include <cstdlib>
 #include <vector>
 #include <map>
+#include <limits>
 
 QAtomicInt NetworkConfiguration::offline{false};
 QAtomicInt NetworkConfiguration::astcEnabled{false};
+QAtomicInt NetworkConfiguration::bcnFormat{0};
 QAtomicInt NetworkConfiguration::logNetworkRequests{false};
+QAtomicInt NetworkConfiguration::heightmapStoreEnabled{true};
+QAtomicInt NetworkConfiguration::heightmapStoreMaxMB{2048};
 
 namespace  {
 template <class T>
@@ -88,6 +93,15 @@ struct TileKeyRegistrar
         qRegisterMetaType<std::shared_ptr<QByteArray>>("QByteArrayShared");
         qRegisterMetaType<std::shared_ptr<Heightmap>>("HeightmapShared");
         qRegisterMetaType<std::shared_ptr<CompressedTextureData>>("CompressedTextureDataShared");
+        qRegisterMetaType<std::shared_ptr<CoveragePatch>>("CoveragePatchShared");
+        qRegisterMetaType<std::shared_ptr<TerrainProducts>>("TerrainProductsShared");
+        qRegisterMetaType<std::shared_ptr<HeightmapMesh>>("HeightmapMeshShared");
+        qRegisterMetaType<std::shared_ptr<HeightmapChunk>>("HeightmapChunkShared");
+        qRegisterMetaType<HillshadeParameters>("HillshadeParameters");
+        qRegisterMetaType<std::shared_ptr<ElevationBatch>>("ElevationBatchShared");
+        qRegisterMetaType<std::shared_ptr<ElevationPoints>>("ElevationPointsShared");
+        qRegisterMetaType<std::shared_ptr<TerrainQueryResults>>("TerrainQueryResultsShared");
+        qRegisterMetaType<std::shared_ptr<TerrainQuery>>("TerrainQueryShared");
     }
 };
 
@@ -134,6 +148,54 @@ std::shared_ptr<QImage> MapFetcher::tile(quint64 id, const TileKey k)
     return d->tile(id, k);
 }
 
+std::shared_ptr<LazyTile> MapFetcher::tileHandle(quint64 id, const TileKey k) const
+{
+    Q_D(const MapFetcher);
+    const auto request = d->m_tileCache.find(id);
+    if (request == d->m_tileCache.end())
+        return nullptr;
+    const auto it = request->second.find(k);
+    if (it == request->second.end())
+        return nullptr;
+    return it->second;
+}
+
+quint64 MapFetcher::releaseDecodedTiles(quint64 keepBytes)
+{
+    Q_D(MapFetcher);
+    quint64 res{0};
+    while (d->m_decodedBytes > keepBytes && !d->m_decodedTiles.empty()) {
+        const auto &t = d->m_decodedTiles.back();
+        res += t.tile->dropDecoded();
+        d->forgetDecoded(t.tile.get());
+    }
+    return res;
+}
+
+void MapFetcher::setPrefetchTiles(bool enabled)
+{
+    Q_D(MapFetcher);
+    d->m_prefetchTiles = enabled;
+}
+
+bool MapFetcher::prefetchTiles() const
+{
+    Q_D(const MapFetcher);
+    return d->m_prefetchTiles;
+}
+
+void MapFetcher::setDecodedTilesBudget(quint64 bytes)
+{
+    Q_D(MapFetcher);
+    d->m_decodedTilesBudget = bytes;
+}
+
+quint64 MapFetcher::decodedTilesBudget() const
+{
+    Q_D(const MapFetcher);
+    return d->m_decodedTilesBudget;
+}
+
 std::shared_ptr<QImage> MapFetcher::tileCoverage(quint64 id)
 {
     Q_D(MapFetcher);
@@ -145,6 +207,15 @@ std::shared_ptr<QImage> MapFetcher::tileCoverage(quint64 id)
     return res;
 }
 
+std::shared_ptr<const QImage> MapFetcher::partialCoverage(quint64 id) const
+{
+    Q_D(const MapFetcher);
+    auto it = d->m_coverages.find(id);
+    if (it == d->m_coverages.end())
+        return {};
+    return it->second;
+}
+
 void MapFetcher::setURLTemplate(const QString &urlTemplate) {
     Q_D(MapFetcher);
 
@@ -188,6 +259,21 @@ int MapFetcher::overzoom() const
     return d->m_overzoom;
 }
 
+void MapFetcher::setProgressiveCoverage(bool enabled)
+{
+    Q_D(MapFetcher);
+    if (enabled == d->m_progressiveCoverage)
+        return;
+    d->m_progressiveCoverage = enabled;
+    emit progressiveCoverageChanged();
+}
+
+bool MapFetcher::progressiveCoverage() const
+{
+    Q_D(const MapFetcher);
+    return d->m_progressiveCoverage;
+}
+
 QString MapFetcher::compoundTileCachePath()
 {
     return CompoundTileCache::cachePath();
@@ -209,18 +295,62 @@ QString MapFetcher::networkCachePath() {
 // returns request id. 0 is invalid
 quint64 MapFetcher::requestCoverage(const QList<QGeoCoordinate> &crds,
                                     const quint8 zoom,
-                                    const bool clip)
+                                    const bool clip,
+                                    const int tileResolution)
 {
     Q_D(MapFetcher);
-    return d->requestCoverage(crds, zoom, clip);
+    return d->requestCoverage(crds, zoom, clip, quint16(qBound(0, tileResolution, 0xffff)));
 }
 
 void MapFetcher::onInsertTile(quint64 id, const TileKey k, std::shared_ptr<QImage> i) {
     Q_D(MapFetcher);
-    d->m_tileCache[id][k] = std::move(i);
+    auto &entry = d->m_tileCache[id][k];
+    if (entry)
+        d->forgetDecoded(entry.get());
+    entry = LazyTile::fromImage(std::move(i));
     emit tileReady(id, k);
 }
 
+void MapFetcher::onInsertEncodedTile(quint64 id, const TileKey k, std::shared_ptr<QByteArray> data)
+{
+    Q_D(MapFetcher);
+    if (!data)
+        return;
+    auto tile = LazyTile::fromEncoded(std::move(*data), true); // same orientation as the decoded tiles
+    auto &entry = d->m_tileCache[id][k];
+    if (entry)
+        d->forgetDecoded(entry.get());
+    entry = tile;
+    if (!d->m_prefetchTiles
+            || (d->m_decodedTilesBudget && d->m_decodedBytes >= d->m_decodedTilesBudget)) {
+        emit tileReady(id, k); // decoded by the first tile()
+        return;
+    }
+
+    // tileReady once decoded, so that tile() doesn't decode on this thread
+    ++d->m_pendingDecodes[id];
+    std::shared_ptr<MapFetcherPrivate::DecodeGuard> guard = d->m_decodeGuard;
+    tile->prefetch([guard, id, k, tile]() {
+        QMutexLocker locker(&guard->mutex);
+        if (!guard->fetcher)
+            return;
+        MapFetcher *f = guard->fetcher;
+        QMetaObject::invokeMethod(f, [f, id, k, tile]() {
+            f->d_func()->onTileDecoded(id, k, tile);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void MapFetcher::onRequestHandlingFinished(quint64 id)
+{
+    Q_D(MapFetcher);
+    if (d->m_pendingDecodes.count(id)) {
+        d->m_finishedRequests.insert(id);
+        return;
+    }
+    emit requestHandlingFinished(id);
+}
+
 void MapFetcher::onInsertCoverage(quint64 id, std::shared_ptr<QImage> i)
 {
     Q_D(MapFetcher);
@@ -228,279 +358,143 @@ void MapFetcher::onInsertCoverage(quint64 id, std::shared_ptr<QImage> i)
     emit coverageReady(id);
 }
 
-Heightmap Heightmap::fromImage(const QImage &dem,
-                               const std::map<Heightmap::Neighbor, std::shared_ptr<QImage> > &borders) {
-    Heightmap h;
-
-    auto elevationFromPixel = [](const QImage &i, int x, int y) {
-        const QRgb px = i.pixel(x,y);
-        const float res = float(qRed(px) * 256 +
-                                qGreen(px) +
-                                qBlue(px) / 256.0) - 32768.0;
-        return res;
-    };
-
-    const bool hasBorders = borders.size();
-    h.setSize((!hasBorders) ? dem.size() : dem.size() + QSize(2,2));
-    float min_ = std::numeric_limits<float>::max();
-    float max_ = std::numeric_limits<float>::min();
-    for (int y = 0; y < dem.height(); ++y) {
-        for (int x = 0; x < dem.width(); ++x) {
-            const float elevationMeters = elevationFromPixel(dem, x, y);
-            h.setElevation( x + ((hasBorders) ? 1 : 0)
-                           ,y + ((hasBorders) ? 1 : 0)
-                           ,elevationMeters);
-            max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-        }
+void MapFetcher::onUpdateCoverage(quint64 id, std::shared_ptr<CoveragePatch> patch)
+{
+    Q_D(MapFetcher);
+    if (!patch)
+        return;
+    if (patch->failed) {
+        d->m_coverages.erase(id);
+        return;
     }
+    emit progress(id, {patch->done, patch->total});
+    if (patch->pixels.isNull())
+        return;
 
-#if 0
-     // cloning neighbor value
-    if (hasBorders) {
-        for (int y = 0; y < h.m_size.height(); ++y ) {
-            for (int x = 0; x < h.m_size.width(); ++x) {
-                size_t offset = y * h.m_size.width() + x;
-                size_t sOffset = y * h.m_size.width();
-                if (   y > 0 && y < (h.m_size.height() - 1)
-                    && x > 0 && x < (h.m_size.width() - 1)) {
-                    continue;
-                }
-                if (!y) {
-                    sOffset = h.m_size.width();
-                } else if (y == h.m_size.height() - 1) {
-                    sOffset = (y - 1) * h.m_size.width();
-                }
-
-                if (!x) {
-                    sOffset += 1;
-                } else if (x == h.m_size.width() - 1) {
-                    sOffset += x - 1;
-                } else {
-                    sOffset += x;
-                }
-                h.elevations[offset] = h.elevations[sOffset];
-            }
+    auto it = d->m_coverages.find(id);
+    if (it == d->m_coverages.end()) {
+        if (patch->format == QImage::Format_Invalid || patch->coverageSize.isEmpty()) {
+            qWarning() << "onUpdateCoverage: invalid coverage for request " << id;
+            return;
         }
+        it = d->m_coverages.emplace(id, std::make_shared<QImage>(patch->coverageSize, patch->format)).first;
+        it->second->fill(Qt::transparent);
     }
-#endif
-#if 1
-    if (hasBorders) {
-        auto left = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Left))
-                return;
-            const auto &other = borders.at(Heightmap::Left);
-            for (int y = 1; y < h.m_size.height() - 1; ++y) {
-                auto otherValue =
-                        elevationFromPixel(*other, other->size().width()-1, y-1);
-                auto thisValue = h.elevation(1, y);
-                const float elevationMeters = (thisValue+otherValue)*.5;
-                h.setElevation(0,y,elevationMeters);
-                max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-            }
-        };
-        auto right = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Right))
-                return;
-            const auto &other = borders.at(Heightmap::Right);
-            for (int y = 1; y < h.m_size.height() - 1; ++y) {
-                auto otherValue = elevationFromPixel(*other, 0, y-1);
-                auto thisValue = h.elevation(h.m_size.width() - 2, y);
-                const float elevationMeters = (thisValue+otherValue)*.5;
-                h.setElevation(h.m_size.width() - 1, y, elevationMeters);
-                max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-            }
-        };
-        auto top = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Top))
-                return;
-            const auto &other = borders.at(Heightmap::Top);
-            for (int x = 1; x < h.m_size.width() - 1; ++x) {
-                auto otherValue = elevationFromPixel(*other, x - 1, other->size().height()-1);
-                auto thisValue = h.elevation(x, 1);
-                const float elevationMeters = (thisValue+otherValue)*.5;
-                h.setElevation(x, 0, elevationMeters);
-                max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-            }
-        };
-        auto bottom = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Bottom))
-                return;
-            const auto &other = borders.at(Heightmap::Bottom);
-            for (int x = 1; x < h.m_size.width() - 1; ++x) {
-                auto otherValue = elevationFromPixel(*other, x - 1, 0);
-                auto thisValue = h.elevation(x, h.m_size.height() - 2);
-                const float elevationMeters = (thisValue+otherValue)*.5;
-                h.setElevation(x, h.m_size.height() - 1, elevationMeters);
-                max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-            }
-        };
-        auto topLeft = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Top)
-                || !borders.at(Heightmap::Left)
-                || !borders.at(Heightmap::TopLeft))
-                return;
-            const auto &other = borders.at(Heightmap::TopLeft);
-            auto tl = elevationFromPixel(*other, other->size().width()-1, other->size().height()-1);
-            auto thisValue = h.elevation(1, 1);
-            auto left = h.elevation(0, 1);
-            auto top = h.elevation(1, 0);
-            const float elevationMeters = (thisValue+tl+left+top)*.25;
-            h.setElevation(0, 0, elevationMeters);
-            max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-        };
-        auto bottomLeft = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Bottom)
-                || !borders.at(Heightmap::Left)
-                || !borders.at(Heightmap::BottomLeft))
-                return;
-            const auto &other = borders.at(Heightmap::BottomLeft);
-            auto bl = elevationFromPixel(*other, other->size().width()-1, 0);
-            auto thisValue = h.elevation(1, h.m_size.height() - 2);
-            auto left = h.elevation(0, h.m_size.height() - 2);
-            auto bottom = h.elevation(1, h.m_size.height() - 1);
-            const float elevationMeters = (thisValue+bl+left+bottom)*.25;
-            h.setElevation(0, h.m_size.height() - 1, elevationMeters);
-            max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-        };
-        auto topRight = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Top)
-                || !borders.at(Heightmap::Right)
-                || !borders.at(Heightmap::TopRight))
-                return;
-            const auto &other = borders.at(Heightmap::TopRight);
-            auto tr = elevationFromPixel(*other, 0, other->size().height()-1);
-            auto thisValue = h.elevation(h.m_size.width() - 2, 1);
-            auto right = h.elevation(h.m_size.width() - 1, 1);
-            auto top = h.elevation(h.m_size.width() - 2, 0);
-            const float elevationMeters = (thisValue+tr+right+top)*.25;
-            h.setElevation(h.m_size.width() - 1, 0, elevationMeters);
-            max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-        };
-        auto bottomRight = [&h, &borders, &elevationFromPixel, &min_, &max_] () {
-            if (!borders.at(Heightmap::Bottom)
-                || !borders.at(Heightmap::Right)
-                || !borders.at(Heightmap::BottomRight))
-                return;
-            const auto &other = borders.at(Heightmap::BottomRight);
-            auto br = elevationFromPixel(*other, 0, 0);
-            auto thisValue = h.elevation(h.m_size.width() - 2, h.m_size.height() - 2);
-            auto right = h.elevation(h.m_size.width() - 1, h.m_size.height() - 2);
-            auto bottom = h.elevation(h.m_size.width() - 2, h.m_size.height() - 1);
-            const float elevationMeters = (thisValue+br+right+bottom)*.25;
-            h.setElevation(h.m_size.width() - 1, h.m_size.height() - 1, elevationMeters);
-            max_ = std::max(elevationMeters,max_); min_ = std::min(elevationMeters,min_);
-        };
-        left();
-        right();
-        top();
-        bottom();
-        topLeft();
-        topRight();
-        bottomLeft();
-        bottomRight();
-        h.m_minMax = QPair<float, float>(min_, max_);
-    }
-#endif
-    h.m_hasBorders = hasBorders;
-    return h;
-}
-
-// TODO: add smarter approaches to allow different output res. E.g., cubic interpolation
-void Heightmap::rescale(QSize size) {
-    if (size == m_size || m_hasBorders) // TODO improve border handling here
+    QImage &coverage = *it->second;
+    if (coverage.format() != patch->pixels.format()
+            || !QRect(QPoint(0, 0), coverage.size()).contains(patch->rect)
+            || patch->pixels.size() != patch->rect.size()) {
+        qWarning() << "onUpdateCoverage: mismatching patch for request " << id;
         return;
-    float hMultiplier = m_size.width() / float(size.width());
-    float vMultiplier = m_size.height() / float(size.height());
-
-    if (  (m_size.isEmpty())
-          || (size.width() >= m_size.width())
-          || (size.height() >= m_size.height())
-          || (fmod(hMultiplier, 1) != 0.0)
-          || (fmod(vMultiplier, 1) != 0.0)) {
-        qWarning() << "Requested downsampling size "<<size<<" not supported for "<<m_size;
     }
+    const int rowBytes = (patch->rect.width() * coverage.depth()) / 8;
+    const int dx = (patch->rect.x() * coverage.depth()) / 8;
+    for (int y = 0; y < patch->rect.height(); ++y)
+        memcpy(coverage.scanLine(patch->rect.y() + y) + dx, patch->pixels.constScanLine(y), rowBytes);
 
-    const size_t arraySize = size.width() * size.height();
-    elevations.resize(arraySize);
-    {
-        size_t pixelsPerPatch = int(hMultiplier) * int(vMultiplier);
-        std::vector<float> downsampled;
-        for (int y = 0; y < size.height(); ++y) {
-            for (int x = 0; x < size.width(); ++x) {
-                float sum = 0;
-                for (int iy = 0; iy < int(vMultiplier); ++iy) {
-                    for (int ix = 0; ix < int(hMultiplier); ++ix) {
-                        sum += elevations[(y*int(vMultiplier)+iy)*m_size.width()
-                                + (x * int(hMultiplier) + ix)];
-                    }
-                }
-                downsampled.push_back(sum / float(pixelsPerPatch));
-            }
-        }
-        elevations.swap(downsampled);
-    }
-    m_size = size;
+    emit coverageUpdated(id, patch->rect);
 }
 
-void Heightmap::rescale(int size) {
-    if (m_hasBorders) // TODO improve border handling here
-        return;
-    int newWidth, newHeight;
-    if (m_size.width() >= m_size.height()) {
-        newWidth = size;
-        newHeight = size * m_size.height() / m_size.width();
-    } else {
-        newHeight = size;
-        newWidth = size * m_size.width() / m_size.height();
-    }
-    rescale(QSize(newWidth, newHeight));
+std::shared_ptr<LazyTile> LazyTile::fromEncoded(QByteArray encoded, bool mirror)
+{
+    std::shared_ptr<LazyTile> res(new LazyTile);
+    res->m_encoded = std::move(encoded);
+    res->m_mirror = mirror;
+    return res;
 }
 
-void Heightmap::setSize(QSize size, float initialValue)
+std::shared_ptr<LazyTile> LazyTile::fromImage(std::shared_ptr<QImage> image)
 {
-    m_size = size;
-    elevations.resize(m_size.width() * m_size.height(), initialValue);
+    std::shared_ptr<LazyTile> res(new LazyTile);
+    res->m_image = std::move(image);
+    return res;
 }
 
-QSize Heightmap::size() const {return m_size;}
-
-void Heightmap::printMinMax() const
+std::shared_ptr<QImage> LazyTile::image()
+{
+    QMutexLocker locker(&m_mutex);
+    while (m_decoding)
+        m_decodeFinished.wait(&m_mutex);
+    if (m_image || m_encoded.isEmpty())
+        return m_image;
+
+    m_decoding = true;
+    const QByteArray encoded = m_encoded;
+    locker.unlock();
+    auto decoded = std::make_shared<QImage>(decodeTile(encoded, m_mirror));
+    locker.relock();
+    m_image = std::move(decoded);
+    m_decoding = false;
+    m_decodeFinished.wakeAll();
+    return m_image;
+}
+
+void LazyTile::prefetch(std::function<void()> done)
 {
-    float minValue = qInf();
-    float maxValue = -qInf();
-    for (const auto &v: elevations) {
-        minValue = qMin(v, minValue);
-        maxValue = qMax(v, maxValue);
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_image || m_decoding || m_encoded.isEmpty()) {
+            locker.unlock();
+            if (done)
+                done();
+            return;
+        }
     }
-    qDebug() << "Heightmap min "<<minValue<<" - max "<<maxValue;
+    std::shared_ptr<LazyTile> self = shared_from_this();
+    QThreadPool::globalInstance()->start([self, done]() {
+        self->image();
+        if (done)
+            done();
+    });
 }
 
-float Heightmap::elevation(int x, int y) const
+quint64 LazyTile::dropDecoded()
 {
-    return elevations[y*m_size.width()+x];
+    QMutexLocker locker(&m_mutex);
+    if (!m_image || m_decoding || m_encoded.isEmpty())
+        return 0;
+    const quint64 res = m_image->sizeInBytes();
+    m_image.reset(); // whoever retrieved the image keeps its own reference
+    return res;
 }
 
-void Heightmap::setElevation(int x, int y, float e)
+bool LazyTile::isDecoded() const
 {
-    elevations[y*m_size.width()+x] = e;
+    QMutexLocker locker(&m_mutex);
+    return bool(m_image);
 }
 
-QPair<float, float> Heightmap::minMax() const
+quint64 LazyTile::encodedBytes() const
 {
-    return m_minMax;
+    QMutexLocker locker(&m_mutex);
+    return m_encoded.size();
 }
 
+quint64 LazyTile::decodedBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return (m_image) ? m_image->sizeInBytes() : 0;
+}
 
 MapFetcher::MapFetcher(QObject *parent)
 : QObject(*new MapFetcherPrivate, parent)
 {
     initTileKey();
+    d_func()->m_decodeGuard->fetcher = this;
 }
 
 MapFetcher::MapFetcher(MapFetcherPrivate &dd, QObject *parent)
 :   QObject(dd, parent)
 {
     initTileKey();
+    d_func()->m_decodeGuard->fetcher = this;
+}
+
+MapFetcher::~MapFetcher()
+{
+    Q_D(MapFetcher);
+    QMutexLocker locker(&d->m_decodeGuard->mutex);
+    d->m_decodeGuard->fetcher = nullptr;
 }
 
 MapFetcherPrivate::MapFetcherPrivate()
@@ -512,13 +506,46 @@ std::shared_ptr<QImage> MapFetcherPrivate::tile(quint64 id, const TileKey k)
 {
     const auto it = m_tileCache[id].find(k);
     if (it != m_tileCache[id].end()) {
-        std::shared_ptr<QImage> res = std::move(it->second);
+        std::shared_ptr<LazyTile> res = std::move(it->second);
         m_tileCache[id].erase(it);
-        return res;
+        forgetDecoded(res.get());
+        return res->image(); // decodes, unless prefetched
     }
     return nullptr;
 }
 
+void MapFetcherPrivate::onTileDecoded(quint64 id, const TileKey k, const std::shared_ptr<LazyTile> &tile)
+{
+    Q_Q(MapFetcher);
+    const auto request = m_tileCache.find(id);
+    const auto it = (request != m_tileCache.end()) ? request->second.find(k)
+                                                   : LazyTileCache::iterator();
+    // skipped if retrieved, or replaced, already
+    if (request != m_tileCache.end() && it != request->second.end() && it->second == tile) {
+        const quint64 bytes = tile->decodedBytes();
+        m_decodedTiles.push_front({tile, bytes});
+        m_decodedIndex[tile.get()] = m_decodedTiles.begin();
+        m_decodedBytes += bytes;
+        emit q->tileReady(id, k);
+    }
+
+    if (--m_pendingDecodes[id] > 0)
+        return;
+    m_pendingDecodes.erase(id);
+    if (m_finishedRequests.erase(id))
+        emit q->requestHandlingFinished(id);
+}
+
+void MapFetcherPrivate::forgetDecoded(const LazyTile *tile)
+{
+    const auto it = m_decodedIndex.find(tile);
+    if (it == m_decodedIndex.end())
+        return;
+    m_decodedBytes -= it->second->bytes;
+    m_decodedTiles.erase(it->second);
+    m_decodedIndex.erase(it);
+}
+
 quint64 MapFetcherPrivate::requestSlippyTiles(const QList<QGeoCoordinate> &crds,
                                               const quint8 zoom,
                                               quint8 destinationZoom,
@@ -529,10 +556,13 @@ quint64 MapFetcherPrivate::requestSlippyTiles(const QList<QGeoCoordinate> &crds,
     return NetworkManager::instance().requestSlippyTiles(*q, crds, cappedZoom, destinationZoom, compound);
 }
 
-quint64 MapFetcherPrivate::requestCoverage(const QList<QGeoCoordinate> &crds, const quint8 zoom, bool clip)
+quint64 MapFetcherPrivate::requestCoverage(const QList<QGeoCoordinate> &crds,
+                                           const quint8 zoom,
+                                           bool clip,
+                                           quint16 tileResolution)
 {
     Q_Q(MapFetcher);
-    return NetworkManager::instance().requestCoverage(*q, crds, zoom, clip);
+    return NetworkManager::instance().requestCoverage(*q, crds, zoom, clip, tileResolution, m_progressiveCoverage);
 }
 
 QString MapFetcherPrivate::objectName() const
@@ -579,6 +609,230 @@ void DEMFetcher::setBorders(bool borders)
     d->m_borders = borders; // FIXME: this must not happen while processing a request!!
 }
 
+void DEMFetcher::setQuantizedHeightmaps(bool enabled)
+{
+    Q_D(DEMFetcher);
+    if (enabled == d->m_quantize)
+        return;
+    d->m_quantize = enabled;
+    emit quantizedHeightmapsChanged(enabled);
+}
+
+bool DEMFetcher::quantizedHeightmaps() const
+{
+    Q_D(const DEMFetcher);
+    return d->m_quantize;
+}
+
+void DEMFetcher::setTerrainProducts(bool enabled, const HillshadeParameters &params)
+{
+    Q_D(DEMFetcher);
+    d->m_terrainProducts = enabled;
+    d->m_hillshade = params;
+    emit terrainProductsChanged(enabled, params);
+}
+
+bool DEMFetcher::terrainProductsEnabled() const
+{
+    Q_D(const DEMFetcher);
+    return d->m_terrainProducts;
+}
+
+HillshadeParameters DEMFetcher::hillshadeParameters() const
+{
+    Q_D(const DEMFetcher);
+    return d->m_hillshade;
+}
+
+std::shared_ptr<TerrainProducts> DEMFetcher::terrainProducts(quint64 id, const TileKey k)
+{
+    Q_D(DEMFetcher);
+    auto &cache = d->m_terrainProductsCache[id];
+    const auto it = cache.find(k);
+    if (it == cache.end())
+        return nullptr;
+    std::shared_ptr<TerrainProducts> res = std::move(it->second);
+    cache.erase(it);
+    return res;
+}
+
+void DEMFetcher::setHeightmapMeshes(bool enabled, float maxError)
+{
+    Q_D(DEMFetcher);
+    d->m_meshes = enabled;
+    d->m_meshMaxError = maxError;
+    emit heightmapMeshesChanged(enabled, maxError);
+}
+
+bool DEMFetcher::heightmapMeshesEnabled() const
+{
+    Q_D(const DEMFetcher);
+    return d->m_meshes;
+}
+
+float DEMFetcher::heightmapMeshMaxError() const
+{
+    Q_D(const DEMFetcher);
+    return d->m_meshMaxError;
+}
+
+std::shared_ptr<HeightmapMesh> DEMFetcher::heightmapMesh(quint64 id, const TileKey k)
+{
+    Q_D(DEMFetcher);
+    auto &cache = d->m_heightmapMeshCache[id];
+    const auto it = cache.find(k);
+    if (it == cache.end())
+        return nullptr;
+    std::shared_ptr<HeightmapMesh> res = std::move(it->second);
+    cache.erase(it);
+    return res;
+}
+
+quint64 DEMFetcher::requestElevations(const QVector<QGeoCoordinate> &points, quint8 zoom)
+{
+    Q_D(DEMFetcher);
+    auto p = std::make_shared<ElevationPoints>();
+    p->latitudes.reserve(points.size());
+    p->longitudes.reserve(points.size());
+    for (const auto &c: points) {
+        p->latitudes.push_back(c.latitude());  // NaN for invalid coordinates
+        p->longitudes.push_back(c.longitude());
+    }
+    const quint8 cappedZoom = quint8(qMin<int>(zoom, d->m_maximumZoomLevel));
+    const quint64 id = NetworkManager::instance().requestElevations(*this, std::move(p), cappedZoom);
+    d->m_elevations[id].assign(points.size(), std::numeric_limits<float>::quiet_NaN());
+    return id;
+}
+
+std::vector<float> DEMFetcher::elevations(quint64 id)
+{
+    Q_D(DEMFetcher);
+    auto it = d->m_elevations.find(id);
+    if (it == d->m_elevations.end())
+        return {};
+    std::vector<float> res = std::move(it->second);
+    d->m_elevations.erase(it);
+    return res;
+}
+
+void DEMFetcher::onInsertElevations(quint64 id, std::shared_ptr<ElevationBatch> b)
+{
+    Q_D(DEMFetcher);
+    auto it = d->m_elevations.find(id);
+    if (it == d->m_elevations.end() || !b) // already taken
+        return;
+    std::vector<float> &res = it->second;
+    for (size_t i = 0; i < b->indices.size(); ++i)
+        res[b->indices[i]] = b->elevations[i];
+    emit elevationsUpdated(id, b->indices.size(), res.size());
+}
+
+quint64 DEMFetcher::requestProfiles(const QVector<QVector<QGeoCoordinate>> &polylines, quint8 zoom)
+{
+    Q_D(DEMFetcher);
+    auto q = std::make_shared<TerrainQuery>();
+    q->type = TerrainQuery::Type::Profiles;
+    q->zoom = quint8(qMin<int>(zoom, d->m_maximumZoomLevel));
+    std::vector<double> latitudes, longitudes;
+    for (const auto &polyline: polylines) {
+        for (const auto &c: polyline) {
+            latitudes.push_back(c.latitude());
+            longitudes.push_back(c.longitude());
+        }
+        q->offsets.push_back(quint32(latitudes.size()));
+    }
+    q->x.resize(latitudes.size());
+    q->y.resize(latitudes.size());
+    projectToMercator(latitudes.data(), longitudes.data(), latitudes.size(), q->x.data(), q->y.data());
+    return NetworkManager::instance().requestTerrainQuery(*this, std::move(q));
+}
+
+quint64 DEMFetcher::requestLinesOfSight(const QVector<QPair<QGeoCoordinate, QGeoCoordinate>> &pairs,
+                                        quint8 zoom,
+                                        double kFactor)
+{
+    Q_D(DEMFetcher);
+    auto q = std::make_shared<TerrainQuery>();
+    q->type = TerrainQuery::Type::LinesOfSight;
+    q->zoom = quint8(qMin<int>(zoom, d->m_maximumZoomLevel));
+    q->kFactor = kFactor;
+    std::vector<double> latitudes, longitudes;
+    for (const auto &p: pairs) {
+        for (const QGeoCoordinate &c: {p.first, p.second}) {
+            latitudes.push_back(c.latitude());
+            longitudes.push_back(c.longitude());
+            q->heights.push_back((std::isnan(c.altitude())) ? 0.f : float(c.altitude()));
+        }
+        q->offsets.push_back(quint32(latitudes.size()));
+    }
+    q->x.resize(latitudes.size());
+    q->y.resize(latitudes.size());
+    projectToMercator(latitudes.data(), longitudes.data(), latitudes.size(), q->x.data(), q->y.data());
+    return NetworkManager::instance().requestTerrainQuery(*this, std::move(q));
+}
+
+quint64 DEMFetcher::requestChunkedCoverage(const QList<QGeoCoordinate> &crds,
+                                           quint8 zoom,
+                                           bool clip)
+{
+    Q_D(DEMFetcher);
+    const quint8 cappedZoom = quint8(qMin<int>(zoom, d->m_maximumZoomLevel));
+    return NetworkManager::instance().requestChunkedCoverage(*this, crds, cappedZoom, clip);
+}
+
+std::shared_ptr<HeightmapChunk> DEMFetcher::heightmapChunk(quint64 id, const TileKey k)
+{
+    Q_D(DEMFetcher);
+    auto &chunks = d->m_heightmapChunks[id];
+    const auto it = chunks.find(k);
+    if (it == chunks.end())
+        return nullptr;
+    std::shared_ptr<HeightmapChunk> res = std::move(it->second);
+    chunks.erase(it);
+    if (chunks.empty())
+        d->m_heightmapChunks.erase(id);
+    return res;
+}
+
+void DEMFetcher::onInsertHeightmapChunk(quint64 id, const TileKey k, std::shared_ptr<HeightmapChunk> c)
+{
+    Q_D(DEMFetcher);
+    d->m_heightmapChunks[id][k] = std::move(c);
+    emit heightmapChunkReady(id, k);
+}
+
+std::shared_ptr<TerrainQueryResults> DEMFetcher::terrainQueryResults(quint64 id)
+{
+    Q_D(DEMFetcher);
+    auto it = d->m_terrainQueryResults.find(id);
+    if (it == d->m_terrainQueryResults.end())
+        return {};
+    auto res = std::move(it->second);
+    d->m_terrainQueryResults.erase(it);
+    return res;
+}
+
+void DEMFetcher::onInsertTerrainQueryResults(quint64 id, std::shared_ptr<TerrainQueryResults> r)
+{
+    Q_D(DEMFetcher);
+    d->m_terrainQueryResults[id] = std::move(r);
+    emit terrainQueryReady(id);
+}
+
+void DEMFetcher::onInsertTerrainProducts(quint64 id, const TileKey k, std::shared_ptr<TerrainProducts> p)
+{
+    Q_D(DEMFetcher);
+    d->m_terrainProductsCache[id][k] = std::move(p);
+    emit terrainProductsReady(id, k);
+}
+
+void DEMFetcher::onInsertHeightmapMesh(quint64 id, const TileKey k, std::shared_ptr<HeightmapMesh> m)
+{
+    Q_D(DEMFetcher);
+    d->m_heightmapMeshCache[id][k] = std::move(m);
+    emit heightmapMeshReady(id, k);
+}
+
 void DEMFetcher::onInsertHeightmap(quint64 id, const TileKey k, std::shared_ptr<Heightmap> h)
 {
     Q_D(DEMFetcher);
@@ -612,10 +866,13 @@ quint64 DEMFetcherPrivate::requestSlippyTiles(const QList<QGeoCoordinate> &crds,
     return NetworkManager::instance().requestSlippyTiles(*q, crds, cappedZoom, destinationZoom);
 }
 
-quint64 DEMFetcherPrivate::requestCoverage(const QList<QGeoCoordinate> &crds, const quint8 zoom, bool clip)
+quint64 DEMFetcherPrivate::requestCoverage(const QList<QGeoCoordinate> &crds,
+                                           const quint8 zoom,
+                                           bool clip,
+                                           quint16 tileResolution)
 {
     Q_Q(DEMFetcher);
-    return NetworkManager::instance().requestCoverage(*q, crds, zoom, clip);
+    return NetworkManager::instance().requestCoverage(*q, crds, zoom, clip, tileResolution);
 }
 
 std::shared_ptr<CompressedTextureData> ASTCFetcherPrivate::tileASTC(quint64 id, const TileKey k)
@@ -639,10 +896,13 @@ quint64 ASTCFetcherPrivate::requestSlippyTiles(const QList<QGeoCoordinate> &crds
     return NetworkManager::instance().requestSlippyTiles(*q, crds, cappedZoom, destinationZoom, compound);
 }
 
-quint64 ASTCFetcherPrivate::requestCoverage(const QList<QGeoCoordinate> &crds, const quint8 zoom, bool clip)
+quint64 ASTCFetcherPrivate::requestCoverage(const QList<QGeoCoordinate> &crds,
+                                            const quint8 zoom,
+                                            bool clip,
+                                            quint16 tileResolution)
 {
     Q_Q(ASTCFetcher);
-    return NetworkManager::instance().requestCoverage(*q, crds, zoom, clip);
+    return NetworkManager::instance().requestCoverage(*q, crds, zoom, clip, tileResolution);
 }
 
 ASTCFetcher::ASTCFetcher(QObject *parent)
@@ -676,7 +936,8 @@ void ASTCFetcher::onInsertTile(const quint64 id, const TileKey k, std::shared_pt
 {
     Q_D(const ASTCFetcher);
 
-    if (!d->m_forwardUncompressed || !NetworkConfiguration::astcEnabled)
+    if (!d->m_forwardUncompressed
+            || (!NetworkConfiguration::astcEnabled && !NetworkConfiguration::bcnFormat))
         return;
 
     auto ctd = std::make_shared<ASTCCompressedTextureData>();
@@ -694,6 +955,97 @@ void ASTCFetcher::setForwardUncompressedTiles(bool enabled)
     emit forwardUncompressedTilesChanged(enabled);
 }
 
+bool ASTCFetcher::setCompression(const QSize &blockSize, float quality)
+{
+    Q_D(ASTCFetcher);
+    ASTCEncoder::Configuration config;
+    config.blockX = blockSize.width();
+    config.blockY = blockSize.height();
+    config.quality = quality;
+    if (!config.isValid()) {
+        qWarning() << "ASTCFetcher::setCompression: invalid configuration "<<blockSize<<" "<<quality;
+        return false;
+    }
+    {
+        QMutexLocker locker(&d->m_settingsMutex);
+        if (blockSize == d->m_blockSize && quality == d->m_quality)
+            return true;
+
+        d->m_blockSize = blockSize;
+        d->m_quality = quality;
+    }
+    emit compressionChanged(blockSize, quality);
+    return true;
+}
+
+static_assert(int(ASTCFetcher::Quality::Fastest) == int(ASTCEncoder::Fastest)
+              && int(ASTCFetcher::Quality::Fast) == int(ASTCEncoder::Fast)
+              && int(ASTCFetcher::Quality::Medium) == int(ASTCEncoder::Medium)
+              && int(ASTCFetcher::Quality::Thorough) == int(ASTCEncoder::Thorough)
+              && int(ASTCFetcher::Quality::VeryThorough) == int(ASTCEncoder::VeryThorough)
+              && int(ASTCFetcher::Quality::Exhaustive) == int(ASTCEncoder::Exhaustive),
+              "ASTCFetcher::Quality must match ASTCEncoder::Preset");
+
+bool ASTCFetcher::setCompression(const QSize &blockSize, Quality preset)
+{
+    return setCompression(blockSize, ASTCEncoder::presetQuality(ASTCEncoder::Preset(int(preset))));
+}
+
+QSize ASTCFetcher::blockSize() const
+{
+    Q_D(const ASTCFetcher);
+    QMutexLocker locker(&d->m_settingsMutex);
+    return d->m_blockSize;
+}
+
+float ASTCFetcher::quality() const
+{
+    Q_D(const ASTCFetcher);
+    QMutexLocker locker(&d->m_settingsMutex);
+    return d->m_quality;
+}
+
+void ASTCFetcher::setMipFilter(int filter)
+{
+    Q_D(ASTCFetcher);
+    filter &= SRGBFilter | PremultipliedAlpha;
+    {
+        QMutexLocker locker(&d->m_settingsMutex);
+        if (filter == d->m_mipFilter)
+            return;
+
+        d->m_mipFilter = filter;
+    }
+    emit mipFilterChanged(filter);
+}
+
+int ASTCFetcher::mipFilter() const
+{
+    Q_D(const ASTCFetcher);
+    QMutexLocker locker(&d->m_settingsMutex);
+    return d->m_mipFilter;
+}
+
+void ASTCFetcher::setRetainUncompressedImages(bool enabled)
+{
+    Q_D(ASTCFetcher);
+    {
+        QMutexLocker locker(&d->m_settingsMutex);
+        if (enabled == d->m_retainUncompressed)
+            return;
+
+        d->m_retainUncompressed = enabled;
+    }
+    emit retainUncompressedImagesChanged(enabled);
+}
+
+bool ASTCFetcher::retainUncompressedImages() const
+{
+    Q_D(const ASTCFetcher);
+    QMutexLocker locker(&d->m_settingsMutex);
+    return d->m_retainUncompressed;
+}
+
 void ASTCFetcher::onInsertASTCTile(const quint64 id,
                                    const TileKey k,
                                    std::shared_ptr<CompressedTextureData> i)
@@ -712,27 +1064,6 @@ void ASTCFetcher::onInsertASTCCoverage(const quint64 id,
 }
 
 std::vector<QImage> ASTCCompressedTextureData::m_white256;
-std::vector<QTextureFileData> ASTCCompressedTextureData::m_white8x8ASTC;
-std::vector<QTextureFileData> ASTCCompressedTextureData::m_transparent8x8ASTC;
-
-namespace  {
-void loadASTCMips(const QString &baseName, std::vector<QTextureFileData> &container) {
-    for (int i : {256,128,64,32,16,8}) {
-        QString fname = ":/" + baseName + QString::number(i) + "_8x8.astc";
-        QFile f(fname);
-        bool res = f.open(QIODevice::ReadOnly);
-        if (!res) {
-            qWarning()<<"Failed opening " <<f.fileName();
-        }
-        QTextureFileReader fr(&f);
-        if (!fr.canRead())
-            qWarning()<<"TFR cannot read texture!";
-
-        container.push_back(fr.read());
-        f.close();
-    }
-}
-}
 
 void ASTCCompressedTextureData::initStatics() {
     if (m_white256.size())
@@ -740,8 +1071,6 @@ void ASTCCompressedTextureData::initStatics() {
     Q_INIT_RESOURCE(qmake_mapfetcher_res);
     m_white256.resize(1);
     m_white256[0].load(":/white256.png");
-    loadASTCMips("white", m_white8x8ASTC);
-    loadASTCMips("transparent", m_transparent8x8ASTC);
 }
 
 
@@ -809,16 +1138,16 @@ bool CompressedTextureData::isFormatCompressed(GLint format) {
                 QOpenGLTexture::SRGB8_Alpha8_ASTC_10x8,
                 QOpenGLTexture::SRGB8_Alpha8_ASTC_10x10,
                 QOpenGLTexture::SRGB8_Alpha8_ASTC_12x10,
-                QOpenGLTexture::SRGB8_Alpha8_ASTC_12x12
+                QOpenGLTexture::SRGB8_Alpha8_ASTC_12x12,
+                QOpenGLTexture::RGB_DXT1,
+                QOpenGLTexture::RGBA_DXT5,
+                QOpenGLTexture::RGB_BP_UNorm
     };
     return compressedFormats.find(format) != compressedFormats.end();
 }
 
 void DEMFetcherWorkerPrivate::insertNeighbors(quint64 id,
                                               const TileKey &k,
-                                              Heightmap::Neighbors n,
-                                              std::map<Heightmap::Neighbor, std::shared_ptr<QImage> > boundaryRasters) {
-    std::pair< Heightmap::Neighbors,
-            std::map<Heightmap::Neighbor, std::shared_ptr<QImage>>> nm = {n, std::move(boundaryRasters)};
-    m_request2Neighbors[id][k] = std::move(nm);
+                                              Heightmap::Neighbors n) {
+    m_request2Neighbors[id][k] = {n, Heightmap::Borders{}};
 }
@@ -22,14 +22,19 @@
 #define TILEFETCHER_H
 
 #include <QImage>
+#include <QFile>
 #include <QtPositioning/QGeoCoordinate>
 #include <QNetworkAccessManager>
 #include <QNetworkDiskCache>
 #include <QNetworkReply>
 #include <QOpenGLTexture>
 #include <QMutex>
+#include <QWaitCondition>
 #include <QThread>
 #include <QDebug>
+#include <array>
+#include <functional>
+#include <limits>
 #include <set>
 #include <tuple>
 #include <math.h>
@@ -76,9 +81,13 @@ struct TileData {
 struct NetworkConfiguration {
     static QAtomicInt offline;
     static QAtomicInt astcEnabled;
+    static QAtomicInt bcnFormat; // BCnEncoder::Format used when astc is disabled, 0 for none
     static QAtomicInt logNetworkRequests;
+    static QAtomicInt heightmapStoreEnabled; // reuse processed heightmaps across runs
+    static QAtomicInt heightmapStoreMaxMB; // past this, the oldest slots are recycled. 0 for no limit
 };
 
+struct DEMTileEdges;
 struct Heightmap {
     enum Neighbor {
         Top = 1 << 0,
@@ -92,26 +101,248 @@ struct Heightmap {
     };
     Q_DECLARE_FLAGS(Neighbors, Neighbor)
 
-    static Heightmap fromImage(const QImage &dem,
-                               const std::map<Neighbor, std::shared_ptr<QImage> > &borders = {});
+    // Edges of the 8 neighbors, indexed by neighborIndex(). Missing ones are null
+    using Borders = std::array<std::shared_ptr<const DEMTileEdges>, 8>;
+    static int neighborIndex(Neighbor n);
 
-    void rescale(QSize size);
-    void rescale(int size);
+    static Heightmap fromImage(const QImage &dem);
+    // Adds a 1 pixel border, blended with the facing edges of the neighbors
+    static Heightmap fromImage(const QImage &dem, const Borders &borders);
+
+    enum class Filter {
+        Box,
+        Bicubic
+    };
+
+    // Any ratio, up or down. With borders, size includes them
+    void rescale(QSize size, Filter filter = Filter::Box);
+    void rescale(int size, Filter filter = Filter::Box);
+    // Halvings down to 1x1 (plus borders), level 1 first
+    std::vector<Heightmap> mipPyramid(Filter filter = Filter::Box) const;
     void setSize(QSize size, float initialValue = .0f);
     QSize size() const;
     void printMinMax() const;
 
+    // Metres, also when quantized
     float elevation(int x, int y) const;
     void setElevation(int x, int y, float e);
     QPair<float, float> minMax() const;
+    void updateMinMax();
+
+    // Min/max of leafSize x leafSize blocks, reduced 2x2 per level up to a single root
+    struct MinMaxPyramid {
+        static constexpr int leafSize = 8;
+        std::vector<QSize> sizes; // blocks per level, leaves first
+        std::vector<std::vector<QPair<float, float>>> levels;
+    };
+    void buildMinMaxPyramid();
+    // Exact range within rect, in O(log n) block lookups once the pyramid is built
+    QPair<float, float> minMax(const QRect &rect) const;
+
+    // Swaps elevations for 16 bit samples over the tile min/max range:
+    // elevation = m_quantizationOffset + sample * m_quantizationScale.
+    // A pyramid already built is rebuilt from the quantized samples
+    void quantize();
+    void dequantize();
+    bool isQuantized() const;
 
     QSize m_size;
     QPair<float, float> m_minMax;
     std::vector<float> elevations;
+    std::vector<quint16> quantized;
+    float m_quantizationOffset{0.f};
+    float m_quantizationScale{1.f};
     bool m_hasBorders{false};
+    Neighbors m_borderNeighbors; // neighbors blended into the border
+    std::shared_ptr<const MinMaxPyramid> m_minMaxPyramid; // dropped by setElevation
 };
 Q_DECLARE_OPERATORS_FOR_FLAGS(Heightmap::Neighbors)
 
+// Outermost rows, columns and corners of a DEM tile, in metres. This is all a
+// neighbor reads from it, so bordered requests keep these instead of the images.
+struct DEMTileEdges {
+    static std::shared_ptr<const DEMTileEdges> fromImage(const QImage &dem);
+    // From the interior of a decoded heightmap, same values fromImage gives for its source
+    static std::shared_ptr<const DEMTileEdges> fromHeightmap(const Heightmap &h);
+
+    std::vector<float> top;
+    std::vector<float> bottom;
+    std::vector<float> left;
+    std::vector<float> right;
+    float topLeft{0.f};
+    float topRight{0.f};
+    float bottomLeft{0.f};
+    float bottomRight{0.f};
+};
+
+struct HillshadeParameters {
+    float azimuth{315.f};  // degrees, clockwise from north
+    float altitude{45.f};  // degrees above the horizon
+    float zFactor{1.f};    // vertical exaggeration
+};
+
+// Rasters derived from a heightmap tile. Bordered heightmaps give exact seams,
+// and the borders themselves are not part of the output.
+struct TerrainProducts {
+    static std::shared_ptr<TerrainProducts> fromHeightmap(const Heightmap &h,
+                                                          double metersPerPixel,
+                                                          const HillshadeParameters &params = {});
+    // Ground resolution at the center of tile k, tileResolution pixels wide
+    static double metersPerPixel(const TileKey &k, int tileResolution);
+
+    QSize size;
+    QByteArray normals; // RG8, octahedral encoded unit normals in (east, north, up)
+    QImage hillshade;   // Grayscale8
+    HillshadeParameters hillshadeParameters;
+};
+
+struct TerrainRTIN;
+// Indexed triangle mesh over the pixel corners of a heightmap tile
+struct HeightmapMesh {
+    int gridSize{0};                // vertices per side, tile pixels + 1
+    std::vector<quint16> positions; // x, y pairs in grid units, 0,0 at the top left tile corner
+    std::vector<float> elevations;  // metres, one per vertex
+    std::vector<quint32> indices;   // 3 per triangle
+    float maxError{0.f};
+    std::shared_ptr<const TerrainRTIN> rtin; // to extract the tile again at a different error
+};
+
+// Right-triangulated irregular network error hierarchy of a heightmap tile (square,
+// power of two sized). Built once, then meshes at any max error are cheap to extract.
+// With bordered heightmaps, edges shared with a blended neighbor are kept at full
+// resolution and only depend on the common border, so adjacent tiles mesh crack free.
+// Quantized heightmaps can leave gaps up to half a quantization step.
+struct TerrainRTIN {
+    static std::shared_ptr<TerrainRTIN> fromHeightmap(const Heightmap &h);
+    // maxError in metres
+    std::shared_ptr<HeightmapMesh> mesh(float maxError) const;
+
+    int gridSize{0};
+    std::vector<float> elevations; // gridSize x gridSize, at pixel corners
+    std::vector<float> errors;     // gridSize x gridSize, infinite on forced vertices
+};
+
+// One block of a chunked heightmap coverage (see DEMFetcher::requestChunkedCoverage)
+struct HeightmapChunk {
+    QRect rect;          // within the coverage, same size as heightmap
+    QSize coverageSize;
+    QPointF topLeft;     // of the coverage, EPSG:3857 metres
+    double pixelSize{0}; // EPSG:3857 metres
+    Heightmap heightmap; // not bordered, not quantized
+};
+
+// Streams a heightmap coverage to a file block by block, in any order. The file is
+// laid out upfront, so at most one block is ever held in memory.
+class HeightmapCoverageWriter {
+public:
+    virtual ~HeightmapCoverageWriter() = default;
+
+    bool isOpen() const;
+    QSize size() const;
+    // rect within the coverage, rows of elevations stride floats apart
+    bool writeBlock(const QRect &rect, const float *elevations, int stride);
+    bool writeChunk(const HeightmapChunk &chunk);
+    bool close();
+
+protected:
+    HeightmapCoverageWriter(const QString &fileName, const QSize &size);
+    bool open(const QByteArray &header);
+
+    QFile m_file;
+    QSize m_size;
+    qint64 m_dataOffset{0};
+};
+
+// Headerless row major float32, as the downloader always wrote
+class RawCoverageWriter : public HeightmapCoverageWriter {
+public:
+    RawCoverageWriter(const QString &fileName, const QSize &size);
+};
+
+// Uncompressed float32 GeoTIFF in EPSG:3857, BigTIFF when larger than 4GB
+class GeoTiffCoverageWriter : public HeightmapCoverageWriter {
+public:
+    GeoTiffCoverageWriter(const QString &fileName,
+                          const QSize &size,
+                          const QPointF &topLeft,
+                          double pixelSize);
+};
+
+// Cesium quantized-mesh-1.0 terrain tiles, from the meshes of web mercator tiles
+struct QuantizedMesh {
+    // Clients interpolate u/v linearly in longitude/latitude, so v is remapped from the
+    // mercator grid. normals appends the oct-encoded vertex normals extension
+    static QByteArray encode(const HeightmapMesh &mesh, const TileKey &k, bool normals = false);
+    // layer.json describing tiles written in the tms scheme, at tmsKey(k)
+    static QByteArray layerJson(const std::set<TileKey> &tiles, bool normals = false);
+    static TileKey tmsKey(const TileKey &k);
+};
+
+// Elevations sampled from one tile, for points of a DEMFetcher::requestElevations call
+struct ElevationBatch {
+    std::vector<quint32> indices; // into the requested points
+    std::vector<float> elevations;
+};
+
+struct ElevationProfile {
+    std::vector<float> distances;  // metres from the start of the polyline
+    std::vector<float> elevations; // one per DEM pixel crossed, NaN without data
+};
+
+struct LineOfSight {
+    bool visible{false};
+    float clearance{std::numeric_limits<float>::quiet_NaN()}; // min height of the sight line above terrain, metres
+    float obstructionDistance{std::numeric_limits<float>::quiet_NaN()}; // metres to the first obstruction
+};
+
+// Indexed like the paths passed to DEMFetcher::requestProfiles / requestLinesOfSight
+struct TerrainQueryResults {
+    std::vector<ElevationProfile> profiles;
+    std::vector<LineOfSight> linesOfSight;
+};
+
+// Tile handle keeping the encoded (PNG/JPEG) payload around, and decoding it
+// only when pixels are requested (or prefetched). Decoded pixels can be dropped.
+class LazyTile : public std::enable_shared_from_this<LazyTile>
+{
+public:
+    static std::shared_ptr<LazyTile> fromEncoded(QByteArray encoded, bool mirror = false);
+    static std::shared_ptr<LazyTile> fromImage(std::shared_ptr<QImage> image);
+
+    // Decodes on the calling thread, or waits for a decode already in flight
+    std::shared_ptr<QImage> image();
+    // Decodes on QThreadPool::globalInstance(), then invokes done on that thread
+    void prefetch(std::function<void()> done = {});
+    // Frees the decoded pixels, if they can be decoded again. Returns the freed bytes
+    quint64 dropDecoded();
+
+    bool isDecoded() const;
+    quint64 encodedBytes() const;
+    quint64 decodedBytes() const;
+
+private:
+    LazyTile() = default;
+    Q_DISABLE_COPY(LazyTile)
+
+    mutable QMutex m_mutex;
+    QWaitCondition m_decodeFinished;
+    bool m_decoding{false};
+    QByteArray m_encoded;
+    bool m_mirror{false};
+    std::shared_ptr<QImage> m_image;
+};
+
+// Region of a progressive coverage that changed since the previous update
+struct CoveragePatch {
+    QImage pixels;      // same orientation of the final coverage. Null for progress only
+    QRect rect;         // destination of pixels within the coverage
+    QSize coverageSize;
+    QImage::Format format{QImage::Format_Invalid}; // of the coverage
+    quint64 done{0};    // tiles blitted so far
+    quint64 total{0};
+    bool failed{false}; // the request was dropped, no coverageReady follows
+};
+
 struct CompressedTextureData {
     CompressedTextureData() = default;
     virtual ~CompressedTextureData() = default;
@@ -122,6 +353,7 @@ struct CompressedTextureData {
                                               int layers) = 0;
     virtual QSize size() const = 0;
     virtual bool hasCompressedData() const = 0;
+    // The source image if retained, otherwise decoded from the compressed data
     virtual std::shared_ptr<QImage> image() const = 0;
     static bool isFormatCompressed(GLint format);
 };
@@ -140,10 +372,14 @@ class MapFetcher : public QObject {
                    READ overzoom
                    WRITE setOverzoom
                    NOTIFY overzoomChanged)
+    Q_PROPERTY(bool progressiveCoverage
+                   READ progressiveCoverage
+                   WRITE setProgressiveCoverage
+                   NOTIFY progressiveCoverageChanged)
 
 public:
     MapFetcher(QObject *parent);
-    ~MapFetcher() override = default;
+    ~MapFetcher() override;
 
     // destinationZoom is the zoom level of the physical geometry
     // onto which the tile is used as texture.
@@ -154,12 +390,33 @@ public:
                                            quint8 destinationZoom,
                                            bool compound = true);
 
+    // tileResolution > 0 decodes every tile at that size (at most the native one)
+    // and assembles the coverage at the reduced resolution. Meant for previews.
     Q_INVOKABLE quint64 requestCoverage(const QList<QGeoCoordinate> &crds,
                                         const quint8 zoom,
-                                        const bool clip = false);
+                                        const bool clip = false,
+                                        const int tileResolution = 0);
 
     std::shared_ptr<QImage> tile(quint64 id, const TileKey k);
+    // Peeks the tile without decoding it. tile() still has to be called to release it
+    std::shared_ptr<LazyTile> tileHandle(quint64 id, const TileKey k) const;
     std::shared_ptr<QImage> tileCoverage(quint64 id);
+    // The coverage assembled so far by a progressive request, without removing it.
+    // Not thread safe: the image is updated in place on coverageUpdated.
+    std::shared_ptr<const QImage> partialCoverage(quint64 id) const;
+
+    // Drops the decoded pixels of prefetched tiles not yet retrieved, least recently
+    // decoded first, until keepBytes remain. tile() decodes those again on the calling
+    // thread. Returns the freed bytes
+    quint64 releaseDecodedTiles(quint64 keepBytes = 0);
+    // Encoded tiles are otherwise decoded by the first tile() call. When prefetching,
+    // they are decoded on QThreadPool::globalInstance() as they arrive, and tileReady
+    // follows the decode, as long as the prefetched tiles not yet retrieved stay within
+    // the budget (0 for no limit). Past it, tiles are announced still encoded.
+    void setPrefetchTiles(bool enabled);
+    bool prefetchTiles() const;
+    void setDecodedTilesBudget(quint64 bytes);
+    quint64 decodedTilesBudget() const;
 
     void setURLTemplate(const QString &urlTemplate);
     QString urlTemplate() const;
@@ -170,10 +427,23 @@ public:
     void setOverzoom(bool enabled);
     int overzoom() const;
 
+    // Coverages requested from now on are blitted as tiles arrive, and
+    // coverageUpdated is emitted (throttled) with the changed region.
+    // Not supported by DEMFetcher and ASTCFetcher.
+    void setProgressiveCoverage(bool enabled);
+    bool progressiveCoverage() const;
+
     static quint8 zoomForCoverage(const QList<QGeoCoordinate> &crds,
                                   const size_t tileResolution,
                                   const size_t maxCoverageResolution,
                                   bool rectangular = false);
+    // Largest power of two tile resolution, up to nativeTileResolution, keeping
+    // the coverage at zoom within maxCoverageResolution. Pass it to requestCoverage.
+    // Passing it back to zoomForCoverage picks the zoom for that output size.
+    static quint16 tileResolutionForCoverage(const QList<QGeoCoordinate> &crds,
+                                             const quint8 zoom,
+                                             const size_t maxCoverageResolution,
+                                             const size_t nativeTileResolution = 256);
 
     static quint64 networkCacheSize();
     static QString networkCachePath();
@@ -184,14 +454,19 @@ signals:
     void tileReady(quint64 id, const TileKey k);
     void progress(quint64 id, QPair<quint64, quint64> operations);
     void coverageReady(quint64 id);
+    void coverageUpdated(quint64 id, const QRect dirty);
     void urlTemplateChanged();
     void requestHandlingFinished(quint64 id);
     void maximumZoomLevelChanged();
     void overzoomChanged();
+    void progressiveCoverageChanged();
 
 protected slots:
     virtual void onInsertTile(quint64 id, const TileKey k, std::shared_ptr<QImage> i);
+    void onInsertEncodedTile(quint64 id, const TileKey k, std::shared_ptr<QByteArray> data);
+    void onRequestHandlingFinished(quint64 id);
     void onInsertCoverage(quint64 id, std::shared_ptr<QImage> i);
+    void onUpdateCoverage(quint64 id, std::shared_ptr<CoveragePatch> patch);
 
 protected:
     MapFetcher(MapFetcherPrivate &dd, QObject *parent = nullptr);
@@ -208,6 +483,11 @@ class DEMFetcher : public MapFetcher {
     Q_DECLARE_PRIVATE(DEMFetcher)
     Q_OBJECT
 
+    Q_PROPERTY(bool quantizedHeightmaps
+               READ quantizedHeightmaps
+               WRITE setQuantizedHeightmaps
+               NOTIFY quantizedHeightmapsChanged)
+
 public:
     DEMFetcher(QObject *parent, bool borders=false);
     ~DEMFetcher() override = default;
@@ -215,15 +495,69 @@ public:
     std::shared_ptr<Heightmap> heightmap(quint64 id, const TileKey k);
     std::shared_ptr<Heightmap> heightmapCoverage(quint64 id);
 
+    // Coverage delivered as one HeightmapChunk per tile (heightmapChunkReady), and never
+    // assembled in memory. Complete on requestHandlingFinished
+    quint64 requestChunkedCoverage(const QList<QGeoCoordinate> &crds,
+                                   quint8 zoom,
+                                   bool clip = false);
+    std::shared_ptr<HeightmapChunk> heightmapChunk(quint64 id, const TileKey k);
+
     void setBorders(bool borders);
 
+    // Heightmaps delivered from now on are quantized to 16 bit (see Heightmap::quantize)
+    void setQuantizedHeightmaps(bool enabled);
+    bool quantizedHeightmaps() const;
+
+    // Computes TerrainProducts on the worker for every heightmap tile delivered from now on
+    void setTerrainProducts(bool enabled, const HillshadeParameters &params = {});
+    bool terrainProductsEnabled() const;
+    HillshadeParameters hillshadeParameters() const;
+    std::shared_ptr<TerrainProducts> terrainProducts(quint64 id, const TileKey k);
+
+    // Builds a TerrainRTIN for every heightmap tile delivered from now on, and a mesh
+    // from it within maxError metres. Meant for bordered fetchers, for crack free seams
+    void setHeightmapMeshes(bool enabled, float maxError = 1.f);
+    bool heightmapMeshesEnabled() const;
+    float heightmapMeshMaxError() const;
+    std::shared_ptr<HeightmapMesh> heightmapMesh(quint64 id, const TileKey k);
+
+    // Bilinear elevations at arbitrary points, from the zoom level tiles covering them.
+    // Only those tiles are fetched, and each is sampled as soon as it arrives. Points
+    // without data stay NaN. The request is complete on requestHandlingFinished.
+    quint64 requestElevations(const QVector<QGeoCoordinate> &points, quint8 zoom);
+    // Moves out what has been sampled so far
+    std::vector<float> elevations(quint64 id);
+
+    // Batch terrain queries over zoom level heightmaps, evaluated in parallel once every
+    // crossed tile is available. Decoded tiles are kept across requests.
+    quint64 requestProfiles(const QVector<QVector<QGeoCoordinate>> &polylines, quint8 zoom);
+    // Coordinate altitudes are antenna heights above ground (0 when unset). kFactor scales
+    // the earth radius for refraction, 0 for a flat earth.
+    quint64 requestLinesOfSight(const QVector<QPair<QGeoCoordinate, QGeoCoordinate>> &pairs,
+                                quint8 zoom,
+                                double kFactor = 4.0 / 3.0);
+    std::shared_ptr<TerrainQueryResults> terrainQueryResults(quint64 id);
+
 signals:
     void heightmapReady(quint64 id, const TileKey k);
     void heightmapCoverageReady(quint64 id);
+    void heightmapChunkReady(quint64 id, const TileKey k);
+    void quantizedHeightmapsChanged(bool enabled);
+    void terrainProductsReady(quint64 id, const TileKey k);
+    void terrainProductsChanged(bool enabled, HillshadeParameters params);
+    void heightmapMeshReady(quint64 id, const TileKey k);
+    void heightmapMeshesChanged(bool enabled, float maxError);
+    void elevationsUpdated(quint64 id, quint64 sampled, quint64 total);
+    void terrainQueryReady(quint64 id);
 
 protected slots:
     void onInsertHeightmap(quint64 id, const TileKey k, std::shared_ptr<Heightmap> h);
     void onInsertHeightmapCoverage(quint64 id, std::shared_ptr<Heightmap> h);
+    void onInsertHeightmapChunk(quint64 id, const TileKey k, std::shared_ptr<HeightmapChunk> c);
+    void onInsertTerrainProducts(quint64 id, const TileKey k, std::shared_ptr<TerrainProducts> p);
+    void onInsertHeightmapMesh(quint64 id, const TileKey k, std::shared_ptr<HeightmapMesh> m);
+    void onInsertElevations(quint64 id, std::shared_ptr<ElevationBatch> b);
+    void onInsertTerrainQueryResults(quint64 id, std::shared_ptr<TerrainQueryResults> r);
 
 protected:
     DEMFetcher(DEMFetcherPrivate &dd, QObject *parent = nullptr);
@@ -244,6 +578,23 @@ class ASTCFetcher : public MapFetcher {
                WRITE setForwardUncompressedTiles
                NOTIFY forwardUncompressedTilesChanged)
 public:
+    // Quality presets of the ASTC encoder
+    enum class Quality {
+        Fastest,
+        Fast,
+        Medium,
+        Thorough,
+        VeryThorough,
+        Exhaustive
+    };
+
+    // Mip generation filters, combinable
+    enum MipFilter {
+        BoxFilter = 0x0,
+        SRGBFilter = 0x1,         // average in linear light
+        PremultipliedAlpha = 0x2  // weight colors by alpha, for transparent tiles
+    };
+
     ASTCFetcher(QObject *parent);
     ~ASTCFetcher() override = default;
 
@@ -253,8 +604,24 @@ public:
     void setForwardUncompressedTiles(bool enabled);
     const QAtomicInt &forwardUncompressedTiles() const;
 
+    // ASTC block footprint and encoder quality, 0 (fastest) to 100 (exhaustive), for the
+    // textures compressed from now on. Default 8x8 at 85. False for invalid footprints
+    bool setCompression(const QSize &blockSize, float quality);
+    bool setCompression(const QSize &blockSize, Quality preset);
+    QSize blockSize() const;
+    float quality() const;
+    void setMipFilter(int filter); // MipFilter flags
+    int mipFilter() const;
+    // Keep the source images of compressed tiles. Off by default, as they take several times
+    // the compressed size: image() then decodes the first mip instead
+    void setRetainUncompressedImages(bool enabled);
+    bool retainUncompressedImages() const;
+
 signals:
     void forwardUncompressedTilesChanged(bool enabled);
+    void compressionChanged(const QSize &blockSize, float quality);
+    void mipFilterChanged(int filter);
+    void retainUncompressedImagesChanged(bool enabled);
 
 protected slots:
     void onInsertTile(const quint64 id, const TileKey k, std::shared_ptr<QImage> i) override;
@@ -278,5 +645,12 @@ Q_DECLARE_METATYPE(std::shared_ptr<QImage>)
 Q_DECLARE_METATYPE(std::shared_ptr<QByteArray>)
 Q_DECLARE_METATYPE(std::shared_ptr<CompressedTextureData>)
 Q_DECLARE_METATYPE(std::shared_ptr<Heightmap>)
+Q_DECLARE_METATYPE(std::shared_ptr<CoveragePatch>)
+Q_DECLARE_METATYPE(std::shared_ptr<TerrainProducts>)
+Q_DECLARE_METATYPE(HillshadeParameters)
+Q_DECLARE_METATYPE(std::shared_ptr<ElevationBatch>)
+Q_DECLARE_METATYPE(std::shared_ptr<TerrainQueryResults>)
+Q_DECLARE_METATYPE(std::shared_ptr<HeightmapMesh>)
+Q_DECLARE_METATYPE(std::shared_ptr<HeightmapChunk>)
 
 #endif
@@ -16,19 +16,7 @@ QT += gui-private # TODO: make this one conditional together with ASTC support (
 CONFIG += c++14
 QMAKE_CXXFLAGS += "-fno-sized-deallocation"
 
-mapfetcher_res.files = $$PWD/assets/white256.png \
-                       $$PWD/assets/white256_8x8.astc \
-                       $$PWD/assets/white128_8x8.astc \
-                       $$PWD/assets/white64_8x8.astc \
-                       $$PWD/assets/white32_8x8.astc \
-                       $$PWD/assets/white16_8x8.astc \
-                       $$PWD/assets/white8_8x8.astc \
-                       $$PWD/assets/transparent256_8x8.astc \
-                       $$PWD/assets/transparent128_8x8.astc \
-                       $$PWD/assets/transparent64_8x8.astc \
-                       $$PWD/assets/transparent32_8x8.astc \
-                       $$PWD/assets/transparent16_8x8.astc \
-                       $$PWD/assets/transparent8_8x8.astc
+mapfetcher_res.files = $$PWD/assets/white256.png
 mapfetcher_res.base = $$PWD/assets
 mapfetcher_res.prefix = /
 
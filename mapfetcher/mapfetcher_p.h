@@ -28,6 +28,7 @@
 #include <QQueue>
 #include <QThread>
 #include <QTimer>
+#include <QElapsedTimer>
 #include <QCoreApplication>
 #include <QtLocation/private/qgeotilespec_p.h>
 #include <unordered_map>
@@ -35,13 +36,103 @@
 #include <set>
 #include <queue>
 #include <unordered_set>
+#include <functional>
+#include <list>
 #include <private/qtexturefiledata_p.h>
 
 using HeightmapCache = std::unordered_map<TileKey, std::shared_ptr<Heightmap>>;
 using TileNeighborsMap = std::unordered_map<TileKey,
                             std::pair< Heightmap::Neighbors,
-                                       std::map<Heightmap::Neighbor, std::shared_ptr<QImage>>>>;
+                                       Heightmap::Borders>>;
 using TileCache = std::unordered_map<TileKey, std::shared_ptr<QImage>>;
+
+// Coordinates of an elevation request, in degrees
+struct ElevationPoints {
+    std::vector<double> latitudes;
+    std::vector<double> longitudes;
+};
+
+// Points of an elevation request falling in one tile, u/v being tile relative in [0, 1]
+struct ElevationSamples {
+    std::vector<quint32> indices;
+    std::vector<float> u;
+    std::vector<float> v;
+};
+
+struct ElevationQuery {
+    // Projects and buckets the points by the tile containing them
+    static ElevationQuery fromPoints(const ElevationPoints &points, quint8 zoom);
+
+    std::unordered_map<TileKey, std::shared_ptr<ElevationSamples>> tiles;
+    size_t numPoints{0};
+};
+
+// Normalized Web Mercator ([0, 1], y pointing south), vectorised
+void projectToMercator(const double *latitudes,
+                       const double *longitudes,
+                       size_t count,
+                       double *x,
+                       double *y);
+// Bilinear on a terrarium encoded tile
+std::shared_ptr<ElevationBatch> sampleElevations(const QImage &dem, const ElevationSamples &samples);
+
+struct TerrainQuery {
+    enum class Type {
+        Profiles,
+        LinesOfSight
+    };
+    // Every tile crossed by the paths
+    std::set<TileKey> tiles() const;
+    size_t size() const { return offsets.size() - 1; }
+
+    Type type{Type::Profiles};
+    quint8 zoom{0};
+    double kFactor{4.0 / 3.0};
+    // Vertices in normalized Web Mercator, path i spanning [offsets[i], offsets[i + 1])
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<float> heights; // above ground, lines of sight only
+    std::vector<quint32> offsets{0};
+};
+
+using TerrainTileSet = std::unordered_map<TileKey, std::shared_ptr<const Heightmap>>;
+
+// Calls f with each tile crossed by the segment, and the [t0, t1] stretch of it inside
+void tilesAlongSegment(double x0, double y0, double x1, double y1, quint8 zoom,
+                       const std::function<void(const TileKey &, double, double)> &f);
+// Fills results for paths [first, last). Results must be presized
+void evaluateTerrainQuery(const TerrainQuery &q,
+                          const TerrainTileSet &tiles,
+                          size_t first,
+                          size_t last,
+                          TerrainQueryResults &res);
+
+// Decoded heightmaps reused across terrain queries, least recently used evicted first
+class TerrainTileStore {
+public:
+    static constexpr size_t capacity = 512; // ~128MB of 256x256 tiles
+
+    std::shared_ptr<const Heightmap> find(const TileKey &k);
+    void insert(const TileKey &k, std::shared_ptr<const Heightmap> h);
+    // Drops everything when the tiles come from somewhere else
+    void setSource(const QString &urlTemplate);
+
+private:
+    QString m_urlTemplate;
+    std::list<TileKey> m_lru;
+    std::unordered_map<TileKey, std::pair<std::shared_ptr<const Heightmap>,
+                                          std::list<TileKey>::iterator>> m_tiles;
+};
+
+struct PendingTerrainQuery {
+    std::shared_ptr<const TerrainQuery> query;
+    std::shared_ptr<TerrainTileSet> tiles;
+    std::shared_ptr<TerrainQueryResults> results;
+    qint64 missingTiles{0};
+    qint64 pendingJobs{0};
+};
+
+using LazyTileCache = std::unordered_map<TileKey, std::shared_ptr<LazyTile>>;
 using TileCacheCache = std::unordered_map<TileKey, std::set<TileData>>;
 using TileCacheASTC = std::unordered_map<TileKey, std::shared_ptr<CompressedTextureData>>;
 
@@ -53,7 +144,11 @@ struct ThreadedJobData {
         DEMTileReply = 3,
         DEMReady = 4,
         Raster2ASTC = 5,
-        ASTCTileReply = 6
+        ASTCTileReply = 6,
+        TerrainProducts = 7,
+        ElevationSampling = 8,
+        TerrainQuery = 9,
+        HeightmapMesh = 10
     };
 
     virtual ~ThreadedJobData() {}
@@ -181,15 +276,40 @@ public:
 
     virtual quint64 requestCoverage(const QList<QGeoCoordinate> &crds,
                                     const quint8 zoom,
-                                    bool clip);
+                                    bool clip,
+                                    quint16 tileResolution);
 
     QString objectName() const;
+    // Emits tileReady for a prefetched tile, and requestHandlingFinished after the last one
+    void onTileDecoded(quint64 id, const TileKey k, const std::shared_ptr<LazyTile> &tile);
+    // Removes the tile from m_decodedTiles, if prefetched
+    void forgetDecoded(const LazyTile *tile);
+
+    // Cleared when the fetcher is destroyed, so that decodes finishing later don't reach it
+    struct DecodeGuard {
+        QMutex mutex;
+        MapFetcher *fetcher{nullptr};
+    };
 
     QString m_urlTemplate;
     int m_maximumZoomLevel{19};
     bool m_overzoom{false};
-
-    std::map<quint64, TileCache> m_tileCache;
+    bool m_progressiveCoverage{false};
+
+    std::map<quint64, LazyTileCache> m_tileCache;
+    std::shared_ptr<DecodeGuard> m_decodeGuard{std::make_shared<DecodeGuard>()};
+    bool m_prefetchTiles{false};
+    quint64 m_decodedTilesBudget{64 * 1024 * 1024};
+    // Prefetched tiles not yet retrieved, most recently decoded first
+    struct DecodedTile {
+        std::shared_ptr<LazyTile> tile;
+        quint64 bytes;
+    };
+    std::list<DecodedTile> m_decodedTiles;
+    std::unordered_map<const LazyTile *, std::list<DecodedTile>::iterator> m_decodedIndex;
+    quint64 m_decodedBytes{0};
+    std::unordered_map<quint64, int> m_pendingDecodes;
+    std::unordered_set<quint64> m_finishedRequests; // waiting for pending decodes
     std::map<quint64, std::shared_ptr<QImage>> m_coverages;
     const QImage m_empty;
 };
@@ -209,11 +329,22 @@ public:
 
     quint64 requestCoverage(const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            bool clip) override;
+                            bool clip,
+                            quint16 tileResolution) override;
 
     std::map<quint64, HeightmapCache> m_heightmapCache;
     std::map<quint64, std::shared_ptr<Heightmap>> m_heightmapCoverages;
+    std::map<quint64, std::unordered_map<TileKey, std::shared_ptr<HeightmapChunk>>> m_heightmapChunks;
+    std::map<quint64, std::unordered_map<TileKey, std::shared_ptr<TerrainProducts>>> m_terrainProductsCache;
+    std::map<quint64, std::unordered_map<TileKey, std::shared_ptr<HeightmapMesh>>> m_heightmapMeshCache;
     bool m_borders{true};
+    bool m_quantize{false};
+    bool m_terrainProducts{false};
+    HillshadeParameters m_hillshade;
+    bool m_meshes{false};
+    float m_meshMaxError{1.f};
+    std::map<quint64, std::vector<float>> m_elevations;
+    std::map<quint64, std::shared_ptr<TerrainQueryResults>> m_terrainQueryResults;
 };
 
 struct ASTCCompressedTextureData : public CompressedTextureData {
@@ -226,16 +357,19 @@ struct ASTCCompressedTextureData : public CompressedTextureData {
                                       int layers) override;
     QSize size() const override;
     bool hasCompressedData() const override;
-    std::shared_ptr<QImage> image() const override {
-        return m_image;
-    }
+    std::shared_ptr<QImage> image() const override;
 
+    // m_image is released once the mips exist, unless retainImage
     static std::shared_ptr<ASTCCompressedTextureData> fromImage(
                                         const std::shared_ptr<QImage> &i,
                                         qint64 x,
                                         qint64 y,
                                         qint64 z,
-                                        QByteArray md5);
+                                        QByteArray md5,
+                                        const QSize &blockSize,
+                                        float quality,
+                                        int mipFilter,
+                                        bool retainImage = false);
 
     std::shared_ptr<QImage> m_image;
     std::vector<QTextureFileData> m_mips;
@@ -243,8 +377,22 @@ struct ASTCCompressedTextureData : public CompressedTextureData {
     void initStatics();
 
     static std::vector<QImage> m_white256;
-    static std::vector<QTextureFileData> m_white8x8ASTC;
-    static std::vector<QTextureFileData> m_transparent8x8ASTC;
+};
+
+// Same uploads, with BC1/BC3/BC7 mips for GPUs without ASTC
+struct BCnCompressedTextureData : public ASTCCompressedTextureData {
+    BCnCompressedTextureData() = default;
+    ~BCnCompressedTextureData() override = default;
+
+    static std::shared_ptr<BCnCompressedTextureData> fromImage(
+                                        const std::shared_ptr<QImage> &i,
+                                        qint64 x,
+                                        qint64 y,
+                                        qint64 z,
+                                        QByteArray md5,
+                                        quint32 format,
+                                        int mipFilter,
+                                        bool retainImage = false);
 };
 
 class ASTCFetcherPrivate :  public MapFetcherPrivate
@@ -263,11 +411,19 @@ public:
 
     quint64 requestCoverage(const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            bool clip) override;
+                            bool clip,
+                            quint16 tileResolution) override;
 
     std::map<quint64, TileCacheASTC> m_tileCacheASTC;
     std::map<quint64, std::shared_ptr<CompressedTextureData>> m_coveragesASTC;
     QAtomicInt m_forwardUncompressed{false};
+    // The settings below are written on the fetcher's thread, and read also by
+    // ASTCFetcherWorker's constructor on the network thread
+    mutable QMutex m_settingsMutex;
+    QSize m_blockSize{8, 8};
+    float m_quality{85.f};
+    int m_mipFilter{ASTCFetcher::BoxFilter};
+    bool m_retainUncompressed{false};
 };
 
 class MapFetcherWorkerPrivate;
@@ -292,7 +448,9 @@ public:
     void requestCoverage(quint64 requestId,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false);
+                            const bool clip = false,
+                            const quint16 tileResolution = 0,
+                            const bool progressive = false);
 
     std::shared_ptr<QImage> tile(quint64 requestId, const TileKey &k);
 
@@ -308,6 +466,8 @@ signals:
                                  std::shared_ptr<QByteArray>);
     void coverageReady(quint64 id,
                        std::shared_ptr<QImage>);
+    void coverageUpdated(quint64 id,
+                         std::shared_ptr<CoveragePatch>);
     void requestHandlingFinished(quint64 id);
 
 protected slots:
@@ -316,6 +476,7 @@ protected slots:
     void onInsertTile(const quint64 id, const TileKey k, std::shared_ptr<QImage> i, QByteArray md5);
     void onInsertCompressedTileData(const quint64 id, const TileKey k, std::shared_ptr<QByteArray> data);
     void onInsertCoverage(const quint64 id, std::shared_ptr<QImage> i);
+    void onUpdateCoverage(const quint64 id, std::shared_ptr<CoveragePatch> p);
     void networkReplyError(QNetworkReply::NetworkError);
 
 protected:
@@ -327,6 +488,21 @@ private:
 friend class TileReplyHandler;
 friend class NetworkIOManager;
 };
+// Mosaic of a progressive coverage request, owned by the (single-threaded) worker queue
+struct ProgressiveCoverage {
+    static constexpr qint64 updateInterval = 100; // ms between coverageUpdated
+
+    quint64 minX{0};
+    quint64 minY{0};
+    quint64 hTiles{0};
+    quint64 vTiles{0};
+    quint64 done{0};
+    QImage mosaic;  // unclipped, unmirrored. Allocated with the first tile
+    QRect clipRect; // mosaic region returned as coverage
+    QRect dirty;    // mosaic region not yet sent to the front end
+    QElapsedTimer lastUpdate;
+};
+
 class MapFetcherWorkerPrivate :  public QObjectPrivate
 {
     Q_DECLARE_PUBLIC(MapFetcherWorker)
@@ -341,6 +517,10 @@ public:
                                 const TileKey &,
                                 Heightmap::Neighbors,
                                 quint8) {}
+    // Produces k without fetching it, e.g. from a persistent store. True if it did
+    virtual bool loadProcessedTile(quint64,
+                                   const TileKey &,
+                                   Heightmap::Neighbors) { return false; }
     QString objectName() const;
 
     QString m_urlTemplate;
@@ -351,9 +531,11 @@ public:
     std::unordered_map<quint64, std::tuple<QList<QGeoCoordinate>,  // polygon
                                  quint8,          // zoom
                                  quint64,         // numTiles
-                                 bool             // clip
+                                 bool,            // clip
+                                 quint16          // tileResolution, 0 = native
                                 >> m_requests;
     std::unordered_map<quint64, std::set<TileData>> m_tileSets;
+    std::unordered_map<quint64, ProgressiveCoverage> m_progressiveCoverages;
 
     QSharedPointer<ThreadedJobQueue> m_worker; // TODO: figure how to use a qthreadpool and move qobjects to it
     MapFetcher *m_fetcher{nullptr};
@@ -372,28 +554,66 @@ class DEMFetcherWorker : public MapFetcherWorker {
     Q_OBJECT
 
 public:
-    DEMFetcherWorker(QObject *parent, DEMFetcher *f, QSharedPointer<ThreadedJobQueue> worker, bool borders=false);
+    DEMFetcherWorker(QObject *parent,
+                     DEMFetcher *f,
+                     QSharedPointer<ThreadedJobQueue> worker,
+                     QSharedPointer<ThreadedJobQueue> workerQueries,
+                     bool borders=false);
     ~DEMFetcherWorker() override = default;
 
     std::shared_ptr<Heightmap> heightmap(const TileKey k);
     std::shared_ptr<Heightmap> heightmapCoverage(quint64 id);
 
+    Q_INVOKABLE void setQuantize(bool enabled);
+    Q_INVOKABLE void setTerrainProducts(bool enabled, HillshadeParameters params);
+    Q_INVOKABLE void setHeightmapMeshes(bool enabled, float maxError);
+
+    void requestElevations(quint64 requestId,
+                           std::shared_ptr<ElevationPoints> points,
+                           const quint8 zoom);
+    void requestTerrainQuery(quint64 requestId,
+                             std::shared_ptr<TerrainQuery> query);
+    void requestChunkedCoverage(quint64 requestId,
+                                const QList<QGeoCoordinate> &crds,
+                                const quint8 zoom,
+                                bool clip);
+
 signals:
     void heightmapReady(quint64 id, const TileKey k, std::shared_ptr<Heightmap>);
     void heightmapCoverageReady(quint64 id, std::shared_ptr<Heightmap>);
+    void heightmapChunkReady(quint64 id, const TileKey k, std::shared_ptr<HeightmapChunk>);
+    void terrainProductsReady(quint64 id, const TileKey k, std::shared_ptr<TerrainProducts>);
+    void heightmapMeshReady(quint64 id, const TileKey k, std::shared_ptr<HeightmapMesh>);
+    void elevationsReady(quint64 id, std::shared_ptr<ElevationBatch>);
+    void terrainQueryReady(quint64 id, std::shared_ptr<TerrainQueryResults>);
 
 protected slots:
     void onTileReady(quint64 id, const TileKey k,  std::shared_ptr<QImage> i);
     void onCoverageReady(quint64 id,  std::shared_ptr<QImage> i);
     void onInsertHeightmap(quint64 id, const TileKey k, std::shared_ptr<Heightmap> h);
     void onInsertHeightmapCoverage(quint64 id, std::shared_ptr<Heightmap> h);
+    void onInsertTerrainProducts(quint64 id, const TileKey k, std::shared_ptr<TerrainProducts> p);
+    void onInsertHeightmapMesh(quint64 id, const TileKey k, std::shared_ptr<HeightmapMesh> m);
+    void onInsertElevations(quint64 id, std::shared_ptr<ElevationBatch> b);
+    void onTerrainQueryJobFinished(quint64 id);
 
 protected:
 //    DEMFetcherWorker(DEMFetcherWorkerPrivate &dd, QObject *parent = nullptr);
     void init();
+    // Stores a tile of a pending terrain query (null when it could not be fetched)
+    void insertTerrainTile(quint64 id, const TileKey &k, std::shared_ptr<const Heightmap> h);
+    void dispatchTerrainQuery(quint64 id);
+    // Crops a tile of a chunked coverage to the coverage and emits it (null when unavailable)
+    void insertCoverageChunk(quint64 id, const TileKey &k, std::shared_ptr<Heightmap> h);
+    // Emits a heightmap that is final, decoded or loaded from the HeightmapStore
+    void deliverHeightmap(quint64 id, const TileKey &k, std::shared_ptr<Heightmap> h);
 private:
     Q_DISABLE_COPY(DEMFetcherWorker)
 friend class DEMReadyHandler;
+friend class TerrainProductsHandler;
+friend class HeightmapMeshHandler;
+friend class ElevationSamplingHandler;
+friend class TerrainQueryHandler;
 friend class NetworkIOManager;
 friend class MapFetcherWorker;
 };
@@ -408,17 +628,35 @@ public:
                         const TileKey &k,
                         Heightmap::Neighbors n,
                         quint8 destinationZoom) override;
+    bool loadProcessedTile(quint64 id,
+                           const TileKey &k,
+                           Heightmap::Neighbors n) override;
 
     void insertNeighbors(quint64 id,
                          const TileKey &k,
-                         Heightmap::Neighbors n,
-                         std::map<Heightmap::Neighbor, std::shared_ptr<QImage>> boundaryRasters);
+                         Heightmap::Neighbors n);
 
     std::unordered_map<quint64, TileNeighborsMap> m_request2Neighbors;
     std::unordered_map<quint64, HeightmapCache> m_heightmapCache;
     std::unordered_map<quint64, std::shared_ptr<Heightmap>> m_heightmapCoverages;
     std::unordered_map<quint64, qint64> m_request2remainingDEMHandlers;
     bool m_borders{false};
+    bool m_quantize{false};
+    bool m_terrainProducts{false};
+    HillshadeParameters m_hillshade;
+    bool m_meshes{false};
+    float m_meshMaxError{1.f};
+    std::unordered_map<quint64, ElevationQuery> m_elevationQueries;
+    std::unordered_map<quint64, PendingTerrainQuery> m_terrainQueries;
+    struct ChunkedCoverage {
+        QList<QGeoCoordinate> crds;
+        quint8 zoom;
+        bool clip;
+        quint64 minX, maxX, minY, maxY;
+    };
+    std::unordered_map<quint64, ChunkedCoverage> m_chunkedCoverages;
+    TerrainTileStore m_terrainTiles;
+    QSharedPointer<ThreadedJobQueue> m_workerQueries;
 };
 
 class ASTCFetcherWorkerPrivate;
@@ -435,6 +673,9 @@ public:
 
     Q_INVOKABLE void setForwardUncompressed(bool enabled);
     bool forwardUncompressed() const;
+    Q_INVOKABLE void setCompression(const QSize &blockSize, float quality);
+    Q_INVOKABLE void setMipFilter(int filter);
+    Q_INVOKABLE void setRetainUncompressedImages(bool enabled);
 
 signals:
     void tileASTCReady(quint64 id, const TileKey k, std::shared_ptr<CompressedTextureData>);
@@ -446,6 +687,7 @@ protected slots:
     void onCoverageReady(quint64 id,  std::shared_ptr<QImage> i);
     void onInsertTileASTC(quint64 id, const TileKey k, std::shared_ptr<CompressedTextureData> h);
     void onInsertCoverageASTC(quint64 id, std::shared_ptr<CompressedTextureData> h);
+    void schedulePendingASTC();
 
 protected:
     void init();
@@ -465,8 +707,14 @@ public:
     ~ASTCFetcherWorkerPrivate() override = default;
 
     bool m_forwardUncompressed{false};
+    QSize m_blockSize{8, 8};
+    float m_quality{85.f};
+    int m_mipFilter{ASTCFetcher::BoxFilter};
+    bool m_retainUncompressed{false};
     std::unordered_map<quint64, qint64> m_request2remainingASTCHandlers;
     QSharedPointer<ThreadedJobQueue> m_workerASTC;
+    // Tiles ready in the same event loop pass, checked against the ASTC cache at once
+    std::vector<Raster2ASTCData *> m_pendingASTC;
 };
 
 class NetworkIOManager: public QObject //living in a separate thread
@@ -490,7 +738,9 @@ public slots:
                             quint64 requestId,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false);
+                            const bool clip = false,
+                            const quint16 tileResolution = 0,
+                            const bool progressive = false);
 
 
     void requestSlippyTiles(DEMFetcher *demFetcher,
@@ -503,7 +753,23 @@ public slots:
                             quint64 requestId,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false);
+                            const bool clip = false,
+                            const quint16 tileResolution = 0);
+
+    void requestElevations(DEMFetcher *demFetcher,
+                           quint64 requestId,
+                           std::shared_ptr<ElevationPoints> points,
+                           const quint8 zoom);
+
+    void requestTerrainQuery(DEMFetcher *demFetcher,
+                             quint64 requestId,
+                             std::shared_ptr<TerrainQuery> query);
+
+    void requestChunkedCoverage(DEMFetcher *demFetcher,
+                                quint64 requestId,
+                                const QList<QGeoCoordinate> &crds,
+                                const quint8 zoom,
+                                const bool clip);
 
     void requestSlippyTiles(ASTCFetcher *fetcher,
                             quint64 requestId,
@@ -516,7 +782,8 @@ public slots:
                             quint64 requestId,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false);
+                            const bool clip = false,
+                            const quint16 tileResolution = 0);
 
     quint64 cacheSize();
 
@@ -537,6 +804,7 @@ protected:
 protected:
     QSharedPointer<ThreadedJobQueue> m_worker; // TODO: figure how to use a qthreadpool and move qobjects to it
     QSharedPointer<ThreadedJobQueue> m_workerASTC;
+    QSharedPointer<ThreadedJobQueue> m_workerQueries;
 
     std::unordered_map<MapFetcher *, MapFetcherWorker *> m_mapFetcher2Worker;
     std::unordered_map<DEMFetcher *, DEMFetcherWorker *> m_demFetcher2Worker;
@@ -579,14 +847,18 @@ public:
     quint64 requestCoverage(MapFetcher &mapFetcher,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false) {
+                            const bool clip = false,
+                            const quint16 tileResolution = 0,
+                            const bool progressive = false) {
         auto requestId = m_requestID++;
         QMetaObject::invokeMethod(m_manager.get(), "requestCoverage", Qt::QueuedConnection
                                   , Q_ARG(MapFetcher *, &mapFetcher)
                                   , Q_ARG(qulonglong, requestId)
                                   , Q_ARG(QList<QGeoCoordinate>, crds)
                                   , Q_ARG(uchar, zoom)
-                                  , Q_ARG(bool, clip));
+                                  , Q_ARG(bool, clip)
+                                  , Q_ARG(ushort, tileResolution)
+                                  , Q_ARG(bool, progressive));
         return requestId;
     }
 
@@ -607,9 +879,47 @@ public:
     quint64 requestCoverage(DEMFetcher &demFetcher,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false) {
+                            const bool clip = false,
+                            const quint16 tileResolution = 0) {
         auto requestId = m_requestID++;
         QMetaObject::invokeMethod(m_manager.get(), "requestCoverage", Qt::QueuedConnection
+                                  , Q_ARG(DEMFetcher *, &demFetcher)
+                                  , Q_ARG(qulonglong, requestId)
+                                  , Q_ARG(QList<QGeoCoordinate>, crds)
+                                  , Q_ARG(uchar, zoom)
+                                  , Q_ARG(bool, clip)
+                                  , Q_ARG(ushort, tileResolution));
+        return requestId;
+    }
+
+    quint64 requestElevations(DEMFetcher &demFetcher,
+                              std::shared_ptr<ElevationPoints> points,
+                              const quint8 zoom) {
+        auto requestId = m_requestID++;
+        QMetaObject::invokeMethod(m_manager.get(), "requestElevations", Qt::QueuedConnection
+                                  , Q_ARG(DEMFetcher *, &demFetcher)
+                                  , Q_ARG(qulonglong, requestId)
+                                  , Q_ARG(std::shared_ptr<ElevationPoints>, points)
+                                  , Q_ARG(uchar, zoom));
+        return requestId;
+    }
+
+    quint64 requestTerrainQuery(DEMFetcher &demFetcher,
+                                std::shared_ptr<TerrainQuery> query) {
+        auto requestId = m_requestID++;
+        QMetaObject::invokeMethod(m_manager.get(), "requestTerrainQuery", Qt::QueuedConnection
+                                  , Q_ARG(DEMFetcher *, &demFetcher)
+                                  , Q_ARG(qulonglong, requestId)
+                                  , Q_ARG(std::shared_ptr<TerrainQuery>, query));
+        return requestId;
+    }
+
+    quint64 requestChunkedCoverage(DEMFetcher &demFetcher,
+                                   const QList<QGeoCoordinate> &crds,
+                                   const quint8 zoom,
+                                   const bool clip) {
+        auto requestId = m_requestID++;
+        QMetaObject::invokeMethod(m_manager.get(), "requestChunkedCoverage", Qt::QueuedConnection
                                   , Q_ARG(DEMFetcher *, &demFetcher)
                                   , Q_ARG(qulonglong, requestId)
                                   , Q_ARG(QList<QGeoCoordinate>, crds)
@@ -637,14 +947,16 @@ public:
     quint64 requestCoverage(ASTCFetcher &fetcher,
                             const QList<QGeoCoordinate> &crds,
                             const quint8 zoom,
-                            const bool clip = false) {
+                            const bool clip = false,
+                            const quint16 tileResolution = 0) {
         auto requestId = m_requestID++;
         QMetaObject::invokeMethod(m_manager.get(), "requestCoverage", Qt::QueuedConnection
                                   , Q_ARG(ASTCFetcher *, &fetcher)
                                   , Q_ARG(qulonglong, requestId)
                                   , Q_ARG(QList<QGeoCoordinate>, crds)
                                   , Q_ARG(uchar, zoom)
-                                  , Q_ARG(bool, clip));
+                                  , Q_ARG(bool, clip)
+                                  , Q_ARG(ushort, tileResolution));
         return requestId;
     }
 
@@ -693,6 +1005,7 @@ signals:
     void insertTile(quint64 id, TileKey k, std::shared_ptr<QImage> i, QByteArray md5 = {});
     void insertCompressedTileData(quint64 id, TileKey k, std::shared_ptr<QByteArray> d);
     void insertCoverage(quint64 id, std::shared_ptr<QImage> i);
+    void updateCoverage(quint64 id, std::shared_ptr<CoveragePatch> p);
     void expectingMoreSubtiles();
 
 public slots:
@@ -702,11 +1015,13 @@ protected:
     void processStandaloneTile();
     void processCoverageTile();
     void finalizeCoverageRequest(quint64 id);
+    void blitProgressiveCoverage(quint64 id, const TileKey &k, const QImage &tile);
+    void flushProgressiveCoverage(quint64 id, ProgressiveCoverage &coverage);
 
     QNetworkReply *m_reply{nullptr};
     MapFetcherWorker *m_mapFetcher{nullptr};
     bool m_computeHash{true}; // it's currently only false for DEM, so it tells whether it is a DEM image
-    bool m_emitUncompressedData{false};
+    bool m_emitUncompressedData{true}; // decoding deferred to the consumer. Only DEM decodes right away
     bool m_dem{false};
 };
 
@@ -821,7 +1136,8 @@ public:
                     DEMFetcherWorker &demFetcher,
                     quint64 id,
                     bool coverage,
-                    std::map<Heightmap::Neighbor, std::shared_ptr<QImage>> neighbors = {});
+                    std::unique_ptr<Heightmap::Borders> neighbors = {},
+                    bool quantize = false);
 
     ~DEMReadyHandler() override = default;
     static int priority() { return 8; }
@@ -842,7 +1158,8 @@ private:
     quint64 m_requestId{0};
     bool m_coverage;
     TileKey m_key;
-    std::map<Heightmap::Neighbor, std::shared_ptr<QImage> > m_neighbors;
+    std::unique_ptr<Heightmap::Borders> m_neighbors; // null for borderless heightmaps
+    bool m_quantize{false};
 };
 
 struct DEMReadyData : public ThreadedJobData {
@@ -851,7 +1168,7 @@ struct DEMReadyData : public ThreadedJobData {
                      DEMFetcherWorker &demFetcher,
                      quint64 id,
                      bool coverage,
-                     std::map<Heightmap::Neighbor, std::shared_ptr<QImage>> neighbors = {})
+                     std::unique_ptr<Heightmap::Borders> neighbors = {})
    : ThreadedJobData()
     , m_demImage(std::move(demImage)), m_k(k), m_demFetcher(demFetcher), m_id(id)
     , m_coverage(coverage), m_neighbors(std::move(neighbors))
@@ -866,7 +1183,206 @@ struct DEMReadyData : public ThreadedJobData {
     DEMFetcherWorker &m_demFetcher;
     quint64 m_id;
     bool m_coverage;
-    std::map<Heightmap::Neighbor, std::shared_ptr<QImage>> m_neighbors;
+    std::unique_ptr<Heightmap::Borders> m_neighbors;
+    bool m_quantize{false}; // copied from the worker, as the job runs on another thread
+};
+
+class TerrainProductsHandler : public ThreadedJob
+{
+    Q_OBJECT
+public:
+    TerrainProductsHandler(std::shared_ptr<const Heightmap> h,
+                           const TileKey k,
+                           DEMFetcherWorker &demFetcher,
+                           quint64 id,
+                           const HillshadeParameters &params);
+
+    ~TerrainProductsHandler() override = default;
+    static int priority() { return 11; } // after all tile and heightmap work
+
+signals:
+    void insertTerrainProducts(quint64 id, const TileKey k, std::shared_ptr<TerrainProducts> p);
+
+public slots:
+    void process() override;
+
+private:
+    DEMFetcherWorker *m_demFetcher{nullptr};
+    std::shared_ptr<const Heightmap> m_heightmap;
+    quint64 m_requestId{0};
+    TileKey m_key;
+    HillshadeParameters m_params;
+};
+
+struct TerrainProductsData : public ThreadedJobData {
+    TerrainProductsData(std::shared_ptr<const Heightmap> h,
+                        const TileKey k,
+                        DEMFetcherWorker &demFetcher,
+                        quint64 id,
+                        const HillshadeParameters &params)
+    : ThreadedJobData()
+    , m_heightmap(std::move(h)), m_k(k), m_demFetcher(demFetcher), m_id(id), m_params(params)
+    {}
+    ~TerrainProductsData() override {}
+    int priority() const override { return TerrainProductsHandler::priority(); }
+
+    JobType type() const override { return JobType::TerrainProducts; }
+
+    std::shared_ptr<const Heightmap> m_heightmap;
+    const TileKey m_k;
+    DEMFetcherWorker &m_demFetcher;
+    quint64 m_id;
+    HillshadeParameters m_params;
+};
+
+class HeightmapMeshHandler : public ThreadedJob
+{
+    Q_OBJECT
+public:
+    HeightmapMeshHandler(std::shared_ptr<const Heightmap> h,
+                         const TileKey k,
+                         DEMFetcherWorker &demFetcher,
+                         quint64 id,
+                         float maxError);
+
+    ~HeightmapMeshHandler() override = default;
+    static int priority() { return 11; } // after all tile and heightmap work
+
+signals:
+    void insertHeightmapMesh(quint64 id, const TileKey k, std::shared_ptr<HeightmapMesh> m);
+
+public slots:
+    void process() override;
+
+private:
+    DEMFetcherWorker *m_demFetcher{nullptr};
+    std::shared_ptr<const Heightmap> m_heightmap;
+    quint64 m_requestId{0};
+    TileKey m_key;
+    float m_maxError{1.f};
+};
+
+struct HeightmapMeshData : public ThreadedJobData {
+    HeightmapMeshData(std::shared_ptr<const Heightmap> h,
+                      const TileKey k,
+                      DEMFetcherWorker &demFetcher,
+                      quint64 id,
+                      float maxError)
+    : ThreadedJobData()
+    , m_heightmap(std::move(h)), m_k(k), m_demFetcher(demFetcher), m_id(id), m_maxError(maxError)
+    {}
+    ~HeightmapMeshData() override {}
+    int priority() const override { return HeightmapMeshHandler::priority(); }
+
+    JobType type() const override { return JobType::HeightmapMesh; }
+
+    std::shared_ptr<const Heightmap> m_heightmap;
+    const TileKey m_k;
+    DEMFetcherWorker &m_demFetcher;
+    quint64 m_id;
+    float m_maxError;
+};
+
+class ElevationSamplingHandler : public ThreadedJob
+{
+    Q_OBJECT
+public:
+    ElevationSamplingHandler(std::shared_ptr<QImage> demImage,
+                             std::shared_ptr<ElevationSamples> samples,
+                             DEMFetcherWorker &demFetcher,
+                             quint64 id);
+
+    ~ElevationSamplingHandler() override = default;
+    static int priority() { return DEMReadyHandler::priority(); }
+
+signals:
+    void insertElevations(quint64 id, std::shared_ptr<ElevationBatch> b);
+
+public slots:
+    void process() override;
+
+private:
+    DEMFetcherWorker *m_demFetcher{nullptr};
+    std::shared_ptr<QImage> m_demImage;
+    std::shared_ptr<ElevationSamples> m_samples;
+    quint64 m_requestId{0};
+};
+
+struct ElevationSamplingData : public ThreadedJobData {
+    ElevationSamplingData(std::shared_ptr<QImage> demImage,
+                          std::shared_ptr<ElevationSamples> samples,
+                          DEMFetcherWorker &demFetcher,
+                          quint64 id)
+    : ThreadedJobData()
+    , m_demImage(std::move(demImage)), m_samples(std::move(samples))
+    , m_demFetcher(demFetcher), m_id(id)
+    {}
+    ~ElevationSamplingData() override {}
+    int priority() const override { return ElevationSamplingHandler::priority(); }
+
+    JobType type() const override { return JobType::ElevationSampling; }
+
+    std::shared_ptr<QImage> m_demImage;
+    std::shared_ptr<ElevationSamples> m_samples;
+    DEMFetcherWorker &m_demFetcher;
+    quint64 m_id;
+};
+
+class TerrainQueryHandler : public ThreadedJob
+{
+    Q_OBJECT
+public:
+    TerrainQueryHandler(std::shared_ptr<const TerrainQuery> query,
+                        std::shared_ptr<const TerrainTileSet> tiles,
+                        std::shared_ptr<TerrainQueryResults> results,
+                        size_t first,
+                        size_t last,
+                        DEMFetcherWorker &demFetcher,
+                        quint64 id);
+
+    ~TerrainQueryHandler() override = default;
+    static int priority() { return DEMReadyHandler::priority(); }
+
+signals:
+    void queryFinished(quint64 id);
+
+public slots:
+    void process() override;
+
+private:
+    DEMFetcherWorker *m_demFetcher{nullptr};
+    std::shared_ptr<const TerrainQuery> m_query;
+    std::shared_ptr<const TerrainTileSet> m_tiles;
+    std::shared_ptr<TerrainQueryResults> m_results; // each job writes its own [first, last)
+    size_t m_first{0};
+    size_t m_last{0};
+    quint64 m_requestId{0};
+};
+
+struct TerrainQueryData : public ThreadedJobData {
+    TerrainQueryData(std::shared_ptr<const TerrainQuery> query,
+                     std::shared_ptr<const TerrainTileSet> tiles,
+                     std::shared_ptr<TerrainQueryResults> results,
+                     size_t first,
+                     size_t last,
+                     DEMFetcherWorker &demFetcher,
+                     quint64 id)
+    : ThreadedJobData()
+    , m_query(std::move(query)), m_tiles(std::move(tiles)), m_results(std::move(results))
+    , m_first(first), m_last(last), m_demFetcher(demFetcher), m_id(id)
+    {}
+    ~TerrainQueryData() override {}
+    int priority() const override { return TerrainQueryHandler::priority(); }
+
+    JobType type() const override { return JobType::TerrainQuery; }
+
+    std::shared_ptr<const TerrainQuery> m_query;
+    std::shared_ptr<const TerrainTileSet> m_tiles;
+    std::shared_ptr<TerrainQueryResults> m_results;
+    size_t m_first;
+    size_t m_last;
+    DEMFetcherWorker &m_demFetcher;
+    quint64 m_id;
 };
 
 struct Raster2ASTCData : public ThreadedJobData {
@@ -875,20 +1391,27 @@ struct Raster2ASTCData : public ThreadedJobData {
                     ASTCFetcherWorker &fetcher,
                     quint64 id,
                     bool coverage,
-                    QByteArray md5)
+                    QByteArray md5,
+                    const QSize &blockSize,
+                    float quality,
+                    int mipFilter)
    : ThreadedJobData()
    , m_rasterImage(std::move(rasterImage)), m_k(k), m_fetcher(fetcher), m_id(id)
-   , m_coverage(coverage), m_md5(std::move(md5))
+   , m_coverage(coverage), m_md5(std::move(md5)), m_blockSize(blockSize), m_quality(quality)
+   , m_mipFilter(mipFilter)
    {}
 
     Raster2ASTCData(std::shared_ptr<QByteArray> compressedImage,
                     const TileKey k,
                     ASTCFetcherWorker &fetcher,
                     quint64 id,
-                    bool coverage)
+                    bool coverage,
+                    const QSize &blockSize,
+                    float quality,
+                    int mipFilter)
    : ThreadedJobData()
    , m_compressedRaster(std::move(compressedImage)), m_k(k), m_fetcher(fetcher), m_id(id)
-   , m_coverage(coverage)
+   , m_coverage(coverage), m_blockSize(blockSize), m_quality(quality), m_mipFilter(mipFilter)
    {}
 
     ~Raster2ASTCData() override {}
@@ -902,6 +1425,11 @@ struct Raster2ASTCData : public ThreadedJobData {
     quint64 m_id;
     bool m_coverage;
     QByteArray m_md5;
+    QSize m_blockSize;
+    float m_quality;
+    int m_mipFilter;
+    bool m_retainImage{false};
+    bool m_cached{false}; // the chain is in the ASTC cache, no compression needed
 };
 
 class Raster2ASTCHandler : public ThreadedJob
@@ -915,6 +1443,7 @@ public:
         return d->m_k;
     }
     static int priority() { return 9; }
+    static int cachedPriority() { return 8; } // cache reads ahead of compressions
 
 signals:
     void insertTileASTC(quint64 id, const TileKey k, std::shared_ptr<CompressedTextureData> i);
@@ -928,6 +1457,9 @@ private:
 };
 
 
+Q_DECLARE_METATYPE(std::shared_ptr<ElevationPoints>)
+Q_DECLARE_METATYPE(std::shared_ptr<TerrainQuery>)
+
 inline uint qHash (const QPoint & key)
 {
     return qHash (QPair<int,int>(key.x(), key.y()) );
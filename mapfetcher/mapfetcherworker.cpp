@@ -22,6 +22,7 @@
 #include "mapfetcher_p.h"
 #include "networksqlitecache_p.h"
 #include "tilecache_p.h"
+#include "heightmapstore_p.h"
 #include "utils_p.h"
 
 #include <QtPositioning/private/qwebmercator_p.h>
@@ -34,6 +35,7 @@
 #include <QThreadPool>
 #include <QRunnable>
 #include <QThread>
+#include <QTimer>
 #include <QQueue>
 
 #include <QByteArray>
@@ -58,6 +60,8 @@
 #include <vector>
 #include <map>
 #include <array>
+#include <algorithm>
+#include "astcencoder.h"
 
 struct GeoTileSpec {
     QGeoTileSpec ts;
@@ -78,16 +82,6 @@ QDebug operator<<(QDebug d, const GeoTileSpec &k) {
 }
 
 namespace  {
-const std::map<Heightmap::Neighbor, std::shared_ptr<QImage>> boundaryRasters{
-    {Heightmap::Top, {}},
-    {Heightmap::Bottom, {}},
-    {Heightmap::Left, {}},
-    {Heightmap::Right, {}},
-    {Heightmap::TopLeft, {}},
-    {Heightmap::TopRight, {}},
-    {Heightmap::BottomLeft, {}},
-    {Heightmap::BottomRight, {}}
-};
 const QString urlTemplateTerrariumS3{"https://s3.amazonaws.com/elevation-tiles-prod/terrarium/{z}/{x}/{y}.png"};
 } // namespace
 
@@ -284,6 +278,28 @@ quint8 MapFetcher::zoomForCoverage(const QList<QGeoCoordinate> &crds,
     return 20;
 }
 
+quint16 MapFetcher::tileResolutionForCoverage(const QList<QGeoCoordinate> &crds,
+                                              const quint8 zoom,
+                                              const size_t maxCoverageResolution,
+                                              const size_t nativeTileResolution) {
+    if (nativeTileResolution == 0
+        || crds.isEmpty())
+        return 0;
+
+    quint64 minX, maxX, minY, maxY;
+    const auto tileSet = tilesFromBounds(crds, zoom, true);
+    if (tileSet.empty())
+        return 0;
+    std::tie(minX, maxX, minY, maxY) = getMinMax(tileSet);
+    const quint64 tiles = std::min(maxX - minX + 1, maxY - minY + 1);
+
+    // Powers of two keep box filtering integral and match the JPEG DCT scale factors
+    size_t res = nativeTileResolution;
+    while (res > 1 && tiles * res > maxCoverageResolution)
+        res /= 2;
+    return quint16(res);
+}
+
 // Use one nam + network cache for all instances of MapFetcher.
 class NAM
 {
@@ -485,32 +501,77 @@ void NetworkIOManager::requestSlippyTiles(DEMFetcher *f,
     w->requestSlippyTiles(requestId, crds, zoom, destinationZoom, true);
 }
 
+void NetworkIOManager::requestElevations(DEMFetcher *f,
+                                         quint64 requestId,
+                                         std::shared_ptr<ElevationPoints> points,
+                                         const quint8 zoom)
+{
+    if (!points) {
+        qWarning() << "requestElevations: no points";
+        return;
+    }
+    DEMFetcherWorker *w = getDEMFetcherWorker(f);
+    w->setURLTemplate(f->urlTemplate()); // it might change in between requests
+    w->requestElevations(requestId, std::move(points), zoom);
+}
+
+void NetworkIOManager::requestTerrainQuery(DEMFetcher *f,
+                                           quint64 requestId,
+                                           std::shared_ptr<TerrainQuery> query)
+{
+    if (!query) {
+        qWarning() << "requestTerrainQuery: empty query";
+        return;
+    }
+    DEMFetcherWorker *w = getDEMFetcherWorker(f);
+    w->setURLTemplate(f->urlTemplate()); // it might change in between requests
+    w->requestTerrainQuery(requestId, std::move(query));
+}
+
+void NetworkIOManager::requestChunkedCoverage(DEMFetcher *f,
+                                              quint64 requestId,
+                                              const QList<QGeoCoordinate> &crds,
+                                              const quint8 zoom,
+                                              const bool clip)
+{
+    if (crds.size() < 2) {
+        qWarning() << "requestChunkedCoverage: Invalid bounds";
+        return;
+    }
+    DEMFetcherWorker *w = getDEMFetcherWorker(f);
+    w->setURLTemplate(f->urlTemplate()); // it might change in between requests
+    w->requestChunkedCoverage(requestId, crds, zoom, clip);
+}
+
 void NetworkIOManager::requestCoverage(MapFetcher *f,
                                        quint64 requestId,
                                        const QList<QGeoCoordinate> &crds,
                                        const quint8 zoom,
-                                       const bool clip) {
+                                       const bool clip,
+                                       const quint16 tileResolution,
+                                       const bool progressive) {
     if (crds.isEmpty()) {
         qWarning() << "requestCoverage: Invalid bounds";
         return;
     }
     MapFetcherWorker *w = getMapFetcherWorker(f);
     w->setURLTemplate(f->urlTemplate()); // it might change in between requests
-    w->requestCoverage(requestId, crds, zoom, clip);
+    w->requestCoverage(requestId, crds, zoom, clip, tileResolution, progressive);
 }
 
 void NetworkIOManager::requestCoverage(DEMFetcher *f,
                                        quint64 requestId,
                                        const QList<QGeoCoordinate> &crds,
                                        const quint8 zoom,
-                                       const bool clip) {
+                                       const bool clip,
+                                       const quint16 tileResolution) {
     if (crds.isEmpty()) {
         qWarning() << "requestCoverage: Invalid bounds";
         return;
     }
     DEMFetcherWorker *w = getDEMFetcherWorker(f);
     w->setURLTemplate(f->urlTemplate()); // it might change in between requests
-    w->requestCoverage(requestId, crds, zoom, clip);
+    w->requestCoverage(requestId, crds, zoom, clip, tileResolution);
 }
 
 void NetworkIOManager::requestSlippyTiles(ASTCFetcher *f,
@@ -533,7 +594,8 @@ void NetworkIOManager::requestCoverage(ASTCFetcher *f,
                                        quint64 requestId,
                                        const QList<QGeoCoordinate> &crds,
                                        const quint8 zoom,
-                                       const bool clip)
+                                       const bool clip,
+                                       const quint16 tileResolution)
 {
     if (crds.isEmpty()) {
         qWarning() << "requestCoverage: Invalid bounds";
@@ -541,7 +603,7 @@ void NetworkIOManager::requestCoverage(ASTCFetcher *f,
     }
     ASTCFetcherWorker *w = getASTCFetcherWorker(f);
     w->setURLTemplate(f->urlTemplate()); // it might change in between requests
-    w->requestCoverage(requestId, crds, zoom, clip);
+    w->requestCoverage(requestId, crds, zoom, clip, tileResolution);
 }
 
 quint64 NetworkIOManager::cacheSize() {
@@ -563,14 +625,22 @@ MapFetcherWorker *NetworkIOManager::getMapFetcherWorker(MapFetcher *f) {
                 SIGNAL(tileReady(quint64,TileKey,std::shared_ptr<QImage>)),
                 f,
                 SLOT(onInsertTile(quint64,TileKey,std::shared_ptr<QImage>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(compressedTileDataReady(quint64,TileKey,std::shared_ptr<QByteArray>)),
+                f,
+                SLOT(onInsertEncodedTile(quint64,TileKey,std::shared_ptr<QByteArray>)), Qt::QueuedConnection);
         connect(w,
                 SIGNAL(coverageReady(quint64,std::shared_ptr<QImage>)),
                 f,
                 SLOT(onInsertCoverage(quint64,std::shared_ptr<QImage>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(coverageUpdated(quint64,std::shared_ptr<CoveragePatch>)),
+                f,
+                SLOT(onUpdateCoverage(quint64,std::shared_ptr<CoveragePatch>)), Qt::QueuedConnection);
         connect(w,
                 SIGNAL(requestHandlingFinished(quint64)),
                 f,
-                SIGNAL(requestHandlingFinished(quint64)), Qt::QueuedConnection);
+                SLOT(onRequestHandlingFinished(quint64)), Qt::QueuedConnection); // after pending decodes
     } else {
         w = it->second;
     }
@@ -582,7 +652,9 @@ DEMFetcherWorker *NetworkIOManager::getDEMFetcherWorker(DEMFetcher *f) {
     auto it = m_demFetcher2Worker.find(f);
     if (it == m_demFetcher2Worker.end()) {
         init();
-        w = new DEMFetcherWorker(this, f, m_worker, f->d_func()->m_borders);
+        if (!m_workerQueries)
+            m_workerQueries = QSharedPointer<ThreadedJobQueue>(new ThreadedJobQueue(qMax(1, QThread::idealThreadCount())));
+        w = new DEMFetcherWorker(this, f, m_worker, m_workerQueries, f->d_func()->m_borders);
         m_demFetcher2Worker.insert({f, w});
         connect(w,
                 SIGNAL(heightmapReady(quint64,TileKey,std::shared_ptr<Heightmap>)),
@@ -592,6 +664,26 @@ DEMFetcherWorker *NetworkIOManager::getDEMFetcherWorker(DEMFetcher *f) {
                 SIGNAL(heightmapCoverageReady(quint64,std::shared_ptr<Heightmap>)),
                 f,
                 SLOT(onInsertHeightmapCoverage(quint64,std::shared_ptr<Heightmap>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(heightmapChunkReady(quint64,TileKey,std::shared_ptr<HeightmapChunk>)),
+                f,
+                SLOT(onInsertHeightmapChunk(quint64,TileKey,std::shared_ptr<HeightmapChunk>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(terrainProductsReady(quint64,TileKey,std::shared_ptr<TerrainProducts>)),
+                f,
+                SLOT(onInsertTerrainProducts(quint64,TileKey,std::shared_ptr<TerrainProducts>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(heightmapMeshReady(quint64,TileKey,std::shared_ptr<HeightmapMesh>)),
+                f,
+                SLOT(onInsertHeightmapMesh(quint64,TileKey,std::shared_ptr<HeightmapMesh>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(elevationsReady(quint64,std::shared_ptr<ElevationBatch>)),
+                f,
+                SLOT(onInsertElevations(quint64,std::shared_ptr<ElevationBatch>)), Qt::QueuedConnection);
+        connect(w,
+                SIGNAL(terrainQueryReady(quint64,std::shared_ptr<TerrainQueryResults>)),
+                f,
+                SLOT(onInsertTerrainQueryResults(quint64,std::shared_ptr<TerrainQueryResults>)), Qt::QueuedConnection);
         connect(w,
                 SIGNAL(requestHandlingFinished(quint64)),
                 f,
@@ -637,6 +729,37 @@ ASTCFetcherWorker *NetworkIOManager::getASTCFetcherWorker(ASTCFetcher *f) {
 void DEMFetcherWorker::onTileReady(const quint64 id, const TileKey k,  std::shared_ptr<QImage> i)
 {
     Q_D(DEMFetcherWorker);
+    const auto query = d->m_elevationQueries.find(id);
+    if (query != d->m_elevationQueries.end()) {
+        const auto samples = query->second.tiles.find(k);
+        if (!i || samples == query->second.tiles.end()) {
+            qWarning() << "DEMFetcher::onTileReady: "<<k<< " unusable for elevation request "<<id;
+            onInsertElevations(id, nullptr);
+            return;
+        }
+        d->m_worker->schedule(new ElevationSamplingData(std::move(i),
+                                                        std::move(samples->second),
+                                                        *this,
+                                                        id));
+        return;
+    }
+    if (d->m_terrainQueries.find(id) != d->m_terrainQueries.end()) {
+        if (!i) {
+            insertTerrainTile(id, k, nullptr);
+            return;
+        }
+        // Unbordered and unquantized, back through onInsertHeightmap
+        d->m_worker->schedule(new DEMReadyData(std::move(i), k, *this, id, false));
+        return;
+    }
+    if (d->m_chunkedCoverages.find(id) != d->m_chunkedCoverages.end()) {
+        if (!i) {
+            insertCoverageChunk(id, k, nullptr);
+            return;
+        }
+        d->m_worker->schedule(new DEMReadyData(std::move(i), k, *this, id, false));
+        return;
+    }
     if (!i) {
         qWarning() << "DEMFetcher::onTileReady: "<<k<< " not ready!";
         return;
@@ -647,6 +770,7 @@ void DEMFetcherWorker::onTileReady(const quint64 id, const TileKey k,  std::shar
                                      *this,
                                      id,
                                      false);
+        h->m_quantize = d->m_quantize;
         d->m_worker->schedule(h);
     } else {
         if (d->m_request2Neighbors.find(id) == d->m_request2Neighbors.end()) {
@@ -666,7 +790,7 @@ void DEMFetcherWorker::onTileReady(const quint64 id, const TileKey k,  std::shar
         auto neighborsComplete = [&tileNeighbors](const TileKey &k) {
             auto &nm = tileNeighbors[k];
             for (const auto n: neighbors) {
-                if (nm.first.testFlag(n) && !nm.second[n])
+                if (nm.first.testFlag(n) && !nm.second[Heightmap::neighborIndex(n)])
                     return false;
             }
             return true;
@@ -682,8 +806,7 @@ void DEMFetcherWorker::onTileReady(const quint64 id, const TileKey k,  std::shar
             if (!bool(tt))
                 return;
             tt.reset();
-            std::map<Heightmap::Neighbor, std::shared_ptr<QImage>> tileNeighbors_;
-            tileNeighbors_.swap(tileNeighbors[tk].second);
+            auto tileNeighbors_ = std::make_unique<Heightmap::Borders>(std::move(tileNeighbors[tk].second));
             tileNeighbors.erase(tk);
             auto h = new DEMReadyData(d->tile(id, tk),
                                          tk,
@@ -691,6 +814,7 @@ void DEMFetcherWorker::onTileReady(const quint64 id, const TileKey k,  std::shar
                                          id,
                                          false,
                                          std::move(tileNeighbors_));
+            h->m_quantize = d->m_quantize;
             d->m_worker->schedule(h);
         };
 
@@ -698,12 +822,14 @@ void DEMFetcherWorker::onTileReady(const quint64 id, const TileKey k,  std::shar
             handleNeighborsComplete(k);
         }
 
-        // Propagate tile into neighbors
+        // Propagate the tile edges into neighbors. Only these are retained for them,
+        // the image itself is released once this tile's own heightmap is scheduled
+        const auto edges = DEMTileEdges::fromImage(*i);
         for (const auto n: neighbors) {
             if (existsNeighbor(n)) {
                 TileKey nk = k + neighborOffsets.at(n);
                 // TODO: add flag check?
-                tileNeighbors[nk].second[neighborReciprocal.at(n)] = i;
+                tileNeighbors[nk].second[Heightmap::neighborIndex(neighborReciprocal.at(n))] = edges;
                 if (neighborsComplete(nk)) {
                     handleNeighborsComplete(nk);
                 }
@@ -720,18 +846,303 @@ void DEMFetcherWorker::onCoverageReady(quint64 id,  std::shared_ptr<QImage> i)
                               *this,
                               id,
                               true);
+    h->m_quantize = d->m_quantize;
     d->m_worker->schedule(h);
 }
 
 void DEMFetcherWorker::onInsertHeightmap(quint64 id, const TileKey k, std::shared_ptr<Heightmap> h)
 {
     Q_D(DEMFetcherWorker);
+    if (d->m_terrainQueries.find(id) != d->m_terrainQueries.end()) {
+        insertTerrainTile(id, k, std::move(h));
+        return;
+    }
+    if (d->m_chunkedCoverages.find(id) != d->m_chunkedCoverages.end()) {
+        insertCoverageChunk(id, k, std::move(h));
+        return;
+    }
+    // Only tiles at their source zoom, fragmented or compound ones depend on the request
+    const auto sourceZoom = d->m_request2sourceZoom.find(id);
+    if (h && NetworkConfiguration::heightmapStoreEnabled
+            && sourceZoom != d->m_request2sourceZoom.end() && sourceZoom->second == k.z
+            && HeightmapStore::instance().initialized()) {
+        HeightmapStore::instance().insert(d->m_request2urlTemplate[id], k, *h);
+    }
+    deliverHeightmap(id, k, std::move(h));
+}
+
+void DEMFetcherWorker::insertCoverageChunk(quint64 id, const TileKey &k, std::shared_ptr<Heightmap> h)
+{
+    Q_D(DEMFetcherWorker);
+    const auto it = d->m_chunkedCoverages.find(id);
+    if (h && !h->m_size.isEmpty() && it != d->m_chunkedCoverages.end()) {
+        const auto &c = it->second;
+        const int tileRes = h->m_size.width();
+        const QRect mosaic(0, 0, int(c.maxX - c.minX + 1) * tileRes, int(c.maxY - c.minY + 1) * tileRes);
+        const QRect clipRect = (c.clip)
+                ? coverageClipRect(c.crds, c.zoom, tileRes, c.minX, c.maxX, c.minY, c.maxY)
+                : mosaic;
+        const QRect tileRect(int(k.x - c.minX) * tileRes, int(k.y - c.minY) * tileRes, tileRes, tileRes);
+        const QRect rect = tileRect & clipRect;
+        if (!rect.isEmpty()) {
+            auto chunk = std::make_shared<HeightmapChunk>();
+            chunk->rect = rect.translated(-clipRect.topLeft());
+            chunk->coverageSize = clipRect.size();
+            const double worldSize = 2.0 * M_PI * 6378137.0;
+            chunk->pixelSize = worldSize / (double(quint64(1) << c.zoom) * tileRes);
+            chunk->topLeft = QPointF(-worldSize * .5 + (c.minX * tileRes + clipRect.x()) * chunk->pixelSize,
+                                     worldSize * .5 - (c.minY * tileRes + clipRect.y()) * chunk->pixelSize);
+            if (rect == tileRect) {
+                chunk->heightmap = std::move(*h);
+            } else {
+                chunk->heightmap.setSize(rect.size());
+                const QPoint origin = rect.topLeft() - tileRect.topLeft();
+                for (int y = 0; y < rect.height(); ++y) {
+                    const float *src = h->elevations.data() + size_t(origin.y() + y) * tileRes + origin.x();
+                    std::copy(src, src + rect.width(),
+                              chunk->heightmap.elevations.data() + size_t(y) * rect.width());
+                }
+                chunk->heightmap.updateMinMax();
+            }
+            emit heightmapChunkReady(id, k, std::move(chunk));
+        }
+    }
+    if (!--d->m_request2remainingDEMHandlers[id]) {
+        d->m_chunkedCoverages.erase(id);
+        emit requestHandlingFinished(id);
+    }
+}
+
+void DEMFetcherWorker::deliverHeightmap(quint64 id, const TileKey &k, std::shared_ptr<Heightmap> h)
+{
+    Q_D(DEMFetcherWorker);
+    if ((d->m_terrainProducts || d->m_meshes) && h) {
+        // Jobs get their own copy, as the consumer is free to take the heightmap apart
+        const auto copy = std::make_shared<const Heightmap>(*h);
+        if (d->m_terrainProducts) {
+            ++d->m_request2remainingDEMHandlers[id];
+            d->m_worker->schedule(new TerrainProductsData(copy,
+                                                          k,
+                                                          *this,
+                                                          id,
+                                                          d->m_hillshade));
+        }
+        if (d->m_meshes) {
+            ++d->m_request2remainingDEMHandlers[id];
+            d->m_worker->schedule(new HeightmapMeshData(copy,
+                                                        k,
+                                                        *this,
+                                                        id,
+                                                        d->m_meshMaxError));
+        }
+    }
     emit heightmapReady(id, k, std::move(h));
     if (!--d->m_request2remainingDEMHandlers[id]) {
         emit requestHandlingFinished(id);
     }
 }
 
+void DEMFetcherWorker::requestElevations(quint64 requestId,
+                                         std::shared_ptr<ElevationPoints> points,
+                                         const quint8 zoom)
+{
+    Q_D(DEMFetcherWorker);
+    ElevationQuery query = ElevationQuery::fromPoints(*points, zoom);
+    points.reset();
+
+    std::set<GeoTileSpec> tiles;
+    for (const auto &t: query.tiles) {
+        tiles.insert({QGeoTileSpec(QString(), 0, t.first.z, int(t.first.x), int(t.first.y)),
+                      Heightmap::Neighbors()});
+    }
+    if (tiles.empty()) {
+        emit requestHandlingFinished(requestId);
+        return;
+    }
+
+    const QString urlTemplate = (d->m_urlTemplate.isEmpty())
+            ? urlTemplateTerrariumS3
+            : d->m_urlTemplate;
+    d->m_request2urlTemplate[requestId] = urlTemplate;
+    d->m_request2sourceZoom[requestId] = zoom;
+    d->m_request2remainingTiles.emplace(requestId, tiles.size());
+    d->m_request2remainingHandlers.emplace(requestId, tiles.size());
+    d->m_request2remainingDEMHandlers[requestId] = tiles.size();
+    d->m_elevationQueries.emplace(requestId, std::move(query));
+
+    requestMapTiles(tiles,
+                    extractTemplates(urlTemplate).alternatives,
+                    zoom,
+                    requestId,
+                    false,
+                    d->m_nm,
+                    this, SLOT(onTileReplyFinished()),
+                    this, SLOT(networkReplyError(QNetworkReply::NetworkError)));
+}
+
+void DEMFetcherWorker::requestChunkedCoverage(quint64 requestId,
+                                              const QList<QGeoCoordinate> &crds,
+                                              const quint8 zoom,
+                                              bool clip)
+{
+    Q_D(DEMFetcherWorker);
+    const auto tiles = tilesFromBounds(crds, zoom, true);
+    if (tiles.empty()) {
+        qWarning() << "requestChunkedCoverage: empty bounds";
+        emit requestHandlingFinished(requestId);
+        return;
+    }
+    auto &coverage = d->m_chunkedCoverages[requestId];
+    coverage.crds = crds;
+    coverage.zoom = zoom;
+    coverage.clip = clip;
+    std::tie(coverage.minX, coverage.maxX, coverage.minY, coverage.maxY) = getMinMax(tiles);
+
+    const QString urlTemplate = (d->m_urlTemplate.isEmpty())
+            ? urlTemplateTerrariumS3
+            : d->m_urlTemplate;
+    d->m_request2urlTemplate[requestId] = urlTemplate;
+    d->m_request2sourceZoom[requestId] = zoom;
+    d->m_request2remainingTiles.emplace(requestId, tiles.size());
+    d->m_request2remainingHandlers.emplace(requestId, tiles.size());
+    d->m_request2remainingDEMHandlers[requestId] = tiles.size();
+
+    requestMapTiles(tiles,
+                    extractTemplates(urlTemplate).alternatives,
+                    zoom,
+                    requestId,
+                    false,
+                    d->m_nm,
+                    this, SLOT(onTileReplyFinished()),
+                    this, SLOT(networkReplyError(QNetworkReply::NetworkError)));
+}
+
+void DEMFetcherWorker::requestTerrainQuery(quint64 requestId,
+                                           std::shared_ptr<TerrainQuery> query)
+{
+    Q_D(DEMFetcherWorker);
+    const QString urlTemplate = (d->m_urlTemplate.isEmpty())
+            ? urlTemplateTerrariumS3
+            : d->m_urlTemplate;
+    d->m_terrainTiles.setSource(urlTemplate);
+
+    PendingTerrainQuery &pending = d->m_terrainQueries[requestId];
+    pending.tiles = std::make_shared<TerrainTileSet>();
+    pending.results = std::make_shared<TerrainQueryResults>();
+    if (query->type == TerrainQuery::Type::Profiles)
+        pending.results->profiles.resize(query->size());
+    else
+        pending.results->linesOfSight.resize(query->size());
+
+    std::set<GeoTileSpec> missing;
+    for (const TileKey &k: query->tiles()) {
+        if (auto h = d->m_terrainTiles.find(k))
+            (*pending.tiles)[k] = std::move(h);
+        else
+            missing.insert({QGeoTileSpec(QString(), 0, k.z, int(k.x), int(k.y)), Heightmap::Neighbors()});
+    }
+    pending.query = std::move(query);
+    pending.missingTiles = missing.size();
+    if (missing.empty()) {
+        dispatchTerrainQuery(requestId);
+        return;
+    }
+
+    d->m_request2urlTemplate[requestId] = urlTemplate;
+    d->m_request2sourceZoom[requestId] = pending.query->zoom;
+    d->m_request2remainingTiles.emplace(requestId, missing.size());
+    d->m_request2remainingHandlers.emplace(requestId, missing.size());
+    requestMapTiles(missing,
+                    extractTemplates(urlTemplate).alternatives,
+                    pending.query->zoom,
+                    requestId,
+                    false,
+                    d->m_nm,
+                    this, SLOT(onTileReplyFinished()),
+                    this, SLOT(networkReplyError(QNetworkReply::NetworkError)));
+}
+
+void DEMFetcherWorker::insertTerrainTile(quint64 id, const TileKey &k, std::shared_ptr<const Heightmap> h)
+{
+    Q_D(DEMFetcherWorker);
+    auto it = d->m_terrainQueries.find(id);
+    if (it == d->m_terrainQueries.end())
+        return;
+    if (h) {
+        d->m_terrainTiles.insert(k, h);
+        (*it->second.tiles)[k] = std::move(h);
+    }
+    if (!--it->second.missingTiles)
+        dispatchTerrainQuery(id);
+}
+
+void DEMFetcherWorker::dispatchTerrainQuery(quint64 id)
+{
+    Q_D(DEMFetcherWorker);
+    PendingTerrainQuery &pending = d->m_terrainQueries.at(id);
+    const size_t size = pending.query->size();
+    // A few chunks per thread, so that long paths don't leave threads idle at the end
+    const size_t chunks = std::min<size_t>(size, size_t(qMax(1, QThread::idealThreadCount())) * 4);
+    if (!chunks) {
+        emit terrainQueryReady(id, std::move(pending.results));
+        d->m_terrainQueries.erase(id);
+        emit requestHandlingFinished(id);
+        return;
+    }
+    pending.pendingJobs = chunks;
+    for (size_t c = 0; c < chunks; ++c) {
+        d->m_workerQueries->schedule(new TerrainQueryData(pending.query,
+                                                          pending.tiles,
+                                                          pending.results,
+                                                          size * c / chunks,
+                                                          size * (c + 1) / chunks,
+                                                          *this,
+                                                          id));
+    }
+}
+
+void DEMFetcherWorker::onTerrainQueryJobFinished(quint64 id)
+{
+    Q_D(DEMFetcherWorker);
+    auto it = d->m_terrainQueries.find(id);
+    if (it == d->m_terrainQueries.end() || --it->second.pendingJobs)
+        return;
+    emit terrainQueryReady(id, std::move(it->second.results));
+    d->m_terrainQueries.erase(it);
+    emit requestHandlingFinished(id);
+}
+
+void DEMFetcherWorker::onInsertElevations(quint64 id, std::shared_ptr<ElevationBatch> b)
+{
+    Q_D(DEMFetcherWorker);
+    if (b)
+        emit elevationsReady(id, std::move(b));
+    if (!--d->m_request2remainingDEMHandlers[id]) {
+        d->m_elevationQueries.erase(id);
+        emit requestHandlingFinished(id);
+    }
+}
+
+void DEMFetcherWorker::onInsertTerrainProducts(quint64 id, const TileKey k, std::shared_ptr<TerrainProducts> p)
+{
+    Q_D(DEMFetcherWorker);
+    if (p)
+        emit terrainProductsReady(id, k, std::move(p));
+    if (!--d->m_request2remainingDEMHandlers[id]) {
+        emit requestHandlingFinished(id);
+    }
+}
+
+void DEMFetcherWorker::onInsertHeightmapMesh(quint64 id, const TileKey k, std::shared_ptr<HeightmapMesh> m)
+{
+    Q_D(DEMFetcherWorker);
+    if (m)
+        emit heightmapMeshReady(id, k, std::move(m));
+    if (!--d->m_request2remainingDEMHandlers[id]) {
+        emit requestHandlingFinished(id);
+    }
+}
+
 void DEMFetcherWorker::onInsertHeightmapCoverage(quint64 id, std::shared_ptr<Heightmap> h)
 {
     emit heightmapCoverageReady(id, std::move(h));
@@ -778,6 +1189,20 @@ void MapFetcherWorker::requestSlippyTiles(quint64 requestId,
     if (af)  // ASTCFetcher is a multistage fetcher that may request compound tiles
         af->d_func()->m_request2remainingASTCHandlers[requestId] = 0;
     quint64 srcTilesSize = tiles.size();
+    quint64 processedTiles = 0;
+    if (zoom == originalDestinationZoom) {
+        // Still counted in srcTilesSize: processed tiles go through the same handler accounting
+        for (auto it = tiles.begin(); it != tiles.end();) {
+            if (d->loadProcessedTile(requestId,
+                                     {quint64(it->ts.x()), quint64(it->ts.y()), quint8(it->ts.zoom())},
+                                     it->nb)) {
+                it = tiles.erase(it);
+                ++processedTiles;
+            } else {
+                ++it;
+            }
+        }
+    }
     std::vector<CachedCompoundTileData *> cachedCompoundTileHandlers;
     if (destinationZoom < zoom) {
         // split tiles to request
@@ -822,7 +1247,7 @@ void MapFetcherWorker::requestSlippyTiles(quint64 requestId,
         tiles.swap(srcTiles);
     }
 
-    if (tiles.empty()) { // everything was cached
+    if (tiles.empty() && !processedTiles) { // everything was cached
         emit requestHandlingFinished(requestId);
 //        return;
     }
@@ -854,7 +1279,12 @@ void MapFetcherWorker::requestSlippyTiles(quint64 requestId,
         d->m_worker->schedule(h);
 }
 
-void MapFetcherWorker::requestCoverage(quint64 requestId, const QList<QGeoCoordinate> &crds, const quint8 zoom, const bool clip) {
+void MapFetcherWorker::requestCoverage(quint64 requestId,
+                                       const QList<QGeoCoordinate> &crds,
+                                       const quint8 zoom,
+                                       const bool clip,
+                                       const quint16 tileResolution,
+                                       const bool progressive) {
     Q_D(MapFetcherWorker);
     const auto tiles = tilesFromBounds(crds, zoom, true);
     if (tiles.empty())     {
@@ -873,7 +1303,14 @@ void MapFetcherWorker::requestCoverage(quint64 requestId, const QList<QGeoCoordi
                     this, SLOT(networkReplyError(QNetworkReply::NetworkError)));
 
     d->m_requests.insert({requestId,
-                          {crds, zoom, tiles.size(), clip}});
+                          {crds, zoom, tiles.size(), clip, tileResolution}});
+    if (progressive) {
+        ProgressiveCoverage &coverage = d->m_progressiveCoverages[requestId];
+        quint64 maxX, maxY;
+        std::tie(coverage.minX, maxX, coverage.minY, maxY) = getMinMax(tiles);
+        coverage.hTiles = maxX - coverage.minX + 1;
+        coverage.vTiles = maxY - coverage.minY + 1;
+    }
 }
 
 std::shared_ptr<QImage> MapFetcherWorker::tile(quint64 requestId, const TileKey &k) {
@@ -912,9 +1349,15 @@ void MapFetcherWorker::onTileReplyFinished() {
     if (reply->error() != QNetworkReply::NoError) {
         reply->deleteLater();
         d->m_request2remainingHandlers[id] -= subtilesPerTile(z, dz); // subtilesPerTile > 1 only during fragmentation
-        if (df) {
+        if (df && df->d_func()->m_terrainQueries.count(id)) {
+            df->insertTerrainTile(id,
+                                  {reply->property("x").toULongLong(), reply->property("y").toULongLong(), z},
+                                  nullptr);
+        } else if (df) {
             df->d_func()->m_request2remainingDEMHandlers[id] -= subtilesPerTile(z, dz);
             if (df->d_func()->m_request2remainingDEMHandlers[id] <= 0) {// TODO: deduplicate? m_request2remainingHandlers might be enough
+                df->d_func()->m_elevationQueries.erase(id);
+                df->d_func()->m_chunkedCoverages.erase(id);
                 emit requestHandlingFinished(id);
             }
         } else if (af) {
@@ -992,6 +1435,10 @@ void MapFetcherWorker::onInsertCoverage(const quint64 id, std::shared_ptr<QImage
     emit coverageReady(id, i);
 }
 
+void MapFetcherWorker::onUpdateCoverage(const quint64 id, std::shared_ptr<CoveragePatch> p) {
+    emit coverageUpdated(id, p);
+}
+
 void MapFetcherWorker::networkReplyError(QNetworkReply::NetworkError) {
     QNetworkReply *reply = static_cast<QNetworkReply *>(sender());
     if (!reply)
@@ -1015,7 +1462,7 @@ void DEMFetcherWorkerPrivate::trackNeighbors(quint64 id,
                                              quint8 destinationZoom)
 {
     if (k.z == destinationZoom) {
-        insertNeighbors(id, k, n, boundaryRasters);
+        insertNeighbors(id, k, n);
     } else if (k.z < destinationZoom) {
         int nSubTiles = subtileSide(k.z, destinationZoom);
         auto getBoundaries = [nSubTiles, n](int x, int y) {
@@ -1059,25 +1506,97 @@ void DEMFetcherWorkerPrivate::trackNeighbors(quint64 id,
                 const quint64 dy = k.y * nSubTiles + sy;
 
                 m_request2Neighbors[id][{dx, dy, destinationZoom}] =
-                    {getBoundaries(sx, sy), boundaryRasters};
+                    {getBoundaries(sx, sy), Heightmap::Borders{}};
             }
         }
     }
 }
 
-DEMFetcherWorker::DEMFetcherWorker(QObject *parent, DEMFetcher *f, QSharedPointer<ThreadedJobQueue> worker, bool borders)
+bool DEMFetcherWorkerPrivate::loadProcessedTile(quint64 id,
+                                                const TileKey &k,
+                                                Heightmap::Neighbors n)
+{
+    Q_Q(DEMFetcherWorker);
+    if (!NetworkConfiguration::heightmapStoreEnabled || !HeightmapStore::instance().initialized())
+        return false;
+    std::shared_ptr<Heightmap> h = HeightmapStore::instance().heightmap(m_request2urlTemplate[id],
+                                                                        k,
+                                                                        m_borders,
+                                                                        m_quantize,
+                                                                        (m_borders) ? n : Heightmap::Neighbors());
+    if (!h)
+        return false;
+    h->buildMinMaxPyramid();
+
+    if (m_borders) {
+        // Fetched neighbors still need this tile's edges for their own borders
+        TileNeighborsMap &tileNeighbors = m_request2Neighbors[id];
+        const auto edges = DEMTileEdges::fromHeightmap(*h);
+        for (const auto nb: neighbors) {
+            const auto it = tileNeighbors.find(k + neighborOffsets.at(nb));
+            if (it != tileNeighbors.end())
+                it->second.second[Heightmap::neighborIndex(neighborReciprocal.at(nb))] = edges;
+        }
+        tileNeighbors.erase(k);
+    }
+
+    // Delivered once the request is fully set up, as decoded tiles are
+    QTimer::singleShot(0, q, [q, id, k, h]() mutable {
+        q->deliverHeightmap(id, k, std::move(h));
+    });
+    return true;
+}
+
+DEMFetcherWorker::DEMFetcherWorker(QObject *parent,
+                                   DEMFetcher *f,
+                                   QSharedPointer<ThreadedJobQueue> worker,
+                                   QSharedPointer<ThreadedJobQueue> workerQueries,
+                                   bool borders)
     :   MapFetcherWorker(*new DEMFetcherWorkerPrivate, f, worker, parent)
 {
     Q_D(DEMFetcherWorker);
+    d->m_workerQueries = std::move(workerQueries);
     d->m_borders = borders;
+    d->m_quantize = f->quantizedHeightmaps();
+    d->m_terrainProducts = f->terrainProductsEnabled();
+    d->m_hillshade = f->hillshadeParameters();
+    d->m_meshes = f->heightmapMeshesEnabled();
+    d->m_meshMaxError = f->heightmapMeshMaxError();
     init();
 }
 
 void DEMFetcherWorker::init() {
+    Q_D(DEMFetcherWorker);
+    connect(qobject_cast<DEMFetcher *>(d->m_fetcher), &DEMFetcher::quantizedHeightmapsChanged,
+            this, &DEMFetcherWorker::setQuantize, Qt::QueuedConnection);
+    connect(qobject_cast<DEMFetcher *>(d->m_fetcher), &DEMFetcher::terrainProductsChanged,
+            this, &DEMFetcherWorker::setTerrainProducts, Qt::QueuedConnection);
+    connect(qobject_cast<DEMFetcher *>(d->m_fetcher), &DEMFetcher::heightmapMeshesChanged,
+            this, &DEMFetcherWorker::setHeightmapMeshes, Qt::QueuedConnection);
     connect(this, &MapFetcherWorker::tileReady, this, &DEMFetcherWorker::onTileReady);
     connect(this, &MapFetcherWorker::coverageReady, this, &DEMFetcherWorker::onCoverageReady);
 }
 
+void DEMFetcherWorker::setQuantize(bool enabled)
+{
+    Q_D(DEMFetcherWorker);
+    d->m_quantize = enabled;
+}
+
+void DEMFetcherWorker::setTerrainProducts(bool enabled, HillshadeParameters params)
+{
+    Q_D(DEMFetcherWorker);
+    d->m_terrainProducts = enabled;
+    d->m_hillshade = params;
+}
+
+void DEMFetcherWorker::setHeightmapMeshes(bool enabled, float maxError)
+{
+    Q_D(DEMFetcherWorker);
+    d->m_meshes = enabled;
+    d->m_meshMaxError = maxError;
+}
+
 std::shared_ptr<QImage> MapFetcherWorkerPrivate::tile(quint64 id, const TileKey &k)
 {
     const auto it = m_tileCache[id].find(k);
@@ -1111,6 +1630,10 @@ ASTCFetcherWorker::ASTCFetcherWorker(QObject *parent,
     Q_D(ASTCFetcherWorker);
     init();
     d->m_forwardUncompressed = f->forwardUncompressedTiles();
+    d->m_blockSize = f->blockSize();
+    d->m_quality = f->quality();
+    d->m_mipFilter = f->mipFilter();
+    d->m_retainUncompressed = f->retainUncompressedImages();
     d->m_workerASTC = std::move(workerASTC);
 }
 
@@ -1126,11 +1649,36 @@ bool ASTCFetcherWorker::forwardUncompressed() const
     return d->m_forwardUncompressed;
 }
 
+void ASTCFetcherWorker::setCompression(const QSize &blockSize, float quality)
+{
+    Q_D(ASTCFetcherWorker);
+    d->m_blockSize = blockSize;
+    d->m_quality = quality;
+}
+
+void ASTCFetcherWorker::setMipFilter(int filter)
+{
+    Q_D(ASTCFetcherWorker);
+    d->m_mipFilter = filter;
+}
+
+void ASTCFetcherWorker::setRetainUncompressedImages(bool enabled)
+{
+    Q_D(ASTCFetcherWorker);
+    d->m_retainUncompressed = enabled;
+}
+
 void ASTCFetcherWorker::init()
 {
     Q_D(ASTCFetcherWorker);
     connect(qobject_cast<ASTCFetcher *>(d->m_fetcher), &ASTCFetcher::forwardUncompressedTilesChanged,
             this, &ASTCFetcherWorker::setForwardUncompressed, Qt::QueuedConnection);
+    connect(qobject_cast<ASTCFetcher *>(d->m_fetcher), &ASTCFetcher::compressionChanged,
+            this, &ASTCFetcherWorker::setCompression, Qt::QueuedConnection);
+    connect(qobject_cast<ASTCFetcher *>(d->m_fetcher), &ASTCFetcher::mipFilterChanged,
+            this, &ASTCFetcherWorker::setMipFilter, Qt::QueuedConnection);
+    connect(qobject_cast<ASTCFetcher *>(d->m_fetcher), &ASTCFetcher::retainUncompressedImagesChanged,
+            this, &ASTCFetcherWorker::setRetainUncompressedImages, Qt::QueuedConnection);
     connect(this, &MapFetcherWorker::tileReady, this, &ASTCFetcherWorker::onTileReady);
     connect(this, &MapFetcherWorker::compressedTileDataReady, this, &ASTCFetcherWorker::onCompressedTileDataReady);
     connect(this, &MapFetcherWorker::coverageReady, this, &ASTCFetcherWorker::onCoverageReady);
@@ -1147,8 +1695,18 @@ void ASTCFetcherWorker::onTileReady(quint64 id,
                                  *this,
                                  id,
                                  false,
-                                 std::move(md5));
-    d->m_workerASTC->schedule(h);
+                                 std::move(md5),
+                                 d->m_blockSize,
+                                 d->m_quality,
+                                 d->m_mipFilter);
+    h->m_retainImage = d->m_retainUncompressed;
+    if (!NetworkConfiguration::astcEnabled || h->m_md5.isEmpty()) {
+        d->m_workerASTC->schedule(h);
+        return;
+    }
+    if (d->m_pendingASTC.empty())
+        QMetaObject::invokeMethod(this, "schedulePendingASTC", Qt::QueuedConnection);
+    d->m_pendingASTC.push_back(h);
 }
 
 void ASTCFetcherWorker::onCompressedTileDataReady(quint64 id,
@@ -1160,7 +1718,11 @@ void ASTCFetcherWorker::onCompressedTileDataReady(quint64 id,
                                  k,
                                  *this,
                                  id,
-                                 false);
+                                 false,
+                                 d->m_blockSize,
+                                 d->m_quality,
+                                 d->m_mipFilter);
+    h->m_retainImage = d->m_retainUncompressed;
     d->m_workerASTC->schedule(h);
 }
 
@@ -1173,7 +1735,11 @@ void ASTCFetcherWorker::onCoverageReady(quint64 id,
                                  *this,
                                  id,
                                  true,
-                                 {});
+                                 {},
+                                 d->m_blockSize,
+                                 d->m_quality,
+                                 d->m_mipFilter);
+    h->m_retainImage = d->m_retainUncompressed;
     d->m_workerASTC->schedule(h);
 }
 
@@ -1190,6 +1756,38 @@ void ASTCFetcherWorker::onInsertTileASTC(quint64 id,
     }
 }
 
+void ASTCFetcherWorker::schedulePendingASTC()
+{
+    Q_D(ASTCFetcherWorker);
+    std::vector<Raster2ASTCData *> pending;
+    pending.swap(d->m_pendingASTC);
+
+    // One cache query per configuration, normally just one
+    std::map<ASTCEncoder::Configuration, std::vector<Raster2ASTCData *>> batches;
+    for (auto h: pending) {
+        ASTCEncoder::Configuration config;
+        config.blockX = h->m_blockSize.width();
+        config.blockY = h->m_blockSize.height();
+        config.quality = h->m_quality;
+        config.mipFilter = h->m_mipFilter;
+        batches[config].push_back(h);
+    }
+    for (const auto &batch: batches) {
+        std::vector<QByteArray> md5s;
+        md5s.reserve(batch.second.size());
+        for (auto h: batch.second)
+            md5s.push_back(h->m_md5);
+        const auto cached = ASTCEncoder::instance().isCached(md5s, batch.first);
+        for (size_t i = 0; i < batch.second.size(); ++i)
+            batch.second[i]->m_cached = cached[i];
+    }
+    // hits first, so the queue hands them out ahead of the compressions
+    std::stable_partition(pending.begin(), pending.end(),
+                          [](const Raster2ASTCData *h) { return h->m_cached; });
+    for (auto h: pending)
+        d->m_workerASTC->schedule(h);
+}
+
 void ASTCFetcherWorker::onInsertCoverageASTC(quint64 id,
                                              std::shared_ptr<CompressedTextureData> h)
 {
@@ -0,0 +1,331 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QtEndian>
+#include <QtMath>
+#include <cmath>
+#include <cstring>
+
+namespace {
+// WGS84
+constexpr double semiMajorAxis = 6378137.0;
+constexpr double semiMinorAxis = 6356752.3142451793;
+constexpr double eccentricitySquared = 6.69437999014e-3;
+constexpr int quantizedMax = 32767;
+
+struct Vec3 {
+    double x, y, z;
+    Vec3 operator+(const Vec3 &o) const { return {x + o.x, y + o.y, z + o.z}; }
+    Vec3 operator-(const Vec3 &o) const { return {x - o.x, y - o.y, z - o.z}; }
+    Vec3 operator*(double s) const { return {x * s, y * s, z * s}; }
+    double dot(const Vec3 &o) const { return x * o.x + y * o.y + z * o.z; }
+    Vec3 cross(const Vec3 &o) const { return {y * o.z - z * o.y, z * o.x - x * o.z, x * o.y - y * o.x}; }
+    double length() const { return std::sqrt(dot(*this)); }
+    Vec3 normalized() const { const double l = length(); return (l > 0) ? *this * (1.0 / l) : *this; }
+};
+
+Vec3 toECEF(double lonRad, double latRad, double height) {
+    const double sinLat = std::sin(latRad);
+    const double cosLat = std::cos(latRad);
+    const double n = semiMajorAxis / std::sqrt(1.0 - eccentricitySquared * sinLat * sinLat);
+    return { (n + height) * cosLat * std::cos(lonRad),
+             (n + height) * cosLat * std::sin(lonRad),
+             (n * (1.0 - eccentricitySquared) + height) * sinLat };
+}
+
+Vec3 toScaledSpace(const Vec3 &p) {
+    return {p.x / semiMajorAxis, p.y / semiMajorAxis, p.z / semiMinorAxis};
+}
+
+// Cesium EllipsoidalOccluder::computeHorizonCullingPoint, in ellipsoid scaled space
+Vec3 horizonOcclusionPoint(const Vec3 &directionToPoint, const std::vector<Vec3> &points) {
+    const Vec3 direction = toScaledSpace(directionToPoint).normalized();
+    double resultMagnitude = 0;
+    for (const Vec3 &p: points) {
+        const Vec3 scaled = toScaledSpace(p);
+        double magnitudeSquared = scaled.dot(scaled);
+        double magnitude = std::sqrt(magnitudeSquared);
+        const Vec3 pointDirection = scaled * (1.0 / magnitude);
+        // Points below the ellipsoid are taken as on it
+        magnitudeSquared = std::max(1.0, magnitudeSquared);
+        magnitude = std::max(1.0, magnitude);
+        const double cosAlpha = pointDirection.dot(direction);
+        const double sinAlpha = pointDirection.cross(direction).length();
+        const double cosBeta = 1.0 / magnitude;
+        const double sinBeta = std::sqrt(magnitudeSquared - 1.0) * cosBeta;
+        const double candidate = 1.0 / (cosAlpha * cosBeta - sinAlpha * sinBeta);
+        if (candidate > 0)
+            resultMagnitude = std::max(resultMagnitude, candidate);
+    }
+    return direction * resultMagnitude;
+}
+
+inline quint16 zigZag(int v) {
+    return quint16((v << 1) ^ (v >> 31));
+}
+
+inline quint8 octSNorm(double v) {
+    return quint8(std::lround((qBound(-1.0, v, 1.0) * .5 + .5) * 255.0));
+}
+
+inline double signNotZero(double v) {
+    return (v < 0.0) ? -1.0 : 1.0;
+}
+
+template <typename T>
+void append(QByteArray &out, T v) {
+    const T le = qToLittleEndian(v);
+    out.append(reinterpret_cast<const char *>(&le), sizeof(T));
+}
+
+template <>
+void append<double>(QByteArray &out, double v) {
+    quint64 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    append(out, bits);
+}
+
+template <>
+void append<float>(QByteArray &out, float v) {
+    quint32 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    append(out, bits);
+}
+} // namespace
+
+TileKey QuantizedMesh::tmsKey(const TileKey &k)
+{
+    return {k.x, (quint64(1) << k.z) - 1 - k.y, k.z};
+}
+
+QByteArray QuantizedMesh::encode(const HeightmapMesh &mesh, const TileKey &k, bool normals)
+{
+    const size_t numVertices = mesh.elevations.size();
+    if (mesh.gridSize < 2 || !numVertices || mesh.indices.size() < 3)
+        return {};
+    const double n = mesh.gridSize - 1;
+    const double tiles = double(quint64(1) << k.z);
+    auto longitude = [&](double x) { return ((k.x + x / n) / tiles) * 2.0 * M_PI - M_PI; };
+    auto latitude = [&](double y) { return std::atan(std::sinh(M_PI * (1.0 - 2.0 * (k.y + y / n) / tiles))); };
+    const double west = longitude(0);
+    const double east = longitude(n);
+    const double north = latitude(0);
+    const double south = latitude(n);
+
+    // Counter clockwise with v pointing north, while the mesh grid has y pointing south
+    std::vector<quint32> sourceIndices(mesh.indices);
+    for (size_t t = 0; t + 2 < sourceIndices.size(); t += 3) {
+        const quint16 *a = &mesh.positions[sourceIndices[t] * 2];
+        const quint16 *b = &mesh.positions[sourceIndices[t + 1] * 2];
+        const quint16 *c = &mesh.positions[sourceIndices[t + 2] * 2];
+        const double area = (double(b[0]) - a[0]) * (double(a[1]) - c[1])
+                          - (double(a[1]) - b[1]) * (double(c[0]) - a[0]);
+        if (area < 0)
+            std::swap(sourceIndices[t + 1], sourceIndices[t + 2]);
+    }
+
+    // Vertices in order of first use, as required by the high water mark index coding
+    std::vector<quint32> remap(numVertices, std::numeric_limits<quint32>::max());
+    std::vector<quint32> order;
+    order.reserve(numVertices);
+    std::vector<quint32> indices(sourceIndices.size());
+    for (size_t i = 0; i < sourceIndices.size(); ++i) {
+        quint32 &r = remap[sourceIndices[i]];
+        if (r == std::numeric_limits<quint32>::max()) {
+            r = quint32(order.size());
+            order.push_back(sourceIndices[i]);
+        }
+        indices[i] = r;
+    }
+    const size_t vertexCount = order.size();
+
+    float minHeight = std::numeric_limits<float>::max();
+    float maxHeight = std::numeric_limits<float>::lowest();
+    for (const quint32 v: order) {
+        minHeight = std::min(minHeight, mesh.elevations[v]);
+        maxHeight = std::max(maxHeight, mesh.elevations[v]);
+    }
+    const double heightRange = maxHeight - minHeight;
+
+    std::vector<quint16> u(vertexCount), v(vertexCount), h(vertexCount);
+    std::vector<Vec3> positions(vertexCount);
+    Vec3 lo{std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+    Vec3 hi{std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+    for (size_t i = 0; i < vertexCount; ++i) {
+        const quint32 src = order[i];
+        const double x = mesh.positions[src * 2];
+        const double y = mesh.positions[src * 2 + 1];
+        const double lat = latitude(y);
+        u[i] = quint16(std::lround(x / n * quantizedMax));
+        v[i] = quint16(qBound(0l, std::lround((lat - south) / (north - south) * quantizedMax), long(quantizedMax)));
+        h[i] = (heightRange > 0)
+                ? quint16(std::lround((mesh.elevations[src] - minHeight) / heightRange * quantizedMax))
+                : quint16(0);
+        // From the quantized values, as decoded by clients
+        positions[i] = toECEF(west + (east - west) * u[i] / quantizedMax,
+                              south + (north - south) * v[i] / quantizedMax,
+                              minHeight + heightRange * h[i] / quantizedMax);
+        lo = {std::min(lo.x, positions[i].x), std::min(lo.y, positions[i].y), std::min(lo.z, positions[i].z)};
+        hi = {std::max(hi.x, positions[i].x), std::max(hi.y, positions[i].y), std::max(hi.z, positions[i].z)};
+    }
+
+    const Vec3 center = toECEF((west + east) * .5, (south + north) * .5, (minHeight + maxHeight) * .5);
+    const Vec3 sphereCenter = (lo + hi) * .5;
+    double radius = 0;
+    for (const Vec3 &p: positions)
+        radius = std::max(radius, (p - sphereCenter).length());
+    const Vec3 occlusion = horizonOcclusionPoint(sphereCenter, positions);
+
+    QByteArray res;
+    res.reserve(int(88 + 4 + vertexCount * 6 + 4 + indices.size() * 4 + 16 + vertexCount * 8));
+    append(res, center.x);
+    append(res, center.y);
+    append(res, center.z);
+    append(res, minHeight);
+    append(res, maxHeight);
+    append(res, sphereCenter.x);
+    append(res, sphereCenter.y);
+    append(res, sphereCenter.z);
+    append(res, radius);
+    append(res, occlusion.x);
+    append(res, occlusion.y);
+    append(res, occlusion.z);
+
+    append(res, quint32(vertexCount));
+    for (const std::vector<quint16> *values: {&u, &v, &h}) {
+        int previous = 0;
+        for (const quint16 value: *values) {
+            append(res, zigZag(int(value) - previous));
+            previous = value;
+        }
+    }
+
+    const bool wide = vertexCount > 65536;
+    auto appendIndex = [&res, wide](quint32 i) {
+        if (wide)
+            append(res, i);
+        else
+            append(res, quint16(i));
+    };
+    if (wide) {
+        while (res.size() % 4)
+            res.append('\0');
+    }
+    append(res, quint32(indices.size() / 3));
+    quint32 highest = 0;
+    for (const quint32 i: indices) {
+        appendIndex(highest - i);
+        if (i == highest)
+            ++highest;
+    }
+
+    // west, south, east, north
+    const std::array<std::pair<const std::vector<quint16> *, quint16>, 4> edges{{
+        {&u, 0}, {&v, 0}, {&u, quint16(quantizedMax)}, {&v, quint16(quantizedMax)}
+    }};
+    for (const auto &edge: edges) {
+        std::vector<quint32> edgeIndices;
+        for (size_t i = 0; i < vertexCount; ++i)
+            if ((*edge.first)[i] == edge.second)
+                edgeIndices.push_back(quint32(i));
+        append(res, quint32(edgeIndices.size()));
+        for (const quint32 i: edgeIndices)
+            appendIndex(i);
+    }
+
+    if (normals) {
+        std::vector<Vec3> accumulated(vertexCount, Vec3{0, 0, 0});
+        for (size_t t = 0; t + 2 < indices.size(); t += 3) {
+            const Vec3 &a = positions[indices[t]];
+            const Vec3 faceNormal = (positions[indices[t + 1]] - a).cross(positions[indices[t + 2]] - a);
+            for (int c = 0; c < 3; ++c)
+                accumulated[indices[t + c]] = accumulated[indices[t + c]] + faceNormal; // area weighted
+        }
+        append(res, quint8(1)); // OctEncodedVertexNormals
+        append(res, quint32(vertexCount * 2));
+        for (size_t i = 0; i < vertexCount; ++i) {
+            const Vec3 &nv = accumulated[i];
+            const double l1 = std::abs(nv.x) + std::abs(nv.y) + std::abs(nv.z);
+            double ox = (l1 > 0) ? nv.x / l1 : 0;
+            double oy = (l1 > 0) ? nv.y / l1 : 0;
+            if (nv.z < 0) {
+                const double tx = ox;
+                ox = (1.0 - std::abs(oy)) * signNotZero(tx);
+                oy = (1.0 - std::abs(tx)) * signNotZero(oy);
+            }
+            append(res, octSNorm(ox));
+            append(res, octSNorm(oy));
+        }
+    }
+    return res;
+}
+
+QByteArray QuantizedMesh::layerJson(const std::set<TileKey> &tiles, bool normals)
+{
+    // One rectangle per run of adjacent tiles in a row, per level
+    std::vector<QJsonArray> levels;
+    auto flush = [&levels](quint8 z, quint64 startX, quint64 endX, quint64 y) {
+        if (levels.size() <= z)
+            levels.resize(z + 1);
+        levels[z].append(QJsonObject{{"startX", qint64(startX)}, {"endX", qint64(endX)},
+                                     {"startY", qint64(y)}, {"endY", qint64(y)}});
+    };
+    std::set<TileKey> tms;
+    for (const TileKey &k: tiles)
+        tms.insert(tmsKey(k));
+    bool open = false;
+    TileKey runStart, previous;
+    for (const TileKey &k: tms) { // ordered by z, y, x
+        if (open && (k.z != previous.z || k.y != previous.y || k.x != previous.x + 1)) {
+            flush(previous.z, runStart.x, previous.x, previous.y);
+            open = false;
+        }
+        if (!open) {
+            runStart = k;
+            open = true;
+        }
+        previous = k;
+    }
+    if (open)
+        flush(previous.z, runStart.x, previous.x, previous.y);
+
+    QJsonArray available;
+    for (const QJsonArray &level: levels)
+        available.append(level);
+    QJsonObject layer{
+        {"tilejson", "2.1.0"},
+        {"name", "qdemviewer"},
+        {"version", "1.0.0"},
+        {"format", "quantized-mesh-1.0"},
+        {"scheme", "tms"},
+        {"projection", "EPSG:3857"},
+        {"tiles", QJsonArray{"{z}/{x}/{y}.terrain?v={version}"}},
+        {"bounds", QJsonArray{-180, -85.05112878, 180, 85.05112878}},
+        {"available", available}
+    };
+    if (normals)
+        layer.insert("extensions", QJsonArray{"octvertexnormals"});
+    return QJsonDocument(layer).toJson();
+}
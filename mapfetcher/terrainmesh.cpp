@@ -0,0 +1,236 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher.h"
+
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+// Recursive descent over the two root triangles, shared by the counting and the emitting pass
+struct RTINExtractor {
+    const TerrainRTIN &rtin;
+    const float maxError;
+    std::vector<quint32> vertexIndex; // 1 based, 0 = not in the mesh
+    quint32 numVertices{0};
+    quint32 numTriangles{0};
+    HeightmapMesh *mesh{nullptr};     // null while counting
+
+    RTINExtractor(const TerrainRTIN &r, float e)
+        : rtin(r), maxError(e), vertexIndex(size_t(r.gridSize) * r.gridSize, 0) {}
+
+    quint32 vertex(int x, int y) {
+        quint32 &idx = vertexIndex[size_t(y) * rtin.gridSize + x];
+        if (!idx) {
+            idx = ++numVertices;
+            if (mesh) {
+                mesh->positions[(idx - 1) * 2] = quint16(x);
+                mesh->positions[(idx - 1) * 2 + 1] = quint16(y);
+                mesh->elevations[idx - 1] = rtin.elevations[size_t(y) * rtin.gridSize + x];
+            }
+        }
+        return idx - 1;
+    }
+
+    // a, b: hypotenuse, c: right angle
+    void triangle(int ax, int ay, int bx, int by, int cx, int cy) {
+        const int mx = (ax + bx) >> 1;
+        const int my = (ay + by) >> 1;
+        if (std::abs(ax - cx) + std::abs(ay - cy) > 1
+                && rtin.errors[size_t(my) * rtin.gridSize + mx] > maxError) {
+            triangle(cx, cy, ax, ay, mx, my);
+            triangle(bx, by, cx, cy, mx, my);
+            return;
+        }
+        const quint32 a = vertex(ax, ay);
+        const quint32 b = vertex(bx, by);
+        const quint32 c = vertex(cx, cy);
+        if (mesh) {
+            mesh->indices[numTriangles * 3] = a;
+            mesh->indices[numTriangles * 3 + 1] = b;
+            mesh->indices[numTriangles * 3 + 2] = c;
+        }
+        ++numTriangles;
+    }
+
+    void run() {
+        const int n = rtin.gridSize - 1;
+        triangle(0, 0, n, n, n, 0);
+        triangle(n, n, 0, 0, 0, n);
+    }
+};
+} // namespace
+
+std::shared_ptr<TerrainRTIN> TerrainRTIN::fromHeightmap(const Heightmap &heightmap)
+{
+    const int border = (heightmap.m_hasBorders) ? 1 : 0;
+    const int n = heightmap.m_size.width() - 2 * border;
+    if (n < 2 || heightmap.m_size.height() != heightmap.m_size.width() || (n & (n - 1))) {
+        qWarning() << "TerrainRTIN: unsupported heightmap size "<<heightmap.m_size;
+        return nullptr;
+    }
+    Heightmap dequantized;
+    if (heightmap.isQuantized()) {
+        dequantized = heightmap;
+        dequantized.dequantize();
+    }
+    const Heightmap &h = (heightmap.isQuantized()) ? dequantized : heightmap;
+
+    auto res = std::make_shared<TerrainRTIN>();
+    const int g = n + 1;
+    res->gridSize = g;
+    res->elevations.resize(size_t(g) * g);
+    res->errors.assign(size_t(g) * g, 0.f);
+
+    // Vertices sit on pixel corners and average the pixels around them. On the tile
+    // boundary only border samples are averaged, as these are common to both tiles.
+    // Borders of missing neighbors carry no data, and are skipped.
+    const int last = h.m_size.width() - 1;
+    const Heightmap::Neighbors blended = (border) ? h.m_borderNeighbors : Heightmap::Neighbors();
+    auto sampleClass = [&](int sx, int sy) {
+        if (!border)
+            return 0;
+        const bool left = sx == 0;
+        const bool right = sx == last;
+        const bool top = sy == 0;
+        const bool bottom = sy == last;
+        Heightmap::Neighbor side;
+        int cls = 1;
+        if ((left || right) && (top || bottom)) {
+            side = (top) ? ((left) ? Heightmap::TopLeft : Heightmap::TopRight)
+                         : ((left) ? Heightmap::BottomLeft : Heightmap::BottomRight);
+            cls = 2;
+        } else if (left || right) {
+            side = (left) ? Heightmap::Left : Heightmap::Right;
+        } else if (top || bottom) {
+            side = (top) ? Heightmap::Top : Heightmap::Bottom;
+        } else {
+            return 0;
+        }
+        return (blended.testFlag(side)) ? cls : -1;
+    };
+    for (int y = 0; y < g; ++y) {
+        for (int x = 0; x < g; ++x) {
+            float &e = res->elevations[size_t(y) * g + x];
+            if (x > 0 && y > 0 && x < n && y < n) {
+                const int sx = x - 1 + border;
+                const int sy = y - 1 + border;
+                e = ((h.elevation(sx, sy) + h.elevation(sx + 1, sy))
+                     + (h.elevation(sx, sy + 1) + h.elevation(sx + 1, sy + 1))) * .25f;
+                continue;
+            }
+            int best = -1;
+            float sum = 0.f;
+            int count = 0;
+            for (int dy = 0; dy < 2; ++dy) {
+                for (int dx = 0; dx < 2; ++dx) {
+                    const int sx = qBound(0, x - 1 + border + dx, last);
+                    const int sy = qBound(0, y - 1 + border + dy, last);
+                    const int cls = sampleClass(sx, sy);
+                    if (cls < best)
+                        continue;
+                    if (cls > best) {
+                        best = cls;
+                        sum = 0.f;
+                        count = 0;
+                    }
+                    sum += h.elevation(sx, sy);
+                    ++count;
+                }
+            }
+            e = (count) ? sum / count : 0.f;
+        }
+    }
+
+    // Shared edges at full resolution: neighbors triangulate them the same way
+    const float forced = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < g; ++i) {
+        if (blended.testFlag(Heightmap::Top))
+            res->errors[size_t(i)] = forced;
+        if (blended.testFlag(Heightmap::Bottom))
+            res->errors[size_t(n) * g + i] = forced;
+        if (blended.testFlag(Heightmap::Left))
+            res->errors[size_t(i) * g] = forced;
+        if (blended.testFlag(Heightmap::Right))
+            res->errors[size_t(i) * g + n] = forced;
+    }
+
+    // Bottom up over the implicit binary triangle tree (Martini): the error of each
+    // hypotenuse midpoint, raised to the error of its descendants, so that extraction
+    // never leaves T-junctions
+    const float *elevations = res->elevations.data();
+    float *errors = res->errors.data();
+    const int numTriangles = n * n * 2 - 2;
+    const int numParentTriangles = numTriangles - n * n;
+    for (int i = numTriangles - 1; i >= 0; --i) {
+        int id = i + 2;
+        int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+        if (id & 1) {
+            bx = by = cx = n;
+        } else {
+            ax = ay = cy = n;
+        }
+        while ((id >>= 1) > 1) {
+            const int mx = (ax + bx) >> 1;
+            const int my = (ay + by) >> 1;
+            if (id & 1) {
+                bx = ax; by = ay;
+                ax = cx; ay = cy;
+            } else {
+                ax = bx; ay = by;
+                bx = cx; by = cy;
+            }
+            cx = mx; cy = my;
+        }
+        const int mx = (ax + bx) >> 1;
+        const int my = (ay + by) >> 1;
+        const size_t middle = size_t(my) * g + mx;
+        const float interpolated = (elevations[size_t(ay) * g + ax] + elevations[size_t(by) * g + bx]) * .5f;
+        float error = std::max(errors[middle], std::abs(interpolated - elevations[middle]));
+        if (i < numParentTriangles) {
+            const size_t left = size_t((ay + cy) >> 1) * g + ((ax + cx) >> 1);
+            const size_t right = size_t((by + cy) >> 1) * g + ((bx + cx) >> 1);
+            error = std::max(error, std::max(errors[left], errors[right]));
+        }
+        errors[middle] = error;
+    }
+    return res;
+}
+
+std::shared_ptr<HeightmapMesh> TerrainRTIN::mesh(float maxError) const
+{
+    if (gridSize < 3)
+        return nullptr;
+    RTINExtractor counter(*this, maxError);
+    counter.run();
+
+    auto res = std::make_shared<HeightmapMesh>();
+    res->gridSize = gridSize;
+    res->maxError = maxError;
+    res->positions.resize(size_t(counter.numVertices) * 2);
+    res->elevations.resize(counter.numVertices);
+    res->indices.resize(size_t(counter.numTriangles) * 3);
+    RTINExtractor extractor(*this, maxError);
+    extractor.mesh = res.get();
+    extractor.run();
+    return res;
+}
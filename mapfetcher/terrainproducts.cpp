@@ -0,0 +1,200 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher.h"
+
+#include <QtMath>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+constexpr double earthRadius = 6378137.0;
+
+inline uchar octByte(float p) {
+    return uchar(qBound(0, int(std::lrint(p * 127.5f + 127.5f)), 255));
+}
+
+// g*: elevation gradients (already z-scaled) towards east and north
+inline void shadePixel(float gEast, float gNorth,
+                       float lx, float ly, float lz,
+                       uchar *normal, uchar *shade) {
+    // The octahedral projection is scale invariant: (-gEast, -gNorth, 1) needs no normalization
+    const float inv = 1.f / (std::abs(gEast) + std::abs(gNorth) + 1.f);
+    normal[0] = octByte(-gEast * inv);
+    normal[1] = octByte(-gNorth * inv);
+    const float d = (lz - gEast * lx - gNorth * ly) / std::sqrt(gEast * gEast + gNorth * gNorth + 1.f);
+    *shade = uchar(std::lrint(qBound(0.f, d, 1.f) * 255.f));
+}
+} // namespace
+
+double TerrainProducts::metersPerPixel(const TileKey &k, int tileResolution)
+{
+    if (tileResolution <= 0)
+        return 0;
+    const double tiles = double(quint64(1) << k.z);
+    const double lat = std::atan(std::sinh(M_PI - 2.0 * M_PI * (k.y + .5) / tiles));
+    return 2.0 * M_PI * earthRadius * std::cos(lat) / (tiles * tileResolution);
+}
+
+std::shared_ptr<TerrainProducts> TerrainProducts::fromHeightmap(const Heightmap &heightmap,
+                                                                double metersPerPixel,
+                                                                const HillshadeParameters &params)
+{
+    if (heightmap.m_size.isEmpty() || metersPerPixel <= 0)
+        return nullptr;
+    Heightmap dequantized;
+    if (heightmap.isQuantized()) {
+        dequantized = heightmap;
+        dequantized.dequantize();
+    }
+    const Heightmap &h = (heightmap.isQuantized()) ? dequantized : heightmap;
+    const int border = (h.m_hasBorders) ? 1 : 0;
+    const QSize size = h.m_size - QSize(2 * border, 2 * border);
+    if (size.isEmpty())
+        return nullptr;
+
+    auto res = std::make_shared<TerrainProducts>();
+    res->size = size;
+    res->normals.resize(size.width() * size.height() * 2);
+    res->hillshade = QImage(size, QImage::Format_Grayscale8);
+    res->hillshadeParameters = params;
+
+    const float azimuth = qDegreesToRadians(params.azimuth);
+    const float altitude = qDegreesToRadians(params.altitude);
+    const float lx = std::sin(azimuth) * std::cos(altitude);
+    const float ly = std::cos(azimuth) * std::cos(altitude);
+    const float lz = std::sin(altitude);
+    const float zScale = params.zFactor / float(metersPerPixel);
+
+    const int width = h.m_size.width();
+    const int height = h.m_size.height();
+    // Border samples blend the edge pixel with the neighbor's own, which lies half a pixel
+    // further: recovering that pixel gives seam pixels the same central difference they
+    // get in a mosaic. Edges without a neighbor extrapolate linearly instead, which
+    // matches the one sided difference of unbordered heightmaps.
+    auto outer = [](float border, float edge, float inner, bool blended) {
+        return (blended) ? 2.f * border - edge : 2.f * edge - inner;
+    };
+    std::vector<float> top, bottom, line;
+    if (border) {
+        top.resize(width);
+        bottom.resize(width);
+        line.resize(width);
+        const float *e = h.elevations.data();
+        const int innerTop = std::min(2, height - 2);
+        const int innerBottom = std::max(height - 3, 1);
+        for (int sx = 1; sx < width - 1; ++sx) {
+            top[sx] = outer(e[sx], e[size_t(width) + sx], e[size_t(innerTop) * width + sx],
+                            h.m_borderNeighbors.testFlag(Heightmap::Top));
+            bottom[sx] = outer(e[size_t(height - 1) * width + sx], e[size_t(height - 2) * width + sx],
+                               e[size_t(innerBottom) * width + sx],
+                               h.m_borderNeighbors.testFlag(Heightmap::Bottom));
+        }
+    }
+    const int innerLeft = std::min(2, width - 2);
+    const int innerRight = std::max(width - 3, 1);
+
+    for (int y = 0; y < size.height(); ++y) {
+        const int sy = y + border;
+        const int north = std::max(sy - 1, 0); // row 0 is the northernmost
+        const int south = std::min(sy + 1, height - 1);
+        const float *row = h.elevations.data() + size_t(sy) * width;
+        const float *rowN = h.elevations.data() + size_t(north) * width;
+        const float *rowS = h.elevations.data() + size_t(south) * width;
+        if (border) {
+            if (north == 0)
+                rowN = top.data();
+            if (south == height - 1)
+                rowS = bottom.data();
+            memcpy(line.data(), row, size_t(width) * sizeof(float));
+            line[0] = outer(row[0], row[1], row[innerLeft],
+                            h.m_borderNeighbors.testFlag(Heightmap::Left));
+            line[width - 1] = outer(row[width - 1], row[width - 2], row[innerRight],
+                                    h.m_borderNeighbors.testFlag(Heightmap::Right));
+            row = line.data();
+        }
+        const float gNorthScale = zScale / float(south - north);
+        uchar *normals = reinterpret_cast<uchar *>(res->normals.data()) + size_t(y) * size.width() * 2;
+        uchar *shade = res->hillshade.scanLine(y);
+
+        auto scalar = [&](int x) {
+            const int sx = x + border;
+            const int west = std::max(sx - 1, 0);
+            const int east = std::min(sx + 1, width - 1);
+            shadePixel((row[east] - row[west]) * zScale / float(east - west),
+                       (rowN[sx] - rowS[sx]) * gNorthScale,
+                       lx, ly, lz,
+                       normals + 2 * x, shade + x);
+        };
+
+        // Pixels with both horizontal neighbors inside the grid
+        const int begin = (border) ? 0 : 1;
+        const int end = (border) ? size.width() : size.width() - 1;
+        int x = 0;
+        for (; x < std::min(begin, size.width()); ++x)
+            scalar(x);
+#if defined(__SSE2__)
+        const __m128 gEastScale = _mm_set1_ps(zScale * .5f);
+        const __m128 gNorthScale4 = _mm_set1_ps(gNorthScale);
+        const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        const __m128 one = _mm_set1_ps(1.f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 half255 = _mm_set1_ps(127.5f);
+        const __m128 v255 = _mm_set1_ps(255.f);
+        const __m128 vlx = _mm_set1_ps(lx);
+        const __m128 vly = _mm_set1_ps(ly);
+        const __m128 vlz = _mm_set1_ps(lz);
+        const __m128i bias = _mm_set1_epi32(32768);
+        const __m128i flip = _mm_set1_epi16(short(0x8000));
+        for (; x + 4 <= end; x += 4) {
+            const int sx = x + border;
+            const __m128 gE = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(row + sx + 1), _mm_loadu_ps(row + sx - 1)), gEastScale);
+            const __m128 gN = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(rowN + sx), _mm_loadu_ps(rowS + sx)), gNorthScale4);
+
+            const __m128 inv = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(_mm_and_ps(gE, absMask),
+                                                                     _mm_and_ps(gN, absMask)), one));
+            const __m128 px = _mm_mul_ps(_mm_sub_ps(zero, gE), inv);
+            const __m128 py = _mm_mul_ps(_mm_sub_ps(zero, gN), inv);
+            const __m128i r = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(px, half255), half255));
+            const __m128i g = _mm_cvtps_epi32(_mm_add_ps(_mm_mul_ps(py, half255), half255));
+            // r | g << 8 per pixel, packed to 16 bit through the signed range
+            __m128i rg = _mm_sub_epi32(_mm_or_si128(r, _mm_slli_epi32(g, 8)), bias);
+            rg = _mm_xor_si128(_mm_packs_epi32(rg, rg), flip);
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(normals + 2 * x), rg);
+
+            const __m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(gE, gE), _mm_mul_ps(gN, gN)), one));
+            __m128 d = _mm_sub_ps(_mm_sub_ps(vlz, _mm_mul_ps(gE, vlx)), _mm_mul_ps(gN, vly));
+            d = _mm_min_ps(_mm_max_ps(_mm_div_ps(d, len), zero), one);
+            __m128i s = _mm_cvtps_epi32(_mm_mul_ps(d, v255));
+            s = _mm_packs_epi32(s, s);
+            s = _mm_packus_epi16(s, s);
+            const int packed = _mm_cvtsi128_si32(s);
+            memcpy(shade + x, &packed, 4);
+        }
+#endif
+        for (; x < size.width(); ++x)
+            scalar(x);
+    }
+    return res;
+}
@@ -0,0 +1,252 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+#include "mapfetcher_p.h"
+
+#include <cmath>
+#include <limits>
+
+namespace {
+constexpr double earthRadius = 6378137.0;
+constexpr float nan = std::numeric_limits<float>::quiet_NaN();
+
+// Bilinear on an unbordered heightmap, u/v tile relative in [0, 1]
+inline float sampleHeightmap(const Heightmap &h, double u, double v) {
+    const int w = h.m_size.width();
+    const int ht = h.m_size.height();
+    const double px = qBound(0.0, u * w - .5, double(w - 1));
+    const double py = qBound(0.0, v * ht - .5, double(ht - 1));
+    const int x0 = int(px);
+    const int y0 = int(py);
+    const int x1 = std::min(x0 + 1, w - 1);
+    const int y1 = std::min(y0 + 1, ht - 1);
+    const float fx = float(px - x0);
+    const float fy = float(py - y0);
+    const float *r0 = h.elevations.data() + size_t(y0) * w;
+    const float *r1 = h.elevations.data() + size_t(y1) * w;
+    const float top = r0[x0] * (1.f - fx) + r0[x1] * fx;
+    const float bottom = r1[x0] * (1.f - fx) + r1[x1] * fx;
+    return top * (1.f - fy) + bottom * fy;
+}
+
+// Ground metres per normalized mercator unit at y: cos(latitude) = sech(pi (1 - 2y))
+inline double metersPerUnit(double y) {
+    return 2.0 * M_PI * earthRadius / std::cosh(M_PI * (1.0 - 2.0 * y));
+}
+
+int tileResolution(const TerrainTileSet &tiles) {
+    for (const auto &t: tiles)
+        if (t.second && !t.second->m_size.isEmpty())
+            return t.second->m_size.width();
+    return 256;
+}
+
+// One sample per DEM pixel along path [first, last) of q
+void evaluateProfile(const TerrainQuery &q,
+                     const TerrainTileSet &tiles,
+                     int resolution,
+                     size_t path,
+                     ElevationProfile &res) {
+    const size_t first = q.offsets[path];
+    const size_t last = q.offsets[path + 1];
+    res.distances.clear();
+    res.elevations.clear();
+    if (last <= first)
+        return;
+    const double side = double(quint64(1) << q.zoom);
+    double distance = 0.0;
+    double prevX = q.x[first], prevY = q.y[first];
+    for (size_t v = first; v + 1 < last; ++v) {
+        const double x0 = q.x[v], y0 = q.y[v];
+        const double dx = q.x[v + 1] - x0, dy = q.y[v + 1] - y0;
+        const int n = std::max(1, int(std::ceil(std::hypot(dx, dy) * side * resolution)));
+        const bool lastSegment = v + 2 == last;
+        int k = 0;
+        tilesAlongSegment(x0, y0, q.x[v + 1], q.y[v + 1], q.zoom,
+                          [&](const TileKey &key, double, double t1) {
+            // One lookup per crossed tile, not per sample
+            const auto it = tiles.find(key);
+            const Heightmap *h = (it != tiles.end() && it->second) ? it->second.get() : nullptr;
+            const int kLast = (lastSegment) ? n : n - 1;
+            while (k <= kLast && (t1 >= 1.0 || double(k) / n < t1)) {
+                const double t = double(k) / n;
+                const double x = x0 + dx * t;
+                const double y = y0 + dy * t;
+                // Straight in mercator, scaled at each step midpoint
+                distance += std::hypot(x - prevX, y - prevY) * metersPerUnit((y + prevY) * .5);
+                prevX = x;
+                prevY = y;
+                res.distances.push_back(float(distance));
+                res.elevations.push_back((h) ? sampleHeightmap(*h, x * side - double(key.x), y * side - double(key.y))
+                                             : nan);
+                ++k;
+            }
+        });
+    }
+    if (last - first == 1) { // single point
+        const double gx = q.x[first] * side, gy = q.y[first] * side;
+        const TileKey key(quint64(gx), quint64(gy), q.zoom);
+        const auto it = tiles.find(key);
+        res.distances.push_back(0.f);
+        res.elevations.push_back((it != tiles.end() && it->second)
+                                 ? sampleHeightmap(*it->second, gx - double(key.x), gy - double(key.y))
+                                 : nan);
+    }
+}
+
+void evaluateLineOfSight(const TerrainQuery &q,
+                         const ElevationProfile &profile,
+                         size_t path,
+                         LineOfSight &res) {
+    res = LineOfSight();
+    const size_t n = profile.elevations.size();
+    if (n < 2 || std::isnan(profile.elevations.front()) || std::isnan(profile.elevations.back()))
+        return;
+    const size_t first = q.offsets[path];
+    const double z0 = profile.elevations.front() + q.heights[first];
+    const double z1 = profile.elevations.back() + q.heights[first + 1];
+    const double total = profile.distances.back();
+    double clearance = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < n; ++i) {
+        if (std::isnan(profile.elevations[i]))
+            continue;
+        const double d = profile.distances[i];
+        const double line = (total > 0) ? z0 + (z1 - z0) * d / total : z0;
+        // Earth bulge over the effective radius k * R
+        const double bulge = (q.kFactor > 0) ? d * (total - d) / (2.0 * q.kFactor * earthRadius) : 0.0;
+        const double c = line - bulge - profile.elevations[i];
+        if (c < 0 && std::isnan(res.obstructionDistance))
+            res.obstructionDistance = float(d);
+        clearance = std::min(clearance, c);
+    }
+    res.clearance = float(clearance);
+    res.visible = clearance >= 0;
+}
+} // namespace
+
+void tilesAlongSegment(double x0, double y0, double x1, double y1, quint8 zoom,
+                       const std::function<void (const TileKey &, double, double)> &f)
+{
+    // Amanatides & Woo traversal of the tile grid, in t along the segment
+    const double side = double(quint64(1) << zoom);
+    const qint64 maxTile = (qint64(1) << zoom) - 1;
+    const double gx0 = x0 * side, gy0 = y0 * side;
+    const double dx = (x1 - x0) * side, dy = (y1 - y0) * side;
+    if (!std::isfinite(gx0) || !std::isfinite(gy0) || !std::isfinite(dx) || !std::isfinite(dy))
+        return;
+    qint64 tx = qBound<qint64>(0, qint64(std::floor(gx0)), maxTile);
+    qint64 ty = qBound<qint64>(0, qint64(std::floor(gy0)), maxTile);
+    const int stepX = (dx > 0) ? 1 : -1;
+    const int stepY = (dy > 0) ? 1 : -1;
+    const double inf = std::numeric_limits<double>::infinity();
+    double tMaxX = (dx > 0) ? (tx + 1 - gx0) / dx : (dx < 0) ? (tx - gx0) / dx : inf;
+    double tMaxY = (dy > 0) ? (ty + 1 - gy0) / dy : (dy < 0) ? (ty - gy0) / dy : inf;
+    const double tDeltaX = (dx != 0) ? 1.0 / std::abs(dx) : inf;
+    const double tDeltaY = (dy != 0) ? 1.0 / std::abs(dy) : inf;
+
+    double t = 0.0;
+    while (true) {
+        const double tNext = std::min({tMaxX, tMaxY, 1.0});
+        f(TileKey(quint64(tx), quint64(ty), zoom), t, tNext);
+        if (tNext >= 1.0)
+            return;
+        t = tNext;
+        if (tMaxX <= tMaxY) {
+            tx += stepX;
+            tMaxX += tDeltaX;
+        } else {
+            ty += stepY;
+            tMaxY += tDeltaY;
+        }
+        if (tx < 0 || ty < 0 || tx > maxTile || ty > maxTile)
+            return;
+    }
+}
+
+std::set<TileKey> TerrainQuery::tiles() const
+{
+    std::set<TileKey> res;
+    for (size_t p = 0; p < size(); ++p) {
+        const size_t first = offsets[p];
+        const size_t last = offsets[p + 1];
+        if (last - first == 1) {
+            tilesAlongSegment(x[first], y[first], x[first], y[first], zoom,
+                              [&res](const TileKey &k, double, double) { res.insert(k); });
+        }
+        for (size_t v = first; v + 1 < last; ++v) {
+            tilesAlongSegment(x[v], y[v], x[v + 1], y[v + 1], zoom,
+                              [&res](const TileKey &k, double, double) { res.insert(k); });
+        }
+    }
+    return res;
+}
+
+void evaluateTerrainQuery(const TerrainQuery &q,
+                          const TerrainTileSet &tiles,
+                          size_t first,
+                          size_t last,
+                          TerrainQueryResults &res)
+{
+    const int resolution = tileResolution(tiles);
+    if (q.type == TerrainQuery::Type::Profiles) {
+        for (size_t p = first; p < last; ++p)
+            evaluateProfile(q, tiles, resolution, p, res.profiles[p]);
+    } else {
+        ElevationProfile profile;
+        for (size_t p = first; p < last; ++p) {
+            evaluateProfile(q, tiles, resolution, p, profile);
+            evaluateLineOfSight(q, profile, p, res.linesOfSight[p]);
+        }
+    }
+}
+
+std::shared_ptr<const Heightmap> TerrainTileStore::find(const TileKey &k)
+{
+    auto it = m_tiles.find(k);
+    if (it == m_tiles.end())
+        return nullptr;
+    m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+    return it->second.first;
+}
+
+void TerrainTileStore::insert(const TileKey &k, std::shared_ptr<const Heightmap> h)
+{
+    auto it = m_tiles.find(k);
+    if (it != m_tiles.end()) {
+        it->second.first = std::move(h);
+        m_lru.splice(m_lru.begin(), m_lru, it->second.second);
+        return;
+    }
+    m_lru.push_front(k);
+    m_tiles.emplace(k, std::make_pair(std::move(h), m_lru.begin()));
+    while (m_tiles.size() > capacity) {
+        m_tiles.erase(m_lru.back());
+        m_lru.pop_back();
+    }
+}
+
+void TerrainTileStore::setSource(const QString &urlTemplate)
+{
+    if (urlTemplate == m_urlTemplate)
+        return;
+    m_urlTemplate = urlTemplate;
+    m_tiles.clear();
+    m_lru.clear();
+}
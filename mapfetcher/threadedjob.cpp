@@ -19,7 +19,9 @@
 ****************************************************************************/
 
 #include "mapfetcher_p.h"
+#include "utils_p.h"
 #include <QImage>
+#include <QImageReader>
 #include <QBuffer>
 #include <QByteArray>
 
@@ -56,6 +58,8 @@
 #include <vector>
 #include <map>
 #include "astcencoder.h"
+#include "bcnencoder.h"
+#include "tilebufferpool.h"
 
 namespace {
 quint64 getX(const TileData& d) {
@@ -108,7 +112,7 @@ QImage assembleTileFromSubtiles(const std::set<TileData> &subCache) {
             || srcFormat == QImage::Format_Grayscale16) {
         srcFormat = QImage::Format_RGBA8888;
     }
-    QImage res(destRes, destRes, srcFormat);
+    QImage res = TileBufferPool::instance().image(QSize(destRes, destRes), srcFormat);
 
     for (const auto &t: subCache) {
         const QImage &i = t.img;
@@ -121,8 +125,158 @@ QImage assembleTileFromSubtiles(const std::set<TileData> &subCache) {
 bool isEven(const QSize &s) {
     return (s.width() % 2) == 0 && (s.height() % 2) == 0;
 }
+// src must be 32bpp. Every byte is a channel, so the same code works for all of them.
+QImage reduce32(const QImage &src, int factor, bool pointSample) {
+    const QSize dstSize = src.size() / factor;
+    QImage res = TileBufferPool::instance().image(dstSize, src.format());
+    const int area = factor * factor;
+    for (int y = 0; y < dstSize.height(); ++y) {
+        uchar *dst = res.scanLine(y);
+        if (pointSample) {
+            const quint32 *srcLine = reinterpret_cast<const quint32 *>(src.constScanLine(y * factor + factor / 2));
+            quint32 *dstLine = reinterpret_cast<quint32 *>(dst);
+            for (int x = 0; x < dstSize.width(); ++x)
+                dstLine[x] = srcLine[x * factor + factor / 2];
+            continue;
+        }
+        for (int x = 0; x < dstSize.width(); ++x) {
+            quint32 acc[4] = {0, 0, 0, 0};
+            for (int sy = y * factor; sy < (y + 1) * factor; ++sy) {
+                const uchar *srcPx = src.constScanLine(sy) + x * factor * 4;
+                for (int sx = 0; sx < factor; ++sx, srcPx += 4) {
+                    acc[0] += srcPx[0];
+                    acc[1] += srcPx[1];
+                    acc[2] += srcPx[2];
+                    acc[3] += srcPx[3];
+                }
+            }
+            for (int c = 0; c < 4; ++c)
+                dst[x * 4 + c] = uchar((acc[c] + area / 2) / area);
+        }
+    }
+    return res;
+}
+QImage::Format coverageFormat(QImage::Format srcFormat) {
+    if (srcFormat == QImage::Format_Indexed8
+            || srcFormat == QImage::Format_Mono
+            || srcFormat == QImage::Format_MonoLSB
+            || srcFormat == QImage::Format_Grayscale8
+            || srcFormat == QImage::Format_Grayscale16) {
+        return QImage::Format_RGBA8888;
+    }
+    return srcFormat;
+}
 } // namespace
 
+QRect coverageClipRect(const QList<QGeoCoordinate> &crds,
+                       const quint8 zoom,
+                       const size_t tileRes,
+                       quint64 minX, quint64 maxX, quint64 minY, quint64 maxY) {
+    double minLat = qInf();
+    double maxLat = -qInf();
+    double minLon = qInf();
+    double maxLon = -qInf();
+    for (const auto &c: crds) {
+        minLat = qMin(minLat, c.latitude());
+        maxLat = qMax(maxLat, c.latitude());
+        minLon = qMin(minLon, c.longitude());
+        maxLon = qMax(maxLon, c.longitude());
+    }
+
+    QGeoCoordinate tlc(maxLat, minLon);
+    QGeoCoordinate brc(minLat, maxLon);
+
+    int xleft, xright, ytop, ybot;
+    const size_t sideLength = 1 << size_t(zoom);
+    // TODO: find tlc and brc in mercator space from crds, then use them here
+    const QDoubleVector2D tl = sideLength * tileRes
+                               * QWebMercator::coordToMercator(tlc);
+    const QDoubleVector2D br = sideLength * tileRes
+                               * QWebMercator::coordToMercator(brc);
+    const QDoubleVector2D tileTl = QDoubleVector2D(minX * tileRes, minY * tileRes);
+    const QDoubleVector2D tileBr = QDoubleVector2D(maxX * tileRes + tileRes,
+                                                   maxY * tileRes + tileRes);
+
+    xleft = std::max(0, int(tl.x() - tileTl.x()));
+    xright = std::max(0, (fmod(tileBr.x() - br.x(), 1) == 0.0)
+                    ? int(tileBr.x() - br.x())
+                    : int(tileBr.x() - br.x()) - 1);
+    ytop = std::max(0, int(tl.y() - tileTl.y()));
+    ybot = std::max(0, (fmod(tileBr.y() - br.y(), 1) == 0.0)
+                    ? int(tileBr.y() - br.y())
+                    : int(tileBr.y() - br.y()) - 1);
+
+    const QSize size((maxX - minX + 1) * tileRes, (maxY - minY + 1) * tileRes);
+    return QRect(QPoint(xleft, ytop), size - QSize(xleft + xright, ytop + ybot));
+}
+
+QImage decodeTile(const QByteArray &data, bool mirror)
+{
+    QByteArray encoded(data);
+    QBuffer buffer(&encoded);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+    // Image handlers reuse the destination buffer when size and format already match
+    QImage res = TileBufferPool::instance().image(reader.size(), reader.imageFormat());
+    if (!reader.read(&res)) {
+        qWarning() << "decodeTile: " << reader.errorString();
+        return QImage();
+    }
+    if (mirror)
+        mirrorVertically(res);
+    return res;
+}
+
+QImage decodeTileScaled(const QByteArray &data, int resolution, bool pointSample)
+{
+    QByteArray encoded(data);
+    QBuffer buffer(&encoded);
+    buffer.open(QIODevice::ReadOnly);
+    QImageReader reader(&buffer);
+    const QSize nativeSize = reader.size();
+    if (resolution <= 0
+            || !nativeSize.isValid()
+            || resolution >= nativeSize.width()
+            || resolution >= nativeSize.height())
+        return decodeTile(data);
+
+    const QSize scaledSize(resolution, resolution);
+    if (!pointSample && reader.format() == QByteArrayLiteral("jpeg")) {
+        // libjpeg scales in the DCT domain, the full size image is never produced
+        reader.setScaledSize(scaledSize);
+        QImage res;
+        if (!reader.read(&res)) {
+            qWarning() << "decodeTileScaled: " << reader.errorString();
+            return QImage();
+        }
+        return res;
+    }
+
+    QImage res = TileBufferPool::instance().image(nativeSize, reader.imageFormat());
+    if (!reader.read(&res)) {
+        qWarning() << "decodeTileScaled: " << reader.errorString();
+        return QImage();
+    }
+    if (nativeSize.width() % resolution || nativeSize.height() % resolution)
+        return res.scaled(scaledSize, Qt::IgnoreAspectRatio,
+                          (pointSample) ? Qt::FastTransformation : Qt::SmoothTransformation);
+    if (res.depth() != 32)
+        res = res.convertToFormat(QImage::Format_RGBA8888); // Indexed PNGs
+    return reduce32(res, nativeSize.width() / resolution, pointSample);
+}
+
+void mirrorVertically(QImage &image)
+{
+    if (image.isNull())
+        return;
+    const int bytesPerLine = image.bytesPerLine();
+    uchar *bits = image.bits();
+    for (int top = 0, bottom = image.height() - 1; top < bottom; ++top, --bottom) {
+        uchar *t = bits + top * bytesPerLine;
+        std::swap_ranges(t, t + bytesPerLine, bits + bottom * bytesPerLine);
+    }
+}
+
 bool ThreadedJobQueue::JobComparator::operator()(const ThreadedJobData *l, const ThreadedJobData *r) const
 {
     if (l && r)
@@ -247,6 +401,8 @@ TileReplyHandler::TileReplyHandler(QNetworkReply *reply,
             &mapFetcher, &MapFetcherWorker::onInsertCompressedTileData, Qt::QueuedConnection);
     connect(this, &TileReplyHandler::insertCoverage,
             &mapFetcher, &MapFetcherWorker::onInsertCoverage, Qt::QueuedConnection);
+    connect(this, &TileReplyHandler::updateCoverage,
+            &mapFetcher, &MapFetcherWorker::onUpdateCoverage, Qt::QueuedConnection);
     connect(this, &TileReplyHandler::insertTile, this, &ThreadedJob::finished);
     connect(this, &TileReplyHandler::insertCompressedTileData, this, &ThreadedJob::finished);
     connect(this, &TileReplyHandler::insertCoverage, this, &ThreadedJob::finished);
@@ -292,7 +448,7 @@ void TileReplyHandler::processStandaloneTile()
                                           k,
                                           std::make_shared<QByteArray>(std::move(data)));
         } else {
-            auto tile = std::make_shared<QImage>(QImage::fromData(std::move(data)).mirrored(false, !m_dem));
+            auto tile = std::make_shared<QImage>(decodeTile(data, !m_dem));
             if (m_computeHash)
                 md5 = md5QImage(*tile);
             emit insertTile(id,
@@ -310,10 +466,12 @@ void TileReplyHandler::processStandaloneTile()
         TileKey dk{dx, dy, dz};
         k = dk;
         std::set<TileData> &subCache = m_mapFetcher->d_func()->m_tileCacheCache[id][dk]; // as this ThreadedJobQueue is currently mono-thread, this can be accessed without mutex
-        subCache.insert({{x,y,z}, QImage::fromData(std::move(data))});
+        subCache.insert({{x,y,z}, decodeTile(data)});
 
         if (subCache.size() == totSubTiles) {
-            QImage image = assembleTileFromSubtiles(subCache).mirrored(false, !m_dem);
+            QImage image = assembleTileFromSubtiles(subCache);
+            if (!m_dem)
+                mirrorVertically(image);
             if (m_computeHash)
                 md5 = md5QImage(image);
             emit insertTile(id,
@@ -325,7 +483,7 @@ void TileReplyHandler::processStandaloneTile()
             emit expectingMoreSubtiles();
         }
     } else { // z < dz -- split
-        auto tile = QImage::fromData(std::move(data)).mirrored(false, !m_dem);
+        auto tile = decodeTile(data, !m_dem);
         int nSubTiles = 1 << (dz - z);
         int subTileSize = tile.size().width() / nSubTiles;
 
@@ -334,7 +492,8 @@ void TileReplyHandler::processStandaloneTile()
         }
 
         auto extractSubTile = [&tile, &subTileSize](int x, int y) {
-            QImage res(subTileSize, subTileSize, tile.format());
+            QImage res = TileBufferPool::instance().image(QSize(subTileSize, subTileSize),
+                                                          tile.format());
 
             for (int sx = 0; sx < subTileSize; ++sx) {
                 for (int sy = 0; sy < subTileSize; ++sy) {
@@ -387,7 +546,8 @@ void TileReplyHandler::processCoverageTile()
     quint8 zoom;
     quint64 totalTileCount;
     bool clip;
-    std::tie(crds, zoom, totalTileCount, clip) = request->second;
+    quint16 tileResolution;
+    std::tie(crds, zoom, totalTileCount, clip, tileResolution) = request->second;
     QByteArray data; ;
 
     if (reply->error() != QNetworkReply::NoError
@@ -397,12 +557,24 @@ void TileReplyHandler::processCoverageTile()
         qWarning() << "Tile request " << TileKey(x,y,z)
                    << " for request " << crds<<","<<zoom<<"  FAILED";
         d->m_tileSets.erase(id);
+        if (d->m_progressiveCoverages.erase(id)) {
+            auto patch = std::make_shared<CoveragePatch>();
+            patch->failed = true;
+            emit updateCoverage(id, std::move(patch));
+        }
         d->m_requests.erase(id);
         emit error();
         return;
     }
 
-    d->m_tileSets[id].insert({TileKey{x,y,z}, QImage::fromData(std::move(data))});
+    QImage tile = (tileResolution) ? decodeTileScaled(data, tileResolution, m_dem)
+                                   : decodeTile(data);
+    if (d->m_progressiveCoverages.count(id)) {
+        blitProgressiveCoverage(id, TileKey{x,y,z}, tile);
+        return;
+    }
+
+    d->m_tileSets[id].insert({TileKey{x,y,z}, std::move(tile)});
     if (d->m_tileSets[id].size() == totalTileCount) {
         // combine tiles and fire reply
         finalizeCoverageRequest(id);
@@ -437,7 +609,8 @@ void TileReplyHandler::finalizeCoverageRequest(quint64 id)
     quint8 zoom;
     quint64 totalTileCount;
     bool clip;
-    std::tie(crds, zoom, totalTileCount, clip) = request;
+    quint16 tileResolution;
+    std::tie(crds, zoom, totalTileCount, clip, tileResolution) = request;
 
     // find min max to compute result extent
     quint64 minX, maxX, minY, maxY;
@@ -448,82 +621,111 @@ void TileReplyHandler::finalizeCoverageRequest(quint64 id)
 
     const size_t tileRes = tileSet.begin()->img.size().width();
 
-    auto srcFormat = tileSet.begin()->img.format();
-    if (srcFormat == QImage::Format_Indexed8
-            || srcFormat == QImage::Format_Mono
-            || srcFormat == QImage::Format_MonoLSB
-            || srcFormat == QImage::Format_Grayscale8
-            || srcFormat == QImage::Format_Grayscale16) {
-        srcFormat = QImage::Format_RGBA8888;
-    }
-    QImage res(QSize(hTiles * tileRes,
-                     vTiles * tileRes),
-                     srcFormat); // Same format of input tiles
+    const auto srcFormat = coverageFormat(tileSet.begin()->img.format());
+    QImage res = TileBufferPool::instance().image(QSize(hTiles * tileRes,
+                                                        vTiles * tileRes),
+                                                  srcFormat); // Same format of input tiles
 
     for (const auto &td: tileSet) {
-        const auto &t = td.img;
         const auto &k = td.k;
-
-        for (size_t y = 0; y < size_t(tileRes); ++y) {
-            for (size_t x = 0; x < size_t(tileRes); ++x) {
-                const int dx = (k.x - minX) * tileRes + x;
-                const int dy = (k.y - minY) * tileRes + y;
-
-                res.setPixelColor(dx,dy,t.pixelColor(x,y));
-            }
+        if (td.img.size() != QSize(tileRes, tileRes)) {
+            qWarning() << "finalizeCoverageRequest: unexpected tile size " << td.img.size() << " for " << k;
+            continue;
         }
+        const QImage t = (td.img.format() == res.format()) ? td.img
+                                                           : td.img.convertToFormat(res.format());
+        const int rowBytes = (tileRes * res.depth()) / 8;
+        const int dx = (k.x - minX) * tileRes;
+        const int dy = (k.y - minY) * tileRes;
+        for (int y = 0; y < int(tileRes); ++y)
+            memcpy(res.scanLine(dy + y) + (dx * res.depth()) / 8, t.constScanLine(y), rowBytes);
     }
 
-    if (clip) {
-        double minLat = qInf();
-        double maxLat = -qInf();
-        double minLon = qInf();
-        double maxLon = -qInf();
-        for (const auto &c: crds) {
-            minLat = qMin(minLat, c.latitude());
-            maxLat = qMax(maxLat, c.latitude());
-            minLon = qMin(minLon, c.longitude());
-            maxLon = qMax(maxLon, c.longitude());
-        }
+    if (clip)
+        res = res.copy(coverageClipRect(crds, zoom, tileRes, minX, maxX, minY, maxY));
 
-        QGeoCoordinate tlc(maxLat, minLon);
-        QGeoCoordinate brc(minLat, maxLon);
-
-        int xleft, xright, ytop, ybot;
-        const size_t sideLength = 1 << size_t(zoom);
-        // TODO: find tlc and brc in mercator space from crds, then use them here
-        const QDoubleVector2D tl = sideLength * tileRes
-                                   * QWebMercator::coordToMercator(tlc);
-        const QDoubleVector2D br = sideLength * tileRes
-                                   * QWebMercator::coordToMercator(brc);
-        const QDoubleVector2D tileTl = QDoubleVector2D(minX * tileRes, minY * tileRes);
-        const QDoubleVector2D tileBr = QDoubleVector2D(maxX * tileRes + tileRes,
-                                                       maxY * tileRes + tileRes);
-
-        xleft = std::max(0, int(tl.x() - tileTl.x()));
-        xright = std::max(0, (fmod(tileBr.x() - br.x(), 1) == 0.0)
-                        ? int(tileBr.x() - br.x())
-                        : int(tileBr.x() - br.x()) - 1);
-        ytop = std::max(0, int(tl.y() - tileTl.y()));
-        ybot = std::max(0, (fmod(tileBr.y() - br.y(), 1) == 0.0)
-                        ? int(tileBr.y() - br.y())
-                        : int(tileBr.y() - br.y()) - 1);
-
-        QImage clipped(res.size() - QSize(xleft + xright, ytop + ybot),
-                       res.format());
-
-        for (int dy = 0; dy < clipped.height(); ++dy) {
-            for (int dx = 0; dx < clipped.width(); ++dx) {
-                int sx = dx + xleft;
-                int sy = dy + ytop;
-                clipped.setPixel(dx, dy, res.pixel(sx, sy));
-            }
-        }
+    if (!m_dem)
+        mirrorVertically(res);
+    emit insertCoverage(id, std::make_shared<QImage>(std::move(res)));
+}
+
+void TileReplyHandler::blitProgressiveCoverage(quint64 id, const TileKey &k, const QImage &tile)
+{
+    auto d = m_mapFetcher->d_func();
+    auto it = d->m_progressiveCoverages.find(id); // no need for mutex as worker thread is single thread
+    ProgressiveCoverage &coverage = it->second;
+    const auto &request = d->m_requests[id];
+    const quint64 totalTileCount = std::get<2>(request);
+
+    const int tileRes = tile.width();
+    if (coverage.mosaic.isNull() && !tile.isNull()) {
+        coverage.mosaic = TileBufferPool::instance().image(QSize(coverage.hTiles * tileRes,
+                                                                 coverage.vTiles * tileRes),
+                                                           coverageFormat(tile.format()));
+        coverage.mosaic.fill(Qt::transparent);
+        coverage.clipRect = (std::get<3>(request))
+                ? coverageClipRect(std::get<0>(request), std::get<1>(request), tileRes,
+                                   coverage.minX, coverage.minX + coverage.hTiles - 1,
+                                   coverage.minY, coverage.minY + coverage.vTiles - 1)
+                : coverage.mosaic.rect();
+    }
 
-        res = std::move(clipped);
+    if (tile.size() != QSize(tileRes, tileRes)
+            || coverage.mosaic.width() != int(coverage.hTiles * tileRes)) {
+        qWarning() << "blitProgressiveCoverage: unexpected tile size " << tile.size() << " for " << k;
+    } else {
+        const QImage t = (tile.format() == coverage.mosaic.format()) ? tile
+                                                                     : tile.convertToFormat(coverage.mosaic.format());
+        const QRect dst(QPoint((k.x - coverage.minX) * tileRes, (k.y - coverage.minY) * tileRes),
+                        t.size());
+        const int rowBytes = (tileRes * coverage.mosaic.depth()) / 8;
+        const int dx = (dst.x() * coverage.mosaic.depth()) / 8;
+        for (int y = 0; y < tileRes; ++y)
+            memcpy(coverage.mosaic.scanLine(dst.y() + y) + dx, t.constScanLine(y), rowBytes);
+        coverage.dirty |= dst;
+    }
+    ++coverage.done;
+
+    if (coverage.done >= totalTileCount) {
+        flushProgressiveCoverage(id, coverage);
+        QImage res = (coverage.clipRect == coverage.mosaic.rect())
+                ? std::move(coverage.mosaic)
+                : coverage.mosaic.copy(coverage.clipRect);
+        d->m_progressiveCoverages.erase(it);
+        d->m_requests.erase(id);
+        if (!m_dem)
+            mirrorVertically(res);
+        emit insertCoverage(id, std::make_shared<QImage>(std::move(res)));
+        return;
     }
 
-    emit insertCoverage(id, std::make_shared<QImage>(res.mirrored(false, !m_dem)));
+    // The first tile goes out right away, then at most one update per interval
+    if (!coverage.lastUpdate.isValid()
+            || coverage.lastUpdate.elapsed() >= ProgressiveCoverage::updateInterval)
+        flushProgressiveCoverage(id, coverage);
+    emit expectingMoreSubtiles();
+}
+
+void TileReplyHandler::flushProgressiveCoverage(quint64 id, ProgressiveCoverage &coverage)
+{
+    const QRect dirty = coverage.dirty & coverage.clipRect;
+    coverage.dirty = QRect();
+    coverage.lastUpdate.start();
+
+    auto patch = std::make_shared<CoveragePatch>();
+    patch->coverageSize = coverage.clipRect.size();
+    patch->format = coverage.mosaic.format();
+    patch->done = coverage.done;
+    patch->total = std::get<2>(m_mapFetcher->d_func()->m_requests[id]);
+    if (!dirty.isEmpty()) {
+        patch->pixels = coverage.mosaic.copy(dirty);
+        patch->rect = dirty.translated(-coverage.clipRect.topLeft());
+        if (!m_dem) {
+            mirrorVertically(patch->pixels);
+            patch->rect.moveTop(patch->coverageSize.height() - patch->rect.bottom() - 1);
+        }
+    }
+    emit updateCoverage(id, std::move(patch));
 }
 
 CachedCompoundTileHandler::CachedCompoundTileHandler(quint64 id, TileKey k, quint8 sourceZoom, QByteArray md5, QString urlTemplate, MapFetcherWorker &mapFetcher)
@@ -560,13 +762,15 @@ DEMReadyHandler::DEMReadyHandler(std::shared_ptr<QImage> demImage,
                                  DEMFetcherWorker &demFetcher,
                                  quint64 id,
                                  bool coverage,
-                                 std::map<Heightmap::Neighbor, std::shared_ptr<QImage> > neighbors)
+                                 std::unique_ptr<Heightmap::Borders> neighbors,
+                                 bool quantize)
     : m_demFetcher(&demFetcher)
     , m_demImage(std::move(demImage))
     , m_requestId(id)
     , m_coverage(coverage)
     , m_key(k)
-    , m_neighbors(neighbors)
+    , m_neighbors(std::move(neighbors))
+    , m_quantize(quantize)
 {
     connect(this, &DEMReadyHandler::insertHeightmap, m_demFetcher, &DEMFetcherWorker::onInsertHeightmap, Qt::QueuedConnection);
     connect(this, &DEMReadyHandler::insertHeightmapCoverage, m_demFetcher, &DEMFetcherWorker::onInsertHeightmapCoverage, Qt::QueuedConnection);
@@ -581,7 +785,11 @@ void DEMReadyHandler::process()
         return;
     }
     std::shared_ptr<Heightmap> h =
-            std::make_shared<Heightmap>(Heightmap::fromImage(*m_demImage, m_neighbors));
+            std::make_shared<Heightmap>((m_neighbors) ? Heightmap::fromImage(*m_demImage, *m_neighbors)
+                                                      : Heightmap::fromImage(*m_demImage));
+    if (m_quantize)
+        h->quantize();
+    h->buildMinMaxPyramid(); // over the samples as delivered
 
     if (m_coverage)
         emit insertHeightmapCoverage(m_requestId, h);
@@ -589,7 +797,119 @@ void DEMReadyHandler::process()
         emit insertHeightmap(m_requestId, m_key, h);
 }
 
-int Raster2ASTCData::priority() const { return Raster2ASTCHandler::priority(); }
+TerrainProductsHandler::TerrainProductsHandler(std::shared_ptr<const Heightmap> h,
+                                               const TileKey k,
+                                               DEMFetcherWorker &demFetcher,
+                                               quint64 id,
+                                               const HillshadeParameters &params)
+    : m_demFetcher(&demFetcher)
+    , m_heightmap(std::move(h))
+    , m_requestId(id)
+    , m_key(k)
+    , m_params(params)
+{
+    connect(this, &TerrainProductsHandler::insertTerrainProducts, m_demFetcher, &DEMFetcherWorker::onInsertTerrainProducts, Qt::QueuedConnection);
+    connect(this, &TerrainProductsHandler::insertTerrainProducts, this, &ThreadedJob::finished);
+}
+
+void TerrainProductsHandler::process()
+{
+    std::shared_ptr<TerrainProducts> res;
+    if (!m_heightmap) {
+        qWarning() << "NULL heightmap in terrain products generation!";
+    } else {
+        const int border = (m_heightmap->m_hasBorders) ? 2 : 0;
+        const double mpp = TerrainProducts::metersPerPixel(m_key, m_heightmap->m_size.width() - border);
+        res = TerrainProducts::fromHeightmap(*m_heightmap, mpp, m_params);
+    }
+    // Always reported, the worker counts this job among the pending ones
+    emit insertTerrainProducts(m_requestId, m_key, std::move(res));
+}
+
+HeightmapMeshHandler::HeightmapMeshHandler(std::shared_ptr<const Heightmap> h,
+                                           const TileKey k,
+                                           DEMFetcherWorker &demFetcher,
+                                           quint64 id,
+                                           float maxError)
+    : m_demFetcher(&demFetcher)
+    , m_heightmap(std::move(h))
+    , m_requestId(id)
+    , m_key(k)
+    , m_maxError(maxError)
+{
+    connect(this, &HeightmapMeshHandler::insertHeightmapMesh, m_demFetcher, &DEMFetcherWorker::onInsertHeightmapMesh, Qt::QueuedConnection);
+    connect(this, &HeightmapMeshHandler::insertHeightmapMesh, this, &ThreadedJob::finished);
+}
+
+void HeightmapMeshHandler::process()
+{
+    std::shared_ptr<HeightmapMesh> res;
+    if (!m_heightmap) {
+        qWarning() << "NULL heightmap in mesh generation!";
+    } else if (auto rtin = TerrainRTIN::fromHeightmap(*m_heightmap)) {
+        m_heightmap.reset();
+        res = rtin->mesh(m_maxError);
+        res->rtin = std::move(rtin);
+    }
+    // Always reported, the worker counts this job among the pending ones
+    emit insertHeightmapMesh(m_requestId, m_key, std::move(res));
+}
+
+ElevationSamplingHandler::ElevationSamplingHandler(std::shared_ptr<QImage> demImage,
+                                                   std::shared_ptr<ElevationSamples> samples,
+                                                   DEMFetcherWorker &demFetcher,
+                                                   quint64 id)
+    : m_demFetcher(&demFetcher)
+    , m_demImage(std::move(demImage))
+    , m_samples(std::move(samples))
+    , m_requestId(id)
+{
+    connect(this, &ElevationSamplingHandler::insertElevations, m_demFetcher, &DEMFetcherWorker::onInsertElevations, Qt::QueuedConnection);
+    connect(this, &ElevationSamplingHandler::insertElevations, this, &ThreadedJob::finished);
+}
+
+void ElevationSamplingHandler::process()
+{
+    std::shared_ptr<ElevationBatch> res;
+    if (!m_demImage || !m_samples)
+        qWarning() << "NULL image in elevation sampling!";
+    else
+        res = sampleElevations(*m_demImage, *m_samples);
+    // Always reported, the worker counts this job among the pending ones
+    emit insertElevations(m_requestId, std::move(res));
+}
+
+TerrainQueryHandler::TerrainQueryHandler(std::shared_ptr<const TerrainQuery> query,
+                                         std::shared_ptr<const TerrainTileSet> tiles,
+                                         std::shared_ptr<TerrainQueryResults> results,
+                                         size_t first,
+                                         size_t last,
+                                         DEMFetcherWorker &demFetcher,
+                                         quint64 id)
+    : m_demFetcher(&demFetcher)
+    , m_query(std::move(query))
+    , m_tiles(std::move(tiles))
+    , m_results(std::move(results))
+    , m_first(first)
+    , m_last(last)
+    , m_requestId(id)
+{
+    connect(this, &TerrainQueryHandler::queryFinished, m_demFetcher, &DEMFetcherWorker::onTerrainQueryJobFinished, Qt::QueuedConnection);
+    connect(this, &TerrainQueryHandler::queryFinished, this, &ThreadedJob::finished);
+}
+
+void TerrainQueryHandler::process()
+{
+    if (m_query && m_tiles && m_results)
+        evaluateTerrainQuery(*m_query, *m_tiles, m_first, m_last, *m_results);
+    else
+        qWarning() << "Incomplete terrain query job!";
+    emit queryFinished(m_requestId);
+}
+
+int Raster2ASTCData::priority() const {
+    return (m_cached) ? Raster2ASTCHandler::cachedPriority() : Raster2ASTCHandler::priority();
+}
 
 Raster2ASTCHandler::Raster2ASTCHandler(Raster2ASTCData *data)
     : d(data)
@@ -610,17 +930,33 @@ void Raster2ASTCHandler::process()
             return;
         }
         d->m_rasterImage =
-                std::make_shared<QImage>(QImage::fromData(*d->m_compressedRaster).mirrored(false, true)); // TODO BEWARE of mirrored when doing the same on DEM!!!!!!!!!!
+                std::make_shared<QImage>(decodeTile(*d->m_compressedRaster, true)); // TODO BEWARE of mirrored when doing the same on DEM!!!!!!!!!!
 
         d->m_md5 = md5QImage(*d->m_rasterImage);
     }
-    std::shared_ptr<CompressedTextureData> t =
-            std::static_pointer_cast<CompressedTextureData>(
+    std::shared_ptr<CompressedTextureData> t;
+    if (!NetworkConfiguration::astcEnabled && NetworkConfiguration::bcnFormat) {
+        t = std::static_pointer_cast<CompressedTextureData>(
+                BCnCompressedTextureData::fromImage(d->m_rasterImage,
+                                                    d->m_k.x,
+                                                    d->m_k.y,
+                                                    d->m_k.z,
+                                                    d->m_md5,
+                                                    quint32(int(NetworkConfiguration::bcnFormat)),
+                                                    d->m_mipFilter,
+                                                    d->m_retainImage));
+    } else {
+        t = std::static_pointer_cast<CompressedTextureData>(
                 ASTCCompressedTextureData::fromImage(d->m_rasterImage,
                                                      d->m_k.x,
                                                      d->m_k.y,
                                                      d->m_k.z,
-                                                     d->m_md5));
+                                                     d->m_md5,
+                                                     d->m_blockSize,
+                                                     d->m_quality,
+                                                     d->m_mipFilter,
+                                                     d->m_retainImage));
+    }
 
     if (d->m_coverage)
         emit insertCoverageASTC(d->m_id, t);
@@ -631,6 +967,7 @@ void Raster2ASTCHandler::process()
 DEMTileReplyHandler::DEMTileReplyHandler(QNetworkReply *reply, MapFetcherWorker &mapFetcher)
 :   TileReplyHandler(reply, mapFetcher) {
     m_dem = true;
+    m_emitUncompressedData = false;
 }
 
 ASTCTileReplyHandler::ASTCTileReplyHandler(QNetworkReply *reply, MapFetcherWorker &mapFetcher)
@@ -641,7 +978,7 @@ ASTCTileReplyHandler::ASTCTileReplyHandler(QNetworkReply *reply, MapFetcherWorke
 
 quint64 ASTCCompressedTextureData::upload(QSharedPointer<QOpenGLTexture> &t)
 {
-    if (!NetworkConfiguration::astcEnabled || !m_mips.size()) {
+    if (!m_mips.size()) {
         if (!m_image)
             return 0;
         t.reset(new QOpenGLTexture(QOpenGLTexture::Target2D));
@@ -682,7 +1019,7 @@ quint64 ASTCCompressedTextureData::upload(QSharedPointer<QOpenGLTexture> &t)
             sz += m_mips.at(i).dataLength();
         }
 
-        return sz; // astc
+        return sz; // astc or bcn
     }
 }
 
@@ -692,7 +1029,7 @@ quint64 ASTCCompressedTextureData::uploadTo2DArray(QSharedPointer<QOpenGLTexture
                                                    int layers)
 {
     initStatics();
-    if (!NetworkConfiguration::astcEnabled) { // || !m_mips.size()) {
+    if (!m_mips.size()) { // astc and bcn disabled
         if (!m_image)
             return 0;
         QOpenGLPixelTransferOptions uploadOptions;
@@ -754,6 +1091,11 @@ quint64 ASTCCompressedTextureData::uploadTo2DArray(QSharedPointer<QOpenGLTexture
         return sz;
     } else {
         const int maxLod = m_mips.size() - 1;
+        // Opaque S3TC tiles are BC1, the others BC3: arrays are always BC3,
+        // as subtiles of the same parent can come in either
+        const bool expand = m_mips.at(0).glInternalFormat() == BCnEncoder::BC1;
+        const quint32 format = (expand) ? quint32(BCnEncoder::BC3)
+                                        : quint32(m_mips.at(0).glInternalFormat());
         auto &t = texArray;
         QOpenGLPixelTransferOptions uploadOptions;
         uploadOptions.setAlignment(1);
@@ -761,7 +1103,7 @@ quint64 ASTCCompressedTextureData::uploadTo2DArray(QSharedPointer<QOpenGLTexture
             || t->width() != m_mips.front().size().width()
             || t->height() != m_mips.front().size().height()
             || t->layers() != layers
-            || !isFormatCompressed(t->format())) {
+            || t->format() != QOpenGLTexture::TextureFormat(format)) {
             t.reset(new QOpenGLTexture(QOpenGLTexture::Target2DArray));
             t->setLayers(layers);
             t->setAutoMipMapGenerationEnabled(false);
@@ -770,47 +1112,46 @@ quint64 ASTCCompressedTextureData::uploadTo2DArray(QSharedPointer<QOpenGLTexture
             t->setMinMagFilters(QOpenGLTexture::LinearMipMapLinear,
                                        QOpenGLTexture::Linear);
             t->setWrapMode(QOpenGLTexture::ClampToEdge);
-            t->setFormat(QOpenGLTexture::TextureFormat(m_mips.at(0).glInternalFormat()));
+            t->setFormat(QOpenGLTexture::TextureFormat(format));
             t->setSize(m_mips.at(0).size().width(), m_mips.at(0).size().height());
             t->setMipLevels(m_mips.size());
 
-            t->allocateStorage();            
-#if 1 // initialize everything with white
-            for (int i = 0; i < layers; ++i) {
-                for (int mip = 0; mip < m_white8x8ASTC.size(); ++mip) {
-                    t->setCompressedData(mip,
-                               i,
-                               m_white8x8ASTC.at(mip).dataLength(),
-                               m_white8x8ASTC.at(mip).data().constData()
-                                         + m_white8x8ASTC.at(mip).dataOffset(),
-                               &uploadOptions);
-                }
-            }
-#else // initialize everything with transparent
-            for (int i = 0; i < layers; ++i) {
-                for (int mip = 0; mip < m_transparent8x8ASTC.size(); ++mip) {
+            t->allocateStorage();
+            // initialize everything with white (qRgba(0, 0, 0, 0) for transparent),
+            // in the block footprint of this texture
+            const QSize blockSize = ASTCEncoder::blockSize(format);
+            for (int mip = 0; mip <= maxLod; ++mip) {
+                const QTextureFileData fill = (BCnEncoder::isFormat(format))
+                        ? BCnEncoder::constantColor(m_mips.at(mip).size(),
+                                                    qRgba(255, 255, 255, 255),
+                                                    BCnEncoder::Format(format))
+                        : ASTCEncoder::constantColor(m_mips.at(mip).size(),
+                                                     qRgba(255, 255, 255, 255),
+                                                     blockSize.width(),
+                                                     blockSize.height());
+                for (int i = 0; i < layers; ++i) {
                     t->setCompressedData(mip,
                                i,
-                               m_transparent8x8ASTC.at(mip).dataLength(),
-                               m_transparent8x8ASTC.at(mip).data().constData()
-                                         + m_transparent8x8ASTC.at(mip).dataOffset(),
+                               fill.dataLength(),
+                               fill.data().constData() + fill.dataOffset(),
                                &uploadOptions);
                 }
             }
-#endif
         }
 
         quint64 sz{0};
         for (int i  = 0; i <= maxLod; ++i) {
+            const QTextureFileData mip = (expand) ? BCnEncoder::toBC3(m_mips.at(i))
+                                                  : m_mips.at(i);
             t->setCompressedData(i,
                                  layer,
-                                 m_mips.at(i).dataLength(),
-                                 m_mips.at(i).data().constData() + m_mips.at(i).dataOffset(),
+                                 mip.dataLength(),
+                                 mip.data().constData() + mip.dataOffset(),
                                  &uploadOptions);
-            sz += m_mips.at(i).dataLength();
+            sz += mip.dataLength();
         }
 
-        return sz; // astc
+        return sz; // astc or bcn
     } // NetworkConfiguration::astcEnabled
 }
 
@@ -828,12 +1169,33 @@ bool ASTCCompressedTextureData::hasCompressedData() const
     return m_mips.size();
 }
 
+std::shared_ptr<QImage> ASTCCompressedTextureData::image() const
+{
+    if (m_image || !m_mips.size())
+        return m_image;
+    const quint32 format = quint32(m_mips.front().glInternalFormat());
+    QImage decoded = (BCnEncoder::isFormat(format))
+            ? BCnEncoder::decompress(m_mips.front())
+            : ASTCEncoder::instance().decompress(m_mips.front());
+    if (decoded.isNull())
+        return {};
+    return std::make_shared<QImage>(std::move(decoded));
+}
+
+static_assert(int(ASTCFetcher::SRGBFilter) == int(ASTCEncoder::SRGBFilter)
+              && int(ASTCFetcher::PremultipliedAlpha) == int(ASTCEncoder::PremultipliedAlpha),
+              "ASTCFetcher::MipFilter must match ASTCEncoder::MipFilter");
+
 std::shared_ptr<ASTCCompressedTextureData>  ASTCCompressedTextureData::fromImage(
         const std::shared_ptr<QImage> &i,
         qint64 x,
         qint64 y,
         qint64 z,
-        QByteArray md5)
+        QByteArray md5,
+        const QSize &blockSize,
+        float quality,
+        int mipFilter,
+        bool retainImage)
 {
     std::shared_ptr<ASTCCompressedTextureData> res = std::make_shared<ASTCCompressedTextureData>();
     res->m_image = i;
@@ -846,14 +1208,49 @@ std::shared_ptr<ASTCCompressedTextureData>  ASTCCompressedTextureData::fromImage
         qWarning() << "Warning: cannot generate mips for size"<<size;
     }
 
+    ASTCEncoder::Configuration config;
+    config.blockX = blockSize.width();
+    config.blockY = blockSize.height();
+    config.quality = quality;
+    config.mipFilter = mipFilter;
     ASTCEncoder::instance().generateMips(*res->m_image,
                                          x,y,z,
                                          res->m_mips,
-                                         std::move(md5));
+                                         std::move(md5),
+                                         config);
+    if (!retainImage && res->m_mips.size())
+        res->m_image.reset();
 
     return res;
 }
 
+std::shared_ptr<BCnCompressedTextureData>  BCnCompressedTextureData::fromImage(
+        const std::shared_ptr<QImage> &i,
+        qint64 x,
+        qint64 y,
+        qint64 z,
+        QByteArray md5,
+        quint32 format,
+        int mipFilter,
+        bool retainImage)
+{
+    std::shared_ptr<BCnCompressedTextureData> res = std::make_shared<BCnCompressedTextureData>();
+    res->m_image = i;
+
+    if (!BCnEncoder::isFormat(format))
+        return res;
+
+    BCnEncoder::instance().generateMips(*res->m_image,
+                                        x,y,z,
+                                        res->m_mips,
+                                        std::move(md5),
+                                        BCnEncoder::format(*res->m_image, BCnEncoder::Format(format)),
+                                        mipFilter);
+    if (!retainImage && res->m_mips.size())
+        res->m_image.reset();
+    return res;
+}
+
 ThreadedJob *ThreadedJob::fromData(ThreadedJobData *data)
 {
     struct ScopeExit {
@@ -895,7 +1292,41 @@ ThreadedJob *ThreadedJob::fromData(ThreadedJobData *data)
                                    d->m_demFetcher,
                                    d->m_id,
                                    d->m_coverage,
-                                   std::move(d->m_neighbors));
+                                   std::move(d->m_neighbors),
+                                   d->m_quantize);
+    }
+    case ThreadedJobData::JobType::TerrainProducts: {
+        TerrainProductsData *d = static_cast<TerrainProductsData *>(data);
+        return new TerrainProductsHandler(std::move(d->m_heightmap),
+                                          d->m_k,
+                                          d->m_demFetcher,
+                                          d->m_id,
+                                          d->m_params);
+    }
+    case ThreadedJobData::JobType::HeightmapMesh: {
+        HeightmapMeshData *d = static_cast<HeightmapMeshData *>(data);
+        return new HeightmapMeshHandler(std::move(d->m_heightmap),
+                                        d->m_k,
+                                        d->m_demFetcher,
+                                        d->m_id,
+                                        d->m_maxError);
+    }
+    case ThreadedJobData::JobType::ElevationSampling: {
+        ElevationSamplingData *d = static_cast<ElevationSamplingData *>(data);
+        return new ElevationSamplingHandler(std::move(d->m_demImage),
+                                            std::move(d->m_samples),
+                                            d->m_demFetcher,
+                                            d->m_id);
+    }
+    case ThreadedJobData::JobType::TerrainQuery: {
+        TerrainQueryData *d = static_cast<TerrainQueryData *>(data);
+        return new TerrainQueryHandler(std::move(d->m_query),
+                                       std::move(d->m_tiles),
+                                       std::move(d->m_results),
+                                       d->m_first,
+                                       d->m_last,
+                                       d->m_demFetcher,
+                                       d->m_id);
     }
     case ThreadedJobData::JobType::Raster2ASTC: {
         Raster2ASTCData *d = static_cast<Raster2ASTCData *>(data);
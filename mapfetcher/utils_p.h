@@ -23,6 +23,10 @@
 
 #include <QList>
 #include <QString>
+#include <QImage>
+#include <QByteArray>
+#include <QRect>
+#include <QtPositioning/QGeoCoordinate>
 
 struct URLTemplate {
     QString hostWildcarded;
@@ -32,4 +36,23 @@ struct URLTemplate {
 
 URLTemplate extractTemplates(QString urlTemplate);
 
+// Decodes into a buffer borrowed from TileBufferPool, optionally flipping it in place
+QImage decodeTile(const QByteArray &data, bool mirror = false);
+// Decodes at resolution x resolution when smaller than the native size.
+// JPEG is scaled by the decoder, the rest is box filtered, or point sampled
+// when averaging would corrupt the encoding (e.g., terrarium DEM tiles).
+QImage decodeTileScaled(const QByteArray &data, int resolution, bool pointSample = false);
+void mirrorVertically(QImage &image);
+// Region of the tile mosaic covered by the bounding box of crds
+QRect coverageClipRect(const QList<QGeoCoordinate> &crds,
+                       const quint8 zoom,
+                       const size_t tileRes,
+                       quint64 minX, quint64 maxX, quint64 minY, quint64 maxY);
+// Meters encoded in a terrarium DEM pixel
+inline float terrariumElevation(QRgb px) {
+    return float(qRed(px) * 256 +
+                 qGreen(px) +
+                 qBlue(px) / 256.0) - 32768.0;
+}
+
 #endif
@@ -5,13 +5,17 @@ SUBDIRS = \
         demviewer \
         astcencoder \
         cacheupdater \
-	downloader
+	downloader \
+        astcbenchmark \
+        terrainproductstest
 
 OTHER_FILES += \
     mapfetcher/mapfetcher.pro \
     demviewer/demviewer.pro\
     astcencoder/astcencoder.pro\
     cacheupdater/cacheupdater.pro\
+    astcbenchmark/astcbenchmark.pro\
+    terrainproductstest/terrainproductstest.pro\
     arch_helper.pri\
     LICENSE\
     README.md
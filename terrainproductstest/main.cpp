@@ -0,0 +1,135 @@
+/****************************************************************************
+**
+** Copyright (C) 2024- Paolo Angelelli <paoletto@gmail.com>
+**
+** Commercial License Usage
+** Licensees holding a valid commercial qdemviewer license may use this file in
+** accordance with the commercial license agreement provided with the
+** Software or, alternatively, in accordance with the terms contained in
+** a written agreement with the copyright holder. For licensing terms
+** and conditions and further information contact the copyright holder.
+**
+** GNU General Public License Usage
+** Alternatively, this file may be used under the terms of the GNU
+** General Public License version 3. The licenses are as published by
+** the Free Software Foundation at https://www.gnu.org/licenses/gpl-3.0.html,
+** with the exception that the use of this work for training artificial intelligence
+** is prohibited for both commercial and non-commercial use.
+**
+****************************************************************************/
+
+// Splits a synthetic DEM into a grid of bordered tiles and checks that the normals
+// and hillshade of every tile, seams included, match those of the whole mosaic.
+// Exits non zero on mismatch.
+
+#include <QCoreApplication>
+#include <QDebug>
+#include <QImage>
+
+#include "mapfetcher.h"
+
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+constexpr int tileSize = 32;
+constexpr int tiles = 3;
+constexpr double metersPerPixel = 20.0;
+// Products are stored as bytes, and recovering the neighbor pixel from the blended
+// border is exact only up to float rounding
+constexpr int tolerance = 1;
+
+QRgb terrariumPixel(double meters) {
+    const int v = int(std::lround((meters + 32768.0) * 256.0)); // 1/256 m steps
+    return qRgb(v >> 16, (v >> 8) & 0xff, v & 0xff);
+}
+
+QImage syntheticDEM(int size) {
+    QImage dem(size, size, QImage::Format_RGB32);
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+            dem.setPixel(x, y, terrariumPixel(1200.0
+                                              + 400.0 * std::sin(x * .11) * std::cos(y * .07)
+                                              + 3.0 * x - 5.0 * y));
+    return dem;
+}
+
+int compare(const TerrainProducts &tile, const TerrainProducts &mosaic, int ox, int oy, int tx, int ty) {
+    int failures = 0;
+    const uchar *tn = reinterpret_cast<const uchar *>(tile.normals.constData());
+    const uchar *mn = reinterpret_cast<const uchar *>(mosaic.normals.constData());
+    for (int y = 0; y < tile.size.height(); ++y) {
+        for (int x = 0; x < tile.size.width(); ++x) {
+            const size_t ti = size_t(y) * tile.size.width() + x;
+            const size_t mi = size_t(y + oy) * mosaic.size.width() + x + ox;
+            const int dx = std::abs(int(tn[2 * ti]) - int(mn[2 * mi]));
+            const int dy = std::abs(int(tn[2 * ti + 1]) - int(mn[2 * mi + 1]));
+            const int ds = std::abs(int(tile.hillshade.constScanLine(y)[x])
+                                    - int(mosaic.hillshade.constScanLine(y + oy)[x + ox]));
+            if (dx > tolerance || dy > tolerance || ds > tolerance) {
+                if (failures++ < 10)
+                    qWarning() << "tile" << tx << ty << "pixel" << x << y
+                               << "normal" << tn[2 * ti] << tn[2 * ti + 1]
+                               << "expected" << mn[2 * mi] << mn[2 * mi + 1]
+                               << "shade" << tile.hillshade.constScanLine(y)[x]
+                               << "expected" << mosaic.hillshade.constScanLine(y + oy)[x + ox];
+            }
+        }
+    }
+    return failures;
+}
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    const QImage dem = syntheticDEM(tileSize * tiles);
+    const auto mosaic = TerrainProducts::fromHeightmap(Heightmap::fromImage(dem), metersPerPixel);
+    if (!mosaic) {
+        qWarning() << "no products for the mosaic";
+        return 1;
+    }
+
+    auto tileImage = [&dem](int tx, int ty) {
+        if (tx < 0 || ty < 0 || tx >= tiles || ty >= tiles)
+            return QImage();
+        return dem.copy(tx * tileSize, ty * tileSize, tileSize, tileSize);
+    };
+
+    int failures = 0;
+    for (int ty = 0; ty < tiles; ++ty) {
+        for (int tx = 0; tx < tiles; ++tx) {
+            Heightmap::Borders borders;
+            auto edges = [&](Heightmap::Neighbor n, int dx, int dy) {
+                const QImage neighbor = tileImage(tx + dx, ty + dy);
+                if (!neighbor.isNull())
+                    borders[Heightmap::neighborIndex(n)] = DEMTileEdges::fromImage(neighbor);
+            };
+            edges(Heightmap::Top, 0, -1);
+            edges(Heightmap::Bottom, 0, 1);
+            edges(Heightmap::Left, -1, 0);
+            edges(Heightmap::Right, 1, 0);
+            edges(Heightmap::TopLeft, -1, -1);
+            edges(Heightmap::TopRight, 1, -1);
+            edges(Heightmap::BottomLeft, -1, 1);
+            edges(Heightmap::BottomRight, 1, 1);
+
+            const auto products = TerrainProducts::fromHeightmap(
+                        Heightmap::fromImage(tileImage(tx, ty), borders), metersPerPixel);
+            if (!products || products->size != QSize(tileSize, tileSize)) {
+                qWarning() << "tile" << tx << ty << "has no products of the expected size";
+                ++failures;
+                continue;
+            }
+            failures += compare(*products, *mosaic, tx * tileSize, ty * tileSize, tx, ty);
+        }
+    }
+
+    if (failures) {
+        qWarning() << failures << "pixels differ from the mosaic";
+        return 1;
+    }
+    qInfo() << "bordered tile products match the mosaic";
+    return 0;
+}